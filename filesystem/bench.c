@@ -0,0 +1,554 @@
+/**************************************************
+			Simple Filesystem Simulator
+				Benchmark suite
+
+				Author: Jiri Besta
+***************************************************/
+
+/*	Benchmark of the filesystem (make bench). Deterministic workloads are generated on the disk,
+	commands run in-process through the library (libzos.a) like the commands of the console.
+	Every command is timed separately, the report in JSON is printed to the standard output.
+
+	Usage: benchmark [format options]	(e.g. benchmark -i 256 -z -d)
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "libzos.h"
+
+#define BENCH_SIZE "64MB"			// Size of the formatted image
+#define MOUNT_ROUNDS 5				// Count of measured loads of the image
+#define LS_SAMPLES 50				// Minimal count of measured ls commands
+#define CMD_SIZE 256				// Size of the command buffer (BUFF_SIZE of the filesystem)
+#define PATH_SIZE 192				// Size of the buffer for paths
+
+// Operations measured by the benchmark
+#define OP_FORMAT 0
+#define OP_MOUNT 1
+#define OP_INCP 2
+#define OP_OUTCP 3
+#define OP_CP 4
+#define OP_RM 5
+#define OP_LS 6
+#define OP_DEFRAG 7
+#define OP_COUNT 8
+
+// Structure of the measured workload
+typedef struct thescenario {
+	const char *name;			// Name in the report
+	int files;					// Count of files
+	int32_t min_size;			// Sizes of files in bytes
+	int32_t max_size;
+	int dirs;					// Count of sibling directories with files (depth = 0)
+	int depth;					// Depth of the chain of nested directories with files, 0 = no chain
+	int8_t fragment;			// If the free space is fragmented by removed files before the defragmentation
+} scenario;
+
+// Structure of results of one operation
+typedef struct theop_stats {
+	int count;					// Count of measured commands
+	int capacity;				// Size of the array of samples
+	double *samples;			// Durations of commands in microseconds
+	long bytes;					// Count of transferred bytes
+	long read_calls;			// Count of read system calls
+	long write_calls;			// Count of write system calls
+} op_stats;
+
+void run_scenario(const scenario *sc, const char *options, int first);
+void generate_file(const char *path, int32_t size, uint64_t *seed);
+uint64_t next_random(uint64_t *seed);
+int32_t random_size(const scenario *sc, uint64_t *seed);
+void file_directory(const scenario *sc, int index, char *path);
+double run_timed(int op, const char *format, ...);
+int read_io(long *reads, long *writes);
+void record(int op, double us, long reads, long writes);
+void print_stats();
+int compare_samples(const void *a, const void *b);
+int check_fs();
+int same_content(const char *first, const char *second);
+long peak_rss();
+
+const char *op_names[OP_COUNT] = {"format", "mount", "incp", "outcp", "cp", "rm", "ls", "defrag"};
+
+// Workloads: many small files, few large files, deep tree, wide directory, fragmented image
+const scenario scenarios[] = {
+	{"small_files", 600, 64, 4096, 12, 0, 0},
+	{"large_files", 8, 262144, 524288, 1, 0, 0},
+	{"deep_tree", 200, 512, 8192, 0, 40, 0},
+	{"wide_directory", 1000, 16, 1024, 1, 0, 0},
+	{"fragmented", 400, 1024, 24576, 1, 0, 1}
+};
+const int scenario_count = sizeof(scenarios) / sizeof(scenario);
+
+op_stats results[OP_COUNT];			// Results of the current scenario
+FILE *report;						// Stream of the report (replies of the filesystem are discarded)
+char work_dir[PATH_SIZE];			// Directory with the image and generated files
+char image[PATH_SIZE];				// Image of the filesystem
+zos_context *context = NULL;		// Mounted image
+int io_overhead_reads = 0;			// Read system calls of one measurement of the I/O counters
+int io_available = 1;				// If the counters of system calls are available (/proc/self/io)
+
+
+/*	Entry point of the benchmark
+
+	param argv[1..] ... options of the format command
+*/
+int main(int argc, char *argv[]) {
+	char options[CMD_SIZE] = "";
+	long r1, w1, r2, w2;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strlen(options) + strlen(argv[i]) + 2 >= CMD_SIZE)
+			break;
+		strcat(options, " ");
+		strcat(options, argv[i]);
+	}
+
+	strcpy(work_dir, "/tmp/zosbench.XXXXXX");
+	if (!mkdtemp(work_dir)) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	sprintf(image, "%s/image", work_dir);
+	report = stdout;
+
+	// Measure the reads of the counters themselves
+	if (read_io(&r1, &w1) || read_io(&r2, &w2))
+		io_available = 0;
+	else
+		io_overhead_reads = (int)(r2 - r1);
+
+	fprintf(report, "{\n  \"image_size\": \"%s\",\n  \"format_options\": \"%s\",\n  \"syscall_counters\": %s,\n  \"scenarios\": [\n",
+		BENCH_SIZE, options[0] ? options + 1 : "", io_available ? "true" : "false");
+	for (i = 0; i < scenario_count; i++) {
+		run_scenario(&scenarios[i], options, i == 0);
+	}
+	fprintf(report, "\n  ],\n  \"peak_rss_kb\": %ld\n}\n", peak_rss());
+
+	zos_unmount(context);
+	unlink(image);
+	rmdir(work_dir);
+	return EXIT_SUCCESS;
+}
+
+
+/*	Run one workload - format, incp, load of the image, ls, cp, outcp, rm, defrag - and print its results
+
+	param sc ... workload
+	param options ... options of the format command (with the leading space)
+	param first ... if it is the first scenario of the report (0 = false, 1 = true)
+*/
+void run_scenario(const scenario *sc, const char *options, int first) {
+	char path[PATH_SIZE], host[PATH_SIZE], copy[PATH_SIZE];
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;	// Every workload has its own sequence
+	int32_t *sizes;
+	long total = 0;
+	int i, j, rounds, refills = 0, errors = 0;
+
+	memset(results, 0, sizeof(results));
+	for (i = 0; sc->name[i] != '\0'; i++) {
+		seed = seed * 31 + sc->name[i];
+	}
+	sizes = (int32_t *)malloc(sizeof(int32_t) * sc->files * 2);
+
+	// Generate the files on the disk
+	sprintf(path, "%s/in", work_dir);
+	mkdir(path, 0700);
+	sprintf(path, "%s/out", work_dir);
+	mkdir(path, 0700);
+	for (i = 0; i < sc->files; i++) {
+		sizes[i] = random_size(sc, &seed);
+		total += sizes[i];
+		sprintf(host, "%s/in/f%04d", work_dir, i);
+		generate_file(host, sizes[i], &seed);
+	}
+
+	// Empty image
+	if (context)
+		zos_unmount(context);
+	unlink(image);
+	zos_create(image, &context);
+	run_timed(OP_FORMAT, "format %s%s", BENCH_SIZE, options);
+
+	// Directories of the workload
+	for (i = 0; i < sc->dirs; i++) {
+		run_timed(-1, "mkdir /s%d", i);
+	}
+	for (i = 0, path[0] = '\0'; i < sc->depth; i++) {
+		sprintf(path + strlen(path), "/d%d", i);
+		run_timed(-1, "mkdir %s", path);
+	}
+	run_timed(-1, "mkdir /copy");
+
+	for (i = 0; i < sc->files; i++) {
+		file_directory(sc, i, path);
+		results[OP_INCP].bytes += sizes[i];
+		run_timed(OP_INCP, "incp %s/in/f%04d %s", work_dir, i, path);
+	}
+
+	// Load of the image from the disk
+	for (i = 0; i < MOUNT_ROUNDS; i++) {
+		zos_unmount(context);
+		run_timed(OP_MOUNT, "");
+	}
+
+	rounds = LS_SAMPLES / (sc->dirs + sc->depth) + 1;
+	for (j = 0; j < rounds; j++) {
+		for (i = 0; i < sc->dirs + sc->depth; i++) {
+			file_directory(sc, i, path);
+			run_timed(OP_LS, "ls %s", path);
+		}
+	}
+
+	for (i = 0; i < sc->files; i++) {
+		file_directory(sc, i, path);
+		results[OP_CP].bytes += sizes[i];
+		run_timed(OP_CP, "cp %s/f%04d /copy", path, i);
+	}
+
+	for (i = 0; i < sc->files; i++) {
+		file_directory(sc, i, path);
+		results[OP_OUTCP].bytes += sizes[i];
+		run_timed(OP_OUTCP, "outcp %s/f%04d %s/out", path, i, work_dir);
+
+		// Content is verified outside of the measurement
+		sprintf(host, "%s/in/f%04d", work_dir, i);
+		sprintf(copy, "%s/out/f%04d", work_dir, i);
+		if (!same_content(host, copy))
+			errors++;
+		unlink(copy);
+	}
+
+	for (i = 0; i < sc->files; i++) {
+		run_timed(OP_RM, "rm /copy/f%04d", i);
+	}
+
+	// Every second file is removed, larger files fill the holes
+	if (sc->fragment) {
+		for (i = 1; i < sc->files; i += 2) {
+			file_directory(sc, i, path);
+			run_timed(OP_RM, "rm %s/f%04d", path, i);
+		}
+		for (i = 1; i < sc->files; i += 2, refills++) {
+			sizes[sc->files + refills] = random_size(sc, &seed) * 2;
+			sprintf(host, "%s/in/g%04d", work_dir, i);
+			generate_file(host, sizes[sc->files + refills], &seed);
+			file_directory(sc, i, path);
+			results[OP_INCP].bytes += sizes[sc->files + refills];
+			run_timed(OP_INCP, "incp %s %s", host, path);
+			unlink(host);
+		}
+	}
+
+	run_timed(OP_DEFRAG, "defrag");
+	if (check_fs())
+		errors++;
+
+	for (i = 0; i < sc->files; i++) {
+		if (sc->fragment && i % 2 == 1)
+			continue;
+		file_directory(sc, i, path);
+		run_timed(OP_RM, "rm %s/f%04d", path, i);
+	}
+
+	// Generated files
+	for (i = 0; i < sc->files; i++) {
+		sprintf(host, "%s/in/f%04d", work_dir, i);
+		unlink(host);
+	}
+	sprintf(path, "%s/in", work_dir);
+	rmdir(path);
+	sprintf(path, "%s/out", work_dir);
+	rmdir(path);
+
+	fprintf(report, "%s    {\n      \"name\": \"%s\",\n      \"files\": %d,\n      \"bytes\": %ld,\n      \"errors\": %d,\n      \"peak_rss_kb\": %ld,\n      \"ops\": {\n",
+		first ? "" : ",\n", sc->name, sc->files, total, errors, peak_rss());
+	print_stats();
+	fprintf(report, "      }\n    }");
+
+	for (i = 0; i < OP_COUNT; i++) {
+		free(results[i].samples);
+	}
+	free(sizes);
+}
+
+
+/*	Run the command of the filesystem and measure its duration (empty command = mount of the image)
+
+	param op ... OP_* identifier of the operation, -1 = not measured
+	param format ... format of the command (printf)
+	return duration in microseconds
+*/
+double run_timed(int op, const char *format, ...) {
+	char buffer[CMD_SIZE];
+	struct timespec start, end;
+	long r1 = 0, w1 = 0, r2 = 0, w2 = 0;
+	double us;
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(buffer, CMD_SIZE, format, args);
+	va_end(args);
+
+	if (op >= 0 && io_available)
+		read_io(&r1, &w1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (buffer[0] == '\0')
+		zos_mount(image, &context);
+	else
+		zos_execute(context, buffer, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (op >= 0 && io_available)
+		read_io(&r2, &w2);
+
+	us = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+	if (op >= 0)
+		record(op, us, r2 - r1 - io_overhead_reads, w2 - w1);
+	return us;
+}
+
+
+/*	Read the counters of read and write system calls of the process
+
+	param reads ... address to store the count of read calls
+	param writes ... address to store the count of write calls
+	return 0 = no error, -1 = counters are not available
+*/
+int read_io(long *reads, long *writes) {
+	char buffer[512], *item;
+	ssize_t length;
+	int fd = open("/proc/self/io", O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+	length = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (length <= 0)
+		return -1;
+	buffer[length] = '\0';
+
+	if (!(item = strstr(buffer, "syscr:")))
+		return -1;
+	*reads = atol(item + 6);
+	if (!(item = strstr(buffer, "syscw:")))
+		return -1;
+	*writes = atol(item + 6);
+	return 0;
+}
+
+
+/*	Store the result of one command
+
+	param op ... OP_* identifier of the operation
+	param us ... duration in microseconds
+	param reads ... count of read system calls
+	param writes ... count of write system calls
+*/
+void record(int op, double us, long reads, long writes) {
+	op_stats *s = &results[op];
+
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity ? s->capacity * 2 : 64;
+		s->samples = (double *)realloc(s->samples, sizeof(double) * s->capacity);
+	}
+	s->samples[s->count++] = us;
+	s->read_calls += (reads > 0) ? reads : 0;
+	s->write_calls += writes;
+}
+
+
+/* Print results of all operations of the current scenario */
+void print_stats() {
+	int i, j, first = 1;
+	double total;
+	op_stats *s;
+
+	for (i = 0; i < OP_COUNT; i++) {
+		s = &results[i];
+		if (s->count == 0)
+			continue;
+
+		qsort(s->samples, s->count, sizeof(double), compare_samples);
+		for (j = 0, total = 0; j < s->count; j++) {
+			total += s->samples[j];
+		}
+
+		fprintf(report, "%s        \"%s\": {\"count\": %d, \"total_ms\": %.3f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, \"ops_per_s\": %.1f",
+			first ? "" : ",\n", op_names[i], s->count, total / 1e3, s->samples[s->count / 2], s->samples[(s->count * 99) / 100],
+			s->samples[s->count - 1], total > 0 ? s->count / (total / 1e6) : 0);
+		if (s->bytes > 0)
+			fprintf(report, ", \"bytes\": %ld, \"mb_per_s\": %.2f", s->bytes, total > 0 ? s->bytes / total : 0);
+		if (io_available)
+			fprintf(report, ", \"read_syscalls\": %ld, \"write_syscalls\": %ld", s->read_calls, s->write_calls);
+		fprintf(report, "}");
+		first = 0;
+	}
+	fprintf(report, "\n");
+}
+
+
+/*	Compare two durations (qsort)
+
+	return -1, 0, 1
+*/
+int compare_samples(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+/*	Generate the file with deterministic content - random runs mixed with repeated text
+	(so the compression and the deduplication have something to do)
+
+	param path ... path of the file
+	param size ... size in bytes
+	param seed ... state of the generator
+*/
+void generate_file(const char *path, int32_t size, uint64_t *seed) {
+	static const char text[] = "Simple filesystem simulator using i-nodes. ";
+	char *data = (char *)malloc(size + 1);
+	int32_t i, run;
+	uint64_t value;
+	FILE *f;
+
+	for (i = 0; i < size; ) {
+		run = 64 + next_random(seed) % 960;
+		if (run > size - i)
+			run = size - i;
+		if (next_random(seed) % 2) {
+			for ( ; run > 0; run--, i++) {
+				data[i] = text[i % (sizeof(text) - 1)];
+			}
+		}
+		else {
+			for ( ; run > 0; run--, i++) {
+				value = next_random(seed);
+				data[i] = (char)value;
+			}
+		}
+	}
+
+	f = fopen(path, "wb");
+	if (f) {
+		fwrite(data, 1, size, f);
+		fclose(f);
+	}
+	free(data);
+}
+
+
+/*	Next number of the generator (xorshift64*)
+
+	param seed ... state of the generator
+	return random number
+*/
+uint64_t next_random(uint64_t *seed) {
+	*seed ^= *seed >> 12;
+	*seed ^= *seed << 25;
+	*seed ^= *seed >> 27;
+	return *seed * 2685821657736338717ULL;
+}
+
+
+/*	Random size of the file of the workload
+
+	param sc ... workload
+	param seed ... state of the generator
+	return size in bytes
+*/
+int32_t random_size(const scenario *sc, uint64_t *seed) {
+	return sc->min_size + (int32_t)(next_random(seed) % (uint64_t)(sc->max_size - sc->min_size + 1));
+}
+
+
+/*	Get the directory of the file of the workload (files are spread evenly over the directories)
+
+	param sc ... workload
+	param index ... index of the file
+	param path ... buffer for the path of the directory
+*/
+void file_directory(const scenario *sc, int index, char *path) {
+	int i, level;
+
+	if (sc->depth > 0) {
+		level = index % sc->depth;
+		path[0] = '\0';
+		for (i = 0; i <= level; i++) {
+			sprintf(path + strlen(path), "/d%d", i);
+		}
+	}
+	else {
+		sprintf(path, "/s%d", index % sc->dirs);
+	}
+}
+
+
+/*	Check the consistency of the filesystem (reply of fsck is captured)
+
+	return 0 = consistent, -1 = problems found
+*/
+int check_fs() {
+	char *text = NULL;
+	size_t size = 0;
+	int result;
+	FILE *replies;
+
+	replies = open_memstream(&text, &size);
+	zos_execute(context, "fsck", replies);
+	fclose(replies);
+
+	result = (text && strcmp(text, "OK\n") == 0) ? 0 : -1;
+	free(text);
+	return result;
+}
+
+
+/*	Compare the content of two files
+
+	param first ... path of the first file
+	param second ... path of the second file
+	return 1 = the same, 0 = different
+*/
+int same_content(const char *first, const char *second) {
+	char a[4096], b[4096];
+	size_t x, y;
+	int same = 1;
+	FILE *f = fopen(first, "rb"), *g = fopen(second, "rb");
+
+	if (!f || !g) {
+		same = 0;
+	}
+	else {
+		do {
+			x = fread(a, 1, sizeof(a), f);
+			y = fread(b, 1, sizeof(b), g);
+			if (x != y || memcmp(a, b, x) != 0)
+				same = 0;
+		} while (same && x > 0);
+	}
+	if (f) fclose(f);
+	if (g) fclose(g);
+	return same;
+}
+
+
+/*	Peak resident memory of the process
+
+	return size in kilobytes
+*/
+long peak_rss() {
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
@@ -0,0 +1,84 @@
+/**************************************************
+			Simple Filesystem Simulator
+				Console
+
+				Author: Jiri Besta
+***************************************************/
+
+/*	Console of the filesystem - commands are read from the standard input and executed by the library
+	(libzos.a), or the filesystem serves clients of the socket (--server), or the workload of the console
+	is recorded for the replay tool (--record).
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include "libzos.h"
+
+#define BUFF_SIZE 256				// Buffer size for input commands
+
+
+/*	Read commands from the console and execute them until the exit command or the end of the input
+
+	param context ... mounted filesystem
+*/
+void run(zos_context *context) {
+	char buffer[BUFF_SIZE];	// User commands buffer
+
+	while (zos_idle(context, STDIN_FILENO) == ZOS_OK && fgets(buffer, BUFF_SIZE, stdin)) {
+		if (buffer[0] == '\n')		// Skip an empty line
+			continue;
+		if (zos_execute(context, buffer, stdout) != ZOS_OK)
+			break;
+	}
+}
+
+
+/* 	***************************************************
+	Entry point of the program
+
+	param argv[1] ... name of the filesystem
+	param argv[2], argv[3] ... optional "--server" and the path of the socket for clients
+							   or "--record" and the log of the workload (replayed by the replay tool)
+*/
+int main(int argc, char *argv[]) {
+	zos_context *context;
+	int formatted, result;
+
+	if (argc < 2) {
+		printf("No argument! Enter the filesystem name.\n");
+		return EXIT_FAILURE;
+	}
+	if (argc > 2 && ((strcmp("--server", argv[2]) != 0 && strcmp("--record", argv[2]) != 0) || argc < 4)) {
+		printf("Usage: %s filesystem [--server socket | --record log]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Test if filesystem already exists
+	formatted = access(argv[1], F_OK) == 0;
+	result = formatted ? zos_mount(argv[1], &context) : zos_create(argv[1], &context);
+	if (result != ZOS_OK) {
+		printf("The filesystem %s cannot be loaded: %s.\n", argv[1], zos_strerror(result));
+		return EXIT_FAILURE;
+	}
+
+	// The workload is replayed on the copy of the image in the recorded state
+	if (argc > 2 && strcmp("--record", argv[2]) == 0 && zos_record(context, argv[3]) != ZOS_OK) {
+		printf("The log %s or the copy of the image cannot be created.\n", argv[3]);
+		zos_unmount(context);
+		return EXIT_FAILURE;
+	}
+
+	printf("Filesystem is running...\n");
+	if (!formatted)
+		printf("The filesystem has to be formatted first.\nUsage: format SIZE [-i N] [-z] [-d] [-c]\n");
+
+	if (argc > 2 && strcmp("--server", argv[2]) == 0)
+		result = zos_serve(context, argv[3]);
+	else
+		run(context);
+	zos_unmount(context);
+
+	return (result == ZOS_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -14,15 +14,126 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include "libzos.h"
+#include "trace.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_HARDWARE				// The instruction crc32 of SSE4.2 is used when the processor has it
+#endif
 
 #define BUFF_SIZE 256				// Buffer size for input commands
 #define CLUSTER_SIZE 1024			// Size of the one cluster in bytes
 #define INODE_SIZE 38				// Size of the i-node in bytes
+#define INODE_HEADER_SIZE 39		// Size of the extended i-node without inline data (i-node + flags)
+#define MIN_INODE_SIZE 64			// Minimum size of the extended i-node record
+#define MAX_INODE_SIZE 512			// Maximum size of the extended i-node record
+#define CHUNK_SIZE 4096				// Size of the chunk of the file which is compressed at once
+#define CHUNK_RAW 0x80000000		// Flag of the chunk which is stored without compression
+#define LZ_HASH_BITS 12				// Size of the hash table of the compressor (2^bits items)
+#define LZ_MIN_MATCH 4				// Minimum length of the match
+#define LZ_LAST_LITERALS 5			// Count of bytes at the end of the chunk which are always stored as literals
+#define LZ_MAX_OFFSET 65535			// Maximum distance of the match
+#define HASH_SIZE 16				// Size of the content hash of one data block in bytes (128 bits)
+#define MAX_REFERENCES 127			// Maximum count of references to one data block (stored in the bitmap)
+#define MAX_SHARED (MAX_REFERENCES - MAX_SNAPSHOTS)	// Maximum count of references of files to one data block (the rest is left for snapshots)
+#define DEFRAG_BATCH 1024			// Count of data blocks moved at once by defragmentation (size of the staging buffer)
+#define BLOCKS_PER_INODE 520		// Maximum count of data blocks of one i-node including indirect blocks (rounded)
+#define OWNER_KEY(nodeid, position) ((int64_t)(nodeid) * BLOCKS_PER_INODE + (position))	// Owner of the data block (map_data_blocks)
+#define OWNER_INODE(key) ((int32_t)((key) / BLOCKS_PER_INODE))		// I-node ID of the owner
+#define OWNER_POSITION(key) ((int32_t)((key) % BLOCKS_PER_INODE))	// Position of the block in the layout of the i-node
+#define DEFRAG_WINDOW 256			// Count of used i-nodes examined by one step of the incremental defragmentation
+#define DEFRAG_STEP_FILES 16		// Maximum count of files relocated by one step of the incremental defragmentation
+#define IDLE_TIMEOUT 1000			// Time without console input after which the idle defragmentation starts (ms)
+#define WORKER_COUNT 4				// Count of threads of the worker pool (parallel I/O of data blocks)
+#define WORKER_BUFFER 65536			// Size of the buffer of one worker in bytes
+#define JOB_READ 0					// Job of the worker pool - read data blocks to the memory
+#define JOB_WRITE 1					// Job of the worker pool - write data blocks from the memory
+#define JOB_COPY 2					// Job of the worker pool - copy data blocks to other data blocks
+#define IMPORT_THREADS 4			// Count of threads which walk and read host directories (incp -r)
+#define IMPORT_MEMORY 33554432		// Maximum size of host files read ahead by the import in bytes (32 MB)
+#define IMPORT_WINDOW 4194304		// Size of data of imported files written at once in bytes (4 MB)
+#define EXPORT_THREADS 4			// Count of threads which write host files (outcp -r)
+#define EXPORT_MEMORY 33554432		// Size of data of exported files read at once in bytes (32 MB)
+#define MAX_SNAPSHOTS 32			// Maximum count of snapshots (items of the table of snapshots in one data block)
+#define CHECKSUM_SIZE 4				// Size of the checksum of one data block in bytes (CRC32C)
+#define CRC32C_POLY 0x82F63B78		// Polynomial of CRC32C (Castagnoli, reversed order of bits)
+#define CHECKSUM_BATCH 64			// Count of checksums of one write computed before they are added to pending ones
+#define HOST_DIRECTORY -1			// Size of the host file which is a directory (import)
+#define NAME_LENGTH 11				// Maximum length of the name of the file/directory
+#define FSCK_INVALID_BLOCK 0		// Problem found by fsck - reference to the data block out of the range
+#define FSCK_FILE_SIZE 1			// Problem found by fsck - size of the file does not match its data blocks
+#define FSCK_DANGLING_ENTRY 2		// Problem found by fsck - directory item refers to the free i-node
+#define FSCK_ORPHAN 3				// Problem found by fsck - used i-node is not reachable from the root
+#define FSCK_LINKS 4				// Problem found by fsck - count of references to the i-node is wrong
+#define FSCK_DIRECTORY_SIZE 5		// Problem found by fsck - size of the directory is not the sum of its content
+#define FSCK_LEAKED 6				// Problem found by fsck - full data block is not referenced
+#define FSCK_UNMARKED 7				// Problem found by fsck - referenced data block is free in the bitmap
+#define FSCK_DOUBLE 8				// Problem found by fsck - data block is referenced more times than allowed
+#define FSCK_REFERENCES 9			// Problem found by fsck - count of references in the bitmap is wrong
+#define FSCK_WINDOW 256				// Count of data blocks read at once by fsck (indirect blocks and blocks of directories)
+#define FSCK_GAP 16					// Maximum count of unneeded data blocks between two blocks read at once by fsck
+#define FSCK_INDIRECT 0				// Kinds of data blocks read by fsck - indirect blocks
+#define FSCK_DIRECTORY 1			// Data blocks of directories
+#define SERVER_THREADS 8			// Count of threads of the server (count of commands of clients executed at once)
+#define MAX_PENDING 64				// Maximum count of clients waiting for the acceptance by the server
+#define MAX_SESSIONS 256			// Maximum count of clients connected to the server at once
+#define OUTPUT (output ? output : stdout)	// Stream for the replies of the current session
+#define READ_BUFFER 65536			// Size of the buffer for reading of the file content at once (cat, outcp)
+#define MAX_BATCH_DEPTH 16			// Maximum nesting of batch scripts (scripts loaded by scripts)
+#define POOL_SLAB 512				// Count of objects in one slab of the pool allocator
+#define INODE_SCAN_CHUNK 16			// Count of i-nodes tested at once by the search of a free i-node
+#define HIST_SUB_BITS 3				// Buckets of the latency histogram - 2^bits buckets for every power of 2 (precision 12.5 %)
+#define HIST_BUCKETS 312			// Count of buckets of the latency histogram (up to 2^40 us)
+#define IO_SITES 128				// Maximum count of functions (call sites) whose I/O of the image is counted
+#define IO_READ 0					// Kinds of counted I/O of the image - read
+#define IO_WRITE 1					// Write
+#define IO_SEEK 2					// Seek
+#define IO_FLUSH 3					// Flush
+#define CMD_UNKNOWN -1				// Identifiers of commands (index to the table of commands)
+#define CMD_APPEND 0
+#define CMD_CAT 1
+#define CMD_CD 2
+#define CMD_CHECKSUM 3
+#define CMD_CP 4
+#define CMD_DEDUP 5
+#define CMD_DEFRAG 6
+#define CMD_FORMAT 7
+#define CMD_FRAGSTAT 8
+#define CMD_FSCK 9
+#define CMD_INCP 10
+#define CMD_INFO 11
+#define CMD_LOAD 12
+#define CMD_LS 13
+#define CMD_MKDIR 14
+#define CMD_MV 15
+#define CMD_OUTCP 16
+#define CMD_PWD 17
+#define CMD_RM 18
+#define CMD_RMDIR 19
+#define CMD_SNAPSHOT 20
+#define CMD_STATS 21
+#define CMD_TRACE 22
+#define CMD_TRUNCATE 23
+#define CMD_WRITE 24
+#define CMD_QUIT 25					// Also the count of commands in the table
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
 #define MAX_NUMBERS_IN_BLOCK 256	// Count of numbers (integers) in one block
 #define MIN_FS_SIZE 20480			// Minimum size of the filesystem
 #define MAX_SIZE 529408				// Maximum size of the file which can be stored in the filesystem (517 * 1024)
 #define ERROR -1
 #define NO_ERROR 0
+#define BAD_CHECKSUM -2				// Data blocks do not match their checksums (ERROR for other corruption)
 
 #define FNF "FILE NOT FOUND\n"
 #define PNF "PATH NOT FOUND\n"
@@ -32,6 +143,10 @@
 #define OK "OK\n"
 #define CCF "CANNOT CREATE FILE\n"
 #define NES "FILESYSTEM HAS NOT ENOUGH SPACE\n"
+#define IR "INVALID RANGE\n"
+#define HS "FILESYSTEM HAS SNAPSHOTS\n"
+#define CHM "CHECKSUM MISMATCH\n"
+#define CCD "CANNOT COPY THE DIRECTORY INTO ITSELF\n"
 
 // Structure of supeblock
 struct superblock {
@@ -45,14 +160,26 @@ struct superblock {
     int32_t bitmap_start_address;   // Start address of the bitmap of the data blocks
     int32_t inode_start_address;    // Start address of the i-nodes
     int32_t data_start_address;     // Start address of data blocks  
+    int32_t inode_size;             // Size of one i-node record, 0 in older filesystems = INODE_SIZE
+    int32_t features;               // Optional features of the filesystem (FEATURE_*)
+    int32_t dedup_cluster_count;    // Count of clusters for hashes of data blocks (only with FEATURE_DEDUP)
+    int32_t dedup_start_address;    // Start address of hashes of data blocks (only with FEATURE_DEDUP)
+    int32_t defrag_cursor;          // I-node ID where the next step of the incremental defragmentation continues
+    int32_t snapshot_count;         // Count of snapshots
+    int32_t snapshot_table;         // Data block with the table of snapshots (only with snapshots)
+    int32_t checksum_cluster_count; // Count of clusters for checksums of data blocks (only with FEATURE_CHECKSUM)
+    int32_t checksum_start_address; // Start address of checksums of data blocks (only with FEATURE_CHECKSUM)
 };
 
-// Structure of i-node
+#define FEATURE_COMPRESS 1			// All files are compressed by default
+#define FEATURE_DEDUP 2				// Identical data blocks of files are shared
+#define FEATURE_CHECKSUM 4			// Data blocks have checksums (CRC32C), reads of files verify them
+#define BLOCKS_SHARED ((sb->features & FEATURE_DEDUP) || sb->snapshot_count > 0)	// If data blocks may have more references
+
+// Structure of i-node (references to data blocks and other fields which are not scanned, the i-node ID,
+// the type and the size are stored in dense arrays inode_ids, inode_dirs and inode_sizes)
 typedef struct theinode {
-    int32_t nodeid;                 // i-node ID, if ID = FREE, then i-node is free
-    int8_t isDirectory;             // 0 = file, 1 = directory
     int8_t references;              // Count of references to i-node
-    int32_t file_size;              // Size of the file/directory in bytes
     int32_t direct1;                // 1. direct reference to data blocks
     int32_t direct2;                // 2. direct reference to data blocks
     int32_t direct3;                // 3. direct reference to data blocks
@@ -60,8 +187,13 @@ typedef struct theinode {
     int32_t direct5;                // 5. direct reference to data blocks
     int32_t indirect1;              // 1. indirect reference 
 	int32_t indirect2;              // 2. indirect reference 
+	int8_t flags;                   // INODE_* flags of the file (only extended i-nodes)
 } inode;
 
+#define INODE_INLINE 1				// Flag of the file whose data are stored inline in the i-node record
+#define INODE_COMPRESSED 2			// Flag of the file whose data blocks contain the compressed stream
+#define INLINE_DATA(id) (inline_data + (id) * inline_capacity)	// Inline data of the i-node
+
 // Structure of directory item
 typedef struct thedirectory_item{
     int32_t inode;               	// i-node ID (index to array)
@@ -75,16 +207,186 @@ typedef struct thedirectory {
 	directory_item *current;		// Current directory item
 	directory_item *subdir;			// Reference to the first subdirectory in the list of all subdirectories in the current directory
 	directory_item *file;			// Reference to the first file in the list of all files in the current directory
+	pthread_mutex_t lock;			// Lock of the items of the directory (server)
 } directory;	
 
-// Structure of info. about particular data block
-typedef struct thedata_info {
-	int32_t nodeid;				// I-node id which contains this data block
-	int32_t *ref_addr;			// Address of the direct/indirect reference where this data block is stored
-								// NULL - if this data block is only in the block referenced by indirect reference
-	int32_t indir_block;		// number of data block of indirect reference
-	int32_t order_in_block;		// Location in the indirect data block (order of number)
-} data_info;
+// Structure of the pool allocator of objects of one size (directory items and directories are allocated
+// in slabs, which keeps items of one directory close in memory and allows to free the whole tree at once)
+typedef struct thepool {
+	size_t size;					// Size of one object
+	void *free_list;				// Released objects (the first bytes of the object refer to the next one)
+	char **slabs;					// Allocated slabs (POOL_SLAB objects each)
+	int slab_count;					// Count of slabs
+	int slab_capacity;				// Size of the array of slabs
+	int slab_used;					// Count of objects taken from the last slab
+	pthread_mutex_t lock;
+} pool;
+
+// Structure of the planned move of one data block (defragmentation)
+typedef struct theblock_move {
+	int32_t from;				// Current number of the data block, FREE = from the park buffer
+	int32_t to;					// New number of the data block, FREE = to the park buffer
+	int32_t slot;				// Position of the data in the staging buffer (during execution)
+} block_move;
+
+// Structure of the sorting key of the data block (defragmentation)
+typedef struct theblock_key {
+	int64_t key;				// i-node ID and position of the block in the i-node
+	int32_t block;				// Number of the data block
+} block_key;
+
+// Structure of one job of the worker pool (I/O of consecutive data blocks)
+typedef struct theio_job {
+	int8_t kind;				// JOB_READ, JOB_WRITE or JOB_COPY
+	int32_t from;				// First source data block (JOB_READ, JOB_COPY)
+	int32_t to;					// First target data block (JOB_WRITE, JOB_COPY)
+	int32_t size;				// Count of bytes
+	char *data;					// Buffer in the memory (JOB_READ, JOB_WRITE)
+} io_job;
+
+// Structure of the growing list of jobs of the worker pool
+typedef struct thejob_list {
+	io_job *jobs;				// Array of jobs
+	int count;					// Count of jobs
+	int capacity;				// Size of the array
+} job_list;
+
+// Structure of the file or directory imported from the host (incp)
+typedef struct thehost_file {
+	char *path;					// Path in the host filesystem
+	char *data;					// Stored data padded to whole data blocks (NULL = not read)
+	int32_t size;				// Size of the file, HOST_DIRECTORY = directory
+	int32_t stored_size;		// Size of the stored data (compressed data are shorter)
+	int32_t parent;				// Index of the parent directory in the list of imported files, FREE = none
+	int32_t inode;				// I-node ID of the exported file (outcp -r)
+	int8_t compressed;			// If the data are compressed
+	int8_t ready;				// If the file was read (directories are always ready), ERROR or BAD_CHECKSUM = corrupted data
+	directory *dir;				// Created directory (only directories)
+} host_file;
+
+// Structure of the snapshot (item of the table of snapshots), records of i-nodes of the snapshot are stored
+// in the chain of data blocks (the first number of the block is the next block, FREE = the last one)
+typedef struct thesnapshot_info {
+	int64_t created;			// Time of the creation (seconds since the epoch)
+	char name[12];				// Name of the snapshot
+	int32_t inode_count;		// Count of stored records of i-nodes (used i-nodes)
+	int32_t first_block;		// First data block of the chain
+	int32_t block_count;		// Count of data blocks of the chain
+} snapshot_info;
+
+// Structure of one problem found by the consistency check
+typedef struct thefsck_problem {
+	int8_t kind;				// FSCK_* kind of the problem
+	int32_t id;					// I-node ID or number of the data block
+	int32_t value;				// Found value
+	int32_t expected;			// Expected value (or position of the directory item)
+} fsck_problem;
+
+// Structure of the data block which the consistency check reads (indirect block or block of the directory)
+typedef struct thefsck_read {
+	int32_t block;				// Number of the data block
+	int32_t id;					// I-node which refers to the data block
+} fsck_read;
+
+// Structure of the list of data blocks which the consistency check reads
+typedef struct thefsck_list {
+	fsck_read *items;			// Data blocks
+	int count;					// Count of data blocks
+	int capacity;				// Size of the array of data blocks
+} fsck_list;
+
+// Structure of the part of the filesystem checked by one thread of the consistency check
+typedef struct thefsck_range {
+	int32_t first_inode;		// First i-node of the range
+	int32_t last_inode;			// Last i-node of the range + 1
+	int32_t first_block;		// First data block of the range
+	int32_t last_block;			// Last data block of the range + 1
+	fsck_list reads[2];			// Data blocks read by the thread (FSCK_INDIRECT, FSCK_DIRECTORY)
+	int8_t kind;				// Kind of data blocks read by the thread now
+	fsck_problem *problems;		// Found problems
+	int problem_count;			// Count of found problems
+	int problem_capacity;		// Size of the array of problems
+} fsck_range;
+
+// Structure of the session of the client of the server (state of the session between its commands)
+typedef struct thesession {
+	int socket;					// Socket of the client
+	FILE *out;					// Stream for the replies to the client
+	char input[BUFF_SIZE];		// Received input which is not executed yet
+	int input_length;			// Count of bytes of the received input
+	int8_t closed;				// If the client closed its side of the connection
+	int8_t queued;				// If the session waits for a thread or runs (its socket is not polled)
+	int8_t started;				// If the session has its working directory
+	directory *working_directory;	// Current directory
+	int file_input;				// If commands are loaded from a file
+	FILE *script;				// File with commands (load)
+	int8_t verify_checksums;	// If reads of files verify checksums of data blocks (checksum on | off)
+} session;
+
+// Structure of the command of the console
+typedef struct thecommand_info {
+	const char *name;			// Name of the command
+	int8_t exclusive;			// If no other command may run meanwhile (it changes the tree of directories or the whole filesystem)
+} command_info;
+
+// Structure of the prepared command of the batch script
+typedef struct thebatch_command {
+	int8_t id;					// CMD_* identifier
+	char *line;					// Whole line of the script
+	char *args;					// Arguments of the command (part of the line), NULL = none
+} batch_command;
+
+// Structure of the file examined by the incremental defragmentation
+typedef struct thedefrag_candidate {
+	int32_t nodeid;				// I-node ID
+	int32_t fragments;			// Count of runs of consecutive data blocks
+} defrag_candidate;
+
+// Structure of the statistics of one command
+typedef struct thecommand_stats {
+	long count;					// Count of runs
+	long total_us;				// Total time in microseconds
+	long max_us;				// The longest run
+	long buckets[HIST_BUCKETS];	// Latency histogram (log-linear buckets, hist_bucket)
+} command_stats;
+
+// Structure of the counters of I/O of the image done by one function
+typedef struct theio_site {
+	const char *name;			// Name of the function (__func__), NULL = free item
+	long counts[4];				// Count of calls - IO_READ, IO_WRITE, IO_SEEK, IO_FLUSH
+	long bytes[2];				// Count of read and written bytes
+} io_site;
+
+// Structure of the pending checksum of the written data block (applied at the end of the command)
+typedef struct thechecksum_update {
+	int32_t block;				// Data block
+	uint32_t crc;				// CRC32C of the written data block
+	int8_t partial;				// If the data block was written partly (its checksum is computed from the image)
+} checksum_update;
+
+// Structure of the statistics of one allocator
+typedef struct thescan_stats {
+	long calls;					// Count of searches
+	long scanned;				// Total count of examined items (i-nodes or bitmap items)
+	long max;					// The longest search
+} scan_stats;
+
+// Structure of the filesystem mounted by the library
+struct zos_context {
+	int32_t mount;				// Number of the mount (api_mount)
+	directory *working_directory;	// Current directory of commands of zos_execute
+	int8_t verify_checksums;	// If reads of files verify checksums of data blocks (checksum on | off)
+};
+
+// Structure of the file opened by the library
+struct zos_file {
+	zos_context *context;		// Filesystem of the file
+	int32_t mount;				// Mount of the filesystem which opened the file (the handle stops working after zos_unmount)
+	char *path;					// Path of the file (resolved by every operation)
+	int32_t inode;				// I-node ID of the file
+	int32_t position;			// Position of the next read/write
+	int flags;					// ZOS_* flags of zos_open
+};
 
 
 void cp(char *files);
@@ -99,2500 +401,10314 @@ void pwd();
 void info(char *file);
 void incp(char *files);
 void outcp(char *files);
+void mywrite(char *args);
+void append(char *args);
+void mytruncate(char *args);
 FILE *load(char *file);
-void format(long bytes);
-void defrag();
-
-void run();
-void shutdown();
+void format(long bytes, int32_t inode_size, int32_t features);
+void defrag(char *options);
+void dedup();
+void fragstat(char *options);
+void fsck(char *options);
+void snapshot(char *args);
+
+int read_command(char *buffer, FILE **f);
+int record_command(char *buffer, FILE **f, directory **current);
+void record_host_file(char *path);
+void record_host_tree(char *path);
+int hash_file(const char *path, int32_t *size, uint64_t *hash);
+int copy_host_file(const char *from, const char *to);
+long elapsed_us(const struct timespec *from, const struct timespec *to);
+int execute_command(char *buffer, FILE **f, directory **current);
+int run_command(int id, char *args, FILE **f);
+int find_command(const char *name, int length);
+int load_batch(char *file);
+batch_command *parse_script(char *script, int *count);
+void defer_inode(int32_t id);
+void defer_blocks(int32_t first, int32_t last);
+void commit_metadata();
+void wait_for_input(int input);
+void shutdown_fs();
+int reply(const char *format, ...);
+
+int serve(const char *path);
+void *session_main(void *arg);
+void accept_client(int listener);
+void receive_input(session *client);
+int read_session_command(session *client, char *buffer);
+void queue_session(session *client);
+void close_session(session *client);
+void stop_server(int number);
+void reset_sessions(directory *from, directory *to);
+void init_locks();
+FILE *open_fs(const char *mode);
+void lock_directories(directory *first, directory *second);
+void unlock_directories(directory *first, directory *second);
 
 int is_sorted(int32_t *blocks, int count);
-data_info *create_data_info(int32_t nodeid, int32_t *ref_addr, int32_t indir_block, int32_t order_in_block);
-data_info **map_data_blocks(int *count_of_full_blocks);
-void switch_blocks(int from, int to, data_info **info_blocks);
+int64_t *map_data_blocks(int *count_of_full_blocks);
+int32_t *plan_layout(int64_t *owners, int count_of_full_blocks);
+int compare_block_keys(const void *a, const void *b);
+block_move *plan_moves(int32_t *target, int *move_count);
+void execute_moves(block_move *moves, int move_count);
+void move_batch(block_move *batch, int count, char *staging, char *output, char *park, uint32_t *park_sum);
+int compare_move_sources(const void *a, const void *b);
+int compare_move_targets(const void *a, const void *b);
+void remap_metadata(int32_t *target);
+int defrag_step(long budget, int verbose);
+int32_t *get_layout_blocks(inode *node, int *count);
+int count_fragments(int32_t *blocks, int count);
+int relocate_inode(int32_t nodeid);
+int compare_defrag_candidates(const void *a, const void *b);
+long get_budget(char *budget);
+void *fsck_inodes(void *arg);
+void fsck_indirect(fsck_range *range, fsck_read *read, int32_t *numbers);
+void fsck_directory(fsck_range *range, fsck_read *read, int32_t *numbers);
+void *fsck_read_blocks(void *arg);
+void run_fsck_threads(fsck_range *ranges, void *(*check)(void *));
+void split_reads(fsck_range *ranges, int8_t kind);
+void add_read(fsck_list *list, int32_t block, int32_t id);
+int compare_fsck_reads(const void *a, const void *b);
+void *fsck_blocks(void *arg);
+void add_problem(fsck_range *range, int8_t kind, int32_t id, int32_t value, int32_t expected);
+int8_t fsck_reachable(int32_t id, int32_t *path);
+void print_problem(fsck_problem *problem);
+int repair_problems(fsck_range *ranges, int range_count);
+int repair_shared_blocks(int8_t *claimed);
+int32_t repair_block(int32_t block, int allowed, int8_t *claimed);
+void release_inode(int32_t id);
+void create_snapshot(char *name);
+void list_snapshots();
+void delete_snapshot(char *name);
+void rollback_snapshot(char *name);
+int find_snapshot(char *name);
+char *load_snapshot(snapshot_info *snapshot, int32_t *chain, int *chain_count);
+void store_snapshots();
+int32_t *get_snapshot_blocks(char *records, int record_count, int distinct, int *count);
+int check_references(int32_t *blocks, int count, int32_t *released, int released_count);
+void count_snapshot_references(int32_t *refs);
+int unshare_blocks(int32_t nodeid);
+int32_t copy_block(int32_t block);
+void reload_directories();
+int remove_file(directory *dir, char *name);
+void copy_directory(directory_item *item, directory *dest_dir, char *name);
+int copy_tree(directory *source, directory *parent, char *name, int32_t *reserved, int *used, job_list *list);
+int count_tree_blocks(directory *dir);
+int count_stored_blocks(int32_t nodeid);
+int count_with_indirect(int block_count);
+int copy_file(directory_item *item, directory *dest_dir, char *name, int32_t *blocks, job_list *list);
+void add_job(job_list *list, int8_t kind, int32_t from, int32_t to, int32_t size, char *data);
+void release_reserved(int32_t *blocks, int count, int32_t nodeid);
+void import_file(char *source, char *name, directory *dir, int compress);
+void load_host_file(host_file *file, int compress);
+int store_host_file(directory *dir, char *name, host_file *file, int32_t *blocks, job_list *list);
+void import_directory(char *source, directory *dest_dir, int compress);
+void *walk_host_directories(void *arg);
+void *read_host_files(void *arg);
+int place_host_file(host_file *file, directory *dest_dir, int32_t *blocks, job_list *list);
+void flush_imported(job_list *list, int from, int to);
+int reserved_blocks(host_file *file);
+void free_host_files(host_file *files, int count);
+void export_directory(directory_item *item, char *dest);
+void collect_exported(directory *dir, char *path);
+void *write_host_files(void *arg);
+int save_host_file(host_file *file);
+int compare_exported(const void *a, const void *b);
+int compare_job_sources(const void *a, const void *b);
+int compare_host_files(const void *a, const void *b);
+void remove_tree(directory *parent, directory_item *item);
+void remove_directory(directory *parent, directory_item *item);
+int create_file(directory *dir, char *name);
+int change_file(directory *dir, int32_t nodeid, int32_t offset, char *data, int32_t length, int32_t new_size);
+void modify_file(char *file, int32_t offset, char *source, int32_t size);
+int expand_file(int32_t nodeid, int32_t offset, char *data, int32_t length, int32_t new_size);
+int resize_blocks(int32_t nodeid, int old_count, int new_count);
+int write_blocks(int32_t nodeid, int32_t offset, char *data, int32_t length);
+void release_blocks(int32_t *blocks, int count);
 
 int32_t get_size(char *size);
+int get_format_options(char *options, int32_t *inode_size, int32_t *features);
 int32_t find_free_inode();
 int32_t *find_free_data_blocks(int count);
 int parse_path(char *path, char **name, directory **dir);
 directory_item *find_item(directory_item *first_item, char *name);
 int32_t *get_data_blocks(int32_t nodeid, int *block_count, int *rest);
+int32_t *get_block_range(int32_t nodeid, int first, int count);
+void set_block_range(int32_t nodeid, int first, int count, int32_t *blocks);
+int read_blocks(int32_t *blocks, int count, char *buffer);
 int create_directory(directory *parent, char *name);
 int test_existence(directory *dir, char *name);
 directory_item *create_directory_item(int32_t inode_id, char *name);
 directory *find_directory(char *path);
 void initialize_inode(int32_t id, int32_t size, int block_count, int tmp_count, int *last_block_index, int32_t *blocks);
-void free_directories(directory *root);
+void free_directories();
+int alloc_inodes(int32_t count);
+void free_inodes();
+void *pool_alloc(pool *p);
+void pool_free(pool *p, void *object);
+void pool_release(pool *p);
 void clear_inode(int id);
 void update_sizes(directory *dir, int32_t size);
 void print_info(directory_item *item);
-void print_file(directory_item *item);
+int write_file(int32_t nodeid, FILE *out, int32_t offset, int32_t length);
+int decompress_file(int32_t nodeid, FILE *out, int32_t offset, int32_t length);
+int inflate_chunks(char *stream, int32_t size, int32_t position, int first, int last, FILE *out, int32_t offset, int32_t length);
+int32_t get_range_value(char *value);
+char *compress_data(char *data, int32_t size, int32_t *stored_size);
+int lz_compress(const uint8_t *src, int length, uint8_t *dst, int capacity);
+int lz_decompress(const uint8_t *src, int length, uint8_t *dst, int capacity);
+int lz_put_length(uint8_t *dst, int op, int length);
 void print_format_msg();
 
-void load_fs();
+int load_fs();
 void load_directory(directory *dir, int id);
 void update_bitmap(directory_item *item, int8_t value, int32_t *data_blocks, int b_count);
 void update_inode(int id);
+void pack_inode(int id, char *record);
+void unpack_inode(char *record, inode *node);
+void store_inodes();
+void store_superblock();
 int update_directory(directory *dir, directory_item *item, int action);
+int32_t find_free_reference(int32_t indirect);
 void remove_reference(directory_item *item, int32_t block_id);
 
+void hash_block(const char *data, uint64_t *hash);
+void build_dedup_index();
+int32_t find_duplicate(uint64_t *hash, char *data);
+void insert_dedup_block(int32_t block, uint64_t *hash);
+void remove_dedup_block(int32_t block);
+void set_references(int32_t block, int8_t count);
+uint64_t fmix64(uint64_t k);
+int32_t *find_duplicates(char *data, int block_count);
+int32_t *allocate_shared_blocks(int32_t *candidates, int block_count, int tmp_count, int8_t *new_blocks);
+void reference_shared_blocks(char *data, int32_t *blocks, int block_count, int8_t *new_blocks);
+int release_shared_blocks(int32_t *blocks, int block_count);
+
+void checksum(char *args);
+void init_crc32c();
+uint32_t crc32c(uint32_t crc, const char *data, size_t length);
+#ifdef CRC32C_HARDWARE
+uint32_t crc32c_sse42(uint32_t crc, const char *data, size_t length);
+#endif
+void update_checksums(const char *data, off_t offset, size_t length);
+size_t write_data(const void *data, size_t size, size_t count, off_t offset, const char *site);
+void apply_checksums();
+void mark_checksums(int32_t first, int32_t last);
+void store_checksums();
+void flush_checksums();
+int verify_blocks(int32_t first, int count, const char *data);
+int verify_layout(int32_t nodeid);
+
+void start_workers();
+void stop_workers();
+void *worker_main(void *arg);
+int run_jobs(io_job *jobs, int count);
+int execute_job(io_job *job, char *buffer);
+int read_at(void *data, size_t size, off_t offset);
+int write_at(const void *data, size_t size, off_t offset);
+int mount_image(const char *image, zos_context **context, int formatted);
+int enter_api(zos_context *context, int exclusive);
+void leave_api();
+int api_split_path(const char *path, char *buffer, char **name, directory **dir);
+int api_find_file(zos_file *file, directory **dir);
+void api_fill_info(int32_t id, zos_info *info);
+int api_stream(zos_context *context);
+void share_fs(zos_context *context);
+void stats(char *option);
+void record_latency(int id, long us);
+int hist_bucket(long us);
+long hist_upper(int bucket);
+long hist_percentile(command_stats *cs, double percentile);
+void record_scan(scan_stats *scan, long length);
+int count_io(const char *site, int kind, size_t bytes);
+int compare_io_sites(const void *a, const void *b);
+void trace(char *args);
+void trace_io(int site, int op, long offset, long length);
+void trace_layout_record();
+void trace_write(int site, int op, long offset, long length, const void *data);
+size_t stat_fread(void *data, size_t size, size_t count, FILE *stream, const char *site);
+size_t stat_fwrite(const void *data, size_t size, size_t count, FILE *stream, const char *site);
+int stat_fseek(FILE *stream, long offset, int whence, const char *site);
+int stat_fflush(FILE *stream, const char *site);
+int stat_read_at(void *data, size_t size, off_t offset, const char *site);
+int stat_write_at(const void *data, size_t size, off_t offset, const char *site);
+
+// I/O of the image is counted by the calling function (stats), the real functions are called as (fread)(...)
+#define fread(data, size, count, stream) stat_fread(data, size, count, stream, __func__)
+#define fwrite(data, size, count, stream) stat_fwrite(data, size, count, stream, __func__)
+#define fseek(stream, offset, whence) stat_fseek(stream, offset, whence, __func__)
+#define fflush(stream) stat_fflush(stream, __func__)
+#define read_at(data, size, offset) stat_read_at(data, size, offset, __func__)
+#define write_at(data, size, offset) stat_write_at(data, size, offset, __func__)
+
+// Writes of data blocks also remember their checksums, the position of the write is given by the caller
+#define fwrite_data(data, size, count, offset) write_data(data, size, count, offset, __func__)
+
 const int32_t FREE = -1;					// item is free
 const char *DELIM = " \n"; 
 
+// Table of commands, sorted by names, command ID = index (CMD_*)
+const command_info commands[] = {
+	{"append", 0}, {"cat", 0}, {"cd", 0}, {"checksum", 0}, {"cp", 0}, {"dedup", 1}, {"defrag", 1}, {"format", 1}, {"fragstat", 1}, {"fsck", 1},
+	{"incp", 0}, {"info", 0}, {"load", 0}, {"ls", 0}, {"mkdir", 1}, {"mv", 0}, {"outcp", 0}, {"pwd", 0}, {"rm", 0}, {"rmdir", 1},
+	{"snapshot", 1}, {"stats", 0}, {"trace", 1}, {"truncate", 0}, {"write", 0}
+};
+const int command_count = sizeof(commands) / sizeof(command_info);
+
 char *fs_name;							// Filesystem name
-FILE *fs;								// File with filesystem
+__thread FILE *fs = NULL;				// File with filesystem (own stream of every session)
+int fs_fd = -1;							// Descriptor of the file with filesystem for the positional I/O (shared by all threads)
 struct superblock *sb;					// Superblock
-int8_t *bitmap = NULL;					// Bitmap of data blocks, 0 = free	1 = full
+int8_t *bitmap = NULL;					// Bitmap of data blocks, 0 = free	1 = full (count of references with FEATURE_DEDUP)
 inode *inodes = NULL;					// Array of i-nodes, i-node ID = index to array
+int32_t *inode_ids = NULL;				// I-node ID of every i-node, FREE = free i-node (index = i-node ID)
+int8_t *inode_dirs = NULL;				// Type of every i-node, 0 = file, 1 = directory
+int32_t *inode_sizes = NULL;			// Size of the file/directory of every i-node in bytes
 directory **directories = NULL;			// Array of pointers to directories, i-node ID = index to array
-directory *working_directory;			// Current directory
+__thread directory *working_directory;	// Current directory
 int fs_formatted;						// If filesystem is formatted, 0 = false, 1 = true
-char block_buffer[CLUSTER_SIZE];		// Buffer for one cluster 
-int file_input = 0;						// If commands are loaded from a file
+__thread char block_buffer[CLUSTER_SIZE];	// Buffer for one cluster 
+__thread int file_input = 0;			// If commands are loaded from a file
+__thread FILE *output = NULL;			// Stream for the replies to the client, NULL = standard output
+__thread char *tokens = NULL;			// Position of strtok_r in the parsed command
+char *inline_data = NULL;				// Inline data of all i-nodes (only extended i-nodes), i-node ID = index
+int32_t inline_capacity = 0;			// Count of bytes which can be stored inline in one i-node
+snapshot_info snapshots[MAX_SNAPSHOTS];	// Table of snapshots (sb->snapshot_count items)
+uint64_t *dedup_hashes = NULL;			// Hashes of all data blocks (2 numbers per block, 0 = block is not indexed)
+int32_t *dedup_index = NULL;			// Hash table of indexed data blocks (open addressing, FREE = empty)
+int32_t dedup_index_size = 0;			// Count of items in the hash table (power of 2)
+long dedup_saved_writes = 0;			// Count of data blocks which were not written thanks to deduplication
+uint32_t *checksums = NULL;				// CRC32C of every data block (only with FEATURE_CHECKSUM)
+__thread int verify_checksums = 1;		// If reads of files by the session verify checksums of data blocks (checksum on | off)
+uint32_t crc32c_table[256];				// CRC32C of every byte (software computation)
+int crc32c_hardware = 0;				// If the processor has the instruction crc32 (SSE4.2)
+uint32_t zero_crc = 0;					// CRC32C of the cleared data block
+int checksums_carried = 0;				// If positional writes keep checksums of data blocks (moves of defrag set them)
+int8_t *checksums_dirty = NULL;			// If the cluster of checksums has to be stored (every cluster of the area of checksums)
+int32_t dirty_checksum_first = INT_MAX;	// Range of changed clusters of checksums (first > last = none)
+int32_t dirty_checksum_last = -1;
+pthread_mutex_t checksum_lock = PTHREAD_MUTEX_INITIALIZER;	// Lock of changed clusters of checksums (writes of workers)
+checksum_update *pending_sums = NULL;	// Checksums of written data blocks in the order of writes (checksum_lock)
+int pending_sum_count = 0;				// Count of pending checksums
+int pending_sum_capacity = 0;
+long idle_defrag_budget = 0;			// Time budget of one step of the idle defragmentation in microseconds, 0 = disabled
+pthread_t workers[WORKER_COUNT];		// Threads of the worker pool
+int worker_count = 0;					// Count of running workers
+int workers_exit = 0;					// If workers have to exit, 0 = false, 1 = true
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;	// Lock of the job queue
+pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;	// Signal of new jobs (for workers)
+pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;		// Signal of finished jobs (for the submitter)
+io_job *job_queue = NULL;				// Submitted jobs
+int job_next = 0;						// Index of the next job which is not taken by any worker
+int job_total = 0;						// Count of submitted jobs
+int job_finished = 0;					// Count of finished jobs
+int job_errors = 0;						// Count of failed jobs
+int job_mismatches = 0;					// Count of jobs which found data blocks not matching their checksums
+pthread_mutex_t import_lock = PTHREAD_MUTEX_INITIALIZER;	// Lock of the list of imported files (incp -r)
+pthread_cond_t import_cond = PTHREAD_COND_INITIALIZER;		// Signal of walked directories, read and written files
+host_file *import_files = NULL;			// Imported files and directories in the order of the walk
+int import_count = 0;					// Count of imported items
+int import_capacity = 0;				// Size of the list of imported items
+int import_walked = 0;					// Index of the next item which may be a directory to walk
+int import_busy = 0;					// Count of threads which walk a directory
+int import_next = 0;					// Index of the next item which may be a file to read
+int import_placed = 0;					// Index of the item which is placed now
+int import_stop = 0;					// If readers should stop (error of the import)
+int import_compress = 0;				// If imported files are compressed
+long import_buffered = 0;				// Bytes of read files which are not written yet
+pthread_mutex_t export_lock = PTHREAD_MUTEX_INITIALIZER;	// Lock of the list of exported files (outcp -r)
+pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;		// Signal of read and written files
+host_file *export_files = NULL;			// Exported files sorted by their first data blocks
+int export_count = 0;					// Count of exported files
+int export_capacity = 0;				// Size of the list of exported files
+int export_next = 0;					// Index of the next file which is not taken by any writer
+int export_ready = 0;					// Count of files whose data are read
+int export_written = 0;					// Count of written files
+int export_done = 0;					// If all files are read
+int32_t *fsck_refs = NULL;				// Count of references to every data block found by fsck
+int32_t *fsck_counts = NULL;			// Count of data blocks of every i-node found by fsck (without indirect blocks)
+int32_t *fsck_links = NULL;				// Count of directory items referring to every i-node found by fsck
+int32_t *fsck_parent = NULL;			// Directory which contains the i-node found by fsck (FREE = none)
+int32_t *fsck_sizes = NULL;				// Size of every directory computed from its content by fsck
+int8_t *fsck_state = NULL;				// Reachability of every i-node from the root (0 = unknown, 1 = checking, 2 = reachable, 3 = unreachable)
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;	// Commands changing the tree of directories or the whole filesystem are exclusive
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;		// Lock of the allocation of i-nodes and data blocks (bitmap, deduplication index)
+pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;	// Only one thread submits jobs to the worker pool at once
+pthread_rwlock_t *inode_locks = NULL;	// Locks of the content of i-nodes, i-node ID = index
+int32_t lock_count = 0;					// Count of locks of i-nodes
+pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;	// Lock of the queue of clients and of sessions
+pthread_cond_t client_ready = PTHREAD_COND_INITIALIZER;		// Signal of a session with the command (for threads of the server)
+session *sessions[MAX_SESSIONS];		// Sessions of connected clients
+int session_count = 0;					// Count of sessions
+session *ready_sessions[MAX_SESSIONS];	// Queue of sessions with the command which wait for a thread of the server
+int ready_first = 0;					// Index of the first session in the queue
+int ready_count = 0;					// Count of sessions in the queue
+int server_wake[2] = {-1, -1};			// Pipe which wakes up the polling of the server (session waits for input again)
+volatile sig_atomic_t server_exit = 0;	// If the server has to exit, 0 = false, 1 = true (atomic, set by signals)
+int batch_running = 0;					// If the batch script runs, metadata are stored only at its end (0 = false, 1 = true)
+int32_t dirty_inode_first = INT_MAX;	// Range of i-nodes changed by the batch script (first > last = none)
+int32_t dirty_inode_last = -1;
+int32_t dirty_block_first = INT_MAX;	// Range of data blocks whose bitmap items or hashes were changed by the batch script
+int32_t dirty_block_last = -1;
+int superblock_dirty = 0;				// If the superblock was changed by the batch script
+zos_context *api_context = NULL;		// Filesystem mounted by the library, NULL = none
+int32_t api_mount = 0;					// Count of mounts by the library (identifies the current mount)
+__thread int32_t api_session = 0;		// Mount for which the thread opened its stream of the filesystem
+pthread_t api_owner;					// Thread which mounted the filesystem by the library
+int fs_shared = 0;						// If more threads use the filesystem (server, library), 0 = false, 1 = true
+__thread int fs_buffered = 0;			// If the stream of the thread is buffered, 0 = false, 1 = true
+FILE *api_output = NULL;				// Replies of the library are discarded
+FILE *record_log = NULL;				// Log of the recorded workload (--record), NULL = not recorded
+struct timespec record_start;			// Start of the recording
+command_stats command_latency[CMD_QUIT + 1];	// Statistics of commands, CMD_* identifier = index (the last one = unknown commands)
+io_site io_sites[IO_SITES];				// Counters of I/O of the image (hash table by the address of the name of the function)
+scan_stats inode_scans;					// Searches of free i-nodes
+scan_stats block_scans;					// Searches of free data blocks
+FILE *trace_log = NULL;					// Trace of I/O of the image (trace on), NULL = not traced
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;	// Records of all threads go to one trace
+struct timespec trace_start;			// Start of the trace
+long trace_records = 0;					// Count of records of the trace
+int8_t trace_named[IO_SITES];			// If the name of the function (item of io_sites) is in the trace
+int trace_sessions = 0;					// Count of threads which wrote to the trace
+__thread int trace_session = -1;		// Number of the thread in the trace, -1 = not assigned
+__thread int trace_command = CMD_QUIT;	// Command whose I/O is traced (CMD_QUIT = none or unknown)
+int job_command = CMD_QUIT;				// Command which submitted jobs to the worker pool (for the trace)
+int job_verify = 1;						// If the session which submitted jobs verifies checksums
+long defrag_peak_memory = 0;			// Peak memory of the last full defragmentation in bytes (stats)
+pool item_pool = {sizeof(directory_item), NULL, NULL, 0, 0, POOL_SLAB, PTHREAD_MUTEX_INITIALIZER};	// Directory items
+pool directory_pool = {sizeof(directory), NULL, NULL, 0, 0, POOL_SLAB, PTHREAD_MUTEX_INITIALIZER};	// Directories
+
+
+/*	Execute one command and write it into the log of the workload - its start and duration in microseconds
+	(C	start	duration	command). Host files read by the command (incp, write, append, load -b) are described
+	before it by their size and hash (F	size	hash	path), their content is not stored. The directory of incp -r
+	is described by the line with the size -1 followed by the lines of its files and subdirectories. Commands
+	of loaded scripts are recorded one by one.
+
+	param buffer ... command with arguments
+	param f ... file with commands (set by the command load)
+	param current ... working directory of the session
+	return 1 = exit command, 0 = otherwise
+*/
+int record_command(char *buffer, FILE **f, directory **current) {
+	char line[BUFF_SIZE], copy[BUFF_SIZE], *cmd, *arg, *parse;
+	struct timespec start, end;
+	int result, batch, recursive = 0;
+	
+	strcpy(line, buffer);
+	line[strcspn(line, "\r\n")] = '\0';
+	strcpy(copy, line);
+	
+	cmd = strtok_r(copy, DELIM, &parse);
+	arg = cmd ? strtok_r(NULL, DELIM, &parse) : NULL;
+	batch = cmd && arg && strcmp(cmd, "load") == 0 && strcmp(arg, "-b") == 0;
+	if (cmd && arg && strcmp(cmd, "incp") == 0) {
+		if (strcmp(arg, "-r") == 0) {
+			recursive = 1;
+			arg = strtok_r(NULL, DELIM, &parse);
+		}
+		if (arg && strcmp(arg, "-z") == 0)
+			arg = strtok_r(NULL, DELIM, &parse);
+		if (recursive)
+			record_host_tree(arg);
+		else
+			record_host_file(arg);
+	}
+	else if (cmd && arg && strcmp(cmd, "write") == 0) {		// write file offset source
+		record_host_file(strtok_r(NULL, DELIM, &parse) ? strtok_r(NULL, "\n", &parse) : NULL);
+	}
+	else if (cmd && arg && strcmp(cmd, "append") == 0) {	// append file source
+		record_host_file(strtok_r(NULL, "\n", &parse));
+	}
+	else if (batch) {
+		record_host_file(strtok_r(NULL, DELIM, &parse));
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result = execute_command(buffer, f, current);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	if (cmd && result == 0) {
+		if (strcmp(cmd, "load") == 0 && !batch)	// Commands of the script follow
+			fprintf(record_log, "# %s\n", line);
+		else
+			fprintf(record_log, "C\t%ld\t%ld\t%s\n", elapsed_us(&record_start, &start), elapsed_us(&start, &end), line);
+		fflush(record_log);
+	}
+	return result;
+}
 
 
-/* 	***************************************************
-	Entry point of the program	
-	
-	param argv[1] ... name of the filesystem
+/*	Write the size and the hash of the host file into the log of the workload
+
+	param path ... path of the host file or NULL
 */
-int main(int argc, char *argv[]) {
-	if (argc < 2) {
-		printf("No argument! Enter the filesystem name.\n");
-		return EXIT_FAILURE;
-	}
+void record_host_file(char *path) {
+	int32_t size;
+	uint64_t hash;
 	
-	printf("Filesystem is running...\n");
-	fs_name = argv[1];
+	if (path && hash_file(path, &size, &hash) == NO_ERROR)
+		fprintf(record_log, "F\t%d\t%016llx\t%s\n", size, (unsigned long long)hash, path);
+}
+
+
+/*	Write the host directory imported by incp -r into the log of the workload - the directory (size -1) and
+	all its files and subdirectories after it (the walk imports the same ones, links and special files are skipped)
+
+	param path ... path of the host directory or the file (it is copied as without -r) or NULL
+*/
+void record_host_tree(char *path) {
+	struct stat info;
+	struct dirent *entry;
+	char *child;
+	DIR *d;
 	
-	// Test if filesystem already exists
-	if (access(argv[1], F_OK) == -1) {
-		fs_formatted = 0;
-		printf("The filesystem has to be formatted first.\nUsage: format [size]\n");
+	if (!path || lstat(path, &info) != 0)
+		return;
+	if (!S_ISDIR(info.st_mode)) {
+		if (S_ISREG(info.st_mode))
+			record_host_file(path);
+		return;
 	}
-	else {
-		fs_formatted = 1;
-		load_fs();
+	
+	fprintf(record_log, "F\t%d\t%016llx\t%s\n", HOST_DIRECTORY, 0ULL, path);
+	if ((d = opendir(path)) == NULL)
+		return;
+	while ((entry = readdir(d)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		child = (char *)malloc(strlen(path) + strlen(entry->d_name) + 2);
+		sprintf(child, "%s/%s", path, entry->d_name);
+		record_host_tree(child);
+		free(child);
 	}
+	closedir(d);
+}
+
+
+/*	Compute the 64-bit hash of the content of the host file (hashes of its clusters are chained)
+
+	param path ... path of the file
+	param size ... address to store the size of the file
+	param hash ... address to store the hash
+	return 0 = no error, -1 = file cannot be read
+*/
+int hash_file(const char *path, int32_t *size, uint64_t *hash) {
+	char data[CLUSTER_SIZE];
+	uint64_t block[2];
+	size_t length;
+	FILE *f = fopen(path, "rb");
 	
-	run();
-	shutdown();
+	if (!f)
+		return ERROR;
 	
-	return EXIT_SUCCESS;
+	*size = 0;
+	*hash = 0;
+	while ((length = fread(data, 1, CLUSTER_SIZE, f)) > 0) {
+		memset(data + length, 0, CLUSTER_SIZE - length);	// Last cluster
+		hash_block(data, block);
+		*hash = fmix64(*hash ^ block[0]) + block[1];
+		*size += length;
+	}
+	*hash ^= (uint64_t)*size;
+	fclose(f);
+	return NO_ERROR;
 }
 
 
-/*	Process user commands */
-void run() {
-	short exit = 0;	
-	char buffer[BUFF_SIZE];	// User commands buffer
-	char *cmd, *args;
-	FILE *f;				// File from which can be loaded commands instead of console
-	int32_t fs_size;		// Size of the filesystem
-	
-	do {
-		memset(buffer, 0, BUFF_SIZE);
+/*	Copy the host file (image of the filesystem before the recorded workload)
 
-		if (file_input) {		// Commands from the file
-			fgets(buffer, BUFF_SIZE, f);
-			if (!feof(f)) {
-				printf("%s", buffer);
-			}
-			else { 				// Switch back to the commands from the console
-				file_input = 0;
-				fclose(f);
-				continue;
+	param from ... path of the file
+	param to ... path of the copy
+	return 0 = no error, -1 = error
+*/
+int copy_host_file(const char *from, const char *to) {
+	char buffer[READ_BUFFER];
+	size_t length;
+	int result = NO_ERROR;
+	FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+	
+	if (!in || !out) {
+		result = ERROR;
+	}
+	else {
+		while ((length = fread(buffer, 1, READ_BUFFER, in)) > 0) {
+			if (fwrite(buffer, 1, length, out) != length) {
+				result = ERROR;
+				break;
 			}
 		}
-		else {					// Commands from the console
-			fgets(buffer, BUFF_SIZE, stdin);
+	}
+	if (in) fclose(in);
+	if (out && fclose(out) != 0)
+		result = ERROR;
+	return result;
+}
+
+
+/*	Time between two moments
+
+	param from ... the first moment
+	param to ... the second moment
+	return microseconds
+*/
+long elapsed_us(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+
+/*	Read the next command from the loaded file (command load), the command is printed like it was entered
+
+	param buffer ... buffer for the command (BUFF_SIZE bytes)
+	param f ... file with commands, closed at its end
+	return 0 = command was read, -1 = end of the file (the session continues with its own input)
+*/
+int read_command(char *buffer, FILE **f) {
+	while (file_input) {
+		memset(buffer, 0, BUFF_SIZE);
+		fgets(buffer, BUFF_SIZE, *f);
+		if (feof(*f)) {
+			file_input = 0;
+			fclose(*f);
+			return ERROR;
 		}
 		
-		if (buffer[0] == '\n')	// Skip an empty line
-			continue;
-		
+		reply("%s", buffer);
+		if (buffer[0] != '\n')	// Skip an empty line
+			return NO_ERROR;
+	}
+	return ERROR;
+}
+
+
+/*	Execute one command. Commands which change the tree of directories or the whole filesystem
+	are exclusive, the other ones run concurrently (they lock only directories and i-nodes they use).
+
+	param buffer ... command with arguments
+	param f ... file with commands (set by the command load)
+	param current ... working directory of the session (the thread uses it while it holds the lock of the tree)
+	return 1 = exit command, 0 = otherwise
+*/
+int execute_command(char *buffer, FILE **f, directory **current) {
+	char *cmd, *args;
+	int id, exclusive, result;
+	
+	cmd = strtok_r(buffer, DELIM, &tokens);
+	args = strtok_r(NULL, "\n", &tokens);
+	if (!cmd)				// Line with white spaces only
+		return 0;
+	
+	id = find_command(cmd, strlen(cmd));
+	if (id == CMD_QUIT)
+		return 1;
+	
+	// Batch script is one transaction, no other command may run meanwhile
+	exclusive = (id >= 0 && commands[id].exclusive) || (id == CMD_LOAD && args && strncmp(args, "-b ", 3) == 0)
+		|| ((id == CMD_CP || id == CMD_RM || id == CMD_INCP || id == CMD_OUTCP) && args && strncmp(args, "-r ", 3) == 0);	// Recursive commands are batches too
+	if (exclusive)
+		pthread_rwlock_wrlock(&tree_lock);
+	else
+		pthread_rwlock_rdlock(&tree_lock);
+	
+	// Stream of the session is opened when the filesystem exists (it may have been formatted by another session)
+	if (!fs && fs_formatted) {
+		fs = open_fs("rb+");
+	}
+	working_directory = *current;
+	result = run_command(id, args, f);
+	*current = working_directory;
+	
+	pthread_rwlock_unlock(&tree_lock);
+	return result;
+}
+
 
-		cmd = strtok(buffer, DELIM);
-		args = strtok(NULL, "\n");
+/*	Find the command in the table of commands
+
+	param name ... name of the command (need not end with \0)
+	param length ... length of the name
+	return CMD_* identifier, CMD_UNKNOWN = unknown command
+*/
+int find_command(const char *name, int length) {
+	int first = 0, last = command_count - 1, middle, order;
+	
+	while (first <= last) {
+		middle = (first + last) / 2;
+		order = strncmp(name, commands[middle].name, length);
+		if (order == 0 && commands[middle].name[length] != '\0')	// Name is a prefix of the command
+			order = -1;
 		
-		if (strcmp("cp", cmd) == 0) {
+		if (order == 0)
+			return middle;
+		if (order < 0)
+			last = middle - 1;
+		else
+			first = middle + 1;
+	}
+	
+	if (name[0] == 'q')		// Exiting command
+		return CMD_QUIT;
+	return CMD_UNKNOWN;
+}
+
+
+/*	Run the command (the caller holds the lock of the tree of directories)
+
+	param id ... CMD_* identifier of the command
+	param args ... arguments of the command or NULL
+	param f ... file with commands (set by the command load)
+	return 1 = exit command, 0 = otherwise
+*/
+int run_command(int id, char *args, FILE **f) {
+	int32_t fs_size;		// Size of the filesystem
+	int32_t inode_size;		// Size of the i-node record
+	int32_t features;		// Optional features of the filesystem
+	int result = 0, traced = trace_command;
+	struct timespec start, end;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	trace_command = (id >= 0 && id < CMD_QUIT) ? id : CMD_QUIT;
+	if (trace_log)
+		trace_io(-1, TRACE_COMMAND, 0, 0);
+	
+	switch (id) {
+		case CMD_CP:
 			cp(args);
-		}
-		else if (strcmp("mv", cmd) == 0) {
+			break;
+		case CMD_MV:
 			mv(args);
-		}
-		else if (strcmp("rm", cmd) == 0) {
+			break;
+		case CMD_RM:
 			rm(args);
-		}
-		else if (strcmp("mkdir", cmd) == 0) {
+			break;
+		case CMD_MKDIR:
 			mymkdir(args);
-		}
-		else if (strcmp("rmdir", cmd) == 0) {
+			break;
+		case CMD_RMDIR:
 			myrmdir(args);
-		}
-		else if (strcmp("ls", cmd) == 0) {
+			break;
+		case CMD_LS:
 			ls(args);
-		}
-		else if (strcmp("cat", cmd) == 0) {
+			break;
+		case CMD_CAT:
 			cat(args);
-		}
-		else if (strcmp("cd", cmd) == 0) {
+			break;
+		case CMD_CHECKSUM:
+			checksum(args);
+			break;
+		case CMD_CD:
 			cd(args);
-		}
-		else if (strcmp("pwd", cmd) == 0) {
+			break;
+		case CMD_PWD:
 			pwd();
-		}
-		else if (strcmp("info", cmd) == 0) {
+			break;
+		case CMD_INFO:
 			info(args);
-		}
-		else if (strcmp("incp", cmd) == 0) {
+			break;
+		case CMD_INCP:
 			incp(args);
-		}
-		else if (strcmp("outcp", cmd) == 0) {
+			break;
+		case CMD_OUTCP:
 			outcp(args);
-		}
-		else if (strcmp("load", cmd) == 0) {
-			f = load(args);
-		}
-		else if (strcmp("format", cmd) == 0) {
+			break;
+		case CMD_WRITE:
+			mywrite(args);
+			break;
+		case CMD_APPEND:
+			append(args);
+			break;
+		case CMD_TRUNCATE:
+			mytruncate(args);
+			break;
+		case CMD_LOAD:
+			if (args && strncmp(args, "-b ", 3) == 0)
+				result = load_batch(args + 3);
+			else
+				*f = load(args);
+			break;
+		case CMD_FORMAT:
 			fs_size = get_size(args);
-			if (fs_size == ERROR)		// Problem with the size of the filesystem
-				continue;
-			format(fs_size);
-		}
-		else if (strcmp("defrag", cmd) == 0) {
-			defrag();
-		}
-		else if (buffer[0] == 'q') {	// Exiting command
-			exit = 1;
-		}
-		else {
-			printf("UNKNOWN COMMAND\n");
-		}
-	} while (!exit);
+			if (fs_size != ERROR && !get_format_options(args, &inode_size, &features))	// Size and options are correct
+				format(fs_size, inode_size, features);
+			if (trace_log && fs_formatted)
+				trace_layout_record();
+			break;
+		case CMD_DEFRAG:
+			defrag(args);
+			break;
+		case CMD_DEDUP:
+			dedup();
+			break;
+		case CMD_FRAGSTAT:
+			fragstat(args);
+			break;
+		case CMD_FSCK:
+			fsck(args);
+			break;
+		case CMD_SNAPSHOT:
+			snapshot(args);
+			break;
+		case CMD_STATS:
+			stats(args);
+			break;
+		case CMD_TRACE:
+			trace(args);
+			break;
+		case CMD_QUIT:
+			return 1;
+		default:
+			reply("UNKNOWN COMMAND\n");
+	}
+	
+	flush_checksums();			// Checksums of data blocks written by the command are stored
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	record_latency(id, elapsed_us(&start, &end));
+	trace_command = traced;		// Batch script continues
+	return result;
+}
+
+
+/*	Print the reply to the output of the current session (console or client)
+
+	param format ... format of the reply (printf)
+	return count of printed characters
+*/
+int reply(const char *format, ...) {
+	va_list args;
+	int result;
+	
+	va_start(args, format);
+	result = vfprintf(OUTPUT, format, args);
+	va_end(args);
+	return result;
 }
 
-/* Perform all needed operations before exiting the program */
-void shutdown() {
+
+/* Perform all needed operations before exiting the program (or before the library mounts another filesystem) */
+void shutdown_fs() {
+	stop_workers();
+	flush_checksums();
 	if (sb) free(sb);
 	if (bitmap) free(bitmap);
-	if (inodes) free(inodes);
+	free_inodes();
+	if (inline_data) free(inline_data);
+	if (dedup_hashes) free(dedup_hashes);
+	if (dedup_index) free(dedup_index);
+	if (checksums) free(checksums);
+	if (checksums_dirty) free(checksums_dirty);
+	if (pending_sums) free(pending_sums);
 	if (directories) {
-		free_directories(directories[0]);
+		free_directories();
 		free(directories);
 	}
-	fclose(fs);
+	if (inode_locks) free(inode_locks);
+	if (fs) fclose(fs);
+	if (fs_fd >= 0) close(fs_fd);
+	if (trace_log) fclose(trace_log);
+	
+	trace_log = NULL;
+	sb = NULL;
+	bitmap = NULL;
+	inline_data = NULL;
+	dedup_hashes = NULL;
+	dedup_index = NULL;
+	checksums = NULL;
+	checksums_dirty = NULL;
+	pending_sums = NULL;
+	pending_sum_count = pending_sum_capacity = 0;
+	directories = NULL;
+	inode_locks = NULL;
+	lock_count = 0;
+	fs = NULL;
+	fs_fd = -1;
 }
 
 
-/*	Copy file to another directory
+/*	Serve clients connected to the Unix domain socket. Every client has its own session (working directory,
+	replies, loaded commands), commands of different sessions run concurrently. This thread polls sockets of idle 
+	sessions and receives their input, a session with the whole command waits in the queue for one of the threads 
+	of the server, which executes one command and returns the session (an idle client does not hold any thread).
+	The server runs until SIGINT or SIGTERM, its state is printed to the standard output.
 
-	param files ... source file (+path) and destination directory (+path)
+	param path ... path of the socket
+	return 0 = server stopped, -1 = server could not start
 */
-void cp(char *files) {
-	int i, block_count, rest, count_with_indir, tmp, last_block_index;
-	int32_t *source_blocks, *dest_blocks, inode_id;
-	char *source, *dest, *name;
-	directory *source_dir, *dest_dir;
-	directory_item *item, **pitem;
-	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
-	}
-	
-	if (!files || files == "") { // No arguments
-		printf(FNF);
-		return;
+int serve(const char *path) {
+	int i, count, listener, thread_count = 0;
+	char drain[64];
+	struct sockaddr_un address;
+	struct sigaction action;
+	sigset_t signals, previous;
+	pthread_t threads[SERVER_THREADS];
+	struct pollfd polled[MAX_SESSIONS + 2];		// Listener, pipe of the server and sockets of idle sessions
+	session *idle[MAX_SESSIONS + 2];			// Session of every polled socket
+	
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		printf("Path of the socket is too long.\n");
+		return ERROR;
 	}
-	source = strtok(files, " ");	// Get source
-	dest = strtok(NULL, "\n");		// Get destination
-	if (!dest || dest == "") {
-		printf(FNF);
-		return;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	
+	unlink(path);	// Socket left by the previous server
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, MAX_PENDING) < 0
+		|| pipe(server_wake) < 0) {
+		printf("Cannot listen on %s: %s\n", path, strerror(errno));
+		if (listener >= 0)
+			close(listener);
+		return ERROR;
 	}
+	fcntl(server_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(server_wake[1], F_SETFL, O_NONBLOCK);
 	
-	// Parse the source path + find the source directory
-	if (parse_path(source, &name, &source_dir)) {
-		printf(FNF);
-		return;
-	}
+	// Signals stop the server (they interrupt poll), disconnected clients do not
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_server;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
 	
-	// Find the file in the source directory
-	item = find_item(source_dir->file, name);
-	if (!item) {
-		printf(FNF);
-		return;
-	}
+	// Signals are handled only by this thread (threads of sessions and their workers inherit the mask)
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
 	
-	// Find the destination directory
-	dest_dir = find_directory(dest);
-	if (!dest_dir) {
-		printf(PNF);
-		return;
+	if (fs) fflush(fs);		// Sessions use their own streams
+	for (i = 0; i < SERVER_THREADS; i++) {
+		if (pthread_create(&threads[thread_count], NULL, session_main, NULL) == 0)
+			thread_count++;
 	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
 	
-	// Test if destination folder contains file/directory with the same name
-	if (test_existence(dest_dir, name)) {
-		printf(EXIST);
-		return;
+	if (thread_count == 0) {
+		printf("Cannot start the threads of the server.\n");
+		__atomic_store_n(&server_exit, 1, __ATOMIC_RELEASE);
+	}
+	else {
+		printf("Server is listening on %s\n", path);
+		fflush(stdout);
 	}
 	
-	// Get numbers of data blocks of the source file
-	source_blocks = get_data_blocks(item->inode, &block_count, &rest);
+	while (!__atomic_load_n(&server_exit, __ATOMIC_ACQUIRE)) {
+		polled[0].fd = listener;
+		polled[1].fd = server_wake[0];
+		count = 2;
+		pthread_mutex_lock(&client_lock);
+		for (i = 0; i < session_count; i++) {
+			if (sessions[i]->queued)
+				continue;
+			idle[count] = sessions[i];
+			polled[count++].fd = sessions[i]->socket;
+		}
+		pthread_mutex_unlock(&client_lock);
+		for (i = 0; i < count; i++) {
+			polled[i].events = POLLIN;
+			polled[i].revents = 0;
+		}
+		
+		if (poll(polled, count, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("Cannot poll clients: %s\n", strerror(errno));
+			break;
+		}
+		
+		if (polled[1].revents)		// Sessions returned by threads are polled in the next round
+			while (read(server_wake[0], drain, sizeof(drain)) > 0);
+		if (polled[0].revents)
+			accept_client(listener);
+		for (i = 2; i < count; i++) {	// Only this thread changes idle sessions
+			if (polled[i].revents)
+				receive_input(idle[i]);
+		}
+	}
 	
-	if (block_count < 5)								// Use only direct references
-		count_with_indir = block_count;
-	else if ((block_count > 5) && (block_count < 262))	// Use first indirect reference (+1 data block)
-		count_with_indir = block_count + 1;
-	else 
-		count_with_indir = block_count + 2;				// Use both indirect references (+2 data block)
+	close(listener);
+	unlink(path);
 	
-	// Get numbers of free data blocks for copied file 
-	dest_blocks = find_free_data_blocks(count_with_indir);
-	if (!dest_blocks) {
-		printf(NES);
-		return;
-	}
+	// Running sessions finish their current command, all clients are disconnected
+	pthread_mutex_lock(&client_lock);
+	__atomic_store_n(&server_exit, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&client_ready);
+	pthread_mutex_unlock(&client_lock);
 	
-	// Get ID of a free i-node
-	inode_id = find_free_inode();
-	if (inode_id == ERROR) {
-		printf(NES);
-		return;
+	for (i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
 	}
-	
-	// Get the last (free) item in the list of all files in the destination directory
-	pitem = &(dest_dir->file);
-	while (*pitem != NULL) {
-		pitem = &((*pitem)->next);
+	while (session_count > 0) {
+		close_session(sessions[0]);
 	}
-	*pitem = create_directory_item(inode_id, name);
-	
-	// Initialize i-node
-	initialize_inode(inode_id, inodes[item->inode].file_size, block_count, count_with_indir, &last_block_index, dest_blocks);
+	ready_count = 0;
+	close(server_wake[0]);
+	close(server_wake[1]);
+	server_wake[0] = server_wake[1] = -1;
+	printf("Server stopped.\n");
+	return (thread_count > 0) ? NO_ERROR : ERROR;
+}
 
-	// Save changes to the file
-	update_bitmap(*pitem, 1, dest_blocks, block_count);
-	update_inode(inode_id);
-	update_sizes(dest_dir, inodes[item->inode].file_size);
-	update_directory(dest_dir, *pitem, 1);
+
+/*	Main function of the thread of the server - execute commands of sessions from the queue, one command at once
+
+	param arg ... not used
+	return NULL
+*/
+void *session_main(void *arg) {
+	int exit, found;
+	char buffer[BUFF_SIZE];		// Commands buffer
+	session *client;
+	
+	pthread_mutex_lock(&client_lock);
+	while (1) {
+		while (ready_count == 0 && !__atomic_load_n(&server_exit, __ATOMIC_ACQUIRE)) {
+			pthread_cond_wait(&client_ready, &client_lock);
+		}
+		if (__atomic_load_n(&server_exit, __ATOMIC_ACQUIRE))
+			break;
 		
-	// Copy data blocks
-	for (i = 0; i < block_count - 1; i++) {
-		fseek(fs, sb->data_start_address + source_blocks[i] * CLUSTER_SIZE, SEEK_SET);
-		fflush(fs);
-		fread(block_buffer, sizeof(block_buffer), 1, fs);
-		fseek(fs, sb->data_start_address + dest_blocks[i] * CLUSTER_SIZE, SEEK_SET);
-		fflush(fs);
-		fwrite(block_buffer, sizeof(block_buffer), 1, fs);
+		client = ready_sessions[ready_first];
+		ready_first = (ready_first + 1) % MAX_SESSIONS;
+		ready_count--;
+		pthread_mutex_unlock(&client_lock);
+		
+		// New session starts in the root directory
+		if (!client->started) {
+			pthread_rwlock_rdlock(&tree_lock);
+			client->working_directory = fs_formatted ? directories[0] : NULL;
+			pthread_rwlock_unlock(&tree_lock);
+			client->started = 1;
+		}
+		
+		// The thread takes the state of the session
+		file_input = client->file_input;
+		verify_checksums = client->verify_checksums;
+		output = client->out;
+		
+		exit = 0;
+		found = (read_session_command(client, buffer) == NO_ERROR);
+		if (found) {
+			exit = execute_command(buffer, &client->script, &client->working_directory);
+			fflush(output);
+		}
+		
+		client->file_input = file_input;
+		client->verify_checksums = verify_checksums;
+		output = NULL;
+		file_input = 0;
+		
+		// Session with more commands waits in the queue again (behind other sessions)
+		pthread_mutex_lock(&client_lock);
+		if (exit || (!found && client->closed)) {
+			pthread_mutex_unlock(&client_lock);
+			close_session(client);
+			pthread_mutex_lock(&client_lock);
+		}
+		else if (client->file_input || memchr(client->input, '\n', client->input_length) 
+			|| client->input_length == BUFF_SIZE - 1 || (client->closed && client->input_length > 0)) {
+			ready_sessions[(ready_first + ready_count++) % MAX_SESSIONS] = client;
+			pthread_cond_signal(&client_ready);
+		}
+		else {
+			client->queued = 0;
+			write(server_wake[1], "", 1);	// Socket of the session is polled again
+		}
 	}
+	pthread_mutex_unlock(&client_lock);
 	
-	// Copy the last data block (may copy only a part of the block)
-	memset(block_buffer, 0, CLUSTER_SIZE);
-	if (rest != 0)
-		tmp = rest;
-	else 
-		tmp = CLUSTER_SIZE;
-	
-	fseek(fs, sb->data_start_address + source_blocks[block_count - 1] * CLUSTER_SIZE, SEEK_SET);
-	fflush(fs);
-	fread(block_buffer, tmp, 1, fs);
-	fseek(fs, sb->data_start_address + dest_blocks[last_block_index] * CLUSTER_SIZE, SEEK_SET);
-	fflush(fs);
-	fwrite(block_buffer, tmp, 1, fs);
-	fflush(fs);
+	if (fs) fclose(fs);
+	return NULL;
+}
+
+
+/*	Accept the new client and create its session (the client is refused if there are too many sessions)
+
+	param listener ... listening socket
+*/
+void accept_client(int listener) {
+	session *client;
+	int socket = accept(listener, NULL, NULL);
 	
-	free(source_blocks);
-	free(dest_blocks);
+	if (socket < 0)
+		return;
 	
-	printf(OK);	
+	client = (session *)calloc(1, sizeof(session));
+	pthread_mutex_lock(&client_lock);
+	if (!client || session_count == MAX_SESSIONS || !(client->out = fdopen(dup(socket), "w"))) {
+		pthread_mutex_unlock(&client_lock);
+		free(client);
+		close(socket);
+		return;
+	}
+	client->socket = socket;
+	client->verify_checksums = 1;
+	sessions[session_count++] = client;
+	pthread_mutex_unlock(&client_lock);
 }
 
 
-/*	Move file to another directory
+/*	Receive the input of the idle session, the session with the whole command (or closed by the client)
+	is queued for a thread of the server
 
-	param files ... source file (+path) and destination directory (+path)
+	param client ... session
 */
-void mv(char *files) {
-	char *source, *dest, *name;
+void receive_input(session *client) {
+	ssize_t length = recv(client->socket, client->input + client->input_length, BUFF_SIZE - 1 - client->input_length, MSG_DONTWAIT);
+	
+	if (length > 0)
+		client->input_length += length;
+	else if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		client->closed = 1;
+	
+	if (client->closed || client->input_length == BUFF_SIZE - 1 || memchr(client->input, '\n', client->input_length))
+		queue_session(client);
+}
+
+
+/*	Read the next command of the session - from the loaded file or from the received input (the line longer than
+	the buffer is split like by fgets, the rest of the input is ended by closing of the connection)
+
+	param client ... session (its state is taken by the thread)
+	param buffer ... buffer for the command (BUFF_SIZE bytes)
+	return 0 = command was read, -1 = no whole command
+*/
+int read_session_command(session *client, char *buffer) {
+	char *end;
+	int length;
+	
+	if (read_command(buffer, &client->script) == NO_ERROR)		// Commands from the file
+		return NO_ERROR;
+	
+	while (1) {
+		memset(buffer, 0, BUFF_SIZE);
+		end = memchr(client->input, '\n', client->input_length);
+		if (end)
+			length = end - client->input + 1;
+		else if (client->input_length == BUFF_SIZE - 1 || (client->closed && client->input_length > 0))
+			length = client->input_length;
+		else
+			return ERROR;
+		
+		memcpy(buffer, client->input, length);
+		client->input_length -= length;
+		memmove(client->input, client->input + length, client->input_length);
+		
+		if (buffer[0] != '\n')	// Skip an empty line
+			return NO_ERROR;
+	}
+}
+
+
+/*	Put the session to the queue of sessions which wait for a thread of the server
+
+	param client ... session
+*/
+void queue_session(session *client) {
+	pthread_mutex_lock(&client_lock);
+	client->queued = 1;
+	ready_sessions[(ready_first + ready_count++) % MAX_SESSIONS] = client;
+	pthread_cond_signal(&client_ready);
+	pthread_mutex_unlock(&client_lock);
+}
+
+
+/*	Disconnect the client and remove its session (the session is not polled nor queued)
+
+	param client ... session
+*/
+void close_session(session *client) {
+	int i;
+	
+	pthread_mutex_lock(&client_lock);
+	for (i = 0; i < session_count && sessions[i] != client; i++);
+	if (i < session_count)
+		sessions[i] = sessions[--session_count];
+	pthread_mutex_unlock(&client_lock);
+	
+	if (client->file_input)		// Client was disconnected during the loaded commands
+		fclose(client->script);
+	fclose(client->out);
+	close(client->socket);
+	free(client);
+}
+
+
+/*	Signal handler which stops the server (the polling of the server is woken up)
+
+	param number ... number of the signal (not used, all signals stop the server)
+*/
+void stop_server(int number __attribute__((unused))) {
+	int saved = errno;		// The interrupted code may test errno
+	
+	__atomic_store_n(&server_exit, 1, __ATOMIC_RELEASE);
+	if (server_wake[1] >= 0)
+		write(server_wake[1], "", 1);
+	errno = saved;
+}
+
+
+/*	Change the working directory of sessions of the server and of the library (the directory was removed or the whole 
+	tree was reloaded). Called only by exclusive commands, so no other command is running.
+
+	param from ... original working directory, NULL = any directory
+	param to ... new working directory
+*/
+void reset_sessions(directory *from, directory *to) {
+	int i;
+	
+	pthread_mutex_lock(&client_lock);
+	for (i = 0; i < session_count; i++) {
+		if (!from || sessions[i]->working_directory == from)
+			sessions[i]->working_directory = to;
+	}
+	if (api_context && (!from || api_context->working_directory == from))
+		api_context->working_directory = to;
+	pthread_mutex_unlock(&client_lock);
+}
+
+
+/*	Open the own stream of the file with filesystem. Streams of sessions are not buffered when more threads
+	use the filesystem (server, library), other sessions may change the data.
+
+	param mode ... mode of fopen
+	return stream or NULL
+*/
+FILE *open_fs(const char *mode) {
+	FILE *stream = fopen(fs_name, mode);
+	
+	fs_buffered = !output || !__atomic_load_n(&fs_shared, __ATOMIC_ACQUIRE);
+	if (stream && !fs_buffered)
+		setvbuf(stream, NULL, _IONBF, 0);
+	return stream;
+}
+
+
+/*	Create locks of all i-nodes of the filesystem (after the filesystem is loaded or formatted) */
+void init_locks() {
+	int32_t i;
+	
+	for (i = 0; i < lock_count; i++) {
+		pthread_rwlock_destroy(&inode_locks[i]);
+	}
+	free(inode_locks);
+	
+	inode_locks = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t) * sb->inode_count);
+	for (i = 0; i < sb->inode_count; i++) {
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	}
+	lock_count = sb->inode_count;
+}
+
+
+/*	Lock two directories (in the order of their i-nodes, so two sessions cannot wait for each other)
+
+	param first ... first directory
+	param second ... second directory (may be the same one)
+*/
+void lock_directories(directory *first, directory *second) {
+	if (first == second) {
+		pthread_mutex_lock(&(first->lock));
+	}
+	else if (first->current->inode < second->current->inode) {
+		pthread_mutex_lock(&(first->lock));
+		pthread_mutex_lock(&(second->lock));
+	}
+	else {
+		pthread_mutex_lock(&(second->lock));
+		pthread_mutex_lock(&(first->lock));
+	}
+}
+
+
+/*	Unlock two directories locked by lock_directories
+
+	param first ... first directory
+	param second ... second directory (may be the same one)
+*/
+void unlock_directories(directory *first, directory *second) {
+	pthread_mutex_unlock(&(first->lock));
+	if (first != second)
+		pthread_mutex_unlock(&(second->lock));
+}
+
+
+/*	Wait for the command from the console, steps of the incremental defragmentation are run 
+	while the console is idle (only if the idle defragmentation is enabled and input is a terminal)
+
+	param input ... descriptor of the input of the console
+*/
+void wait_for_input(int input) {
+	fd_set ready;
+	struct timeval timeout;
+	int idle_steps = 0;		// Count of consecutive steps which relocated nothing
+	
+	if (!idle_defrag_budget || !fs_formatted || !isatty(input))
+		return;
+	
+	while (1) {
+		FD_ZERO(&ready);
+		FD_SET(input, &ready);
+		timeout.tv_sec = IDLE_TIMEOUT / 1000;
+		timeout.tv_usec = (IDLE_TIMEOUT % 1000) * 1000;
+		
+		// All i-nodes were examined without result -> wait only for the input
+		if (select(input + 1, &ready, NULL, NULL, (idle_steps > sb->inode_count / DEFRAG_WINDOW) ? NULL : &timeout) != 0)
+			return;
+		
+		pthread_rwlock_wrlock(&tree_lock);
+		if (defrag_step(idle_defrag_budget, 0) > 0)
+			idle_steps = 0;
+		else
+			idle_steps++;
+		flush_checksums();
+		pthread_rwlock_unlock(&tree_lock);
+	}
+}
+
+
+/*	Copy file to another directory (cp -r copies the whole directory)
+
+	param files ... source file (+path) and destination directory (+path)
+*/
+void cp(char *files) {
+	char *source, *dest, *name;
+	int recursive, result;
 	directory *source_dir, *dest_dir;
-	directory_item *item, **pitem, **temp;
+	directory_item *item;
+	job_list list = {NULL, 0, 0};	// Copies of runs of data blocks
 	
 	if (!fs_formatted) {
 		print_format_msg();
 		return;	
 	}
 	
-	if (!files || files == "") { 	// No arguments
-		printf(FNF);
+	if (!files || files == "") { // No arguments
+		reply(FNF);
 		return;
 	}
-	source = strtok(files, " ");	// Get source
-	dest = strtok(NULL, "\n");		// Get destination
+	recursive = (strncmp(files, "-r ", 3) == 0);
+	source = strtok_r(recursive ? files + 3 : files, " ", &tokens);	// Get source
+	dest = strtok_r(NULL, "\n", &tokens);		// Get destination
 	if (!dest || dest == "") {
-		printf(FNF);
+		reply(FNF);
 		return;
 	}
 	
 	// Parse the source path + find the source directory
 	if (parse_path(source, &name, &source_dir)) {
-		printf(FNF);
+		reply(FNF);
 		return;
 	}
 	
 	// Find the destination directory
 	dest_dir = find_directory(dest);
 	if (!dest_dir) {
-		printf(PNF);
+		reply(PNF);
+		return;
+	}
+	if (recursive && (item = find_item(source_dir->subdir, name))) {	// Copy of the directory (a file is copied as without -r)
+		copy_directory(item, dest_dir, name);
 		return;
 	}
+	lock_directories(source_dir, dest_dir);
 	
-	// If source and destination directories are the same
-	if (dest_dir == source_dir) {
-		printf(OK);
+	// Find the file in the source directory
+	item = find_item(source_dir->file, name);
+	if (!item) {
+		unlock_directories(source_dir, dest_dir);
+		reply(FNF);
 		return;
 	}
 	
 	// Test if destination folder contains file/directory with the same name
 	if (test_existence(dest_dir, name)) {
-		printf(EXIST);
+		unlock_directories(source_dir, dest_dir);
+		reply(EXIST);
 		return;
 	}
+	pthread_rwlock_rdlock(&inode_locks[item->inode]);
 	
-	// Remove the file from the list of all files in the source directory
-	temp = &(source_dir->file); 
-	item = source_dir->file;
-	while (item != NULL) {
-		if (strcmp(name, item->item_name) == 0) {
-			(*temp) = item->next;
-			update_sizes(source_dir, -(inodes[item->inode].file_size));
-			update_directory(source_dir, item, 0);
-			break;
-		}
-		temp = &(item->next);
-		item = item->next;
-	}
-	
-	if (!item) {
-		printf(FNF);
+	if ((result = verify_layout(item->inode)) != NO_ERROR) {	// Indirect blocks of the source are corrupted
+		pthread_rwlock_unlock(&inode_locks[item->inode]);
+		unlock_directories(source_dir, dest_dir);
+		reply(result == BAD_CHECKSUM ? CHM : CCF);
 		return;
 	}
-	
-
-	// Get the last (free) item in the list of all files in the destination directory
-	pitem = &(dest_dir->file);
-	while (*pitem != NULL) {
-		pitem = &((*pitem)->next);
+	if (copy_file(item, dest_dir, name, NULL, &list)) {
+		pthread_rwlock_unlock(&inode_locks[item->inode]);
+		unlock_directories(source_dir, dest_dir);
+		reply(NES);
+		return;
 	}
+	result = run_jobs(list.jobs, list.count);		// Fails with corrupted data blocks of the source
 	
-	*pitem = item;	// Add file to the destination directory
-	
-	update_sizes(dest_dir, inodes[item->inode].file_size);
-	update_directory(dest_dir, item, 1);
+	pthread_rwlock_unlock(&inode_locks[item->inode]);
+	unlock_directories(source_dir, dest_dir);
+	free(list.jobs);
 	
-	printf(OK);
+	reply(result == BAD_CHECKSUM ? CHM : result == ERROR ? CCF : OK);	
 }
 
 
-/*	Remove file
+/*	Copy the directory with all its files and subdirectories (cp -r). The command is exclusive, the whole subtree
+	is one batch - metadata are stored once at the end and data blocks of all files (without dedup) are found
+	by one search of the bitmap. Data blocks of all files are copied at once by the worker pool.
 
-	param file ... removing file (+path)
+	param item ... copied directory
+	param dest_dir ... destination directory
+	param name ... name of the copy
 */
-void rm(char *file) {
-	int i, block_count, rest, tmp, prev;
-	int32_t *blocks;
-	char *name;
+void copy_directory(directory_item *item, directory *dest_dir, char *name) {
+	int i, total = 0, used = 0, result, copied = NO_ERROR;
+	int32_t *reserved = NULL;		// Data blocks of all copied files in the order of the walk
 	directory *dir;
-	directory_item *item, **temp;
-	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
-	}
+	job_list list = {NULL, 0, 0};
 	
-	if (!file || file == "") {
-		printf(FNF);
+	if (test_existence(dest_dir, name)) {
+		reply(EXIST);
 		return;
 	}
 	
-	// Parse the path + find the directory
-	if (parse_path(file, &name, &dir)) {
-		printf(FNF);
-		return;
-	}
-
-	// Remove the file from the list of all files in the directory
-	temp = &(dir->file);
-	item = dir->file;
-	while (item != NULL) {
-		if (strcmp(name, item->item_name) == 0) {
-			(*temp) = item->next;
-			break;
+	// The destination cannot be in the copied subtree
+	for (dir = dest_dir; ; dir = dir->parent) {
+		if (dir == directories[item->inode]) {
+			reply(CCD);
+			return;
 		}
-		temp = &(item->next);
-		item = item->next;
+		if (dir->parent == dir)		// Root
+			break;
 	}
 	
-	if (!item) {
-		printf(FNF);
-		return;
-	}
-
-	// Get numbers of data blocks of the file
-	blocks = get_data_blocks(item->inode, &block_count, &rest);
-
-	// Clear data blocks
-	memset(block_buffer, 0, CLUSTER_SIZE);
-	prev = blocks[0];
-	for (i = 0; i < block_count - 1; i++) {
-		if (prev != blocks[i] - 1) {
-			fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+	// Data blocks of all files are reserved at once (in the memory only), directories take other blocks.
+	// With dedup every file looks for its shared blocks itself.
+	if (!(sb->features & FEATURE_DEDUP)) {
+		total = count_tree_blocks(directories[item->inode]);
+		reserved = find_free_data_blocks(total);
+		if (!reserved) {
+			reply(NES);
+			return;
 		}
-		fwrite(block_buffer, sizeof(block_buffer), 1, fs);
-		prev = blocks[i];
-	}
-	
-	if (rest != 0)
-		tmp = rest;
-	else 
-		tmp = CLUSTER_SIZE;
-	
-	fseek(fs, sb->data_start_address + blocks[block_count - 1] * CLUSTER_SIZE, SEEK_SET);
-	fwrite(block_buffer, tmp, 1, fs);
-	
-	if (inodes[item->inode].indirect1 != FREE) {
-		fseek(fs, sb->data_start_address + inodes[item->inode].indirect1 * CLUSTER_SIZE, SEEK_SET);
-		fwrite(block_buffer, sizeof(block_buffer), 1, fs);
-		
-		if (inodes[item->inode].indirect2 != FREE) {
-			fseek(fs, sb->data_start_address + inodes[item->inode].indirect2 * CLUSTER_SIZE, SEEK_SET);
-			fwrite(block_buffer, sizeof(block_buffer), 1, fs);
+		for (i = 0; i < total; i++) {
+			bitmap[reserved[i]] = 1;
 		}
 	}
 	
-	fflush(fs);
-
-	update_bitmap(item, 0, blocks, block_count);
-	update_sizes(dir, -(inodes[item->inode].file_size));
-	update_directory(dir, item, 0);
-	
-	clear_inode(item->inode);
-	update_inode(item->inode);
+	batch_running++;
+	result = copy_tree(directories[item->inode], dest_dir, name, reserved, &used, &list);
+	if (result == NO_ERROR)
+		copied = run_jobs(list.jobs, list.count);	// Fails with corrupted data blocks of some source
 	
-	free(item);
-	free(blocks);
+	// Blocks of files which were not copied (error) are released before the bitmap is stored
+	if (reserved) {
+		release_reserved(reserved + used, total - used, FREE);
+	}
+	if (--batch_running == 0)
+		commit_metadata();
 	
-	printf(OK);
+	free(reserved);
+	free(list.jobs);
+	reply(result ? NES : copied == BAD_CHECKSUM ? CHM : copied ? CCF : OK);
 }
 
 
-/*	Create a new directory
-	
-	param path ... name of the new directory (+path)
+/*	Copy the directory into the parent directory and continue with its files and subdirectories
+
+	param source ... copied directory
+	param parent ... directory of the copy
+	param name ... name of the copy
+	param reserved ... data blocks reserved for all files, NULL = every file finds its blocks
+	param used ... count of reserved blocks used by already copied files
+	param list ... list to append copies of data blocks
+	return 0 = no error, -1 = not enough space
 */
-void mymkdir(char *path) {
-	directory *dir;
-	char *name;			
-	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
-	}
+int copy_tree(directory *source, directory *parent, char *name, int32_t *reserved, int *used, job_list *list) {
+	directory *copy;
+	directory_item *item;
+	int count, result;
 	
-	if (!path || path == "") {
-		printf(PNF);
-		return;
-	}
+	if (create_directory(parent, name))
+		return ERROR;
+	copy = directories[find_item(parent->subdir, name)->inode];
 	
-	// Parse the path + find the parent directory
-	if (parse_path(path, &name, &dir)) {
-		printf(PNF);
-		return;
-	}
-
-	// Test if destination folder doesn't contain file/directory with the same name
-	if (test_existence(dir, name)) {
-		printf(EXIST);
-		return;
+	for (item = source->file; item != NULL; item = item->next) {
+		if ((result = verify_layout(item->inode)) != NO_ERROR) {	// File with corrupted indirect blocks is not copied
+			reply("%s: %s", item->item_name, result == BAD_CHECKSUM ? CHM : CCF);
+			continue;
+		}
+		count = reserved ? count_with_indirect(count_stored_blocks(item->inode)) : 0;
+		if (copy_file(item, copy, item->item_name, reserved ? reserved + *used : NULL, list))
+			return ERROR;
+		*used += count;
 	}
-
-	// Create directory
-	if (create_directory(dir, name)) {
-		printf(NES);
-		return;
+	for (item = source->subdir; item != NULL; item = item->next) {
+		if (copy_tree(directories[item->inode], copy, item->item_name, reserved, used, list))
+			return ERROR;
 	}
-	printf(OK);
+	return NO_ERROR;
 }
 
 
-/* 	Remove the empty directory
+/*	Count data blocks needed by copies of all files of the directory and its subdirectories
 
-	param path ... name of the removing directory (+path)
+	param dir ... directory
+	return count of data blocks (with blocks of indirect references)
 */
-void myrmdir(char *path) {
-	directory *dir;
-	directory_item *item, **temp;
-	char *name;
-	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
-	}
+int count_tree_blocks(directory *dir) {
+	directory_item *item;
+	int count = 0;
 	
-	if (!path || path == "") {
-		printf(PNF);
-		return;
+	for (item = dir->file; item != NULL; item = item->next) {
+		count += count_with_indirect(count_stored_blocks(item->inode));
 	}
-	
-	// Parse the path + find the parent directory
-	if (parse_path(path, &name, &dir)) {
-		printf(PNF);
-		return;
+	for (item = dir->subdir; item != NULL; item = item->next) {
+		count += count_tree_blocks(directories[item->inode]);
 	}
+	return count;
+}
 
-	temp = &(dir->subdir); 
-	item = dir->subdir;
-	while (item != NULL) {
-		if (strcmp(name, item->item_name) == 0) {
-			if ((directories[item->inode]->file != NULL) || (directories[item->inode]->subdir != NULL)) {		// If directory is not empty
-				printf(NE);		
-				return;			
-			}
 
-			(*temp) = item->next;
-			
-			if (working_directory == directories[item->inode]) {	// If removing working directory -> get to one level up in hierarchy
-				working_directory = directories[item->inode]->parent;
-			}
-			
-			update_bitmap(item, 0, NULL, 0);
-			clear_inode(item->inode);
-			update_inode(item->inode);
-			update_directory(dir, item, 0);
+/*	Count data blocks which store the data of the file (without blocks of indirect references)
 
-			free(directories[item->inode]);
-			free(item);
-			break;
-		}
-		temp = &(item->next);
-		item = item->next;
-	}
+	param nodeid ... i-node of the file
+	return count of data blocks
+*/
+int count_stored_blocks(int32_t nodeid) {
+	int block_count, rest;
 	
-	if (!item) {	// If directory wasn't found
-		printf(FNF);
-		return;
+	if (inodes[nodeid].flags & INODE_INLINE)
+		return 0;
+	if (inodes[nodeid].flags & INODE_COMPRESSED) {	// Size of the stored stream is known only from the references
+		free(get_data_blocks(nodeid, &block_count, &rest));
+		return block_count;
 	}
-
-	printf(OK);
+	return (inode_sizes[nodeid] + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
 }
 
 
-/*	Print all items in the directory
+/*	Count data blocks of the file together with blocks of its indirect references
 
-	param path ... path of the directory
+	param block_count ... count of data blocks of the file
+	return count of all blocks
 */
-void ls(char *path) {
-	directory *dir;
-	directory_item *item;
+int count_with_indirect(int block_count) {
+	if (block_count < 5)								// Use only direct references
+		return block_count;
+	if ((block_count > 5) && (block_count < 262))		// Use first indirect reference (+1 data block)
+		return block_count + 1;
+	return block_count + 2;								// Use both indirect references (+2 data block)
+}
+
+
+/*	Copy the file into the directory, the caller holds locks of both directories and the read lock of the file
+	and runs the copies of data blocks
+
+	param item ... copied file
+	param dest_dir ... directory of the copy
+	param name ... name of the copy
+	param blocks ... data blocks reserved for the copy (in the bitmap), NULL = find free blocks
+	param list ... list to append copies of data blocks
+	return 0 = no error, -1 = not enough space
+*/
+int copy_file(directory_item *item, directory *dest_dir, char *name, int32_t *blocks, job_list *list) {
+	int i, block_count, rest, count_with_indir, tmp, last_block_index;
+	int32_t *source_blocks, *dest_blocks = blocks, inode_id;
+	int8_t *new_blocks = NULL;	// Data blocks which have to be copied (not shared)
+	directory_item **pitem;
 	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
+	// Inline file is copied only within the i-nodes, no data blocks are needed
+	if (inodes[item->inode].flags & INODE_INLINE) {
+		pthread_mutex_lock(&alloc_lock);
+		inode_id = find_free_inode();
+		if (inode_id == ERROR) {
+			pthread_mutex_unlock(&alloc_lock);
+			return ERROR;
+		}
+		inodes[inode_id] = inodes[item->inode];
+		inode_ids[inode_id] = inode_id;
+		inode_dirs[inode_id] = inode_dirs[item->inode];
+		inode_sizes[inode_id] = inode_sizes[item->inode];
+		pthread_mutex_unlock(&alloc_lock);
+		
+		pitem = &(dest_dir->file);
+		while (*pitem != NULL) {
+			pitem = &((*pitem)->next);
+		}
+		*pitem = create_directory_item(inode_id, name);
+		
+		memcpy(INLINE_DATA(inode_id), INLINE_DATA(item->inode), inline_capacity);
+		
+		update_inode(inode_id);
+		update_sizes(dest_dir, inode_sizes[item->inode]);
+		update_directory(dest_dir, *pitem, 1);
+		return NO_ERROR;
 	}
 	
-	if (!path || path == "") {
-		printf(PNF);
-		return;
+	// Get numbers of data blocks of the source file
+	source_blocks = get_data_blocks(item->inode, &block_count, &rest);
+	count_with_indir = count_with_indirect(block_count);
+	
+	// Get numbers of free data blocks for copied file 
+	pthread_mutex_lock(&alloc_lock);
+	if (!blocks) {
+		if (sb->features & FEATURE_DEDUP) {	// Copy shares the data blocks of the source file
+			new_blocks = (int8_t *)malloc(block_count);
+			dest_blocks = allocate_shared_blocks(source_blocks, block_count, count_with_indir, new_blocks);
+		}
+		else {
+			dest_blocks = find_free_data_blocks(count_with_indir);
+		}
+	}
+	if (!dest_blocks) {
+		pthread_mutex_unlock(&alloc_lock);
+		free(source_blocks);
+		free(new_blocks);
+		return ERROR;
 	}
 	
-	// Find the directory
-	dir = find_directory(path);
-	if (!dir) {
-		printf(PNF);
-		return;
+	// Get ID of a free i-node
+	inode_id = find_free_inode();
+	if (inode_id == ERROR) {
+		pthread_mutex_unlock(&alloc_lock);
+		free(source_blocks);
+		if (!blocks)
+			free(dest_blocks);
+		free(new_blocks);
+		return ERROR;
 	}
 	
-	item = dir->subdir;
-	while (item != NULL) {	// Print all subdirectories
-		printf("+%s\n", item->item_name);
-		item = item->next;
+	// Get the last (free) item in the list of all files in the destination directory
+	pitem = &(dest_dir->file);
+	while (*pitem != NULL) {
+		pitem = &((*pitem)->next);
 	}
+	*pitem = create_directory_item(inode_id, name);
+	
+	// Initialize i-node
+	initialize_inode(inode_id, inode_sizes[item->inode], block_count, count_with_indir, &last_block_index, dest_blocks);
+	inodes[inode_id].flags = inodes[item->inode].flags;
 
-	item = dir->file;	
-	while (item != NULL) {	// Print all files
-		printf("-%s\n", item->item_name);
-		item = item->next;
+	// Save changes to the file
+	if (new_blocks) {	// Shared data blocks get one more reference, bitmap is updated only for indirect blocks
+		reference_shared_blocks(NULL, dest_blocks, block_count, new_blocks);
+		update_bitmap(*pitem, 1, dest_blocks, 0);
 	}
-}
-
-
-/*	Print content of the file
-
-	param file ... name of file (+path)
-*/
-void cat(char *file) {
-	directory *dir;
-	directory_item *item;
-	char *name;
-	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
+	else {
+		update_bitmap(*pitem, 1, dest_blocks, block_count);
 	}
-	
-	if (!file || file == "") {
-		printf(FNF);
-		return;
+	if (blocks) {	// Reserved blocks not used by the i-node (file of 5 blocks) are free again
+		release_reserved(blocks + block_count, count_with_indir - block_count, inode_id);
 	}
-	
-	// Parse the path + file + find the directory
-	if (parse_path(file, &name, &dir)) {
-		printf(FNF);
-		return;
+	pthread_mutex_unlock(&alloc_lock);
+	update_inode(inode_id);
+	update_sizes(dest_dir, inode_sizes[item->inode]);
+	update_directory(dest_dir, *pitem, 1);
+		
+	// Runs of blocks consecutive in the source and in the copy are copied by one job
+	for (i = 0; i < block_count - 1; i++) {
+		if (!new_blocks || new_blocks[i])	// Shared data block is not copied
+			add_job(list, JOB_COPY, source_blocks[i], dest_blocks[i], CLUSTER_SIZE, NULL);
 	}
 	
-	item = find_item(dir->file, name);
-	if (!item) {
-		printf(FNF);
-		return;
+	// Copy the last data block (may copy only a part of the block)
+	if (rest != 0)
+		tmp = rest;
+	else 
+		tmp = CLUSTER_SIZE;
+	
+	if (block_count > 0 && (!new_blocks || new_blocks[block_count - 1])) {
+		add_job(list, JOB_COPY, source_blocks[block_count - 1], dest_blocks[last_block_index], tmp, NULL);
 	}
-	print_file(item);
-	printf("\n");
+	
+	free(source_blocks);
+	if (!blocks)
+		free(dest_blocks);
+	free(new_blocks);
+	return NO_ERROR;
 }
 
 
-/*	Change the working directory according to the path
+/*	Append the job to the list of jobs of the worker pool (it extends the previous job if both runs continue)
 
-	param path ... path to the new working directory
+	param list ... list of jobs
+	param kind ... JOB_READ, JOB_WRITE or JOB_COPY
+	param from ... first source data block (JOB_READ, JOB_COPY)
+	param to ... first target data block (JOB_WRITE, JOB_COPY)
+	param size ... count of bytes
+	param data ... buffer in the memory (JOB_READ, JOB_WRITE)
 */
-void cd(char *path) {
-	directory *dir;
-	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
-	}
-	
-	if (!path || path == "") {
-		printf(PNF);
+void add_job(job_list *list, int8_t kind, int32_t from, int32_t to, int32_t size, char *data) {
+	io_job *last = list->count > 0 ? &list->jobs[list->count - 1] : NULL;
+	int32_t run = last ? last->size / CLUSTER_SIZE : 0;	// Count of blocks of the previous job
+	
+	if (last && last->kind == kind && last->size % CLUSTER_SIZE == 0
+		&& (kind == JOB_READ || last->to + run == to)				// Target blocks continue
+		&& (kind == JOB_WRITE || last->from + run == from)			// Source blocks continue
+		&& (kind == JOB_COPY || last->data + last->size == data)) {	// Data in the memory continue
+		last->size += size;
 		return;
 	}
-	
-	// Find the directory
-	dir = find_directory(path);
-	if (!dir) {		
-		printf(PNF);
-		return;
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 16;
+		list->jobs = (io_job *)realloc(list->jobs, sizeof(io_job) * list->capacity);
 	}
-	
-	working_directory = dir;
-	printf(OK);
+	last = &list->jobs[list->count++];
+	last->kind = kind;
+	last->from = from;
+	last->to = to;
+	last->size = size;
+	last->data = data;
 }
 
 
-/*	Print the path of the working directory */
-void pwd() {
-	char *names[64];	// Directory names on the path to the working directory
-	int count = 0;
+/*	Release data blocks reserved in the memory (cp -r, incp -r) which are not used by the i-node
+
+	param blocks ... reserved data blocks
+	param count ... count of the blocks
+	param nodeid ... i-node which may use some of the blocks for indirect references, FREE = none
+*/
+void release_reserved(int32_t *blocks, int count, int32_t nodeid) {
 	int i;
-	directory *temp = working_directory;
-	
-	if (!fs_formatted) {
-		print_format_msg();
-		return;	
-	}
-	
-	while (temp != directories[0]) {	// Until get to root directory
-		names[count] = temp->current->item_name;
-		count++;
-		temp = temp->parent;
-	}
 	
-	printf("/");
-	for (i = count - 1; i >= 0; i--) {
-		printf("%s", names[i]);
-		if (i != 0)
-			printf("/");
+	for (i = 0; i < count; i++) {
+		if (nodeid == FREE || (blocks[i] != inodes[nodeid].indirect1 && blocks[i] != inodes[nodeid].indirect2))
+			bitmap[blocks[i]] = 0;
 	}
-	printf("\n");
 }
 
 
-/*	Print the info about the file/directory
+/*	Move file to another directory
 
-	param path ... file/directory name (+path)
+	param files ... source file (+path) and destination directory (+path)
 */
-void info(char *path) {
-	directory *dir;
-	char *name;
-	directory_item *item;
+void mv(char *files) {
+	char *source, *dest, *name;
+	directory *source_dir, *dest_dir;
+	directory_item *item, **pitem, **temp;
 	
 	if (!fs_formatted) {
 		print_format_msg();
 		return;	
 	}
 	
-	if (!path || path == "") {
-		printf(FNF);
+	if (!files || files == "") { 	// No arguments
+		reply(FNF);
+		return;
+	}
+	source = strtok_r(files, " ", &tokens);	// Get source
+	dest = strtok_r(NULL, "\n", &tokens);		// Get destination
+	if (!dest || dest == "") {
+		reply(FNF);
 		return;
 	}
 	
-	// Parse the path + file + find the directory
-	if (parse_path(path, &name, &dir)) {
-		printf(FNF);
+	// Parse the source path + find the source directory
+	if (parse_path(source, &name, &source_dir)) {
+		reply(FNF);
 		return;
 	}
 	
-	// If directory is root
-	if (dir == directories[0] && strlen(name) == 0) {
-		print_info(dir->current);
+	// Find the destination directory
+	dest_dir = find_directory(dest);
+	if (!dest_dir) {
+		reply(PNF);
 		return;
 	}
 	
-	// Finding item between files 
-	if (item = find_item(dir->file, name)) {
-		print_info(item);
+	// If source and destination directories are the same
+	if (dest_dir == source_dir) {
+		reply(OK);
 		return;
-		
+	}
+	lock_directories(source_dir, dest_dir);
+	
+	// Test if destination folder contains file/directory with the same name
+	if (test_existence(dest_dir, name)) {
+		unlock_directories(source_dir, dest_dir);
+		reply(EXIST);
+		return;
+	}
+	
+	// Remove the file from the list of all files in the source directory
+	temp = &(source_dir->file); 
+	item = source_dir->file;
+	while (item != NULL) {
+		if (strcmp(name, item->item_name) == 0) {
+			(*temp) = item->next;
+			update_sizes(source_dir, -(inode_sizes[item->inode]));
+			update_directory(source_dir, item, 0);
+			break;
+		}
+		temp = &(item->next);
+		item = item->next;
 	}
 	
-	// Finding item between subdirectories
-	if (item = find_item(dir->subdir, name)) {
-		print_info(item);
+	if (!item) {
+		unlock_directories(source_dir, dest_dir);
+		reply(FNF);
 		return;
 	}
 	
-	printf(FNF);
+
+	// Get the last (free) item in the list of all files in the destination directory
+	pitem = &(dest_dir->file);
+	while (*pitem != NULL) {
+		pitem = &((*pitem)->next);
+	}
+	
+	*pitem = item;	// Add file to the destination directory
+	item->next = NULL;
+	
+	update_sizes(dest_dir, inode_sizes[item->inode]);
+	update_directory(dest_dir, item, 1);
+	unlock_directories(source_dir, dest_dir);
+	
+	reply(OK);
 }
 
 
-/*	Copy file from the extern filesystem into this filesystem
+/*	Remove file (rm -r removes also the directory with all its files and subdirectories)
 
-	param files ... source file (+path) and destination directory (+path)
+	param file ... removing file (+path)
 */
-void incp(char *files) {
-	int32_t file_size, *blocks, inode_id;
-	int i, block_count, rest, tmp_count, tmp, last_block_index, prev;
-	char *source, *dest, *name;
-	directory *dir; 
-	directory_item **pitem;
-	FILE *f;
+void rm(char *file) {
+	char *name;
+	int recursive;
+	directory *dir;
+	directory_item *item;
 	
 	if (!fs_formatted) {
 		print_format_msg();
 		return;	
 	}
 	
-	if (!files || files == "") { // No arguments
-		printf(FNF);
-		return;
-	}
-	source = strtok(files, " ");	// Get source
-	dest = strtok(NULL, "\n");		// Get destination
-	if (!dest || dest == "") {
-		printf(PNF);
-		return;
-	}
-	
-	// Get name of the source file
-	if ((name = strrchr(source, '/')) == NULL) {
-		name = source;
-	}
-	else {
-		name++;
-	}
-	
-	// Find destination directory
-	dir = find_directory(dest);
-	if (!dir) {
-		printf(PNF);
-		return;
-	}
-	
-	// Test if destination folder doesn't contain file with the same name
-	if (test_existence(dir, name)) {
-		printf(EXIST);
+	if (!file || file == "") {
+		reply(FNF);
 		return;
 	}
+	recursive = (strncmp(file, "-r ", 3) == 0);
 	
-	if (!(f = fopen(source, "rb"))) {
-		printf(FNF);
+	// Parse the path + find the directory
+	if (parse_path(recursive ? file + 3 : file, &name, &dir)) {
+		reply(FNF);
 		return;
 	}
 	
-	// Get size of the copied file
-	fseek(f, 0, SEEK_END);
-	file_size = ftell(f);
-	rewind(f);
-	
-	if (file_size > MAX_SIZE) {
-		printf(TL);
-		fclose(f);
+	// The command is exclusive with -r, the whole subtree is one batch (metadata are stored once at the end)
+	if (recursive && (item = find_item(dir->subdir, name))) {
+		batch_running++;
+		remove_tree(dir, item);
+		if (--batch_running == 0)
+			commit_metadata();
+		reply(OK);
 		return;
 	}
 	
-	block_count = file_size / CLUSTER_SIZE;
-	rest = file_size % CLUSTER_SIZE;
-	
-	if (rest != 0)
-		block_count++;
-	
-	if (block_count < 5)	// Use only direct references
-		tmp_count = block_count;
-	else if ((block_count > 5) && (block_count < 262))	// Use first indirect reference (+1 data block)
-		tmp_count = block_count + 1;
-	else 
-		tmp_count = block_count + 2;			// Use both indirect references (+2 data block)
-	
-	blocks = find_free_data_blocks(tmp_count);
-	if (!blocks) {
-		printf(NES);
-		fclose(f);
+	if (remove_file(dir, name)) {
+		reply(FNF);
 		return;
 	}
+	reply(OK);
+}
+
+
+/*	Remove the directory with all its files and subdirectories (from the deepest ones)
+
+	param parent ... parent directory
+	param item ... removing directory
+*/
+void remove_tree(directory *parent, directory_item *item) {
+	directory *dir = directories[item->inode];
 	
-	// Get ID of a free i-node
-	inode_id = find_free_inode();
-	if (inode_id == ERROR) {
-		printf(NES);
-		fclose(f);
-		return;
+	while (dir->subdir != NULL) {
+		remove_tree(dir, dir->subdir);
 	}
-	
-	pitem = &(dir->file);
-	while (*pitem != NULL) {
-		pitem = &((*pitem)->next);
+	while (dir->file != NULL) {
+		remove_file(dir, dir->file->item_name);
 	}
-	*pitem = create_directory_item(inode_id, name);
+	remove_directory(parent, item);
+}
 
-	// Initialize i-node
-	initialize_inode(inode_id, file_size, block_count, tmp_count, &last_block_index, blocks);
 
-	update_bitmap(*pitem, 1, blocks, block_count);
-	update_inode(inode_id);
-	update_directory(dir, *pitem, 1);
-	update_sizes(dir, file_size);
+/*	Remove the file from the directory and release its i-node and data blocks
+
+	param dir ... directory of the file
+	param name ... name of the file
+	return 0 = no error, -1 = file not found
+*/
+int remove_file(directory *dir, char *name) {
+	int i, block_count, rest, tmp, prev;
+	int32_t *blocks, *indirect[2];
+	directory_item *item, **temp;
 	
-	// Copy data
-	prev = blocks[0];
-	for (i = 0; i < block_count - 1; i++) {
-		fread(block_buffer, sizeof(block_buffer), 1, f);
-		if (prev != blocks[i] - 1) {
-			fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+	// Remove the file from the list of all files in the directory
+	pthread_mutex_lock(&(dir->lock));
+	temp = &(dir->file);
+	item = dir->file;
+	while (item != NULL) {
+		if (strcmp(name, item->item_name) == 0) {
+			(*temp) = item->next;
+			break;
 		}
-		fwrite(block_buffer, sizeof(block_buffer), 1, fs);
-		prev = blocks[i];
+		temp = &(item->next);
+		item = item->next;
 	}
 	
-	memset(block_buffer, 0, CLUSTER_SIZE);
-	if (rest != 0)
-		tmp = rest;
-	else 
-		tmp = CLUSTER_SIZE;
+	if (!item) {
+		pthread_mutex_unlock(&(dir->lock));
+		return ERROR;
+	}
+	pthread_rwlock_wrlock(&inode_locks[item->inode]);	// Wait for readers of the file
+	indirect[0] = &inodes[item->inode].indirect1;
+	indirect[1] = &inodes[item->inode].indirect2;
+
+	if (!(inodes[item->inode].flags & INODE_INLINE)) {	// Inline file has no data blocks
+		// Get numbers of data blocks of the file
+		blocks = get_data_blocks(item->inode, &block_count, &rest);
+		pthread_mutex_lock(&alloc_lock);
+		
+		// Shared data blocks only lose one reference, the other blocks are cleared and freed
+		if (BLOCKS_SHARED) {
+			tmp = release_shared_blocks(blocks, block_count);
+			if (tmp != block_count) {	// The last block may be another one -> clear whole blocks
+				block_count = tmp;
+				rest = 0;
+			}
+		}
+		
+		// Indirect blocks may be shared with snapshots
+		for (i = 0; i < 2 && sb->snapshot_count > 0; i++) {
+			if (*indirect[i] != FREE && bitmap[*indirect[i]] > 1) {
+				set_references(*indirect[i], bitmap[*indirect[i]] - 1);
+				*indirect[i] = FREE;
+			}
+		}
+
+		// Clear data blocks
+		memset(block_buffer, 0, CLUSTER_SIZE);
+		if (block_count > 0) {
+			prev = blocks[0];
+			for (i = 0; i < block_count - 1; i++) {
+				if (prev != blocks[i] - 1) {
+					fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+				}
+				fwrite_data(block_buffer, sizeof(block_buffer), 1, sb->data_start_address + blocks[i] * CLUSTER_SIZE);
+				prev = blocks[i];
+			}
+		
+			if (rest != 0 && !checksums)	// With checksums the whole block (its checksum is not computed from the image)
+				tmp = rest;
+			else 
+				tmp = CLUSTER_SIZE;
+		
+			fseek(fs, sb->data_start_address + blocks[block_count - 1] * CLUSTER_SIZE, SEEK_SET);
+			fwrite_data(block_buffer, tmp, 1, sb->data_start_address + blocks[block_count - 1] * CLUSTER_SIZE);
+		}
 	
-	fread(block_buffer, sizeof(char), tmp, f);
-	fseek(fs, sb->data_start_address + blocks[last_block_index] * CLUSTER_SIZE, SEEK_SET);
-	fwrite(block_buffer, sizeof(char), tmp, fs);
-	fflush(fs);
+		for (i = 0; i < 2; i++) {
+			if (*indirect[i] != FREE) {
+				fseek(fs, sb->data_start_address + *indirect[i] * CLUSTER_SIZE, SEEK_SET);
+				fwrite_data(block_buffer, sizeof(block_buffer), 1, sb->data_start_address + *indirect[i] * CLUSTER_SIZE);
+			}
+		}
 	
-	fclose(f);
-	free(blocks);
+		fflush(fs);
 
-	printf(OK);
+		update_bitmap(item, 0, blocks, block_count);
+		pthread_mutex_unlock(&alloc_lock);
+		free(blocks);
+	}
+	update_sizes(dir, -(inode_sizes[item->inode]));
+	update_directory(dir, item, 0);
+	
+	pthread_mutex_lock(&alloc_lock);
+	clear_inode(item->inode);
+	update_inode(item->inode);
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_rwlock_unlock(&inode_locks[item->inode]);
+	pthread_mutex_unlock(&(dir->lock));
+	
+	pool_free(&item_pool, item);
+	return NO_ERROR;
 }
 
 
-/*	Copy file from this filesystem to extern filesystem
+/*	Create an empty file in the directory (inline file if the filesystem has extended i-nodes),
+	the caller holds the lock of the directory and tested that the name is free
 
-	param files ... source file (+path) and destination directory (+path)
+	param dir ... directory of the file
+	param name ... name of the file
+	return i-node ID of the file, -1 = no free i-node
 */
-void outcp(char *files) {
-	int i, block_count, rest, tmp, prev;
-	int32_t *blocks;
-	char *source, *dest, *name;
-	char whole_dest[BUFF_SIZE];
+int create_file(directory *dir, char *name) {
+	int32_t inode_id;
+	directory_item **pitem;
+	
+	pthread_mutex_lock(&alloc_lock);
+	inode_id = find_free_inode();
+	if (inode_id == ERROR) {
+		pthread_mutex_unlock(&alloc_lock);
+		return ERROR;
+	}
+	clear_inode(inode_id);
+	inode_ids[inode_id] = inode_id;
+	pthread_mutex_unlock(&alloc_lock);
+	
+	pitem = &(dir->file);
+	while (*pitem != NULL) {
+		pitem = &((*pitem)->next);
+	}
+	*pitem = create_directory_item(inode_id, name);
+	
+	inodes[inode_id].references = 1;
+	if (inline_capacity > 0)	// Otherwise the file has no data blocks
+		inodes[inode_id].flags = INODE_INLINE;
+	
+	update_inode(inode_id);
+	update_directory(dir, *pitem, 1);
+	return inode_id;
+}
+
+
+/*	Create a new directory
+	
+	param path ... name of the new directory (+path)
+*/
+void mymkdir(char *path) {
 	directory *dir;
-	directory_item *item;
-	FILE *f;
+	char *name;			
 	
 	if (!fs_formatted) {
 		print_format_msg();
 		return;	
 	}
 	
-	if (!files || files == "") { // No arguments
-		printf(FNF);
+	if (!path || path == "") {
+		reply(PNF);
 		return;
 	}
-	source = strtok(files, " ");	// Get source
-	dest = strtok(NULL, "\n");		// Get destination
-	if (!dest || dest == "") {
-		printf(PNF);
+	
+	// Parse the path + find the parent directory
+	if (parse_path(path, &name, &dir)) {
+		reply(PNF);
 		return;
 	}
-	// Parse the path + file + find the directory
-	if (parse_path(source, &name, &dir)) {
-		printf(FNF);
+
+	// Test if destination folder doesn't contain file/directory with the same name
+	if (test_existence(dir, name)) {
+		reply(EXIST);
 		return;
 	}
-	
-	item = find_item(dir->file, name);
-	if (!item) {
-		printf(FNF);
+
+	// Create directory
+	if (create_directory(dir, name)) {
+		reply(NES);
 		return;
 	}
+	reply(OK);
+}
+
+
+/* 	Remove the empty directory
+
+	param path ... name of the removing directory (+path)
+*/
+void myrmdir(char *path) {
+	directory *dir;
+	directory_item *item;
+	char *name;
 	
-	// Set a whole destination (path + name)
-	memset(whole_dest, 0, BUFF_SIZE);
-	sprintf(whole_dest, "%s/%s", dest, name);
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
 	
-	if (!(f = fopen(whole_dest, "wb"))) {
-		printf(PNF);
+	if (!path || path == "") {
+		reply(PNF);
 		return;
 	}
 	
-	blocks = get_data_blocks(item->inode, &block_count, &rest);
+	// Parse the path + find the parent directory
+	if (parse_path(path, &name, &dir)) {
+		reply(PNF);
+		return;
+	}
 
-	// Copy data
-	prev = blocks[0];
-	for (i = 0; i < block_count - 1; i++) {
-		if (prev != (blocks[i] - 1)) {	// If data blocks are not in sequence
-			fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
-		}
-		fread(block_buffer, sizeof(block_buffer), 1, fs);
-		fwrite(block_buffer, sizeof(block_buffer), 1, f);
-		fflush(f);
-		prev = blocks[i];
+	item = find_item(dir->subdir, name);
+	if (!item) {	// If directory wasn't found
+		reply(FNF);
+		return;
 	}
+	if ((directories[item->inode]->file != NULL) || (directories[item->inode]->subdir != NULL)) {		// If directory is not empty
+		reply(NE);		
+		return;			
+	}
+	remove_directory(dir, item);
 
-	memset(block_buffer, 0, CLUSTER_SIZE);
-	if (rest != 0)
-		tmp = rest;
-	else 
-		tmp = CLUSTER_SIZE;
+	reply(OK);
+}
+
+
+/*	Remove the empty directory from its parent and release its i-node and data blocks
+
+	param parent ... parent directory
+	param item ... removing directory
+*/
+void remove_directory(directory *parent, directory_item *item) {
+	int count;
+	int32_t *blocks;
+	directory_item **temp = &(parent->subdir);
 	
-	fseek(fs, sb->data_start_address + blocks[block_count - 1] * CLUSTER_SIZE, SEEK_SET);
-	fread(block_buffer, tmp, 1, fs);
-	fwrite(block_buffer, tmp, 1, f);
+	while (*temp != item) {
+		temp = &((*temp)->next);
+	}
+	(*temp) = item->next;
 	
-	fflush(fs);
-	fclose(f);
+	if (working_directory == directories[item->inode]) {	// If removing working directory -> get to one level up in hierarchy
+		working_directory = directories[item->inode]->parent;
+	}
+	reset_sessions(directories[item->inode], directories[item->inode]->parent);
+	
+	// Blocks of the directory may be shared with snapshots
+	blocks = get_layout_blocks(&inodes[item->inode], &count);
+	pthread_mutex_lock(&alloc_lock);
+	release_blocks(blocks, count);
+	pthread_mutex_unlock(&alloc_lock);
 	free(blocks);
-		
-	printf(OK);
+	clear_inode(item->inode);
+	update_inode(item->inode);
+	update_directory(parent, item, 0);
+
+	pthread_mutex_destroy(&(directories[item->inode]->lock));
+	pool_free(&directory_pool, directories[item->inode]);
+	pool_free(&item_pool, item);
 }
 
 
-/*	Load a file with commands to perform
+/*	Print all items in the directory
 
-	param file ... name of the file with commands (+path)
-	return open file
+	param path ... path of the directory
 */
-FILE *load(char *file) {
-	FILE *f;
+void ls(char *path) {
+	directory *dir;
+	directory_item *item;
 	
 	if (!fs_formatted) {
 		print_format_msg();
-		return NULL;	
+		return;	
 	}
-
-	if ((f = fopen(file, "r")) == NULL) {
-		printf(FNF);
-		return NULL;
+	
+	if (!path || path == "") {
+		reply(PNF);
+		return;
 	}
-	file_input = 1;	// Set the indicator that commands are loaded from the file
 	
-	printf(OK);
-	return f;
+	// Find the directory
+	dir = find_directory(path);
+	if (!dir) {
+		reply(PNF);
+		return;
+	}
+	
+	pthread_mutex_lock(&(dir->lock));
+	item = dir->subdir;
+	while (item != NULL) {	// Print all subdirectories
+		reply("+%s\n", item->item_name);
+		item = item->next;
+	}
+
+	item = dir->file;	
+	while (item != NULL) {	// Print all files
+		reply("-%s\n", item->item_name);
+		item = item->next;
+	}
+	pthread_mutex_unlock(&(dir->lock));
 }
 
 
-/* 	Format existing filesystem or create a new one with a specific size
+/*	Print content of the file
 
-	param bytes ... size of the filesystem in bytes
+	param file ... name of file (+path), optionally followed by the offset and the length of the printed range
 */
-void format(long bytes) {
-	int i, one = 1;
-	directory *root;
+void cat(char *file) {
+	int tmp;
+	int32_t size, offset = 0, length = 0;
+	directory *dir;
+	directory_item *item;
+	char *name, *range_offset, *range_length;
 	
-	if (!fs) {
-		fs = fopen(fs_name, "wb+");
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
 	}
 	
-	// Prepare superblock
-	if (!fs_formatted) {		// If not exist -> create
-		sb = (struct superblock *)malloc(sizeof(struct superblock));
-		if (!sb) {
-			printf(CCF);
-			return;
-		}
+	if (!file || file == "") {
+		reply(FNF);
+		return;
 	}
 	
-	sb->cluster_size = CLUSTER_SIZE;											// Size of the cluster
-	sb->cluster_count = bytes / CLUSTER_SIZE; 									// Count of all clusters
-	sb->disk_size = sb->cluster_count * CLUSTER_SIZE; 							// Exact size of the filesystem in bytes
-	sb->inode_cluster_count = sb->cluster_count / 20; 							// Count of blocks for i-nodes, 5% of all blocks
-	sb->inode_count = (sb->inode_cluster_count * CLUSTER_SIZE) / INODE_SIZE;	// Count of i-nodes
-	sb->bitmap_start_address = CLUSTER_SIZE; 									// Initial address of bitmap blocks
-	sb->bitmap_cluster_count = ceil((sb->cluster_count - sb->inode_cluster_count - 1) / (float)CLUSTER_SIZE);	// Count of blocks for bitmap to cover all data blocks
-	sb->data_cluster_count = sb->cluster_count - 1 - sb->bitmap_cluster_count - sb->inode_cluster_count;		// Count of data blocks
-	sb->inode_start_address = sb->bitmap_start_address + CLUSTER_SIZE * sb->bitmap_cluster_count;				// Initial address of i-node blocks
-	sb->data_start_address = sb->inode_start_address + CLUSTER_SIZE * sb->inode_cluster_count;					// Initial address of data blocks
-	
-	
-//	printf("Size: %d\nCount of clusters: %d\nCount of i-nodes: %d\nCount of bitmap blocks: %d\nCount of i-node blocks: %d\nCount of data blocks: %d\nAddress of bitmap: %d\nAddress of i-nodes: %d\nAddress of data: %d\n", 
-//	sb->disk_size, sb->cluster_count, sb->inode_count, sb->bitmap_cluster_count, sb->inode_cluster_count, sb->data_cluster_count, sb->bitmap_start_address, sb->inode_start_address, sb->data_start_address);
-	
-	if (fs_formatted) {		// If filesystem has already been formatted 
-		free(bitmap);
-		free_directories(directories[0]);
-		free(directories);
-		free(inodes);
+	// Split the name and the range before the path is parsed
+	file = strtok_r(file, " ", &tokens);
+	range_offset = strtok_r(NULL, " ", &tokens);
+	range_length = strtok_r(NULL, " ", &tokens);
+	if (range_offset && (offset = get_range_value(range_offset)) == ERROR) {
+		reply(IR);
+		return;
+	}
+	if (range_length && (length = get_range_value(range_length)) == ERROR) {
+		reply(IR);
+		return;
 	}
 	
-	// Prepare bitmap, i-nodes and pointers to directories
-	bitmap = (int8_t *)malloc(sb->data_cluster_count);
-	inodes = (inode *)malloc(sizeof(inode) * sb->inode_count);
-	directories = (directory **)malloc(sizeof(directory *) * sb->inode_count);
-	if (!bitmap || !inodes || !directories) {
-		printf(CCF);
+	// Parse the path + file + find the directory
+	if (parse_path(file, &name, &dir)) {
+		reply(FNF);
 		return;
 	}
 	
-	// Create root directory
-	root = (directory *)malloc(sizeof(directory));
-	if (!root) {
-		printf(CCF);
+	pthread_mutex_lock(&(dir->lock));
+	item = find_item(dir->file, name);
+	if (!item) {
+		pthread_mutex_unlock(&(dir->lock));
+		reply(FNF);
 		return;
 	}
-	root->current = create_directory_item(0,"/");
-	root->parent = root;
-	root->subdir = NULL;
-	root->file = NULL;
-
-	working_directory = root;	// Set root as working directory
-	directories[0] = root;
+	pthread_rwlock_rdlock(&inode_locks[item->inode]);
+	pthread_mutex_unlock(&(dir->lock));
 	
-	bitmap[0] = 1;
+	// Clamp the range to the file
+	size = inode_sizes[item->inode];
+	if (offset > size)
+		offset = size;
+	if (!range_length || length > size - offset)
+		length = size - offset;
+	
+	tmp = write_file(item->inode, OUTPUT, offset, length);
+	pthread_rwlock_unlock(&inode_locks[item->inode]);
+	reply(tmp == BAD_CHECKSUM ? "\n" CHM : tmp == ERROR ? "\n" CCF : "\n");
+}
 
-	// Clear bitmap (except root)
-	for (i = 1; i < sb->data_cluster_count; i++) {
-		bitmap[i] = 0;
-	}
+/*	Validate entered offset or length of the range
 
-	// Set all i-nodes as free 
-	for (i = 0; i < sb->inode_count; i++) {
-		inodes[i].nodeid = FREE;
-		inodes[i].isDirectory = 0;
-		inodes[i].references = 0;
-		inodes[i].file_size = 0;
-		inodes[i].direct1 = FREE;
-		inodes[i].direct2 = FREE;
-		inodes[i].direct3 = FREE;
-		inodes[i].direct4 = FREE;
-		inodes[i].direct5 = FREE;
-		inodes[i].indirect1 = FREE;
-		inodes[i].indirect2 = FREE;
-	}
+	param value ... non-negative number of bytes
+	return number of bytes or ERROR
+*/
+int32_t get_range_value(char *value) {
+	long number;
+	char *end;
 	
-	// Set root i-node
-	inodes[0].nodeid = 0;
-	inodes[0].isDirectory = 1;
-	inodes[0].references = 1;
-	inodes[0].direct1 = 0;
+	errno = 0;
+	number = strtol(value, &end, 10);
+	if (errno || end == value || *end != '\0' || number < 0)
+		return ERROR;
+	if (number > INT_MAX)	// Range is clamped to the file anyway
+		number = INT_MAX;
+	return number;
+}
+
+
+
+/*	Change the working directory according to the path
+
+	param path ... path to the new working directory
+*/
+void cd(char *path) {
+	directory *dir;
 	
-	// Fill the file by zeros
-	memset(block_buffer, 0, CLUSTER_SIZE);
-	for (i = 0; i < sb->cluster_count; i++) {
-		fwrite(block_buffer, sizeof(block_buffer), 1, fs);		
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
 	}
 	
-	// Store the superblock
-	rewind(fs);
-	fwrite(&(sb->disk_size), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->cluster_size), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->cluster_count), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->inode_count), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->bitmap_cluster_count), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->inode_cluster_count), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->data_cluster_count), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->bitmap_start_address), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->inode_start_address), sizeof(int32_t), 1, fs);
-	fwrite(&(sb->data_start_address), sizeof(int32_t), 1, fs);
-	
-	// Store bitmap - data block 0 (root)
-	fseek(fs, sb->bitmap_start_address, SEEK_SET);
-	fwrite(&one, sizeof(int8_t), 1, fs);
+	if (!path || path == "") {
+		reply(PNF);
+		return;
+	}
 	
-	// Store i-nodes
-	for (i = 0; i < sb->inode_count; i++) {
-		update_inode(i);
+	// Find the directory
+	dir = find_directory(path);
+	if (!dir) {		
+		reply(PNF);
+		return;
 	}
 	
-	fs_formatted = 1;
-	printf(OK);
+	working_directory = dir;
+	reply(OK);
 }
 
 
-/*	Defragment filesystem - first shift all data blocks to the begin of file (remove spaces between data blocks)
-	and then reorder not consecutive data blocks belonging to one i-node
-*/
-void defrag() {
-	int32_t i, j, k, l, tmp, rest, count_of_full_blocks = 0;
-	int32_t *blocks, *blocks2;
-	short changed_inodes[sb->inode_count];	// bitmap of i-nodes which were modified	1 = changed, 0 = unchanged
-	int inode_block_count[sb->inode_count];	// count of data blocks for every i-node
-	int32_t **data_blocks;					// array of data blocks for every i-node
-	data_info **info_blocks;				// array of information for every full data block
+/*	Print the path of the working directory */
+void pwd() {
+	char *names[64];	// Directory names on the path to the working directory
+	int count = 0;
+	int i;
+	directory *temp = working_directory;
 	
 	if (!fs_formatted) {
 		print_format_msg();
 		return;	
 	}
-
-	// Prepare data for defragmentation
-	info_blocks = map_data_blocks(&count_of_full_blocks);
-	data_blocks = (int32_t **)malloc(sizeof(int32_t *) * sb->inode_count);
-
-	for (i = 0; i < sb->inode_count; i++) {
-		data_blocks[i] = NULL;
+	
+	while (temp != directories[0]) {	// Until get to root directory
+		names[count] = temp->current->item_name;
+		count++;
+		temp = temp->parent;
 	}
-	for (i = 0; i < sb->inode_count; i++) {
-		if (inodes[i].nodeid == FREE) {
-			continue;
-		}
-
-		data_blocks[i] = get_data_blocks(i, &(inode_block_count[i]), &rest);
-		
-		tmp = 0;
-		if (inodes[i].indirect1 != FREE) 
-			tmp++;
-		if (inodes[i].indirect2 != FREE)
-			tmp++;
-			
-		if (tmp != 0) {
-			data_blocks[i] = (int32_t *)realloc(data_blocks[i], sizeof(int32_t) * inode_block_count[i] + tmp);
-			if (tmp == 1) {
-				data_blocks[i][inode_block_count[i]] = inodes[i].indirect1;
-			}
-			else {
-				data_blocks[i][inode_block_count[i]] = inodes[i].indirect2;
-				data_blocks[i][inode_block_count[i] + 1] = inodes[i].indirect1;
-			}
-			inode_block_count[i] += tmp;
-		}
+	
+	reply("/");
+	for (i = count - 1; i >= 0; i--) {
+		reply("%s", names[i]);
+		if (i != 0)
+			reply("/");
 	}
+	reply("\n");
+}
 
-	// Rearrange data blocks so that free blocks were after full blocks
-	for (i = 0; i < count_of_full_blocks; i++) {
-		if (info_blocks[i] != NULL) 
-			continue;
-		
-		j = i + 1;
-		// Find the next nearest full data block
-		while (info_blocks[j] == NULL) {
-			j++;
-		}
-		changed_inodes[info_blocks[j]->nodeid] = 1;
-		switch_blocks(j, i, info_blocks);
-	}
 
-	// Rearrange data blocks so that blocks of one i-node were consecutive
-	i = 0;
-	while (i < count_of_full_blocks) {	// Iteration over full data blocks
-		blocks = data_blocks[info_blocks[i]->nodeid];	// get all data blocks of the i-node to which current data block belongs
-			
-		if (is_sorted(blocks, inode_block_count[info_blocks[i]->nodeid])) {	// if data blocks are already sorted -> skip to another data block of other i-node
-			i += inode_block_count[info_blocks[i]->nodeid];
-			continue;
-		}
+/*	Print the info about the file/directory
 
-		for (j = i, k = 0; j < (i + inode_block_count[info_blocks[i]->nodeid]); j++, k++) {
-			if (j == blocks[k]) 
-				continue;
-			
-			changed_inodes[info_blocks[j]->nodeid] = 1;
-			changed_inodes[info_blocks[blocks[k]]->nodeid] = 1;
-			
-			blocks2 = data_blocks[info_blocks[j]->nodeid];	// data blocks of the destination
-			for (l = 0; l < inode_block_count[info_blocks[j]->nodeid]; l++) {
-				if (j == blocks2[l]) {
-					blocks2[l] = blocks[k];
-					break;
-				}
-			}
-			switch_blocks(blocks[k], j, info_blocks);
-			blocks[k] = j;
-		}
-		i += inode_block_count[info_blocks[i]->nodeid];
-	}
+	param path ... file/directory name (+path)
+*/
+void info(char *path) {
+	directory *dir;
+	char *name;
+	directory_item *item;
 	
-	// Save bitmap
-	fseek(fs, sb->bitmap_start_address, SEEK_SET);
-	fwrite(bitmap, sizeof(int8_t), sb->data_cluster_count, fs);
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
 	
-	// Save changed i-nodes
-	for (i = 0; i < sb->inode_count; i++) {
-		if (changed_inodes[i] == 1) {
-			update_inode(i);
-		}
+	if (!path || path == "") {
+		reply(FNF);
+		return;
 	}
 	
-	// Free data blocks
-	for (i = 0; i < sb->inode_count; i++) {
-		if (data_blocks[i] == NULL)
-			continue;
-		
-		free(data_blocks[i]);
+	// Parse the path + file + find the directory
+	if (parse_path(path, &name, &dir)) {
+		reply(FNF);
+		return;
 	}
-	free(data_blocks);
 	
-	// Free data_info blocks
-	for (i = 0; i < sb->data_cluster_count; i++) {
-		if (info_blocks[i] == NULL)
-			continue;
-			
-		free(info_blocks[i]);
+	// If directory is root
+	pthread_mutex_lock(&(dir->lock));
+	if (dir == directories[0] && strlen(name) == 0) {
+		item = dir->current;
 	}
-	free(info_blocks);
+	// Finding item between files, then between subdirectories
+	else if (!(item = find_item(dir->file, name))) {
+		item = find_item(dir->subdir, name);
+	}
+	if (item)
+		pthread_rwlock_rdlock(&inode_locks[item->inode]);
+	pthread_mutex_unlock(&(dir->lock));
 	
-	printf(OK);
+	if (!item) {
+		reply(FNF);
+		return;
+	}
+	print_info(item);
+	pthread_rwlock_unlock(&inode_locks[item->inode]);
 }
 
 
-/*	Test if data blocks are consecutive
+/*	Copy file from the extern filesystem into this filesystem (incp -r copies the whole host directory)
 
-	param blocks ... data blocks
-	param count ... count of blocks
-	return 0 = unsorted, 1 = sorted
+	param files ... source file (+path) and destination directory (+path)
 */
-int is_sorted(int32_t *blocks, int count) {
-	int i;
+void incp(char *files) {
+	int compress;		// If the file should be compressed
+	int recursive;
+	char *source, *dest, *name;
+	directory *dir; 
+	struct stat info;
 	
-	for (i = 1; i < count; i++) {
-		if (blocks[i - 1] != (blocks[i] - 1)) {
-			return 0;	
-		}
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
 	}
-	return 1;
+	
+	compress = (sb->features & FEATURE_COMPRESS);
+	if (!files || files == "") { // No arguments
+		reply(FNF);
+		return;
+	}
+	recursive = (strncmp(files, "-r ", 3) == 0);
+	source = strtok_r(recursive ? files + 3 : files, " ", &tokens);	// Get source
+	if (source && strcmp("-z", source) == 0) {	// Compress this file
+		compress = 1;
+		source = strtok_r(NULL, " ", &tokens);
+	}
+	dest = strtok_r(NULL, "\n", &tokens);		// Get destination
+	if (!source || !dest || dest == "") {
+		reply(PNF);
+		return;
+	}
+	
+	// Get name of the source file
+	if ((name = strrchr(source, '/')) == NULL) {
+		name = source;
+	}
+	else {
+		name++;
+	}
+	
+	// Find destination directory
+	dir = find_directory(dest);
+	if (!dir) {
+		reply(PNF);
+		return;
+	}
+	
+	// Directory is imported as a whole (a file is copied as without -r)
+	if (recursive && stat(source, &info) == 0 && S_ISDIR(info.st_mode)) {
+		import_directory(source, dir, compress);
+		return;
+	}
+	import_file(source, name, dir, compress);
 }
 
 
-/*	Create a data info for the specific data block
+/*	Copy one host file into the directory
 
-	param nodeid ... i-node id to which belongs this data block
-	param ref_addr ... address where is stored number of this data block (in i-node)
-	param indir_block ... number of data block which is indirect reference
-	param order_in_block ... if this data block is stored in the indirect reference -> order in that block
-	return info about this data block
-*/ 
-data_info *create_data_info(int32_t nodeid, int32_t *ref_addr, int32_t indir_block, int32_t order_in_block) {
-	data_info *block = (data_info *)malloc(sizeof(data_info));
-	block->nodeid = nodeid;
-	block->ref_addr = ref_addr;
-	block->indir_block = indir_block;
-	block->order_in_block = order_in_block;
+	param source ... path of the host file
+	param name ... name of the new file
+	param dir ... destination directory
+	param compress ... if the file should be compressed
+*/
+void import_file(char *source, char *name, directory *dir, int compress) {
+	int tmp;
+	host_file file;
+	job_list list = {NULL, 0, 0};	// Writes of runs of data blocks
+	FILE *f;
+	
+	// Test if destination folder doesn't contain file with the same name
+	pthread_mutex_lock(&(dir->lock));
+	tmp = test_existence(dir, name);
+	pthread_mutex_unlock(&(dir->lock));
+	if (tmp) {
+		reply(EXIST);
+		return;
+	}
+	
+	if (!(f = fopen(source, "rb"))) {
+		reply(FNF);
+		return;
+	}
+	
+	// Get size of the copied file
+	fseek(f, 0, SEEK_END);
+	file.size = ftell(f);
+	fclose(f);
+	
+	if (file.size > MAX_SIZE) {
+		reply(TL);
+		return;
+	}
+	file.path = source;
+	load_host_file(&file, compress);
+	if (!file.data) {
+		reply(FNF);
+		return;
+	}
+	
+	// The same name may have been added by another session meanwhile
+	pthread_mutex_lock(&(dir->lock));
+	if (test_existence(dir, name)) {
+		pthread_mutex_unlock(&(dir->lock));
+		reply(EXIST);
+		free(file.data);
+		return;
+	}
+	if (store_host_file(dir, name, &file, NULL, &list)) {
+		pthread_mutex_unlock(&(dir->lock));
+		reply(NES);
+		free(file.data);
+		return;
+	}
+	run_jobs(list.jobs, list.count);
+	pthread_mutex_unlock(&(dir->lock));	// The file is complete now
 	
-	return block;
+	free(list.jobs);
+	free(file.data);
+	reply(OK);
 }
 
 
-/*	Create an array of information for every full data block
+/*	Read the whole host file into the memory (padded by zeros to whole data blocks), the file is compressed
+	if it saves some space (flag of the compressed file needs the extended i-node)
 
-	param count_of_full_blocks ... count of used data blocks
-	return array of information
+	param file ... host file with its path and size, data are NULL if the file cannot be read
+	param compress ... if the file should be compressed
 */
-data_info **map_data_blocks(int *count_of_full_blocks) {
-	int i, j;
-	int32_t number;
-	data_info **blocks = (data_info **)malloc(sizeof(data_info *) * sb->data_cluster_count);
-	for (i = 0; i < sb->data_cluster_count; i++) {
-		blocks[i] = NULL;
-	}
+void load_host_file(host_file *file, int compress) {
+	int32_t block_count = (file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	char *data, *stream;
+	FILE *f = fopen(file->path, "rb");
+	
+	file->data = NULL;
+	file->compressed = 0;
+	file->stored_size = file->size;
+	if (!f)
+		return;
+	data = (char *)calloc(block_count > 0 ? block_count : 1, CLUSTER_SIZE);
+	fread(data, sizeof(char), file->size, f);
+	fclose(f);
 	
-	for (i = 0; i < sb->inode_count; i++) {
-		if (inodes[i].nodeid == FREE)
-			continue;
-			
-		if (inodes[i].direct1 != FREE) {
-			blocks[inodes[i].direct1] = create_data_info(inodes[i].nodeid, &(inodes[i].direct1), 0, 0);
-			(*count_of_full_blocks)++;
-		}
-		if (inodes[i].direct2 != FREE) {
-			blocks[inodes[i].direct2] = create_data_info(inodes[i].nodeid, &(inodes[i].direct2), 0, 0);
-			(*count_of_full_blocks)++;
-		}
-		if (inodes[i].direct3 != FREE) {
-			blocks[inodes[i].direct3] = create_data_info(inodes[i].nodeid, &(inodes[i].direct3), 0, 0);
-			(*count_of_full_blocks)++;
-		}
-		if (inodes[i].direct4 != FREE) {
-			blocks[inodes[i].direct4] = create_data_info(inodes[i].nodeid, &(inodes[i].direct4), 0, 0);
-			(*count_of_full_blocks)++;
-		}
-		if (inodes[i].direct5 != FREE) {
-			blocks[inodes[i].direct5] = create_data_info(inodes[i].nodeid, &(inodes[i].direct5), 0, 0);
-			(*count_of_full_blocks)++;
-		}
-		if (inodes[i].indirect1 != FREE) {
-			blocks[inodes[i].indirect1] = create_data_info(inodes[i].nodeid, &(inodes[i].indirect1), inodes[i].indirect1, 0);
-			(*count_of_full_blocks)++;
-			fseek(fs, sb->data_start_address + inodes[i].indirect1 * CLUSTER_SIZE, SEEK_SET);
-			for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
-				fread(&number, sizeof(int32_t), 1, fs);
-				if (number > 0) {
-					blocks[number] = create_data_info(inodes[i].nodeid, NULL, inodes[i].indirect1, j);
-					(*count_of_full_blocks)++;
-				}
-			}
+	// Small file is stored inline in the i-node, it is not compressed
+	if (compress && (sb->inode_size > INODE_SIZE) && !((inline_capacity > 0) && (file->size <= inline_capacity))) {
+		stream = compress_data(data, file->size, &file->stored_size);
+		if (stream) {
+			free(data);
+			data = stream;
+			file->compressed = 1;
 		}
-		if (inodes[i].indirect2 != FREE) {
-			blocks[inodes[i].indirect2] = create_data_info(inodes[i].nodeid, &(inodes[i].indirect2), inodes[i].indirect2, 0);
-			(*count_of_full_blocks)++;
-			fseek(fs, sb->data_start_address + inodes[i].indirect2 * CLUSTER_SIZE, SEEK_SET);
-			for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
-				fread(&number, sizeof(int32_t), 1, fs);
-				if (number > 0) {
-					blocks[number] = create_data_info(inodes[i].nodeid, NULL, inodes[i].indirect2, j);
-					(*count_of_full_blocks)++;
-				}
-			}
+		else {	// Data are not compressible -> store them raw
+			file->stored_size = file->size;
 		}
 	}
-	
-	fflush(fs);
-	return blocks;
+	file->data = data;
 }
 
 
-/*	Switch two data blocks
+/*	Store the host file loaded in the memory into the directory, the caller holds the lock of the directory,
+	tested that the name is free and runs the writes of data blocks
 
-	param from ... number of the first data block
-	param to ... number of the second data block
-	param info_blocks ... array of information of all data blocks
-*/ 
-void switch_blocks(int from, int to, data_info **info_blocks) {
-	int i;
-	int32_t number;
-	data_info *tmp;
-	char tmp_buffer[CLUSTER_SIZE];
-
-	// Update source (from) i-node
-	if (info_blocks[from]->ref_addr != NULL) {
-		if (info_blocks[from]->indir_block > 0) {		// indirect reference -> change data block number to all blocks in this indirect reference
-			fseek(fs, sb->data_start_address + info_blocks[from]->indir_block * CLUSTER_SIZE, SEEK_SET);
-			for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
-				fread(&number, sizeof(int32_t), 1, fs);
-				if (number > 0) {
-					info_blocks[number]->indir_block = to;
-				}
-			}
-			fflush(fs);
-			info_blocks[from]->indir_block = to;
+	param dir ... destination directory
+	param name ... name of the new file
+	param file ... loaded host file
+	param blocks ... data blocks reserved for the file (in the bitmap), NULL = find free blocks
+	param list ... list to append writes of data blocks (they refer to the data of the file)
+	return 0 = no error, -1 = not enough space
+*/
+int store_host_file(directory *dir, char *name, host_file *file, int32_t *blocks, job_list *list) {
+	int32_t *dest_blocks = blocks, inode_id;
+	int i, block_count, rest, tmp_count, tmp, last_block_index;
+	int32_t *candidates;	// Data blocks which can be shared with this file
+	int8_t *new_blocks = NULL;	// Data blocks which have to be written (not shared)
+	directory_item **pitem;
+	
+	// Small file is stored inline in the i-node, no data blocks are needed
+	if ((inline_capacity > 0) && (file->size <= inline_capacity)) {
+		pthread_mutex_lock(&alloc_lock);
+		inode_id = find_free_inode();
+		if (inode_id == ERROR) {
+			pthread_mutex_unlock(&alloc_lock);
+			return ERROR;
 		}
-		*(info_blocks[from]->ref_addr) = to; 
+		inode_ids[inode_id] = inode_id;
+		pthread_mutex_unlock(&alloc_lock);
 		
-	}
-	else {	// is in the data block of indirect reference	
-		fseek(fs, sb->data_start_address + info_blocks[from]->indir_block * CLUSTER_SIZE + info_blocks[from]->order_in_block * sizeof(int32_t), SEEK_SET);
-		fwrite(&to, sizeof(int32_t), 1, fs);
-		fflush(fs);
+		pitem = &(dir->file);
+		while (*pitem != NULL) {
+			pitem = &((*pitem)->next);
+		}
+		*pitem = create_directory_item(inode_id, name);
+		
+		inode_dirs[inode_id] = 0;
+		inodes[inode_id].references = 1;
+		inode_sizes[inode_id] = file->size;
+		inodes[inode_id].flags = INODE_INLINE;
+		memset(INLINE_DATA(inode_id), 0, inline_capacity);
+		memcpy(INLINE_DATA(inode_id), file->data, file->size);
+		
+		update_inode(inode_id);
+		update_directory(dir, *pitem, 1);
+		update_sizes(dir, file->size);
+		return NO_ERROR;
 	}
 	
-	if (info_blocks[to] == NULL) { // Destination data block is free -> one directional move
-		// Update bitmap
-		bitmap[from] = 0;
-		bitmap[to] = 1;
-		
-		memset(tmp_buffer, 0, sizeof(tmp_buffer));
-		
-		info_blocks[to] = info_blocks[from];
-		info_blocks[from] = NULL;
-	}
-	else  {	// Exchange of data blocks
-		
-		// Update destination (to) i-node
-		if (info_blocks[to]->ref_addr != NULL) {
-			if (info_blocks[to]->indir_block > 0) {		// indirect reference -> change data block number to all blocks in this indirect reference
-				fseek(fs, sb->data_start_address + *(info_blocks[to]->ref_addr) * CLUSTER_SIZE, SEEK_SET);
-				for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
-					fread(&number, sizeof(int32_t), 1, fs);
-					if (number > 0) {
-						info_blocks[number]->indir_block = from;
-					}
-				}
-				fflush(fs);
-				info_blocks[to]->indir_block = from;
-			}
-			*(info_blocks[to]->ref_addr) = from; 
+	block_count = file->stored_size / CLUSTER_SIZE;
+	rest = file->stored_size % CLUSTER_SIZE;
+	
+	if (rest != 0)
+		block_count++;
+	tmp_count = count_with_indirect(block_count);
+	
+	pthread_mutex_lock(&alloc_lock);
+	if (!blocks) {
+		if (sb->features & FEATURE_DEDUP) {	// Share identical data blocks, only the other blocks are allocated
+			new_blocks = (int8_t *)malloc(block_count);
+			candidates = find_duplicates(file->data, block_count);
+			dest_blocks = allocate_shared_blocks(candidates, block_count, tmp_count, new_blocks);
+			free(candidates);
 		}
-		else {		
-			fseek(fs, sb->data_start_address + info_blocks[to]->indir_block * CLUSTER_SIZE + info_blocks[to]->order_in_block * sizeof(int32_t), SEEK_SET);
-			fwrite(&from, sizeof(int32_t), 1, fs);
-			fflush(fs);
+		else {
+			dest_blocks = find_free_data_blocks(tmp_count);
 		}
-							
-		//Copy: to -> tmp_buffer
-		fseek(fs, sb->data_start_address + to * CLUSTER_SIZE, SEEK_SET);
-		fread(tmp_buffer, sizeof(tmp_buffer), 1, fs);
-		
-		tmp = info_blocks[to];
-		info_blocks[to] = info_blocks[from];
-		info_blocks[from] = tmp;
 	}
-	
-							// Copy blocks
-	// from -> block_buffer
-	fseek(fs, sb->data_start_address + from * CLUSTER_SIZE, SEEK_SET);
-	fread(block_buffer, sizeof(block_buffer), 1, fs);
-	// block_buffer -> to
-	fseek(fs, sb->data_start_address + to * CLUSTER_SIZE, SEEK_SET);
-	fflush(fs);
-	fwrite(block_buffer, sizeof(block_buffer), 1, fs);
-	// tmp_buffer -> from
-	fseek(fs, sb->data_start_address + from * CLUSTER_SIZE, SEEK_SET);
-	fwrite(tmp_buffer, sizeof(tmp_buffer), 1, fs);
-	fflush(fs);
-}
-
-
-/*	Validate entered size of the filesystem
-	and convert it into bytes
-	
-	param size ... size of the filesystem as the string
-	return ... size of the filesystem in bytes
-*/
-int32_t get_size(char *size) {
-	char *units = NULL;
-	long number;
-	
-	if (!size || size == "") {
-		printf(CCF);
+	if (!dest_blocks) {
+		pthread_mutex_unlock(&alloc_lock);
+		free(new_blocks);
 		return ERROR;
 	}
 	
-	number = strtol(size, &units, 0);	// Convert to number
-	
-	if (number == 0 || errno != 0) {
-		printf(CCF);
+	// Get ID of a free i-node
+	inode_id = find_free_inode();
+	if (inode_id == ERROR) {
+		pthread_mutex_unlock(&alloc_lock);
+		free(new_blocks);
+		if (!blocks)
+			free(dest_blocks);
 		return ERROR;
 	}
 	
-	if (strncmp("KB", units, 2) == 0) {			// Kilobytes
-		number *= 1000;
+	pitem = &(dir->file);
+	while (*pitem != NULL) {
+		pitem = &((*pitem)->next);
 	}
-	else if (strncmp("MB", units, 2) == 0) {	// Megabytes
-		number *= 1000000;
+	*pitem = create_directory_item(inode_id, name);
+
+	// Initialize i-node
+	initialize_inode(inode_id, file->size, block_count, tmp_count, &last_block_index, dest_blocks);
+	if (file->compressed) {
+		inodes[inode_id].flags = INODE_COMPRESSED;
 	}
-	else if (strncmp("GB", units, 2) == 0) {	// Gigabytes
-		number *= 1000000000;
+
+	if (new_blocks) {	// Shared data blocks get one more reference, bitmap is updated only for indirect blocks
+		reference_shared_blocks(file->data, dest_blocks, block_count, new_blocks);
+		update_bitmap(*pitem, 1, dest_blocks, 0);
 	}
-	
-	if (number < MIN_FS_SIZE) {			// If the size is not enough large 
-		printf(CCF);
-		return ERROR;
+	else {
+		update_bitmap(*pitem, 1, dest_blocks, block_count);
 	}
-	else if (number > INT_MAX) {	// If the size is too large
-		printf(CCF);
-		return ERROR;
+	if (blocks) {	// Reserved blocks not used by the i-node (file of 5 blocks) are free again
+		release_reserved(blocks + block_count, tmp_count - block_count, inode_id);
 	}
+	pthread_mutex_unlock(&alloc_lock);
+	update_inode(inode_id);
+	update_directory(dir, *pitem, 1);
+	update_sizes(dir, file->size);
 	
-	return (int32_t)number;
-}
-
-
-/*	Find a free i-node
+	// Runs of consecutive data blocks are written at once by the worker pool
+	for (i = 0; i < block_count - 1; i++) {
+		if (!new_blocks || new_blocks[i])	// Shared data block is already stored
+			add_job(list, JOB_WRITE, FREE, dest_blocks[i], CLUSTER_SIZE, file->data + i * CLUSTER_SIZE);
+	}
 	
-	return ... i-node ID or -1 if no i-node is free
-*/
-int32_t find_free_inode() {
-	int i;
+	if (rest != 0)
+		tmp = rest;
+	else 
+		tmp = CLUSTER_SIZE;
 	
-	for (i = 1; i < sb->inode_count; i++) {	// Finding a free i-node
-		if (inodes[i].nodeid == FREE) {
-			return i;
-		}
+	if (block_count > 0 && (!new_blocks || new_blocks[block_count - 1])) {	// Empty file has no data blocks
+		add_job(list, JOB_WRITE, FREE, dest_blocks[last_block_index], tmp, file->data + (block_count - 1) * CLUSTER_SIZE);
 	}
-	return ERROR;
+	
+	if (!blocks)
+		free(dest_blocks);
+	free(new_blocks);
+	return NO_ERROR;
 }
 
 
-/* 	Find free data blocks in bitmap	
+/*	Copy the host directory with all its files and subdirectories (incp -r). The command is exclusive and runs
+	as a pipeline - threads walk the host directories in parallel, then they read (and compress) host files
+	in parallel ahead of this thread which places the files one by one and submits their data to the worker pool
+	in large writes. The whole import is one batch (metadata are stored once at the end), without dedup
+	and compression data blocks of all files are found at once, so files follow each other in the image.
 
-	param count ... count of data blocks
-	return array of free data blocks or NULL if not enough blocks found
+	param source ... path of the host directory
+	param dest_dir ... destination directory
+	param compress ... if files should be compressed
 */
-int32_t *find_free_data_blocks(int count) {
-	int i, j = 0;
-	int32_t *blocks = (int32_t *)malloc(sizeof(int32_t) * count);
+void import_directory(char *source, directory *dest_dir, int compress) {
+	char *name;
+	int i, total = 0, used = 0, flushed = 0, threads = 0, result = NO_ERROR;
+	long pending = 0;				// Bytes of data which wait for the write
+	int32_t *reserved = NULL;		// Data blocks of all files in the order of the walk
+	pthread_t readers[IMPORT_THREADS];
+	host_file *file;
+	job_list list = {NULL, 0, 0};
+	
+	// Name of the directory is the last part of the path
+	for (i = strlen(source) - 1; i > 0 && source[i] == '/'; i--) {
+		source[i] = '\0';
+	}
+	name = strrchr(source, '/') ? strrchr(source, '/') + 1 : source;
+	if (test_existence(dest_dir, name)) {
+		reply(EXIST);
+		return;
+	}
 	
-	// Try to find consecutive blocks
-	for (i = 1; i < sb->data_cluster_count; i++) {
-		if (bitmap[i] == 0) {
-			if ((j != 0) && (blocks[j - 1] != (i - 1))) {
-				j = 0;
-				i--;
+	// Walk host directories, every directory adds its items at once (so items of one directory follow each other)
+	import_capacity = 64;
+	import_files = (host_file *)malloc(sizeof(host_file) * import_capacity);
+	memset(&import_files[0], 0, sizeof(host_file));
+	import_files[0].path = strdup(source);
+	import_files[0].size = HOST_DIRECTORY;
+	import_files[0].parent = FREE;
+	import_files[0].ready = 1;
+	import_count = 1;
+	import_walked = 0;
+	import_busy = 0;
+	for (i = 0; i < IMPORT_THREADS; i++) {
+		if (pthread_create(&readers[threads], NULL, walk_host_directories, NULL) == 0)
+			threads++;
+	}
+	if (threads == 0)	// Threads are not available -> walk here
+		walk_host_directories(NULL);
+	for (i = 0; i < threads; i++) {
+		pthread_join(readers[i], NULL);
+	}
+	
+	// Data blocks of all files are reserved at once (in the memory only), directories take other blocks.
+	// Size of compressed files is not known before they are read, with dedup every file looks for its shared blocks.
+	import_compress = compress;
+	if (!(sb->features & FEATURE_DEDUP) && !(compress && (sb->inode_size > INODE_SIZE))) {
+		for (i = 0; i < import_count; i++) {
+			total += reserved_blocks(&import_files[i]);
+		}
+		reserved = find_free_data_blocks(total);
+		if (!reserved) {
+			free_host_files(import_files, import_count);
+			reply(NES);
+			return;
+		}
+		for (i = 0; i < total; i++) {
+			bitmap[reserved[i]] = 1;
+		}
+	}
+	
+	// Readers load files in the order of the walk
+	import_next = 0;
+	import_placed = 0;
+	import_buffered = 0;
+	import_stop = 0;
+	for (i = 0, threads = 0; i < IMPORT_THREADS; i++) {
+		if (pthread_create(&readers[threads], NULL, read_host_files, NULL) == 0)
+			threads++;
+	}
+	
+	batch_running++;
+	for (i = 0; i < import_count && result == NO_ERROR; i++) {
+		file = &import_files[i];
+		if (threads == 0 && !file->ready) {		// Threads are not available -> read here
+			load_host_file(file, compress);
+			file->ready = 1;
+		}
+		
+		// Data of placed files are written while the next file is being read
+		pthread_mutex_lock(&import_lock);
+		import_placed = i;
+		pthread_cond_broadcast(&import_cond);
+		while (!file->ready) {
+			if (list.count > 0) {
+				pthread_mutex_unlock(&import_lock);
+				flush_imported(&list, flushed, i);
+				flushed = i;
+				pending = 0;
+				pthread_mutex_lock(&import_lock);
 				continue;
 			}
-			blocks[j++] = i;
-			if (j == count) {
-				return blocks;
-			}
+			pthread_cond_wait(&import_cond, &import_lock);
+		}
+		pthread_mutex_unlock(&import_lock);
+		
+		result = place_host_file(file, dest_dir, reserved ? reserved + used : NULL, &list);
+		if (result == NO_ERROR && reserved)
+			used += reserved_blocks(file);
+		if (file->size > 0)
+			pending += file->size;
+		if (pending >= IMPORT_WINDOW) {
+			flush_imported(&list, flushed, i + 1);
+			flushed = i + 1;
+			pending = 0;
 		}
 	}
 	
-	j = 0;
-	// If blocks are not consecutive
-	for (i = 1; i < sb->data_cluster_count; i++) {
-		if (bitmap[i] == 0) {
-			blocks[j] = i;
-			j++;
-			if (j == count)
-				return blocks;
-		}
+	// Readers stop after an error
+	pthread_mutex_lock(&import_lock);
+	import_stop = 1;
+	pthread_cond_broadcast(&import_cond);
+	pthread_mutex_unlock(&import_lock);
+	for (i = 0; i < threads; i++) {
+		pthread_join(readers[i], NULL);
 	}
-	free(blocks);
-	return NULL;
+	flush_imported(&list, flushed, import_count);
+	
+	// Blocks of files which were not imported (error) are released before the bitmap is stored
+	if (reserved) {
+		release_reserved(reserved + used, total - used, FREE);
+	}
+	if (--batch_running == 0)
+		commit_metadata();
+	
+	free_host_files(import_files, import_count);
+	free(reserved);
+	free(list.jobs);
+	reply(result ? NES : OK);
 }
 
 
-/*	Get numbers of all data blocks of the particular item
+/*	Walk host directories of the import (thread of incp -r), items of every directory are added to the end
+	of the list of imported files. The thread ends when no directory is left and no other thread walks.
 
-	param item ... item from which we get data blocks
-	param block_count ... address to store count of data blocks
-	param rest ... address to store rest size of the last data block (only with file)
-	return array of numbers of data blocks
+	param arg ... unused
+	return NULL
 */
-int32_t *get_data_blocks(int32_t nodeid, int *block_count, int *rest) {
-	int32_t *blocks, number;
-	int i, tmp, counter;
-	int max_numbers = 517;	// Maximum data blocks 
-	inode *node = &inodes[nodeid];
-	
-	if (node->isDirectory) {	// If item is directory
-		counter = 0;
-		blocks = (int32_t *)malloc(sizeof(int32_t) * max_numbers);
-		
-		if (node->direct1 != FREE) {
-			blocks[counter++] = node->direct1;
+void *walk_host_directories(void *arg) {
+	int index, count, capacity;
+	char *path;
+	host_file *found;		// Items of the walked directory
+	DIR *d;
+	struct dirent *entry;
+	struct stat info;
+	
+	pthread_mutex_lock(&import_lock);
+	while (1) {
+		while (import_walked < import_count && import_files[import_walked].size != HOST_DIRECTORY) {
+			import_walked++;
 		}
-		if (node->direct2 != FREE) {
-			blocks[counter++] = node->direct2;
+		if (import_walked == import_count) {
+			if (import_busy == 0)	// Nobody can find another directory
+				break;
+			pthread_cond_wait(&import_cond, &import_lock);
+			continue;
 		}
-		if (node->direct3 != FREE) {
-			blocks[counter++] = node->direct3;
-		}	
-		if (node->direct4 != FREE) {
-			blocks[counter++] = node->direct4;
-		}	
-		if (node->direct5 != FREE) {
-			blocks[counter++] = node->direct5;
-		}	
-		if (node->indirect1 != FREE) {
-			fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
-			for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
-				fread(&number, sizeof(int32_t), 1, fs);
-				if (number > 0) {
-					blocks[counter++] = number;
+		index = import_walked++;
+		path = import_files[index].path;	// Path is not moved by the growth of the list
+		import_busy++;
+		pthread_mutex_unlock(&import_lock);
+		
+		count = 0;
+		capacity = 16;
+		found = (host_file *)malloc(sizeof(host_file) * capacity);
+		if ((d = opendir(path)) != NULL) {
+			while ((entry = readdir(d)) != NULL) {
+				if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+					continue;
+				if (count == capacity) {
+					capacity *= 2;
+					found = (host_file *)realloc(found, sizeof(host_file) * capacity);
 				}
-			}
-		}
-		if (node->indirect2 != FREE) {
-			fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
-			for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
-				fread(&number, sizeof(int32_t), 1, fs);
-				if (number > 0) {
-					blocks[counter++] = number;
+				memset(&found[count], 0, sizeof(host_file));
+				found[count].path = (char *)malloc(strlen(path) + strlen(entry->d_name) + 2);
+				sprintf(found[count].path, "%s/%s", path, entry->d_name);
+				
+				// Links and special files are not imported
+				if (lstat(found[count].path, &info) || !(S_ISDIR(info.st_mode) || S_ISREG(info.st_mode))) {
+					free(found[count].path);
+					continue;
 				}
-			}			
+				if (S_ISDIR(info.st_mode)) {
+					found[count].size = HOST_DIRECTORY;
+					found[count].ready = 1;		// Directory is not read
+				}
+				else {
+					found[count].size = (info.st_size > MAX_SIZE) ? MAX_SIZE + 1 : (int32_t)info.st_size;
+				}
+				found[count++].parent = index;
+			}
+			closedir(d);
 		}
+		qsort(found, count, sizeof(host_file), compare_host_files);
 		
-		*block_count = counter;
-	}
-	else {	// If item is file
-		*block_count = node->file_size / CLUSTER_SIZE;
-		*rest = node->file_size % CLUSTER_SIZE;
-		if (*rest != 0)
-			(*block_count)++;
-		
-		blocks = (int32_t *)malloc(sizeof(int32_t) * (*block_count));
-		
-		blocks[0] = node->direct1;
-		if (*block_count > 1) {
-			blocks[1] = node->direct2;
-			if (*block_count > 2) {
-				blocks[2] = node->direct3;
-				if (*block_count > 3) {
-					blocks[3] = node->direct4;
-					if (*block_count > 4) {
-						blocks[4] = node->direct5;
-						if (*block_count > 5) {
-							if (*block_count > 261) {	// Both indirect references are used
-								// Read all data blocks of indirect1
-								fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
-								fread(&blocks[5], sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
-								
-								// Read the rest of indirect2
-								tmp = *block_count - 261;
-								fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
-								fread(&blocks[261], sizeof(int32_t), tmp, fs);
-							}
-							else {	// Only first indirect reference is used
-								tmp = *block_count - 5;
-								fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
-								fread(&blocks[5], sizeof(int32_t), tmp, fs);
-							}
-						}
-					}
-				}
+		pthread_mutex_lock(&import_lock);
+		if (import_count + count > import_capacity) {
+			while (import_count + count > import_capacity) {
+				import_capacity *= 2;
 			}
+			import_files = (host_file *)realloc(import_files, sizeof(host_file) * import_capacity);
 		}
+		memcpy(import_files + import_count, found, sizeof(host_file) * count);
+		import_count += count;
+		import_busy--;
+		pthread_cond_broadcast(&import_cond);
+		free(found);
 	}
-	fflush(fs);
-	return blocks;
+	pthread_mutex_unlock(&import_lock);
+	return NULL;
 }
 
 
-/* 	Find particular item with the specific name in a list of items starting with first_item
+/*	Read host files of the import in the order of the walk (thread of incp -r). Threads stop reading ahead
+	when IMPORT_MEMORY bytes are loaded, only the file which is placed next is read anyway.
 
-	param first_item ... first item in the list of items (directories or files)
-	param name ... name of the finding item
-	return founded item or NULL
+	param arg ... unused
+	return NULL
 */
-directory_item *find_item(directory_item *first_item, char *name) {
-	directory_item *item = first_item;
+void *read_host_files(void *arg) {
+	host_file *file;
 	
-	while (item != NULL) {
-		if (strcmp(name, item->item_name) == 0) {
-			return item;
+	pthread_mutex_lock(&import_lock);
+	while (!import_stop) {
+		while (import_next < import_count && import_files[import_next].ready) {		// Directories
+			import_next++;
 		}
-		item = item->next;
+		if (import_next == import_count)
+			break;
+		if (import_next != import_placed && import_buffered >= IMPORT_MEMORY) {
+			pthread_cond_wait(&import_cond, &import_lock);
+			continue;
+		}
+		file = &import_files[import_next++];
+		if (file->size <= MAX_SIZE)
+			import_buffered += file->size;
+		pthread_mutex_unlock(&import_lock);
+		
+		if (file->size <= MAX_SIZE)		// Too large file is only reported
+			load_host_file(file, import_compress);
+		
+		pthread_mutex_lock(&import_lock);
+		if (!file->data && file->size <= MAX_SIZE)
+			import_buffered -= file->size;
+		file->ready = 1;
+		pthread_cond_broadcast(&import_cond);
 	}
+	pthread_mutex_unlock(&import_lock);
 	return NULL;
 }
 
 
-/*	Parse the path of the file/directory
+/*	Create the imported directory or store the imported file in its directory, problems of single items
+	are reported and the items are skipped (with their content)
 
-	param path ... path + name of file/directory
-	param name ... address to store name of the file/directory
-	param dir ... address to store founded directory
-	return 0 = directory found, -1 = not found
+	param file ... imported item
+	param dest_dir ... destination directory of the import
+	param blocks ... data blocks reserved for the file, NULL = find free blocks
+	param list ... list to append writes of data blocks
+	return 0 = no error, -1 = not enough space
 */
-int parse_path(char *path, char **name, directory **dir) {
-	int length;				// Length of the path (without name of the new directory)
-	char buff[BUFF_SIZE];
+int place_host_file(host_file *file, directory *dest_dir, int32_t *blocks, job_list *list) {
+	char *name = strrchr(file->path, '/') ? strrchr(file->path, '/') + 1 : file->path;
+	char *problem = NULL;
+	directory *parent = (file->parent == FREE) ? dest_dir : import_files[file->parent].dir;
 	
-	if (!path || path == "") {
-		return ERROR;
+	if (!parent) {		// Parent directory was skipped
+		problem = "";
+	}
+	else if (strlen(name) > NAME_LENGTH) {
+		problem = "NAME IS TOO LONG";
+	}
+	else if (test_existence(parent, name)) {
+		problem = "EXIST";
+	}
+	else if (file->size > MAX_SIZE) {
+		problem = TL;
+	}
+	else if (file->size != HOST_DIRECTORY && !file->data) {
+		problem = "FILE NOT FOUND";
+	}
+	if (problem) {
+		if (problem[0])
+			reply("%s: %s\n", file->path, problem);
+		if (blocks)
+			release_reserved(blocks, reserved_blocks(file), FREE);
+		return NO_ERROR;
 	}
 	
-	if ((*name = strrchr(path, '/')) == NULL) {	// If path contains only directory/file name
-		*name = path;
-		*dir = working_directory;
+	if (file->size == HOST_DIRECTORY) {
+		if (create_directory(parent, name))
+			return ERROR;
+		file->dir = directories[find_item(parent->subdir, name)->inode];
+		return NO_ERROR;
 	}
-	else  {
-		// Separate the name of the directory/file from the rest of the path
-		length = strlen(path) - strlen(*name);
-		if (path[0] == '/') {					
-			if (!strchr(path + 1, '/'))	// If the path contains only root directory (and name of the creating directory)
-				length = 1;
-		}
-		
-		*name = *name + 1;
-		memset(buff, '\0', BUFF_SIZE);
-		strncpy(buff, path, length);
-		
-		// Find the directory
-		*dir = find_directory(buff);		
-		if (!(*dir)) {
-			return ERROR;
+	return store_host_file(parent, name, file, blocks, list);
+}
+
+
+/*	Write data of placed files and release their data
+
+	param list ... writes of data blocks
+	param from ... first placed file whose data are not written
+	param to ... index after the last placed file
+*/
+void flush_imported(job_list *list, int from, int to) {
+	int i;
+	long released = 0;
+	
+	run_jobs(list->jobs, list->count);
+	list->count = 0;
+	for (i = from; i < to; i++) {
+		if (import_files[i].data) {
+			free(import_files[i].data);
+			import_files[i].data = NULL;
+			released += import_files[i].size;
 		}
 	}
+	
+	pthread_mutex_lock(&import_lock);
+	import_buffered -= released;
+	pthread_cond_broadcast(&import_cond);
+	pthread_mutex_unlock(&import_lock);
+}
 
-	return NO_ERROR;
+
+/*	Count data blocks reserved for the imported file (only not compressed files stored in data blocks)
+
+	param file ... imported item
+	return count of data blocks with blocks of indirect references
+*/
+int reserved_blocks(host_file *file) {
+	if (file->size < 0 || file->size > MAX_SIZE || ((inline_capacity > 0) && (file->size <= inline_capacity)))
+		return 0;
+	return count_with_indirect((file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
 }
 
 
+/*	Release the list of imported/exported files
 
-/*	Create a new directory
+	param files ... list of files
+	param count ... count of files
+*/
+void free_host_files(host_file *files, int count) {
+	int i;
 	
-	param parent ... parent directory
-	param name ... directory name
-	return 0 = no error, -1 = error
+	for (i = 0; i < count; i++) {
+		free(files[i].path);
+		free(files[i].data);
+	}
+	free(files);
+}
+
+
+/*	Compare host files by their paths (qsort)
+
+	return order
 */
-int create_directory(directory *parent, char *name) {
-	int32_t inode_id, *data_block;
-	directory_item **temp;
+int compare_host_files(const void *a, const void *b) {
+	return strcmp(((const host_file *)a)->path, ((const host_file *)b)->path);
+}
 
-	// Get ID of a free i-node
-	inode_id = find_free_inode();
-	if (inode_id == ERROR) return ERROR;	// No free i-node
-	
-	// Get number of a free data block
-	data_block = find_free_data_blocks(1);
-	if (data_block == NULL) return ERROR; 	// No free data block
 
-	// Create directory
-	directory *newdir = (directory *)malloc(sizeof(directory));
-	newdir->parent = parent;
-	newdir->current = create_directory_item(inode_id, name);
-	newdir->file = NULL;
-	newdir->subdir = NULL;
-	
-	directories[inode_id] = newdir;
-	bitmap[data_block[0]] = 1;
+/*	Copy file from this filesystem to extern filesystem (outcp -r copies the whole directory)
+
+	param files ... source file (+path) and destination directory (+path)
+*/
+void outcp(char *files) {
+	int tmp, recursive;
+	char *source, *dest, *name;
+	char whole_dest[BUFF_SIZE];
+	directory *dir;
+	directory_item *item;
+	FILE *f;
 	
-	// Initialize i-node of a new directory
-	inodes[inode_id].nodeid = inode_id;
-	inodes[inode_id].isDirectory = 1;
-	inodes[inode_id].references = 1;
-	inodes[inode_id].file_size = 0;
-	inodes[inode_id].direct1 = data_block[0];
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
 	
+	if (!files || files == "") { // No arguments
+		reply(FNF);
+		return;
+	}
+	recursive = (strncmp(files, "-r ", 3) == 0);
+	source = strtok_r(recursive ? files + 3 : files, " ", &tokens);	// Get source
+	dest = strtok_r(NULL, "\n", &tokens);		// Get destination
+	if (!dest || dest == "") {
+		reply(PNF);
+		return;
+	}
+	// Parse the path + file + find the directory
+	if (parse_path(source, &name, &dir)) {
+		reply(FNF);
+		return;
+	}
+	if (recursive && (item = find_item(dir->subdir, name))) {	// Export of the directory (a file is copied as without -r)
+		export_directory(item, dest);
+		return;
+	}
 	
-	temp = &(parent->subdir);
-	while (*temp != NULL) {
-		temp = &((*temp)->next);
+	pthread_mutex_lock(&(dir->lock));
+	item = find_item(dir->file, name);
+	if (!item) {
+		pthread_mutex_unlock(&(dir->lock));
+		reply(FNF);
+		return;
 	}
+	pthread_rwlock_rdlock(&inode_locks[item->inode]);
+	pthread_mutex_unlock(&(dir->lock));
 	
-	*temp = directories[inode_id]->current;
+	// Set a whole destination (path + name)
+	memset(whole_dest, 0, BUFF_SIZE);
+	sprintf(whole_dest, "%s/%s", dest, name);
 	
-	if (update_directory(parent, newdir->current, 1)) {
-		return ERROR;	// No free data block for extending parent data blocks
+	if (!(f = fopen(whole_dest, "wb"))) {
+		pthread_rwlock_unlock(&inode_locks[item->inode]);
+		reply(PNF);
+		return;
 	}
-
-	update_inode(inode_id);
-	update_bitmap(newdir->current, 1, data_block, 1);
-	free(data_block);
 	
-	return NO_ERROR;
+	tmp = write_file(item->inode, f, 0, inode_sizes[item->inode]);
+	pthread_rwlock_unlock(&inode_locks[item->inode]);
+	fclose(f);
+	reply(tmp == BAD_CHECKSUM ? CHM : tmp == ERROR ? CCF : OK);
 }
 
 
-/* 	Create a new directory item 
+/*	Copy the directory with all its files and subdirectories to the host (outcp -r). The command is exclusive.
+	Files are exported in groups of EXPORT_MEMORY bytes sorted by their first data blocks, data blocks
+	of the group are read in the order of their numbers (runs of consecutive blocks at once), so the image
+	is read sequentially. Threads write host files of the group while the next group is read.
 
-	param inode_id ... i-node ID
-	param name ... name of the file/directory
+	param item ... exported directory
+	param dest ... host directory
 */
-directory_item *create_directory_item(int32_t inode_id, char *name) {
-	char buff[12] = {'\0'};
+void export_directory(directory_item *item, char *dest) {
+	char *path;
+	int i, j, first, end, previous = 0, block_count, rest, result, threads = 0;
+	long bytes;
+	int32_t *blocks;
+	pthread_t writers[EXPORT_THREADS];
+	host_file *file;
+	job_list plan = {NULL, 0, 0};	// Reads of data blocks in the order of files
+	job_list list = {NULL, 0, 0};	// Reads of runs of data blocks
+	struct stat info;
+	
+	if (stat(dest, &info) || !S_ISDIR(info.st_mode)) {
+		reply(PNF);
+		return;
+	}
 	
-	directory_item *dir_item = (directory_item *)malloc(sizeof(directory_item));
-
-	strncpy(buff, name, strlen(name));
-	dir_item->inode = inode_id;
-	strncpy(dir_item->item_name, buff, 12);
-	dir_item->next = NULL;
+	// Walk the directories, host directories are created meanwhile
+	export_count = 0;
+	export_capacity = 64;
+	export_files = (host_file *)malloc(sizeof(host_file) * export_capacity);
+	path = (char *)malloc(strlen(dest) + strlen(item->item_name) + 2);
+	sprintf(path, "%s/%s", dest, item->item_name);
+	collect_exported(directories[item->inode], path);
+	free(path);
+	qsort(export_files, export_count, sizeof(host_file), compare_exported);
+	
+	export_next = 0;
+	export_ready = 0;
+	export_written = 0;
+	export_done = 0;
+	for (i = 0; i < EXPORT_THREADS; i++) {
+		if (pthread_create(&writers[threads], NULL, write_host_files, NULL) == 0)
+			threads++;
+	}
+	
+	fflush(fs);		// Data blocks are read directly from the file
+	for (first = 0; first < export_count; first = end) {
+		// Only the previous group may wait for its writes
+		pthread_mutex_lock(&export_lock);
+		while (export_written < previous) {
+			pthread_cond_wait(&export_cond, &export_lock);
+		}
+		pthread_mutex_unlock(&export_lock);
+		
+		// Plan reads of data blocks of the group
+		plan.count = 0;
+		list.count = 0;
+		for (end = first, bytes = 0; end < export_count && (end == first || bytes < EXPORT_MEMORY); end++) {
+			file = &export_files[end];
+			if (inodes[file->inode].flags & INODE_INLINE) {	// Data are stored in the i-node
+				file->stored_size = file->size;
+				file->data = (char *)malloc(file->size + 1);
+				memcpy(file->data, INLINE_DATA(file->inode), file->size);
+			}
+			else {
+				blocks = get_data_blocks(file->inode, &block_count, &rest);
+				file->compressed = (inodes[file->inode].flags & INODE_COMPRESSED) ? 1 : 0;
+				file->stored_size = block_count * CLUSTER_SIZE;
+				file->data = (char *)malloc(file->stored_size + 1);
+				if ((result = verify_layout(file->inode)) != NO_ERROR)	// Numbers of data blocks cannot be trusted
+					file->ready = result;
+				for (j = 0; j < block_count; j++) {	// The target of the planned read is the index of the file
+					add_job(&plan, JOB_READ, blocks[j], end, CLUSTER_SIZE, file->data + j * CLUSTER_SIZE);
+				}
+				free(blocks);
+			}
+			bytes += file->stored_size;
+		}
+		
+		// Blocks are read in their order, runs of consecutive blocks (consecutive also in the memory) at once
+		qsort(plan.jobs, plan.count, sizeof(io_job), compare_job_sources);
+		for (j = 0; j < plan.count; j++) {
+			add_job(&list, JOB_READ, plan.jobs[j].from, FREE, plan.jobs[j].size, plan.jobs[j].data);
+		}
+		for (j = 0; j < list.count; j++) {
+			execute_job(&list.jobs[j], NULL);
+		}
+		for (j = 0; j < plan.count; j++) {		// Files with corrupted data blocks are not written
+			if ((result = verify_blocks(plan.jobs[j].from, plan.jobs[j].size / CLUSTER_SIZE, plan.jobs[j].data)) != NO_ERROR)
+				export_files[plan.jobs[j].to].ready = result;
+		}
+		
+		if (threads == 0) {		// Threads are not available -> write here
+			for (j = first; j < end; j++) {
+				result = save_host_file(&export_files[j]);
+				export_files[j].ready = (result == NO_ERROR) ? 1 : result;
+			}
+			export_written = end;
+		}
+		pthread_mutex_lock(&export_lock);
+		export_ready = end;
+		pthread_cond_broadcast(&export_cond);
+		pthread_mutex_unlock(&export_lock);
+		previous = first;
+	}
 	
-	return dir_item;
+	pthread_mutex_lock(&export_lock);
+	export_done = 1;
+	pthread_cond_broadcast(&export_cond);
+	pthread_mutex_unlock(&export_lock);
+	for (i = 0; i < threads; i++) {
+		pthread_join(writers[i], NULL);
+	}
+	
+	for (i = 0; i < export_count; i++) {
+		if (export_files[i].ready < 0)
+			reply("%s: %s", export_files[i].path, export_files[i].ready == BAD_CHECKSUM ? CHM : CCF);
+	}
+	free_host_files(export_files, export_count);
+	free(plan.jobs);
+	free(list.jobs);
+	reply(OK);
 }
 
 
-/*	Test if directory already contains item with the same name
+/*	Create the host directory and add files of the directory to the list of exported files (subdirectories
+	are walked recursively)
 
-	param dir ... directory
-	param name ... name of the testing item
-	return 1 = exist, 0 = not exist
+	param dir ... exported directory
+	param path ... path of the host directory
 */
-int test_existence(directory *dir, char *name) {
+void collect_exported(directory *dir, char *path) {
+	char *subpath;
 	directory_item *item;
 	
-	// If the file with the same name already exist 
-	item = dir->file;
-	while (item != NULL) {
-		if (strcmp(name, item->item_name) == 0) {
-			return 1;
-		}
-		item = item->next;
+	if (mkdir(path, 0777) && errno != EEXIST) {
+		reply("%s: %s", path, CCF);
+		return;
 	}
 	
-	// If the directory with the same name already exist
-	item = dir->subdir;
-	while (item != NULL) {
-		if (strcmp(name, item->item_name) == 0) {	
-			return 1;
+	for (item = dir->file; item != NULL; item = item->next) {
+		if (export_count == export_capacity) {
+			export_capacity *= 2;
+			export_files = (host_file *)realloc(export_files, sizeof(host_file) * export_capacity);
 		}
-		item = item->next;
+		memset(&export_files[export_count], 0, sizeof(host_file));
+		export_files[export_count].path = (char *)malloc(strlen(path) + strlen(item->item_name) + 2);
+		sprintf(export_files[export_count].path, "%s/%s", path, item->item_name);
+		export_files[export_count].inode = item->inode;
+		export_files[export_count++].size = inode_sizes[item->inode];
+	}
+	
+	for (item = dir->subdir; item != NULL; item = item->next) {
+		subpath = (char *)malloc(strlen(path) + strlen(item->item_name) + 2);
+		sprintf(subpath, "%s/%s", path, item->item_name);
+		collect_exported(directories[item->inode], subpath);
+		free(subpath);
 	}
-	return 0;
 }
 
 
-/*	Find an entered directory according to the path
-	
-	return ... directory or NULL if wasn't found 
+/*	Write exported files to the host in the order of the list (thread of outcp -r), files are available
+	up to export_ready. The thread ends when all files are written.
+
+	param arg ... unused
+	return NULL
 */
-directory *find_directory(char *path) {
-	int found;	// If directory was found
-	char *part;	// Part of the path
-	char *delim = "/";
-	directory *dir;
-	directory_item *item;
-	
-	if (path[0] == '/') {	// Absolute path
-		dir = directories[0];
-	}
-	else {					// Relative path
-		dir = working_directory;
+void *write_host_files(void *arg) {
+	host_file *file;
+	int result;
+	
+	pthread_mutex_lock(&export_lock);
+	while (1) {
+		while (export_next == export_ready && !export_done) {
+			pthread_cond_wait(&export_cond, &export_lock);
+		}
+		if (export_next == export_ready)
+			break;
+		file = &export_files[export_next++];
+		pthread_mutex_unlock(&export_lock);
+		
+		result = save_host_file(file);
+		file->ready = (result == NO_ERROR) ? 1 : result;
+		
+		pthread_mutex_lock(&export_lock);
+		export_written++;
+		pthread_cond_broadcast(&export_cond);
 	}
+	pthread_mutex_unlock(&export_lock);
+	return NULL;
+}
 
-	part = strtok(path, delim);
-	while (part != NULL) {
-		if (strcmp(part, ".") == 0) {	// The same directory
-			part = strtok(NULL, delim);
-			continue;
-		}
-		else if (strcmp(part, "..") == 0) {	// Go to the parent directory
-			dir = dir->parent;
-			part = strtok(NULL, delim);
-			continue;
+
+/*	Write the exported file loaded in the memory to the host (compressed file is decompressed) and release its data
+
+	param file ... exported file (ready = ERROR or BAD_CHECKSUM if its data blocks are corrupted)
+	return 0 = no error, -1 = file cannot be created or its data are corrupted, -2 = data do not match their checksums
+*/
+int save_host_file(host_file *file) {
+	int i, chunk_count, result = NO_ERROR;
+	int32_t start, end;
+	FILE *f = NULL;
+	
+	if (file->ready >= 0)
+		f = fopen(file->path, "wb");
+	
+	if (f && file->compressed) {
+		// The table of lengths and all chunks must be within the stream
+		chunk_count = (file->size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		start = chunk_count * sizeof(int32_t);
+		if (start > file->stored_size) {
+			result = ERROR;
 		}
 		else {
-			found = 0;
-			item = dir->subdir;
-			while (item != NULL) {
-				if (strcmp(part, directories[item->inode]->current->item_name) == 0) {
-					dir = directories[item->inode];
-					part = strtok(NULL, delim);
-					found = 1;
-					break;
-				}
-				item = item->next;
-			}
-			
-			if (found == 0) {	// No such directory wasn't found
-				return NULL;
+			for (i = 0, end = start; i < chunk_count && end <= file->stored_size; i++) {
+				end += ((int32_t *)file->data)[i] & ~CHUNK_RAW;
 			}
+			if (end > file->stored_size)
+				result = ERROR;
+			else
+				result = inflate_chunks(file->data, file->size, start, 0, chunk_count - 1, f, 0, file->size);
 		}
 	}
-	return dir;
+	else if (f) {
+		fwrite(file->data, sizeof(char), file->size, f);
+	}
+	
+	if (f)
+		fclose(f);
+	free(file->data);
+	file->data = NULL;
+	return f ? result : (file->ready < 0) ? file->ready : ERROR;
 }
 
 
-/*	Free allocated memory for directories */
-void free_directories(directory *root) {
-	directory_item *f, *d, *t;
-	
-	if (!root) return;
-	
-	d = root->subdir;
-	while (d != NULL) {
-		free_directories(directories[d->inode]);
-		d = d->next;
-	}
+/*	Compare exported files by their first data blocks (qsort), inline files go first
 
-	f = root->file;
-	while (f != NULL) {
-		t = f->next;
-		free(f);
-		f = t;
-	}
+	return order
+*/
+int compare_exported(const void *a, const void *b) {
+	int32_t x = ((const host_file *)a)->inode, y = ((const host_file *)b)->inode;
+	int32_t first_x = (inodes[x].flags & INODE_INLINE) ? FREE : inodes[x].direct1;
+	int32_t first_y = (inodes[y].flags & INODE_INLINE) ? FREE : inodes[y].direct1;
 	
-	free(d);
-	d = NULL;
-	free(root->current);
-	free(root);
-	root = NULL;
+	return (first_x > first_y) - (first_x < first_y);
 }
 
 
-/* Set specific i-node as free 
+/*	Compare jobs of the worker pool by their source data blocks (qsort)
 
-	param id ... i-node id
-*/ 
-void clear_inode(int id) {
-	inodes[id].nodeid = FREE;
-	inodes[id].isDirectory = 0;
-	inodes[id].references = 0;
-	inodes[id].file_size = 0;
-	inodes[id].direct1 = FREE;
-	inodes[id].direct2 = FREE;
-	inodes[id].direct3 = FREE;
-	inodes[id].direct4 = FREE;
-	inodes[id].direct5 = FREE;
-	inodes[id].indirect1 = FREE;
-	inodes[id].indirect2 = FREE;
+	return order
+*/
+int compare_job_sources(const void *a, const void *b) {
+	int32_t x = ((const io_job *)a)->from, y = ((const io_job *)b)->from;
+	
+	return (x > y) - (x < y);
 }
 
+/*	Write the content of the extern file into the file at the offset (the file is extended if needed)
 
-/*	Update size of all i-nodes on the path from the directory to root
-
-	param dir ... the directory from which we move up in hierarchy
-	param size ... adding size to originally size (can be negative if remove file)
+	param args ... file (+path), offset in bytes and extern file (+path)
 */
-void update_sizes(directory *dir, int32_t size) {
-	directory *d = dir;
-	while (d != directories[0]) {
-		inodes[d->current->inode].file_size += size;
-		update_inode(d->current->inode);
-		d = d->parent;
+void mywrite(char *args) {
+	char *file, *offset, *source;
+	int32_t value;
+	
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
 	}
 	
-	inodes[d->current->inode].file_size += size;
-	update_inode(d->current->inode);	
+	file = args ? strtok_r(args, " ", &tokens) : NULL;
+	offset = strtok_r(NULL, " ", &tokens);
+	source = strtok_r(NULL, "\n", &tokens);
+	if (!file || !offset || !source) {
+		reply(FNF);
+		return;
+	}
+	
+	if ((value = get_range_value(offset)) == ERROR) {
+		reply(IR);
+		return;
+	}
+	modify_file(file, value, source, 0);
 }
 
 
-/*	Print info about file/directory
+/*	Append the content of the extern file to the end of the file
 
-	param item ... file or directory
+	param args ... file (+path) and extern file (+path)
 */
-void print_info(directory_item *item) {
-	int i;
-	int32_t number; // Data block number
-	inode node = inodes[item->inode];
+void append(char *args) {
+	char *file, *source;
 	
-	printf("%s - %dB - i-node %d -", item->item_name, node.file_size, node.nodeid);
-	printf(" Dir:");
-	if (node.direct1 != FREE) {
-		printf(" %d", node.direct1);
-	}
-	if (node.direct2 != FREE) {
-		printf(" %d", node.direct2);
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
 	}
-	if (node.direct3 != FREE) {
-		printf(" %d", node.direct3);
+	
+	file = args ? strtok_r(args, " ", &tokens) : NULL;
+	source = strtok_r(NULL, "\n", &tokens);
+	if (!file || !source) {
+		reply(FNF);
+		return;
 	}
-	if (node.direct4 != FREE) {
-		printf(" %d", node.direct4);
+	modify_file(file, ERROR, source, 0);
+}
+
+
+/*	Change the size of the file (the file is extended by zeros or its end is removed)
+
+	param args ... file (+path) and the new size in bytes
+*/
+void mytruncate(char *args) {
+	char *file, *size;
+	int32_t value;
+	
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
 	}
-	if (node.direct5 != FREE) {
-		printf(" %d", node.direct5);
+	
+	file = args ? strtok_r(args, " ", &tokens) : NULL;
+	size = strtok_r(NULL, " ", &tokens);
+	if (!file || !size) {
+		reply(FNF);
+		return;
 	}
-	printf(" Indir:");
-	if (node.indirect1 != FREE) {
-		printf(" (%d)", node.indirect1);
-		fseek(fs, sb->data_start_address + node.indirect1 * CLUSTER_SIZE, SEEK_SET);
-		for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
-			fread(&number, sizeof(int32_t), 1, fs);
-			if (number == 0) 
-				break;
-			printf(" %d", number);
+	
+	if ((value = get_range_value(size)) == ERROR) {
+		reply(IR);
+		return;
+	}
+	modify_file(file, 0, NULL, value);
+}
+
+
+/*	Write the data into the file or change its size, only data blocks of the changed range are
+	written and only the missing data blocks are allocated (inline and compressed files are stored
+	as plain files when they no longer fit)
+
+	param file ... name of the file (+path)
+	param offset ... offset of the written data, ERROR = end of the file
+	param source ... extern file with the written data, NULL = only change the size
+	param size ... new size of the file (only without the extern file)
+*/
+void modify_file(char *file, int32_t offset, char *source, int32_t size) {
+	int32_t old_size, new_size, length = 0, id;
+	int result = NO_ERROR;
+	char *name, *data = NULL;
+	directory *dir;
+	directory_item *item;
+	FILE *f;
+	
+	if (source) {	// Load the written data
+		if (!(f = fopen(source, "rb"))) {
+			reply(FNF);
+			return;
 		}
+		fseek(f, 0, SEEK_END);
+		length = ftell(f);
+		rewind(f);
+		if (length > MAX_SIZE) {
+			reply(TL);
+			fclose(f);
+			return;
+		}
+		data = (char *)malloc(length + 1);
+		fread(data, sizeof(char), length, f);
+		fclose(f);
 	}
-	if (node.indirect2 != FREE) {
-		printf(" (%d)", node.indirect2);
-		fseek(fs, sb->data_start_address + node.indirect2 * CLUSTER_SIZE, SEEK_SET);
-		for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
-			fread(&number, sizeof(int32_t), 1, fs);
-			if (number == 0) 
-				break;
-			printf(" %d", number);
+	
+	// Parse the path + file + find the directory
+	if (parse_path(file, &name, &dir)) {
+		reply(FNF);
+		free(data);
+		return;
+	}
+	
+	pthread_mutex_lock(&(dir->lock));
+	item = find_item(dir->file, name);
+	if (!item) {
+		pthread_mutex_unlock(&(dir->lock));
+		reply(FNF);
+		free(data);
+		return;
+	}
+	id = item->inode;
+	pthread_rwlock_wrlock(&inode_locks[id]);	// Wait for readers of the file
+	
+	old_size = inode_sizes[id];
+	if (!source) {	// New part of the file is filled by zeros
+		new_size = size;
+		offset = old_size;
+		length = (size > old_size) ? size - old_size : 0;
+	}
+	else {
+		if (offset == ERROR)	// Append
+			offset = old_size;
+		if (offset > old_size) {	// Files have no holes
+			result = ERROR;
+			reply(IR);
+		}
+		new_size = (offset + length > old_size) ? offset + length : old_size;
+	}
+	
+	if (result == NO_ERROR && new_size > MAX_SIZE) {
+		result = ERROR;
+		reply(TL);
+	}
+	
+	if (result == NO_ERROR) {
+		result = change_file(dir, id, offset, data, length, new_size);
+		if (result == NO_ERROR)
+			reply(OK);
+		else
+			reply(result == ERROR ? NES : result == BAD_CHECKSUM ? CHM : CCF);
+	}
+	
+	pthread_rwlock_unlock(&inode_locks[id]);
+	pthread_mutex_unlock(&(dir->lock));
+	free(data);
+}
+
+/*	Write the data into the file and set its new size (+sizes of all directories on the path to the root),
+	the caller holds the lock of the directory and the write lock of the i-node
+
+	param dir ... directory of the file
+	param nodeid ... i-node of the file
+	param offset ... offset of the written data (at most the size of the file)
+	param data ... written data, NULL = zeros
+	param length ... count of written bytes
+	param new_size ... new size of the file (at most MAX_SIZE)
+	return 0 = no error, -1 = not enough space, 1 = corrupted data, -2 = data do not match their checksums
+*/
+int change_file(directory *dir, int32_t nodeid, int32_t offset, char *data, int32_t length, int32_t new_size) {
+	int32_t old_size = inode_sizes[nodeid];
+	int result = NO_ERROR;
+	
+	if ((inodes[nodeid].flags & INODE_INLINE) && new_size <= inline_capacity) {	// File stays in the i-node
+		if (data)
+			memcpy(INLINE_DATA(nodeid) + offset, data, length);
+		else
+			memset(INLINE_DATA(nodeid) + offset, 0, length);
+		if (new_size < old_size)
+			memset(INLINE_DATA(nodeid) + new_size, 0, old_size - new_size);
+	}
+	else if (inodes[nodeid].flags & (INODE_INLINE | INODE_COMPRESSED)) {
+		result = expand_file(nodeid, offset, data, length, new_size);
+	}
+	else {
+		result = resize_blocks(nodeid, (old_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE, (new_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+		if (result == NO_ERROR && length > 0 && write_blocks(nodeid, offset, data, length) == ERROR) {
+			resize_blocks(nodeid, (new_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE, (old_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+			result = ERROR;
 		}
 	}
-	printf("\n");
+	
+	if (result == NO_ERROR) {
+		inode_sizes[nodeid] = new_size;
+		update_inode(nodeid);
+		update_sizes(dir, new_size - old_size);
+	}
+	return result;
 }
 
 
-/* 	Print content of the file
 
-	param item ... printing file
+
+/*	Load a file with commands to perform
+
+	param file ... name of the file with commands (+path)
+	return open file
 */
-void print_file(directory_item *item) {
-	int i, tmp, block_count, rest, prev;
-	int32_t *blocks;
+FILE *load(char *file) {
+	FILE *f;
+	
+	if (!fs_formatted) {
+		print_format_msg();
+		return NULL;	
+	}
+
+	if ((f = fopen(file, "r")) == NULL) {
+		reply(FNF);
+		return NULL;
+	}
+	file_input = 1;	// Set the indicator that commands are loaded from the file
 	
-	// Get data blocks of the file
-	blocks = get_data_blocks(item->inode, &block_count, &rest); 
+	reply(OK);
+	return f;
+}
 
-	prev = blocks[0];
-	for (i = 0; i < block_count - 1; i++) {
-		if (prev != blocks[i] - 1) {
-			fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+
+/*	Run the whole script as one batch - the script is parsed at once, replies are printed at the end
+	and changed metadata (i-nodes, bitmap, hashes, superblock) are stored only once after the last command.
+	Scripts loaded by the script are a part of the batch.
+
+	param file ... name of the file with commands (+path)
+	return 1 = exit command, 0 = otherwise
+*/
+int load_batch(char *file) {
+	FILE *f, *saved = output, *buffered = NULL;
+	char *script, *text = NULL;	// Content of the script, collected replies
+	size_t text_size = 0;
+	long size;
+	int i, count, result = 0;
+	batch_command *list;
+	
+	if (!fs_formatted) {
+		print_format_msg();
+		return 0;
+	}
+	
+	if (!file || (f = fopen(file, "rb")) == NULL) {
+		reply(FNF);
+		return 0;
+	}
+	if (batch_running == MAX_BATCH_DEPTH) {
+		fclose(f);
+		reply("TOO MANY NESTED SCRIPTS\n");
+		return 0;
+	}
+	
+	// Read and parse the whole script
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	script = (char *)malloc(size + 1);
+	size = fread(script, sizeof(char), size, f);
+	script[size] = '\0';
+	fclose(f);
+	list = parse_script(script, &count);
+	
+	if (!batch_running) {	// All replies are collected in the memory
+		buffered = open_memstream(&text, &text_size);
+		if (buffered)
+			output = buffered;
+	}
+	batch_running++;
+	
+	reply(OK);
+	for (i = 0; i < count && !result; i++) {
+		reply("%s\n", list[i].line);
+		if (list[i].id == CMD_LOAD)		// Nested script
+			result = load_batch((list[i].args && strncmp(list[i].args, "-b ", 3) == 0) ? list[i].args + 3 : list[i].args);
+		else
+			result = run_command(list[i].id, list[i].args, NULL);
+	}
+	
+	if (--batch_running == 0) {
+		commit_metadata();
+		if (buffered) {
+			fclose(buffered);
+			output = saved;
+			fwrite(text, sizeof(char), text_size, OUTPUT);
+			free(text);
 		}
-		fread(block_buffer, CLUSTER_SIZE, 1, fs);
-		printf("%s", block_buffer);
-		prev = blocks[i];
 	}
-	memset(block_buffer, 0, CLUSTER_SIZE);
-	if (rest != 0)
-		tmp = rest;
-	else 
-		tmp = CLUSTER_SIZE;
-		
-	fseek(fs, sb->data_start_address + blocks[block_count - 1] * CLUSTER_SIZE, SEEK_SET);
-	fread(block_buffer, tmp, 1, fs);
-	printf("%s", block_buffer);
 	
-	fflush(fs);
-	free(blocks);
+	free(list);
+	free(script);
+	return result;
 }
 
 
-/* Printf the message of unformatted filesystem. */
-void print_format_msg() {
-	printf("The filesystem has to be formatted first.\nUsage: format [size]\n");
+/*	Split the script into commands (the script is modified, lines end with \0)
+
+	param script ... content of the script
+	param count ... count of commands
+	return array of commands
+*/
+batch_command *parse_script(char *script, int *count) {
+	int capacity = 1024, length;
+	char *line = script, *end, *name;
+	batch_command *list = (batch_command *)malloc(sizeof(batch_command) * capacity);
+	
+	*count = 0;
+	while (*line != '\0') {
+		if ((end = strchr(line, '\n')) != NULL)
+			*end = '\0';
+		
+		name = line + strspn(line, " ");
+		length = strcspn(name, " ");
+		if (length > 0) {	// Skip an empty line
+			if (*count == capacity) {
+				capacity *= 2;
+				list = (batch_command *)realloc(list, sizeof(batch_command) * capacity);
+			}
+			list[*count].id = find_command(name, length);
+			list[*count].line = line;
+			list[*count].args = (name[length] == ' ' && name[length + 1] != '\0') ? name + length + 1 : NULL;
+			(*count)++;
+		}
+		
+		if (!end)
+			break;
+		line = end + 1;
+	}
+	return list;
 }
 
-/*	Set i-node as file and initialize all data blocks
+
+/*	Remember the i-node which has to be stored at the end of the batch
 
 	param id ... i-node ID
-	param size ... size of the file
-	param block_count ... count of data blocks occupied by file
-	param tmp_count ... block_count + blocks for indirect references
-	param last_block_index ... address of the index to the last data block of the file
-	param blocks ... data blocks
 */
-void initialize_inode(int32_t id, int32_t size, int block_count, int tmp_count, int *last_block_index, int32_t *blocks) {
-	int tmp;
-	inode *node = &inodes[id];
+void defer_inode(int32_t id) {
+	if (id < dirty_inode_first)
+		dirty_inode_first = id;
+	if (id > dirty_inode_last)
+		dirty_inode_last = id;
+}
+
+
+/*	Remember data blocks whose items of the bitmap (and hashes) have to be stored at the end of the batch
+
+	param first ... first data block
+	param last ... last data block
+*/
+void defer_blocks(int32_t first, int32_t last) {
+	if (first < dirty_block_first)
+		dirty_block_first = first;
+	if (last > dirty_block_last)
+		dirty_block_last = last;
+}
+
+
+/*	Store metadata changed by the batch (each part of the metadata is written at once) */
+void commit_metadata() {
+	int32_t i, count;
+	char *records;
 	
-	node->nodeid = id;
-	node->isDirectory = 0;
-	node->references = 1;
-	node->file_size = size;
-	node->direct1 = blocks[0];
+	if (superblock_dirty) {
+		store_superblock();
+	}
 	
-	*last_block_index = 0;
-	if (block_count > 1) {
-		node->direct2 = blocks[1];
-		*last_block_index = 1;
-		
-		if (block_count > 2) {
-			node->direct3 = blocks[2];
-			*last_block_index = 2;
-			
-			if (block_count > 3) {
-				node->direct4 = blocks[3];
-				*last_block_index = 3;
-				
-				if (block_count > 4) {
-					node->direct5 = blocks[4];
-					*last_block_index = 4;
-					
-					if (block_count > 5) {
-						node->indirect1 = blocks[tmp_count - 1];
-						
-						
-						if (block_count > 261) {
-							node->indirect2 = blocks[tmp_count - 2];
-							*last_block_index = tmp_count - 3;
-							fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
-							fwrite(&blocks[5], sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
-							
-							tmp = block_count - 261;
-							fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
-							fwrite(&blocks[261], sizeof(int32_t), tmp, fs);
-						}
-						else  {
-							*last_block_index = tmp_count - 2;
-							tmp = block_count - 5;
-							fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
-							fwrite(&blocks[5], sizeof(int32_t), tmp, fs);
-						}
-					}
-				}
-			}
+	// I-nodes (the filesystem may have been formatted to the smaller one meanwhile)
+	if (dirty_inode_last >= sb->inode_count)
+		dirty_inode_last = sb->inode_count - 1;
+	if (dirty_inode_first <= dirty_inode_last) {
+		count = dirty_inode_last - dirty_inode_first + 1;
+		records = (char *)malloc(sb->inode_size * count);
+		for (i = 0; i < count; i++) {
+			pack_inode(dirty_inode_first + i, records + i * sb->inode_size);
+		}
+		fseek(fs, sb->inode_start_address + dirty_inode_first * sb->inode_size, SEEK_SET);
+		fwrite(records, sb->inode_size, count, fs);
+		free(records);
+	}
+	
+	// Bitmap and hashes of data blocks
+	if (dirty_block_last >= sb->data_cluster_count)
+		dirty_block_last = sb->data_cluster_count - 1;
+	if (dirty_block_first <= dirty_block_last) {
+		count = dirty_block_last - dirty_block_first + 1;
+		fseek(fs, sb->bitmap_start_address + dirty_block_first, SEEK_SET);
+		fwrite(bitmap + dirty_block_first, sizeof(int8_t), count, fs);
+		if (sb->features & FEATURE_DEDUP) {
+			fseek(fs, sb->dedup_start_address + dirty_block_first * HASH_SIZE, SEEK_SET);
+			fwrite(&dedup_hashes[2 * dirty_block_first], HASH_SIZE, count, fs);
 		}
 	}
+	fflush(fs);
+	
+	dirty_inode_first = dirty_block_first = INT_MAX;
+	dirty_inode_last = dirty_block_last = -1;
+	superblock_dirty = 0;
 }
 
 
-/*	Load filesystem from the file */
-void load_fs() {
+/* 	Format existing filesystem or create a new one with a specific size
+
+	param bytes ... size of the filesystem in bytes
+	param inode_size ... size of the i-node record in bytes (INODE_SIZE or extended i-node with inline data)
+	param features ... optional features of the filesystem (FEATURE_*)
+*/
+void format(long bytes, int32_t inode_size, int32_t features) {
+	int i, one = 1;
+	uint32_t zero, *sums = NULL;
 	directory *root;
-	int i;
 	
+	init_crc32c();
 	if (!fs) {
-		fs = fopen(fs_name, "rb+");
+		fs = open_fs("wb+");
 	}
-
-	// Load superblock
-	sb = (struct superblock *)malloc(sizeof(struct superblock));
-	if (!sb) {
-		printf("Filesystem loading failed.\n");
-		return;
+	if (fs_fd < 0) {
+		fs_fd = open(fs_name, O_RDWR);
 	}
 	
-	fread(&(sb->disk_size), sizeof(int32_t), 1, fs);
-	fread(&(sb->cluster_size), sizeof(int32_t), 1, fs);
-	fread(&(sb->cluster_count), sizeof(int32_t), 1, fs);
-	fread(&(sb->inode_count), sizeof(int32_t), 1, fs);
-	fread(&(sb->bitmap_cluster_count), sizeof(int32_t), 1, fs);
-	fread(&(sb->inode_cluster_count), sizeof(int32_t), 1, fs);
-	fread(&(sb->data_cluster_count), sizeof(int32_t), 1, fs);
-	fread(&(sb->bitmap_start_address), sizeof(int32_t), 1, fs);
-	fread(&(sb->inode_start_address), sizeof(int32_t), 1, fs);
-	fread(&(sb->data_start_address), sizeof(int32_t), 1, fs);
+	// Prepare superblock
+	if (!fs_formatted) {		// If not exist -> create
+		sb = (struct superblock *)malloc(sizeof(struct superblock));
+		if (!sb) {
+			reply(CCF);
+			return;
+		}
+	}
+	
+	sb->cluster_size = CLUSTER_SIZE;											// Size of the cluster
+	sb->cluster_count = bytes / CLUSTER_SIZE; 									// Count of all clusters
+	sb->disk_size = sb->cluster_count * CLUSTER_SIZE; 							// Exact size of the filesystem in bytes
+	sb->inode_cluster_count = sb->cluster_count / 20; 							// Count of blocks for i-nodes, 5% of all blocks
+	sb->inode_size = inode_size;												// Size of the i-node record
+	sb->features = features;													// Optional features
+	sb->inode_count = (sb->inode_cluster_count * CLUSTER_SIZE) / inode_size;	// Count of i-nodes
+	sb->bitmap_start_address = CLUSTER_SIZE; 									// Initial address of bitmap blocks
+	sb->bitmap_cluster_count = ceil((sb->cluster_count - sb->inode_cluster_count - 1) / (float)CLUSTER_SIZE);	// Count of blocks for bitmap to cover all data blocks
+	sb->data_cluster_count = sb->cluster_count - 1 - sb->bitmap_cluster_count - sb->inode_cluster_count;		// Count of data blocks
+	sb->dedup_cluster_count = 0;
+	if (features & FEATURE_DEDUP) {		// Blocks for hashes of data blocks are taken from data blocks
+		sb->dedup_cluster_count = ceil(sb->data_cluster_count * HASH_SIZE / (float)(CLUSTER_SIZE + HASH_SIZE));
+		sb->data_cluster_count -= sb->dedup_cluster_count;
+	}
+	sb->checksum_cluster_count = 0;
+	if (features & FEATURE_CHECKSUM) {	// Blocks for checksums of data blocks are taken from data blocks
+		sb->checksum_cluster_count = ceil(sb->data_cluster_count * CHECKSUM_SIZE / (float)(CLUSTER_SIZE + CHECKSUM_SIZE));
+		sb->data_cluster_count -= sb->checksum_cluster_count;
+	}
+	sb->inode_start_address = sb->bitmap_start_address + CLUSTER_SIZE * sb->bitmap_cluster_count;				// Initial address of i-node blocks
+	sb->dedup_start_address = sb->inode_start_address + CLUSTER_SIZE * sb->inode_cluster_count;					// Initial address of hashes of data blocks
+	sb->checksum_start_address = sb->dedup_start_address + CLUSTER_SIZE * sb->dedup_cluster_count;			// Initial address of checksums of data blocks
+	sb->data_start_address = sb->checksum_start_address + CLUSTER_SIZE * sb->checksum_cluster_count;			// Initial address of data blocks
+	sb->defrag_cursor = 0;																						// Incremental defragmentation starts with the root
+	sb->snapshot_count = 0;																						// No snapshots
+	sb->snapshot_table = FREE;
+	
 	
 //	printf("Size: %d\nCount of clusters: %d\nCount of i-nodes: %d\nCount of bitmap blocks: %d\nCount of i-node blocks: %d\nCount of data blocks: %d\nAddress of bitmap: %d\nAddress of i-nodes: %d\nAddress of data: %d\n", 
 //	sb->disk_size, sb->cluster_count, sb->inode_count, sb->bitmap_cluster_count, sb->inode_cluster_count, sb->data_cluster_count, sb->bitmap_start_address, sb->inode_start_address, sb->data_start_address);
 	
+	if (fs_formatted) {		// If filesystem has already been formatted 
+		free(bitmap);
+		free_directories();
+		free(directories);
+		free_inodes();
+		free(inline_data);
+		inline_data = NULL;
+		free(dedup_hashes);
+		dedup_hashes = NULL;
+		free(checksums);
+		free(checksums_dirty);
+		checksums = NULL;
+		checksums_dirty = NULL;
+		pending_sum_count = 0;
+		dirty_checksum_first = INT_MAX;
+		dirty_checksum_last = -1;
+	}
+	
+	// Prepare bitmap, i-nodes and pointers to directories
+	inline_capacity = (inode_size > INODE_SIZE) ? inode_size - INODE_HEADER_SIZE : 0;
 	bitmap = (int8_t *)malloc(sb->data_cluster_count);
-	inodes = (inode *)malloc(sizeof(inode) * sb->inode_count);
+	alloc_inodes(sb->inode_count);
 	directories = (directory **)malloc(sizeof(directory *) * sb->inode_count);
-	if (!bitmap || !inodes || !directories) {
-		printf(CCF);
-		return;
+	if (inline_capacity > 0) {
+		inline_data = (char *)calloc(sb->inode_count, inline_capacity);
 	}
-	
-	// Load bitmap
-	fseek(fs, sb->bitmap_start_address, SEEK_SET);
-	fread(bitmap, sizeof(int8_t), sb->data_cluster_count, fs);
-	
-	// Load i-nodes
-	fseek(fs, sb->inode_start_address, SEEK_SET);
-	for (i = 0; i < sb->inode_count; i++) {
-		fread(&(inodes[i].nodeid), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].isDirectory), sizeof(int8_t), 1, fs);
-		fread(&(inodes[i].references), sizeof(int8_t), 1, fs);
-		fread(&(inodes[i].file_size), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].direct1), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].direct2), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].direct3), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].direct4), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].direct5), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].indirect1), sizeof(int32_t), 1, fs);
-		fread(&(inodes[i].indirect2), sizeof(int32_t), 1, fs);
+	if (features & FEATURE_DEDUP) {
+		dedup_hashes = (uint64_t *)calloc(sb->data_cluster_count, HASH_SIZE);
+	}
+	if (features & FEATURE_CHECKSUM) {
+		sums = (uint32_t *)malloc(CHECKSUM_SIZE * sb->data_cluster_count);
+		checksums_dirty = (int8_t *)calloc(sb->checksum_cluster_count, sizeof(int8_t));
+	}
+	if (!bitmap || !inodes || !directories || (inline_capacity > 0 && !inline_data) || ((features & FEATURE_DEDUP) && !dedup_hashes)
+		|| ((features & FEATURE_CHECKSUM) && (!sums || !checksums_dirty))) {
+		reply(CCF);
+		return;
 	}
+	init_locks();
 	
 	// Create root directory
-	root = (directory *)malloc(sizeof(directory));
+	root = (directory *)pool_alloc(&directory_pool);
 	if (!root) {
-		printf(CCF);
+		reply(CCF);
 		return;
 	}
 	root->current = create_directory_item(0,"/");
 	root->parent = root;
 	root->subdir = NULL;
 	root->file = NULL;
+	pthread_mutex_init(&(root->lock), NULL);
 
 	working_directory = root;	// Set root as working directory
+	reset_sessions(NULL, root);
 	directories[0] = root;
 	
-	// Load directories
-	load_directory(root, 0);
-}
-
+	bitmap[0] = 1;
 
-/*	Load all items of the directory from the file
+	// Clear bitmap (except root)
+	for (i = 1; i < sb->data_cluster_count; i++) {
+		bitmap[i] = 0;
+	}
 
-	param dir ... directory
-	param id ... directory id
-*/
-void load_directory(directory *dir, int id) {
-	int i, j, block_count, rest;
-	int inode_count = 64;	// Maximum count of i-nodes in one data block
-	int32_t *blocks;		// Numbers of data blocks
-	int32_t nodeid;			// Item id
-	char name[12];			// Item name
-	directory *newdir;
-	directory_item *item, *temp;
-	directory_item **psubdir = &(dir->subdir);	// Address of the last (free) subdirectory in the list of subdirectories
-	directory_item **pfile = &(dir->file);		// Address of the last (free) file in the list of files
+	// Set all i-nodes as free 
+	for (i = 0; i < sb->inode_count; i++) {
+		inode_ids[i] = FREE;
+		inode_dirs[i] = 0;
+		inodes[i].references = 0;
+		inode_sizes[i] = 0;
+		inodes[i].direct1 = FREE;
+		inodes[i].direct2 = FREE;
+		inodes[i].direct3 = FREE;
+		inodes[i].direct4 = FREE;
+		inodes[i].direct5 = FREE;
+		inodes[i].indirect1 = FREE;
+		inodes[i].indirect2 = FREE;
+		inodes[i].flags = 0;
+	}
 	
-	// Get data blocks of this directory
-	blocks = get_data_blocks(dir->current->inode, &block_count, NULL);
+	// Set root i-node
+	inode_ids[0] = 0;
+	inode_dirs[0] = 1;
+	inodes[0].references = 1;
+	inodes[0].direct1 = 0;
 	
-	for (i = 0; i < block_count; i++) {		// Iteration over data blocks
-		fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
-		for (j = 0; j < inode_count; j++) {	// Iteration over items in data block
-			fread(&nodeid, sizeof(int32_t), 1, fs);		// Read inode id, if id < 1 -> invalid item and skip to the next item
-			if (nodeid > 0) {
-				fread(name, sizeof(name), 1, fs);
-				item = create_directory_item(nodeid, name);
-				if (inodes[nodeid].isDirectory) {	// If item is directory
-					*psubdir = item;
-					psubdir = &(item->next);
-				}
-				else {								// If item is file
-					*pfile = item;
-					pfile = &(item->next);
-				}
-			}
-			else {
-				fseek(fs, sizeof(name), SEEK_CUR);	// Skip the place for the name of the file/directory
-			} 
-		}	
+	// Fill the file by zeros (from the start, the file may contain the previous filesystem)
+	memset(block_buffer, 0, CLUSTER_SIZE);
+	fseek(fs, 0, SEEK_SET);
+	for (i = 0; i < sb->cluster_count; i++) {
+		fwrite(block_buffer, sizeof(block_buffer), 1, fs);		
 	}
-	free(blocks);
-
-	// Recursive call this function on all loaded subdirectories
-	temp = dir->subdir;
-	while (temp != NULL) {
-		newdir = (directory *)malloc(sizeof(directory));
-		newdir->parent = dir;
-		newdir->current = temp;
-		newdir->subdir = NULL;
-		newdir->file = NULL;
-		
-		directories[temp->inode] = newdir;
-		load_directory(newdir, temp->inode);
-		
-		temp = temp->next;
+	
+	// Checksums of the cleared data blocks (writes of data blocks update them from now)
+	if (sums) {
+		zero = crc32c(0, block_buffer, CLUSTER_SIZE);
+		for (i = 0; i < sb->data_cluster_count; i++) {
+			sums[i] = zero;
+		}
+		checksums = sums;
+		mark_checksums(0, sb->data_cluster_count - 1);
+		store_checksums();
 	}
+	
+	// Store the superblock
+	store_superblock();
+	
+	// Store bitmap - data block 0 (root)
+	fseek(fs, sb->bitmap_start_address, SEEK_SET);
+	fwrite(&one, sizeof(int8_t), 1, fs);
+	
+	// Store i-nodes
+	store_inodes();
+	
+	build_dedup_index();
+	
+	fs_formatted = 1;
+	reply(OK);
 }
 
 
-/*	Update bitmap in the file according to the file/directory
+/*	Defragment filesystem - plan the new layout of all data blocks (blocks of every i-node consecutive, 
+	i-nodes in order of their IDs, no spaces between them), move the data blocks in large batches 
+	and then rewrite the metadata at once. The full defragmentation is refused while snapshots exist
+	(steps of the incremental defragmentation skip shared blocks).
 
-	param item ... file/directory
-	param value ... 1 = use data blocks, 0 = free data blocks
-	param data_blocks ... data blocks of the item or NULL (directory)
-	param b_count ... count of blocks if not NULL
+	Options:	--budget <time> ... only one step of the incremental defragmentation (e.g. 50ms, 500us, 1s)
+				--auto <time>|off ... run the incremental defragmentation while the console is idle
+	
+	param options ... options of the defragmentation (NULL = full defragmentation)
 */
-void update_bitmap(directory_item *item, int8_t value, int32_t *data_blocks, int b_count) {
-	int i, block_count, rest;
-	int32_t *blocks; 
+void defrag(char *options) {
+	int count_of_full_blocks = 0, move_count;
+	int32_t *target;			// new number of every data block, FREE = free data block
+	block_move *moves;			// sequence of moves of data blocks
+	int64_t *owners;			// owner of every data block (reverse map)
+	char *option, *value;
+	long budget, plan_memory, move_memory, phase_memory;
 	
-	if (!data_blocks) {
-		blocks = get_data_blocks(item->inode, &block_count, NULL);
-	}
-	else {
-		blocks = data_blocks;
-		block_count = b_count;
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
 	}
-	for (i = 0; i < block_count; i++) {
-		bitmap[blocks[i]] = value;
-		fseek(fs, sb->bitmap_start_address + blocks[i], SEEK_SET);
-		fwrite(&value, sizeof(int8_t), 1, fs);
+	
+	if (options) {
+		option = strtok_r(options, " ", &tokens);
+		value = strtok_r(NULL, " ", &tokens);
+		
+		if (option && strcmp("--budget", option) == 0) {
+			if ((budget = get_budget(value)) == ERROR)
+				return;
+			defrag_step(budget, 1);
+			return;
+		}
+		else if (option && strcmp("--auto", option) == 0) {
+			if (value && strcmp("off", value) == 0) {
+				idle_defrag_budget = 0;
+			}
+			else {
+				if ((budget = get_budget(value)) == ERROR)
+					return;
+				idle_defrag_budget = budget;
+			}
+			reply(OK);
+			return;
+		}
+		else if (option) {
+			reply("UNKNOWN OPTION %s\n", option);
+			return;
+		}
 	}
 
-	// Indirect references blocks
-	if (inodes[item->inode].indirect1 != FREE) {
-		bitmap[inodes[item->inode].indirect1] = value;
-		fseek(fs, sb->bitmap_start_address + inodes[item->inode].indirect1, SEEK_SET);
-		fwrite(&value, sizeof(int8_t), 1, fs);
-	}
-	if (inodes[item->inode].indirect2 != FREE) {
-			bitmap[inodes[item->inode].indirect2] = value;
-			fseek(fs, sb->bitmap_start_address + inodes[item->inode].indirect2, SEEK_SET);
-			fwrite(&value, sizeof(int8_t), 1, fs);
+	// Blocks of snapshots would have to be remapped too
+	if (sb->snapshot_count > 0) {
+		reply(HS);
+		return;
 	}
-
-	fflush(fs);
+	
+	// Plan the new layout
+	owners = map_data_blocks(&count_of_full_blocks);
+	target = plan_layout(owners, count_of_full_blocks);
+	free(owners);
+	
+	// Move the data blocks and update the metadata
+	moves = plan_moves(target, &move_count);
+	execute_moves(moves, move_count);
+	remap_metadata(target);
+	
+	free(moves);
+	free(target);
+	
+	// Peak memory of the defragmentation (reported by stats) - the reverse map, targets and sorting keys
+	// while planning, then targets and moves with the sources of moves, staging buffers or the new bitmap and hashes
+	plan_memory = (long)sb->data_cluster_count * (sizeof(int64_t) + sizeof(int32_t)) + (long)count_of_full_blocks * sizeof(block_key);
+	move_memory = (long)sb->data_cluster_count * sizeof(int32_t);
+	if (move_memory < 2L * DEFRAG_BATCH * CLUSTER_SIZE)
+		move_memory = 2L * DEFRAG_BATCH * CLUSTER_SIZE;
+	phase_memory = (long)sb->data_cluster_count * (sizeof(int8_t) + ((sb->features & FEATURE_DEDUP) ? HASH_SIZE : 0));
+	if (move_memory < phase_memory)
+		move_memory = phase_memory;
+	move_memory += (long)sb->data_cluster_count * sizeof(int32_t) + (long)(move_count + move_count / 2 + 1) * sizeof(block_move);
+	defrag_peak_memory = plan_memory > move_memory ? plan_memory : move_memory;
+	
+	reply(OK);
 }
 
 
-/* 	Update specific i-node in the file
-
-	param id ... i-node id = offset in the file from the start of i-nodes
-*/
-void update_inode(int id) {
-	fseek(fs, sb->inode_start_address + id * INODE_SIZE, SEEK_SET);
-	
-	fwrite(&(inodes[id].nodeid), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].isDirectory), sizeof(int8_t), 1, fs);	
-	fwrite(&(inodes[id].references), sizeof(int8_t), 1, fs);	
-	fwrite(&(inodes[id].file_size), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].direct1), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].direct2), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].direct3), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].direct4), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].direct5), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].indirect1), sizeof(int32_t), 1, fs);
-	fwrite(&(inodes[id].indirect2), sizeof(int32_t), 1, fs);
+/*	Print the report of the deduplication of data blocks */
+void dedup() {
+	int32_t i;
+	long indexed = 0, shared = 0, saved = 0;
 	
-	fflush(fs);
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
+	
+	if (!(sb->features & FEATURE_DEDUP)) {
+		reply("DEDUPLICATION IS NOT ENABLED\n");
+		return;
+	}
+	
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		if (bitmap[i] == 0)
+			continue;
+		
+		if (dedup_hashes[2 * i] != 0 || dedup_hashes[2 * i + 1] != 0)
+			indexed++;
+		if (bitmap[i] > 1) {
+			shared++;
+			saved += bitmap[i] - 1;
+		}
+	}
+	
+	reply("Indexed blocks: %ld\n", indexed);
+	reply("Shared blocks: %ld\n", shared);
+	reply("Saved space: %ld blocks (%ldB)\n", saved, saved * CLUSTER_SIZE);
+	reply("Saved writes since mount: %ld blocks (%ldB)\n", dedup_saved_writes, dedup_saved_writes * CLUSTER_SIZE);
+	reply("Index: %ldB in memory, %dB on disk\n", (long)dedup_index_size * sizeof(int32_t) + (long)sb->data_cluster_count * HASH_SIZE, 
+		sb->dedup_cluster_count * CLUSTER_SIZE);
 }
 
 
-/*	Update directory - add/remove item from the file
+/*	Print the report of the fragmentation - extents of every file, contiguous files, estimated count 
+	of seeks for reading all files (in order of i-nodes) and the histogram of free extents
 
-	param dir ... directory
-	param item ... item adding/removing to/from the directory
-	param action ... 1 = add item, 0 = remove item
-	return 0 = success, -1 = all data blocks of the directory are full or removing item was not found
+	param options ... --json = machine-readable output (with extents of every file)
 */
-int update_directory(directory *dir, directory_item *item, int action) {
-	int i, j, block_count, prev, item_count, found = 0;
-	int32_t *blocks, *free_block;
-	int name_length = 12;
-	int zeros[4] = {0};  // buffer with zeros - for removing the item from the file
-	int max_items_in_block = 64;
-	int32_t nodeid;
-	inode *dir_node;
+void fragstat(char *options) {
+	int32_t id, i, run, last = FREE, max_id = FREE;
+	int count, extents, bucket, buckets = 0, json = 0;
+	int32_t *blocks;
+	long files = 0, contiguous = 0, total_extents = 0, max_extents = 0, seeks = 0;
+	long free_blocks = 0, free_extents = 0, largest_free = 0;
+	long histogram[32] = {0};	// Count of free extents with length 2^i .. 2^(i+1)-1
+	char *option;
 	
-	// Get data blocks
-	blocks = get_data_blocks(dir->current->inode, &block_count, NULL);
-
-	if (action == 1) {	// Store item (find free space)
-		for (i = 0; i < block_count; i++) {
-			fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
-			for (j = 0; j < max_items_in_block; j++) {
-				fread(&nodeid, sizeof(int32_t), 1, fs);
-				if (nodeid == 0) {	// Free place found -> store item
-					fseek(fs, -4, SEEK_CUR);
-					fflush(fs);
-					fwrite(&(item->inode), sizeof(int32_t), 1, fs);
-					fwrite(item->item_name, sizeof(item->item_name), 1, fs);
-					fflush(fs);
-					free(blocks);
-					return NO_ERROR;
-				}
-				else {
-					fseek(fs, name_length, SEEK_CUR);	// Skip the space for name
-				}
-			}
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
+	
+	if (options && (option = strtok_r(options, " ", &tokens))) {
+		if (strcmp("--json", option) != 0) {
+			reply("UNKNOWN OPTION %s\n", option);
+			return;
 		}
+		json = 1;
+	}
+	
+	// Files and directories
+	if (json)
+		reply("{\"files\":[");
+	for (id = 0; id < sb->inode_count; id++) {
+		if (inode_ids[id] == FREE)
+			continue;
 		
-		// No free space was found in the current data blocks of the directory -> try to find another free data block
-		free_block = find_free_data_blocks(1);	// Use direct reference
-		if (!free_block) 
-			return ERROR;
+		blocks = get_layout_blocks(&inodes[id], &count);
+		extents = count_fragments(blocks, count);
+		for (i = 0; i < count; i++) {
+			if (last == FREE || blocks[i] != last + 1)
+				seeks++;
+			last = blocks[i];
+		}
+		free(blocks);
 		
-		dir_node = &(inodes[dir->current->inode]);
+		if (json)
+			reply("%s{\"inode\":%d,\"directory\":%s,\"blocks\":%d,\"extents\":%d}", files ? "," : "", id, 
+				inode_dirs[id] ? "true" : "false", count, extents);
 		
-		if (dir_node->direct1 == FREE) {
-			dir_node->direct1 = free_block[0];
-		}
-		else if (dir_node->direct2 == FREE) {
-			dir_node->direct2 = free_block[0];
-		}
-		else if (dir_node->direct3 == FREE) {
-			dir_node->direct3 = free_block[0];
-		}
-		else if (dir_node->direct4 == FREE) {
-			dir_node->direct4 = free_block[0];
-		}
-		else if (dir_node->direct5 == FREE) {
-			dir_node->direct5 = free_block[0];
+		files++;
+		total_extents += extents;
+		if (extents <= 1) 
+			contiguous++;
+		if (extents > max_extents) {
+			max_extents = extents;
+			max_id = id;
 		}
-		else {
-			free(free_block);
-			free_block = find_free_data_blocks(2);	// Use indirect reference (need 2 free blocks)
-			if (!free_block) 
-				return ERROR;
-				
-			if (dir_node->indirect1 == FREE) {
-				dir_node->indirect1 = free_block[1];
-				fseek(fs, sb->data_start_address + free_block[1] * CLUSTER_SIZE, SEEK_SET);
-				fwrite(&(free_block[0]), sizeof(int32_t), 1, fs);
-			}
-			else if (dir_node->indirect2 == FREE) {
-				dir_node->indirect2 = free_block[1];
-				fseek(fs, sb->data_start_address + free_block[1] * CLUSTER_SIZE, SEEK_SET);
-				fwrite(&(free_block[0]), sizeof(int32_t), 1, fs);
-			}
+	}
+	
+	// Free space
+	for (i = 1; i < sb->data_cluster_count; i += run) {
+		for (run = 0; i + run < sb->data_cluster_count && bitmap[i + run] == 0; run++);
+		if (run == 0) {
+			run = 1;
+			continue;
 		}
-
-		fseek(fs, sb->data_start_address + free_block[0] * CLUSTER_SIZE, SEEK_SET);
-		fwrite(&(item->inode), sizeof(int32_t), 1, fs);
-		fwrite(item->item_name, sizeof(item->item_name), 1, fs);
 		
-		fflush(fs);
-		update_bitmap(dir->current, 1, NULL, 0);
-		update_inode(dir->current->inode);
-		free(free_block);
-		free(blocks);
-		return NO_ERROR;
-	}
-	else {	// Remove item (find the item with the specific id)
-		prev = blocks[0];
-		for (i = 0; i < block_count; i++) {
-			if (prev != (blocks[i] - 1)) {
-				fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
-			}
-
-			item_count = 0;	// Counter of items in this data block
-			for (j = 0; j < max_items_in_block; j++) {
-				fread(&nodeid, sizeof(int32_t), 1, fs);
-				if (nodeid > 0)
-					item_count++;
-					
-				if (!found) {
-					if (nodeid == (item->inode)) {
-						fseek(fs, -4, SEEK_CUR);
-						fflush(fs);
-						fwrite(&zeros, sizeof(zeros), 1, fs);
-						fflush(fs);
-						found = 1;
-						if (item_count > 1)
-							break;
-					}
-				}	
-			}
-			if (found) {	// If the only item in the data block was removing item -> free data block
-				if (item_count == 1) {
-					remove_reference(dir->current, i);
-				}
-				
-				free(blocks);
-				return NO_ERROR;
-			}
-			prev = blocks[i];
+		for (bucket = 0; (run >> (bucket + 1)) > 0; bucket++);
+		histogram[bucket]++;
+		if (bucket >= buckets)
+			buckets = bucket + 1;
+		free_blocks += run;
+		free_extents++;
+		if (run > largest_free)
+			largest_free = run;
+	}
+	
+	if (json) {
+		reply("],\"file_count\":%ld,\"contiguous_files\":%ld,\"contiguous_percent\":%.1f,\"total_extents\":%ld,", 
+			files, contiguous, files ? 100.0 * contiguous / files : 100.0, total_extents);
+		reply("\"max_extents\":%ld,\"max_extents_inode\":%d,\"estimated_seeks\":%ld,", max_extents, max_id, seeks);
+		reply("\"free_blocks\":%ld,\"free_extents\":%ld,\"largest_free_extent\":%ld,\"free_histogram\":[", 
+			free_blocks, free_extents, largest_free);
+		for (i = 0; i < buckets; i++) {
+			reply("%s{\"min\":%d,\"max\":%d,\"count\":%ld}", i ? "," : "", 1 << i, (1 << (i + 1)) - 1, histogram[i]);
 		}
+		reply("]}\n");
+		return;
+	}
+	
+	reply("Files: %ld (%ld contiguous, %.1f%%)\n", files, contiguous, files ? 100.0 * contiguous / files : 100.0);
+	reply("Extents: %ld (%.2f per file, max %ld in i-node %d)\n", total_extents, files ? (double)total_extents / files : 0.0, 
+		max_extents, max_id);
+	reply("Estimated seeks for a full read: %ld\n", seeks);
+	reply("Free space: %ld blocks in %ld extents, largest extent %ld blocks\n", free_blocks, free_extents, largest_free);
+	for (i = 0; i < buckets; i++) {
+		reply("  %6d - %-6d %ld\n", 1 << i, (1 << (i + 1)) - 1, histogram[i]);
 	}
-	return ERROR;
 }
 
 
-/*	Remove reference to the data block from i-node (except data block of direct1)
-	(+from the file with indirect references)
+/*	Check the consistency of the filesystem - references to data blocks in i-nodes and indirect blocks
+	against the bitmap, directory items against i-nodes and sizes of files and directories.
+	Ranges of i-nodes and then ranges of data blocks are checked in parallel (WORKER_COUNT threads).
+	Indirect blocks and then data blocks of directories are read in order of their numbers, every thread
+	reads one part of the sorted blocks (large reads in one direction, see fsck_read_blocks).
+	References of snapshots are counted too, the repair is refused while snapshots exist.
 
-	param item ... directory in which we remove data block
-	param block_id ... number of the removing data block
+	param options ... -r = repair found problems
 */
-void remove_reference(directory_item *item, int32_t block_id) {
-	int i, j;
-	int32_t number, count, found, zero = 0, blocks[2];
-	inode *node = &inodes[item->inode];
+void fsck(char *options) {
+	int t, i, repair = 0, problem_count = 0, repaired = 0;
+	int32_t id, parent, *path;
+	fsck_range ranges[WORKER_COUNT];
+	char *option;
 	
-	if (node->direct1 == block_id) {	// First direct block is not removing
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
+	
+	if (options && (option = strtok_r(options, " ", &tokens))) {
+		if (strcmp("-r", option) != 0) {
+			reply("UNKNOWN OPTION %s\n", option);
+			return;
+		}
+		if (sb->snapshot_count > 0) {	// Repair would not keep the blocks of snapshots
+			reply(HS);
+			return;
+		}
+		repair = 1;
+	}
+	
+	fsck_refs = (int32_t *)calloc(sb->data_cluster_count, sizeof(int32_t));
+	fsck_counts = (int32_t *)calloc(sb->inode_count, sizeof(int32_t));
+	fsck_links = (int32_t *)calloc(sb->inode_count, sizeof(int32_t));
+	fsck_sizes = (int32_t *)calloc(sb->inode_count, sizeof(int32_t));
+	fsck_state = (int8_t *)calloc(sb->inode_count, sizeof(int8_t));
+	fsck_parent = (int32_t *)malloc(sizeof(int32_t) * sb->inode_count);
+	path = (int32_t *)malloc(sizeof(int32_t) * sb->inode_count);
+	if (!fsck_refs || !fsck_counts || !fsck_links || !fsck_sizes || !fsck_state || !fsck_parent || !path) {
+		reply(CCF);
 		return;
 	}
-	else if (node->direct2 == block_id) {
-		blocks[0] = node->direct2;
-		node->direct2 = FREE;
+	for (id = 0; id < sb->inode_count; id++) {
+		fsck_parent[id] = FREE;
+	}
+	fflush(fs);		// Threads read the file directly
+	
+	for (t = 0; t < WORKER_COUNT; t++) {
+		ranges[t].first_inode = (int64_t)sb->inode_count * t / WORKER_COUNT;
+		ranges[t].last_inode = (int64_t)sb->inode_count * (t + 1) / WORKER_COUNT;
+		ranges[t].first_block = (int64_t)sb->data_cluster_count * t / WORKER_COUNT;
+		ranges[t].last_block = (int64_t)sb->data_cluster_count * (t + 1) / WORKER_COUNT;
+		ranges[t].problems = NULL;
+		ranges[t].problem_count = 0;
+		ranges[t].problem_capacity = 0;
+		memset(ranges[t].reads, 0, sizeof(ranges[t].reads));
+	}
+	
+	// I-nodes, indirect blocks and directory items
+	run_fsck_threads(ranges, fsck_inodes);
+	split_reads(ranges, FSCK_INDIRECT);
+	run_fsck_threads(ranges, fsck_read_blocks);
+	split_reads(ranges, FSCK_DIRECTORY);
+	run_fsck_threads(ranges, fsck_read_blocks);
+	count_snapshot_references(fsck_refs);
+	
+	// Reachability from the root and sizes of directories (sums of sizes of all files inside)
+	fsck_state[0] = 2;
+	for (id = 1; id < sb->inode_count; id++) {
+		if (inode_ids[id] == FREE || inode_dirs[id] || fsck_reachable(id, path) != 2)
+			continue;
+		
+		for (parent = fsck_parent[id]; parent != FREE; parent = (parent == 0) ? FREE : fsck_parent[parent]) {
+			fsck_sizes[parent] += inode_sizes[id];
+		}
 	}
-	else if (node->direct3 == block_id) {
-		blocks[0] = node->direct3;
-		node->direct3 = FREE;
+	for (id = 1; id < sb->inode_count; id++) {
+		if (inode_ids[id] != FREE)
+			fsck_reachable(id, path);
 	}
-	else if (node->direct4 == block_id) {
-		blocks[0] = node->direct4;
-		node->direct4 = FREE;
+	
+	// Counts of references to i-nodes and data blocks
+	run_fsck_threads(ranges, fsck_blocks);
+	
+	for (t = 0; t < WORKER_COUNT; t++) {
+		for (i = 0; i < ranges[t].problem_count; i++) {
+			print_problem(&ranges[t].problems[i]);
+		}
+		problem_count += ranges[t].problem_count;
+	}
+	
+	if (repair && problem_count > 0) {
+		repaired = repair_problems(ranges, WORKER_COUNT);
+	}
+	
+	if (problem_count == 0)
+		reply(OK);
+	else if (repair)
+		reply("%d problems found, %d repaired\n", problem_count, repaired);
+	else
+		reply("%d problems found\n", problem_count);
+	
+	for (t = 0; t < WORKER_COUNT; t++) {
+		free(ranges[t].problems);
+		free(ranges[t].reads[FSCK_INDIRECT].items);
+		free(ranges[t].reads[FSCK_DIRECTORY].items);
+	}
+	free(fsck_refs);
+	free(fsck_counts);
+	free(fsck_links);
+	free(fsck_sizes);
+	free(fsck_state);
+	free(fsck_parent);
+	free(path);
+	fsck_refs = fsck_counts = fsck_links = fsck_sizes = fsck_parent = NULL;
+	fsck_state = NULL;
+}
+
+
+/*	Test if data blocks are consecutive
+
+	param blocks ... data blocks
+	param count ... count of blocks
+	return 0 = unsorted, 1 = sorted
+*/
+int is_sorted(int32_t *blocks, int count) {
+	int i;
+	
+	for (i = 1; i < count; i++) {
+		if (blocks[i - 1] != (blocks[i] - 1)) {
+			return 0;	
+		}
 	}
-	else if (node->direct5 == block_id) {
-		blocks[0] = node->direct5;
-		node->direct5 = FREE;
+	return 1;
+}
+
+
+/*	Create the reverse map of data blocks in one pass over i-nodes - the owner of every used data block
+	is encoded as OWNER_KEY(i-node ID, position of the block in the layout of the i-node), positions are
+	0-4 direct blocks, 5 indirect1, 6.. its blocks, 6 + MAX_NUMBERS_IN_BLOCK indirect2, 7 + ... its blocks.
+	The map is one array (no allocation per block), data block shared by more i-nodes is assigned to the first of them.
+
+	param count_of_full_blocks ... address to store count of used data blocks
+	return owner of every data block, FREE = free data block
+*/
+int64_t *map_data_blocks(int *count_of_full_blocks) {
+	int i, j, k;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK], direct[5], indirect[2], base;
+	int64_t *owners = (int64_t *)malloc(sizeof(int64_t) * sb->data_cluster_count);
+	
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		owners[i] = FREE;
 	}
-	else {
-		for (i = 0; i < 2; i++) {
-			if (i == 0)	// Go through indirect1
-				fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
-			else 		// Go through indirect2
-				fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
-			
-			count = 0;
-			found = 0;
-			for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
-				fread(&number, sizeof(int32_t), 1, fs);
-				if (number > 0) 
-					count++;
-				if (!found) {
-					if (number == block_id) {
-						found = 1;
-						blocks[0] = number;
-						fseek(fs, -4, SEEK_CUR);
-						fflush(fs);
-						fwrite(&zero, sizeof(int32_t), 1, fs);
-						fflush(fs);
-						if (count > 1)
-							break;
-					}
-				}
+	
+	for (i = 0; i < sb->inode_count; i++) {
+		if (inode_ids[i] == FREE)
+			continue;
+		
+		direct[0] = inodes[i].direct1;
+		direct[1] = inodes[i].direct2;
+		direct[2] = inodes[i].direct3;
+		direct[3] = inodes[i].direct4;
+		direct[4] = inodes[i].direct5;
+		indirect[0] = inodes[i].indirect1;
+		indirect[1] = inodes[i].indirect2;
+		
+		for (j = 0; j < 5; j++) {
+			if (direct[j] != FREE && owners[direct[j]] == FREE) {
+				owners[direct[j]] = OWNER_KEY(i, j);
+				(*count_of_full_blocks)++;
 			}
+		}
+		for (j = 0; j < 2; j++) {
+			if (indirect[j] == FREE)
+				continue;
 			
-			if (found) {
-				if (count == 1) {
-					if (i == 0) {
-						blocks[1] = node->indirect1;
-						node->indirect1 = FREE;
-					}
-					else {
-						blocks[1] = node->indirect2;
-						node->indirect2 = FREE;
-					}
+			base = (j == 0) ? 5 : 6 + MAX_NUMBERS_IN_BLOCK;
+			owners[indirect[j]] = OWNER_KEY(i, base);
+			(*count_of_full_blocks)++;
+			fseek(fs, sb->data_start_address + indirect[j] * CLUSTER_SIZE, SEEK_SET);
+			fread(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+			for (k = 0; k < MAX_NUMBERS_IN_BLOCK; k++) {
+				if (numbers[k] > 0 && numbers[k] < sb->data_cluster_count && owners[numbers[k]] == FREE) {	// Shared data block keeps its first owner
+					owners[numbers[k]] = OWNER_KEY(i, base + 1 + k);
+					(*count_of_full_blocks)++;
 				}
+			}
+		}
+	}
+	
+	fflush(fs);
+	return owners;
+}
+
+
+/*	Plan the new layout of data blocks - data blocks are ordered by i-node ID and position in the i-node
+	(direct blocks, indirect1 and its blocks, indirect2 and its blocks)
+
+	param owners ... owner of every data block (map_data_blocks)
+	param count_of_full_blocks ... count of used data blocks
+	return new number of every data block, FREE = free data block
+*/
+int32_t *plan_layout(int64_t *owners, int count_of_full_blocks) {
+	int32_t i, j = 0;
+	int32_t *target = (int32_t *)malloc(sizeof(int32_t) * sb->data_cluster_count);
+	block_key *keys = (block_key *)malloc(sizeof(block_key) * count_of_full_blocks);
+	
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		target[i] = FREE;
+		if (owners[i] == FREE)
+			continue;
+		
+		keys[j].key = owners[i];
+		keys[j].block = i;
+		j++;
+	}
+	
+	qsort(keys, j, sizeof(block_key), compare_block_keys);
+	for (i = 0; i < j; i++) {
+		target[keys[i].block] = i;
+	}
+	
+	free(keys);
+	return target;
+}
+
+
+/*	Compare two data blocks by the sorting key (for qsort) */
+int compare_block_keys(const void *a, const void *b) {
+	int64_t k1 = ((block_key *)a)->key;
+	int64_t k2 = ((block_key *)b)->key;
+	return (k1 > k2) - (k1 < k2);
+}
+
+
+/*	Create the sequence of moves which transforms the current layout into the new one.
+	Every data block is read before its place is overwritten - chains of moves end in free blocks,
+	cycles are broken by the park buffer.
+
+	param target ... new number of every data block
+	param move_count ... address to store count of moves
+	return sequence of moves
+*/
+block_move *plan_moves(int32_t *target, int *move_count) {
+	int32_t i, p, next, count = 0;
+	int32_t *source = (int32_t *)malloc(sizeof(int32_t) * sb->data_cluster_count);	// block which moves to this place
+	block_move *moves;
+	
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		source[i] = FREE;
+	}
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		if (target[i] != FREE && target[i] != i) {
+			source[target[i]] = i;
+			count++;
+		}
+	}
+	
+	// Every cycle needs one more move (to and from the park buffer)
+	moves = (block_move *)malloc(sizeof(block_move) * (count + count / 2 + 1));
+	*move_count = 0;
+	
+	// Chains which end in a free block
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		if (target[i] != FREE || source[i] == FREE)
+			continue;
+		
+		p = i;
+		while (source[p] != FREE) {
+			moves[*move_count].from = source[p];
+			moves[*move_count].to = p;
+			(*move_count)++;
+			next = source[p];
+			source[p] = FREE;
+			p = next;
+		}
+	}
+	
+	// Cycles
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		if (source[i] == FREE)
+			continue;
+		
+		moves[*move_count].from = i;
+		moves[*move_count].to = FREE;
+		(*move_count)++;
+		
+		p = i;
+		while (source[p] != i) {
+			moves[*move_count].from = source[p];
+			moves[*move_count].to = p;
+			(*move_count)++;
+			next = source[p];
+			source[p] = FREE;
+			p = next;
+		}
+		moves[*move_count].from = FREE;
+		moves[*move_count].to = p;
+		(*move_count)++;
+		source[p] = FREE;
+	}
+	
+	free(source);
+	return moves;
+}
+
+
+/*	Execute the sequence of moves in batches of DEFRAG_BATCH data blocks
+
+	param moves ... sequence of moves
+	param move_count ... count of moves
+*/
+void execute_moves(block_move *moves, int move_count) {
+	int i = 0, count;
+	char *staging = (char *)malloc(DEFRAG_BATCH * CLUSTER_SIZE);	// Data of the read blocks
+	char *output = (char *)malloc(DEFRAG_BATCH * CLUSTER_SIZE);		// Data of the written blocks
+	char park[CLUSTER_SIZE];										// Data of the first block of the cycle
+	uint32_t park_sum = 0;											// Its checksum
+	
+	while (i < move_count) {
+		// Batch ends after the move from the park buffer (the next cycle uses the buffer again)
+		count = 0;
+		while (i + count < move_count && count < DEFRAG_BATCH) {
+			count++;
+			if (moves[i + count - 1].from == FREE) 
 				break;
+		}
+		
+		move_batch(moves + i, count, staging, output, park, &park_sum);
+		i += count;
+	}
+	
+	free(staging);
+	free(output);
+}
+
+
+/*	Move one batch of data blocks - all blocks are read (in order of their numbers) and then written 
+	(in order of their new numbers), consecutive blocks are read/written at once. Runs are read/written 
+	in parallel by the worker pool, writes start after all reads are finished, so a block overwritten 
+	in the batch is always read before. Moved blocks keep their checksums (they are not computed again).
+
+	param batch ... moves in the batch
+	param count ... count of moves
+	param staging ... buffer for the read blocks
+	param output ... buffer for the written blocks
+	param park ... park buffer
+	param park_sum ... checksum of the block in the park buffer
+*/
+void move_batch(block_move *batch, int count, char *staging, char *output, char *park, uint32_t *park_sum) {
+	int i, j, job_count = 0;
+	io_job *jobs = (io_job *)malloc(sizeof(io_job) * count);
+	uint32_t *sums = NULL;		// Checksums of the read blocks (index = slot)
+	
+	if (checksums) {
+		sums = (uint32_t *)malloc(sizeof(uint32_t) * count);
+		apply_checksums();		// Checksums of blocks written before are current
+	}
+	
+	// Read blocks
+	qsort(batch, count, sizeof(block_move), compare_move_sources);
+	for (i = 0; i < count; i = j) {
+		if (batch[i].from == FREE) {	// Data are in the park buffer
+			j = i + 1;
+			continue;
+		}
+		
+		for (j = i; j < count && batch[j].from == batch[i].from + (j - i); j++) {
+			batch[j].slot = j;
+			if (sums)
+				sums[j] = checksums[batch[j].from];
+		}
+		jobs[job_count].kind = JOB_READ;
+		jobs[job_count].from = batch[i].from;
+		jobs[job_count].size = (j - i) * CLUSTER_SIZE;
+		jobs[job_count++].data = staging + i * CLUSTER_SIZE;
+	}
+	run_jobs(jobs, job_count);
+	for (i = 0; i < count; i++) {
+		if (batch[i].to == FREE) {		// The first block of the cycle
+			memcpy(park, staging + batch[i].slot * CLUSTER_SIZE, CLUSTER_SIZE);
+			if (sums)
+				*park_sum = sums[batch[i].slot];
+		}
+	}
+	
+	// Write blocks
+	qsort(batch, count, sizeof(block_move), compare_move_targets);
+	job_count = 0;
+	for (i = 0; i < count; i = j) {
+		if (batch[i].to == FREE) {
+			j = i + 1;
+			continue;
+		}
+		
+		for (j = i; j < count && batch[j].to == batch[i].to + (j - i); j++) {
+			if (batch[j].from == FREE)
+				memcpy(output + j * CLUSTER_SIZE, park, CLUSTER_SIZE);
+			else
+				memcpy(output + j * CLUSTER_SIZE, staging + batch[j].slot * CLUSTER_SIZE, CLUSTER_SIZE);
+		}
+		jobs[job_count].kind = JOB_WRITE;
+		jobs[job_count].to = batch[i].to;
+		jobs[job_count].size = (j - i) * CLUSTER_SIZE;
+		jobs[job_count++].data = output + i * CLUSTER_SIZE;
+	}
+	checksums_carried = (sums != NULL);
+	run_jobs(jobs, job_count);
+	checksums_carried = 0;
+	
+	if (sums) {
+		pthread_mutex_lock(&checksum_lock);
+		for (i = 0; i < count; i++) {
+			if (batch[i].to == FREE)
+				continue;
+			checksums[batch[i].to] = (batch[i].from == FREE) ? *park_sum : sums[batch[i].slot];
+			mark_checksums(batch[i].to, batch[i].to);
+		}
+		pthread_mutex_unlock(&checksum_lock);
+		free(sums);
+	}
+	free(jobs);
+}
+
+
+/*	Compare two moves by the current number of the block (for qsort) */
+int compare_move_sources(const void *a, const void *b) {
+	return ((block_move *)a)->from - ((block_move *)b)->from;
+}
+
+
+/*	Compare two moves by the new number of the block (for qsort) */
+int compare_move_targets(const void *a, const void *b) {
+	return ((block_move *)a)->to - ((block_move *)b)->to;
+}
+
+
+/*	Rewrite all metadata according to the new layout of data blocks - references in i-nodes 
+	and indirect blocks, bitmap and hashes of data blocks. Freed data blocks are cleared.
+
+	param target ... new number of every data block
+*/
+void remap_metadata(int32_t *target) {
+	int32_t i, j, count = 0;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK];
+	int8_t *new_bitmap = (int8_t *)calloc(sb->data_cluster_count, sizeof(int8_t));
+	uint64_t *new_hashes = NULL;
+	
+	// References in i-nodes
+	for (i = 0; i < sb->inode_count; i++) {
+		if (inode_ids[i] == FREE)
+			continue;
+		
+		if (inodes[i].direct1 != FREE) inodes[i].direct1 = target[inodes[i].direct1];
+		if (inodes[i].direct2 != FREE) inodes[i].direct2 = target[inodes[i].direct2];
+		if (inodes[i].direct3 != FREE) inodes[i].direct3 = target[inodes[i].direct3];
+		if (inodes[i].direct4 != FREE) inodes[i].direct4 = target[inodes[i].direct4];
+		if (inodes[i].direct5 != FREE) inodes[i].direct5 = target[inodes[i].direct5];
+		if (inodes[i].indirect1 != FREE) inodes[i].indirect1 = target[inodes[i].indirect1];
+		if (inodes[i].indirect2 != FREE) inodes[i].indirect2 = target[inodes[i].indirect2];
+		
+		// References in indirect blocks (already moved)
+		for (j = 0; j < 2; j++) {
+			if ((j == 0 ? inodes[i].indirect1 : inodes[i].indirect2) == FREE)
+				continue;
+			
+			fseek(fs, sb->data_start_address + (j == 0 ? inodes[i].indirect1 : inodes[i].indirect2) * CLUSTER_SIZE, SEEK_SET);
+			fread(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+			for (count = 0; count < MAX_NUMBERS_IN_BLOCK; count++) {
+				if (numbers[count] > 0)
+					numbers[count] = target[numbers[count]];
 			}
+			fseek(fs, sb->data_start_address + (j == 0 ? inodes[i].indirect1 : inodes[i].indirect2) * CLUSTER_SIZE, SEEK_SET);
+			fwrite_data(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, sb->data_start_address + (j == 0 ? inodes[i].indirect1 : inodes[i].indirect2) * CLUSTER_SIZE);
 		}
 	}
 	
-	update_bitmap(item, 0, blocks, 1);
-	update_inode(item->inode);
+	// Bitmap (counts of references) and hashes move together with the data blocks
+	if (sb->features & FEATURE_DEDUP) {
+		new_hashes = (uint64_t *)calloc(sb->data_cluster_count, HASH_SIZE);
+	}
+	count = 0;
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		if (target[i] == FREE)
+			continue;
+		
+		new_bitmap[target[i]] = bitmap[i];
+		if (new_hashes) {
+			new_hashes[2 * target[i]] = dedup_hashes[2 * i];
+			new_hashes[2 * target[i] + 1] = dedup_hashes[2 * i + 1];
+		}
+		count++;
+	}
+	
+	// Clear data blocks which became free
+	memset(block_buffer, 0, CLUSTER_SIZE);
+	for (i = count; i < sb->data_cluster_count; i++) {
+		if (bitmap[i] != 0) {
+			fseek(fs, sb->data_start_address + i * CLUSTER_SIZE, SEEK_SET);
+			fwrite_data(block_buffer, sizeof(block_buffer), 1, sb->data_start_address + i * CLUSTER_SIZE);
+		}
+	}
+	
+	free(bitmap);
+	bitmap = new_bitmap;
+	fseek(fs, sb->bitmap_start_address, SEEK_SET);
+	fwrite(bitmap, sizeof(int8_t), sb->data_cluster_count, fs);
+	
+	if (new_hashes) {
+		free(dedup_hashes);
+		dedup_hashes = new_hashes;
+		fseek(fs, sb->dedup_start_address, SEEK_SET);
+		fwrite(dedup_hashes, HASH_SIZE, sb->data_cluster_count, fs);
+		build_dedup_index();
+	}
+	
+	store_inodes();
+}
+
+
+/*	One step of the incremental defragmentation - find the most fragmented files among the used i-nodes 
+	starting at the cursor and relocate them to consecutive free data blocks until the time budget runs out.
+	The cursor is stored in the superblock, so the next step (even after remount) continues where this ended.
+
+	param budget ... time budget in microseconds
+	param verbose ... 1 = print the result, 0 = quiet (idle defragmentation)
+	return count of relocated files
+*/
+int defrag_step(long budget, int verbose) {
+	struct timespec start, now;
+	int32_t id, next;
+	int i, count, scanned = 0, candidate_count = 0, relocated = 0, moved = 0, blocks_moved;
+	int32_t *blocks;
+	defrag_candidate candidates[DEFRAG_WINDOW];
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	if (sb->defrag_cursor < 0 || sb->defrag_cursor >= sb->inode_count) {
+		sb->defrag_cursor = 0;
+	}
+	
+	// Examine the window of used i-nodes
+	for (id = sb->defrag_cursor; id < sb->inode_count && scanned < DEFRAG_WINDOW; id++) {
+		if (inode_ids[id] == FREE)
+			continue;
+		
+		scanned++;
+		blocks = get_layout_blocks(&inodes[id], &count);
+		candidates[candidate_count].nodeid = id;
+		candidates[candidate_count].fragments = count_fragments(blocks, count);
+		if (candidates[candidate_count].fragments > 1)
+			candidate_count++;
+		free(blocks);
+	}
+	
+	// Relocate the most fragmented files first
+	qsort(candidates, candidate_count, sizeof(defrag_candidate), compare_defrag_candidates);
+	for (i = 0; i < candidate_count && relocated < DEFRAG_STEP_FILES; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 >= budget)
+			break;
+		
+		if ((blocks_moved = relocate_inode(candidates[i].nodeid)) > 0) {
+			relocated++;
+			moved += blocks_moved;
+		}
+	}
+	
+	// Files which were not handled are examined again by the next step
+	for (next = id; i < candidate_count; i++) {
+		if (candidates[i].nodeid < next)
+			next = candidates[i].nodeid;
+	}
+	sb->defrag_cursor = (next < sb->inode_count) ? next : 0;		// Wrap around at the end of the i-node table
+	store_superblock();
+	
+	if (verbose) {
+		reply("Relocated %d files (%d blocks), next step starts at i-node %d\n", relocated, moved, sb->defrag_cursor);
+	}
+	return relocated;
+}
+
+
+/*	Get numbers of all data blocks of the i-node including indirect blocks in order 
+	of the defragmented layout (direct blocks, indirect1, its blocks, indirect2, its blocks)
+
+	param node ... i-node (of the filesystem or of the snapshot)
+	param count ... address to store count of data blocks
+	return array of numbers of data blocks
+*/
+int32_t *get_layout_blocks(inode *node, int *count) {
+	int i, j;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK];
+	int32_t direct[5] = {node->direct1, node->direct2, node->direct3, node->direct4, node->direct5};
+	int32_t indirect[2] = {node->indirect1, node->indirect2};
+	int32_t *blocks = (int32_t *)malloc(sizeof(int32_t) * BLOCKS_PER_INODE);
+	
+	*count = 0;
+	for (i = 0; i < 5; i++) {
+		if (direct[i] != FREE)
+			blocks[(*count)++] = direct[i];
+	}
+	for (i = 0; i < 2; i++) {
+		if (indirect[i] == FREE)
+			continue;
+		
+		blocks[(*count)++] = indirect[i];
+		fseek(fs, sb->data_start_address + indirect[i] * CLUSTER_SIZE, SEEK_SET);
+		fread(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+		for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
+			if (numbers[j] > 0)
+				blocks[(*count)++] = numbers[j];
+		}
+	}
+	return blocks;
 }
 
+
+/*	Count runs of consecutive data blocks
+
+	param blocks ... data blocks
+	param count ... count of blocks
+	return count of runs (0 = no blocks, 1 = all blocks are consecutive)
+*/
+int count_fragments(int32_t *blocks, int count) {
+	int i, fragments = (count > 0);
+	
+	for (i = 1; i < count; i++) {
+		if (blocks[i - 1] != (blocks[i] - 1)) {
+			fragments++;
+		}
+	}
+	return fragments;
+}
+
+
+/*	Move all data blocks of the i-node to consecutive free data blocks. The data are written first,
+	then the references are switched and the old blocks are freed at last, so the filesystem is 
+	consistent after every step. Files with shared data blocks are left to the full defragmentation.
+
+	param nodeid ... i-node ID
+	return count of moved data blocks, 0 = i-node was not relocated
+*/
+int relocate_inode(int32_t nodeid) {
+	int i, j, k, count;
+	int32_t *blocks, *new_blocks = NULL, *numbers;
+	int32_t *refs[7] = {&inodes[nodeid].direct1, &inodes[nodeid].direct2, &inodes[nodeid].direct3, &inodes[nodeid].direct4, 
+		&inodes[nodeid].direct5, &inodes[nodeid].indirect1, &inodes[nodeid].indirect2};
+	uint64_t hash[2];
+	char *data;
+	
+	blocks = get_layout_blocks(&inodes[nodeid], &count);
+	for (i = 0; i < count; i++) {
+		if (bitmap[blocks[i]] > 1)		// Shared data block
+			break;
+	}
+	if (count < 2 || i < count || !(new_blocks = find_free_data_blocks(count)) || !is_sorted(new_blocks, count)) {
+		free(blocks);
+		if (new_blocks) 
+			free(new_blocks);
+		return 0;
+	}
+	
+	// Read the data (consecutive blocks at once)
+	data = (char *)malloc(count * CLUSTER_SIZE);
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count && blocks[j] == blocks[j - 1] + 1; j++);
+		fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+		fread(data + i * CLUSTER_SIZE, CLUSTER_SIZE, j - i, fs);
+	}
+	
+	// Blocks of the indirect block follow it in the layout
+	for (i = 0; i < count; i++) {
+		if (blocks[i] != inodes[nodeid].indirect1 && blocks[i] != inodes[nodeid].indirect2)
+			continue;
+		
+		numbers = (int32_t *)(data + i * CLUSTER_SIZE);
+		for (j = 0, k = i + 1; j < MAX_NUMBERS_IN_BLOCK; j++) {
+			if (numbers[j] > 0)
+				numbers[j] = new_blocks[k++];
+		}
+	}
+	
+	// Write the data to the new place and mark the blocks as full
+	fseek(fs, sb->data_start_address + new_blocks[0] * CLUSTER_SIZE, SEEK_SET);
+	fwrite_data(data, CLUSTER_SIZE, count, sb->data_start_address + new_blocks[0] * CLUSTER_SIZE);
+	memset(bitmap + new_blocks[0], 1, count);
+	fseek(fs, sb->bitmap_start_address + new_blocks[0], SEEK_SET);
+	fwrite(bitmap + new_blocks[0], sizeof(int8_t), count, fs);
+	fflush(fs);
+	
+	// Switch the references
+	for (i = 0; i < 7; i++) {
+		if (*refs[i] == FREE)
+			continue;
+		for (j = 0; blocks[j] != *refs[i]; j++);
+		*refs[i] = new_blocks[j];
+	}
+	update_inode(nodeid);
+	
+	// Free the old blocks, hashes move with the data
+	memset(block_buffer, 0, CLUSTER_SIZE);
+	for (i = 0; i < count; i++) {
+		if ((sb->features & FEATURE_DEDUP) && (dedup_hashes[2 * blocks[i]] != 0 || dedup_hashes[2 * blocks[i] + 1] != 0)) {
+			hash[0] = dedup_hashes[2 * blocks[i]];
+			hash[1] = dedup_hashes[2 * blocks[i] + 1];
+			remove_dedup_block(blocks[i]);
+			insert_dedup_block(new_blocks[i], hash);
+		}
+		set_references(blocks[i], 0);
+		fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+		fwrite_data(block_buffer, sizeof(block_buffer), 1, sb->data_start_address + blocks[i] * CLUSTER_SIZE);
+	}
+	fflush(fs);
+	
+	free(data);
+	free(blocks);
+	free(new_blocks);
+	return count;
+}
+
+
+/*	Compare two files by the count of fragments, the most fragmented first (for qsort) */
+int compare_defrag_candidates(const void *a, const void *b) {
+	return ((defrag_candidate *)b)->fragments - ((defrag_candidate *)a)->fragments;
+}
+
+
+/*	Validate entered time budget and convert it into microseconds
+
+	param budget ... time with the unit (us, ms, s), default unit is ms
+	return time budget in microseconds or ERROR
+*/
+long get_budget(char *budget) {
+	long value;
+	char *unit;
+	
+	if (!budget) {
+		reply("NO TIME BUDGET\n");
+		return ERROR;
+	}
+	
+	errno = 0;
+	value = strtol(budget, &unit, 10);
+	if (errno || unit == budget || value <= 0) {
+		reply("INVALID TIME BUDGET\n");
+		return ERROR;
+	}
+	
+	if (strcmp("us", unit) == 0)
+		return value;
+	if (strcmp("ms", unit) == 0 || *unit == '\0')
+		return value * 1000;
+	if (strcmp("s", unit) == 0)
+		return value * 1000000;
+	
+	reply("INVALID TIME BUDGET\n");
+	return ERROR;
+}
+
+
+/*	Check the range of i-nodes (thread of fsck) - count references to data blocks and i-nodes,
+	find references out of the range. Indirect blocks and data blocks of directories are only 
+	collected, fsck reads them later in order of their numbers (fsck_read_blocks).
+
+	param arg ... range to check (fsck_range)
+	return NULL
+*/
+void *fsck_inodes(void *arg) {
+	fsck_range *range = (fsck_range *)arg;
+	int32_t id, i;
+	int32_t pointers[7];
+	inode *node;
+	
+	for (id = range->first_inode; id < range->last_inode; id++) {
+		if (inode_ids[id] == FREE)
+			continue;
+		node = &inodes[id];
+		
+		pointers[0] = node->direct1;
+		pointers[1] = node->direct2;
+		pointers[2] = node->direct3;
+		pointers[3] = node->direct4;
+		pointers[4] = node->direct5;
+		pointers[5] = node->indirect1;
+		pointers[6] = node->indirect2;
+		
+		for (i = 0; i < 7; i++) {
+			if (pointers[i] == FREE)
+				continue;
+			if (pointers[i] < 0 || pointers[i] >= sb->data_cluster_count) {
+				add_problem(range, FSCK_INVALID_BLOCK, id, pointers[i], 0);
+				continue;
+			}
+			
+			__atomic_fetch_add(&fsck_refs[pointers[i]], 1, __ATOMIC_RELAXED);
+			if (i >= 5) {
+				add_read(&range->reads[FSCK_INDIRECT], pointers[i], id);
+				continue;
+			}
+			fsck_counts[id]++;
+			if (inode_dirs[id])
+				add_read(&range->reads[FSCK_DIRECTORY], pointers[i], id);
+		}
+	}
+	return NULL;
+}
+
+
+/*	Read data blocks of one kind (thread of fsck) - the part of sorted data blocks is read in order of their
+	numbers, close data blocks (at most FSCK_GAP unneeded blocks between them) are read at once, up to 
+	FSCK_WINDOW blocks. Indirect blocks add data blocks of directories to the range.
+
+	param arg ... range with data blocks to read (fsck_range, reads[kind])
+	return NULL
+*/
+void *fsck_read_blocks(void *arg) {
+	fsck_range *range = (fsck_range *)arg;
+	fsck_read *items = range->reads[range->kind].items;
+	int i, j, k, count = range->reads[range->kind].count;
+	int32_t first;
+	char *window;
+	
+	if (count == 0)
+		return NULL;
+	window = (char *)malloc(FSCK_WINDOW * CLUSTER_SIZE);
+	
+	for (i = 0; i < count; i = j) {
+		first = items[i].block;
+		for (j = i + 1; j < count && items[j].block - first < FSCK_WINDOW && items[j].block - items[j - 1].block <= FSCK_GAP + 1; j++);
+		
+		if (read_at(window, (size_t)(items[j - 1].block - first + 1) * CLUSTER_SIZE, 
+			(off_t)sb->data_start_address + (off_t)first * CLUSTER_SIZE) == ERROR)
+			continue;
+		for (k = i; k < j; k++) {
+			if (range->kind == FSCK_INDIRECT)
+				fsck_indirect(range, &items[k], (int32_t *)(window + (items[k].block - first) * CLUSTER_SIZE));
+			else
+				fsck_directory(range, &items[k], (int32_t *)(window + (items[k].block - first) * CLUSTER_SIZE));
+		}
+	}
+	free(window);
+	return NULL;
+}
+
+
+/*	Count references to data blocks from the indirect block
+
+	param range ... range of the thread
+	param read ... indirect block and its i-node
+	param numbers ... content of the indirect block
+*/
+void fsck_indirect(fsck_range *range, fsck_read *read, int32_t *numbers) {
+	int32_t j;
+	
+	for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
+		if (numbers[j] == 0)
+			continue;
+		if (numbers[j] < 0 || numbers[j] >= sb->data_cluster_count) {
+			add_problem(range, FSCK_INVALID_BLOCK, read->id, numbers[j], 0);
+			continue;
+		}
+		__atomic_fetch_add(&fsck_refs[numbers[j]], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&fsck_counts[read->id], 1, __ATOMIC_RELAXED);
+		if (inode_dirs[read->id])
+			add_read(&range->reads[FSCK_DIRECTORY], numbers[j], read->id);
+	}
+}
+
+
+/*	Count references to i-nodes from items in the data block of the directory, find items referring to free i-nodes
+
+	param range ... range of the thread
+	param read ... data block and the i-node of the directory
+	param numbers ... content of the data block (items of 16 bytes)
+*/
+void fsck_directory(fsck_range *range, fsck_read *read, int32_t *numbers) {
+	int32_t j, nodeid;
+	
+	for (j = 0; j < CLUSTER_SIZE / 16; j++) {
+		nodeid = numbers[j * 4];
+		if (nodeid <= 0)
+			continue;
+		if (nodeid >= sb->inode_count || inode_ids[nodeid] == FREE) {
+			add_problem(range, FSCK_DANGLING_ENTRY, read->id, nodeid, read->block * (CLUSTER_SIZE / 16) + j);
+			continue;
+		}
+		__atomic_fetch_add(&fsck_links[nodeid], 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&fsck_parent[nodeid], read->id, __ATOMIC_RELAXED);
+	}
+}
+
+
+/*	Run one check of fsck in WORKER_COUNT threads (the check runs in this thread if the thread cannot be created)
+
+	param ranges ... ranges of threads
+	param check ... function of the thread
+*/
+void run_fsck_threads(fsck_range *ranges, void *(*check)(void *)) {
+	int t, started[WORKER_COUNT];
+	pthread_t threads[WORKER_COUNT];
+	
+	for (t = 0; t < WORKER_COUNT; t++) {
+		started[t] = (pthread_create(&threads[t], NULL, check, &ranges[t]) == 0);
+		if (!started[t])
+			check(&ranges[t]);
+	}
+	for (t = 0; t < WORKER_COUNT; t++) {
+		if (started[t])
+			pthread_join(threads[t], NULL);
+	}
+}
+
+
+/*	Sort data blocks of one kind collected by all threads and split them to WORKER_COUNT parts of consecutive
+	numbers (one part for every thread)
+
+	param ranges ... ranges of threads
+	param kind ... FSCK_INDIRECT or FSCK_DIRECTORY
+*/
+void split_reads(fsck_range *ranges, int8_t kind) {
+	int t, total = 0, first, count;
+	fsck_read *all;
+	fsck_list *list;
+	
+	for (t = 0; t < WORKER_COUNT; t++) {
+		total += ranges[t].reads[kind].count;
+	}
+	all = (fsck_read *)malloc(sizeof(fsck_read) * (total + 1));
+	for (t = 0, first = 0; t < WORKER_COUNT; t++) {
+		list = &ranges[t].reads[kind];
+		if (list->count > 0)	// The empty list may have no items
+			memcpy(all + first, list->items, sizeof(fsck_read) * list->count);
+		first += list->count;
+		list->count = 0;
+	}
+	qsort(all, total, sizeof(fsck_read), compare_fsck_reads);
+	
+	for (t = 0; t < WORKER_COUNT; t++) {
+		first = (int64_t)total * t / WORKER_COUNT;
+		count = (int64_t)total * (t + 1) / WORKER_COUNT - first;
+		list = &ranges[t].reads[kind];
+		if (count > list->capacity) {
+			list->capacity = count;
+			list->items = (fsck_read *)realloc(list->items, sizeof(fsck_read) * count);
+		}
+		if (count > 0)
+			memcpy(list->items, all + first, sizeof(fsck_read) * count);
+		list->count = count;
+		ranges[t].kind = kind;
+	}
+	free(all);
+}
+
+
+/*	Add the data block to the list of data blocks which fsck reads
+
+	param list ... list
+	param block ... number of the data block
+	param id ... i-node which refers to the data block
+*/
+void add_read(fsck_list *list, int32_t block, int32_t id) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->items = (fsck_read *)realloc(list->items, sizeof(fsck_read) * list->capacity);
+	}
+	list->items[list->count].block = block;
+	list->items[list->count++].id = id;
+}
+
+
+/*	Compare two data blocks read by fsck by their numbers (for qsort) */
+int compare_fsck_reads(const void *a, const void *b) {
+	return ((fsck_read *)a)->block - ((fsck_read *)b)->block;
+}
+
+
+/*	Check the range of i-nodes and data blocks (thread of fsck) - compare the counts of references
+	found by fsck_inodes with the i-nodes and the bitmap, check sizes of files and directories
+
+	param arg ... range to check (fsck_range)
+	return NULL
+*/
+void *fsck_blocks(void *arg) {
+	fsck_range *range = (fsck_range *)arg;
+	int32_t id, block, found, needed;
+	int allowed = BLOCKS_SHARED ? MAX_REFERENCES : 1;
+	
+	for (id = range->first_inode; id < range->last_inode; id++) {
+		if (inode_ids[id] == FREE)
+			continue;
+		
+		if (!inode_dirs[id] && (inodes[id].flags & INODE_INLINE)) {
+			if (fsck_counts[id] != 0 || inode_sizes[id] > inline_capacity)
+				add_problem(range, FSCK_FILE_SIZE, id, fsck_counts[id], 0);
+		}
+		else if (!inode_dirs[id] && !(inodes[id].flags & INODE_COMPRESSED)) {	// Compressed file has less blocks than its size
+			needed = (inode_sizes[id] + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+			if (fsck_counts[id] != needed)
+				add_problem(range, FSCK_FILE_SIZE, id, fsck_counts[id], needed);
+		}
+		
+		if (fsck_state[id] != 2) {
+			add_problem(range, FSCK_ORPHAN, id, 0, 0);
+			continue;
+		}
+		if (id != 0 && fsck_links[id] != inodes[id].references)
+			add_problem(range, FSCK_LINKS, id, inodes[id].references, fsck_links[id]);
+		if (inode_dirs[id] && inode_sizes[id] != fsck_sizes[id])
+			add_problem(range, FSCK_DIRECTORY_SIZE, id, inode_sizes[id], fsck_sizes[id]);
+	}
+	
+	for (block = range->first_block; block < range->last_block; block++) {
+		found = fsck_refs[block];
+		if (found == 0 && bitmap[block] != 0)
+			add_problem(range, FSCK_LEAKED, block, bitmap[block], 0);
+		else if (found > 0 && bitmap[block] == 0)
+			add_problem(range, FSCK_UNMARKED, block, 0, found);
+		else if (allowed > 1 && found != bitmap[block] && found <= allowed)
+			add_problem(range, FSCK_REFERENCES, block, bitmap[block], found);
+		
+		if (found > allowed)
+			add_problem(range, FSCK_DOUBLE, block, found, allowed);
+	}
+	return NULL;
+}
+
+
+/*	Add the problem to the list of problems of the range
+
+	param range ... range where the problem was found
+	param kind ... FSCK_* kind of the problem
+	param id ... i-node ID or number of the data block
+	param value ... found value
+	param expected ... expected value
+*/
+void add_problem(fsck_range *range, int8_t kind, int32_t id, int32_t value, int32_t expected) {
+	if (range->problem_count == range->problem_capacity) {
+		range->problem_capacity = range->problem_capacity ? range->problem_capacity * 2 : 16;
+		range->problems = (fsck_problem *)realloc(range->problems, sizeof(fsck_problem) * range->problem_capacity);
+	}
+	
+	range->problems[range->problem_count].kind = kind;
+	range->problems[range->problem_count].id = id;
+	range->problems[range->problem_count].value = value;
+	range->problems[range->problem_count++].expected = expected;
+}
+
+
+/*	Find out if the i-node is reachable from the root through directory items (result is stored 
+	for all i-nodes on the way, cycles of directories are unreachable)
+
+	param id ... i-node ID
+	param path ... buffer for i-nodes on the way (inode_count items)
+	return 2 = reachable, 3 = unreachable
+*/
+int8_t fsck_reachable(int32_t id, int32_t *path) {
+	int count = 0;
+	int8_t result;
+	
+	while (1) {
+		if (fsck_state[id] >= 2) {
+			result = fsck_state[id];
+			break;
+		}
+		if (fsck_state[id] == 1 || fsck_parent[id] == FREE) {	// Cycle or no directory item
+			result = 3;
+			break;
+		}
+		
+		fsck_state[id] = 1;
+		path[count++] = id;
+		id = fsck_parent[id];
+	}
+	
+	while (count > 0) {
+		fsck_state[path[--count]] = result;
+	}
+	if (fsck_state[id] < 2)		// The first i-node of the cycle / without a directory item
+		fsck_state[id] = result;
+	return result;
+}
+
+
+/*	Print the problem found by fsck
+
+	param problem ... problem
+*/
+void print_problem(fsck_problem *problem) {
+	switch (problem->kind) {
+		case FSCK_INVALID_BLOCK:
+			reply("I-node %d refers to invalid data block %d\n", problem->id, problem->value);
+			break;
+		case FSCK_FILE_SIZE:
+			reply("I-node %d has %d data blocks, its size needs %d\n", problem->id, problem->value, problem->expected);
+			break;
+		case FSCK_DANGLING_ENTRY:
+			reply("Directory i-node %d refers to free i-node %d\n", problem->id, problem->value);
+			break;
+		case FSCK_ORPHAN:
+			reply("I-node %d is not reachable from the root\n", problem->id);
+			break;
+		case FSCK_LINKS:
+			reply("I-node %d has %d references, %d found\n", problem->id, problem->value, problem->expected);
+			break;
+		case FSCK_DIRECTORY_SIZE:
+			reply("Directory i-node %d has size %dB, content has %dB\n", problem->id, problem->value, problem->expected);
+			break;
+		case FSCK_LEAKED:
+			reply("Data block %d is full but not referenced\n", problem->id);
+			break;
+		case FSCK_UNMARKED:
+			reply("Data block %d is referenced %d times but free in the bitmap\n", problem->id, problem->expected);
+			break;
+		case FSCK_DOUBLE:
+			reply("Data block %d is referenced %d times, %d allowed\n", problem->id, problem->value, problem->expected);
+			break;
+		case FSCK_REFERENCES:
+			reply("Data block %d has %d references in the bitmap, %d found\n", problem->id, problem->value, problem->expected);
+			break;
+	}
+}
+
+
+/*	Repair problems found by fsck - dangling directory items are removed, unreachable i-nodes are released,
+	data blocks referenced more times than allowed are copied, counts of references and sizes of directories
+	are set to the found values, leaked data blocks are freed and cleared. Invalid references and wrong sizes
+	of files are only reported. The tree of directories is loaded again (root becomes the working directory).
+
+	param ranges ... checked ranges with found problems
+	param range_count ... count of ranges
+	return count of repaired problems
+*/
+int repair_problems(fsck_range *ranges, int range_count) {
+	int t, i, repaired = 0;
+	int32_t block, count, zeros[4] = {0};
+	long offset;
+	int8_t *claimed = (int8_t *)calloc(sb->data_cluster_count, sizeof(int8_t));	// Counts of references kept by repair_block
+	fsck_problem *problem;
+	
+	for (t = 0; t < range_count; t++) {
+		for (i = 0; i < ranges[t].problem_count; i++) {
+			problem = &ranges[t].problems[i];
+			switch (problem->kind) {
+				case FSCK_DANGLING_ENTRY:
+					offset = sb->data_start_address + (problem->expected / (CLUSTER_SIZE / 16)) * CLUSTER_SIZE 
+						+ (problem->expected % (CLUSTER_SIZE / 16)) * 16;
+					fseek(fs, offset, SEEK_SET);
+					fwrite_data(zeros, sizeof(zeros), 1, offset);
+					repaired++;
+					break;
+				case FSCK_ORPHAN:
+					release_inode(problem->id);
+					repaired++;
+					break;
+				case FSCK_LINKS:
+					inodes[problem->id].references = problem->expected;
+					update_inode(problem->id);
+					repaired++;
+					break;
+				case FSCK_DIRECTORY_SIZE:
+					inode_sizes[problem->id] = problem->expected;
+					update_inode(problem->id);
+					repaired++;
+					break;
+				case FSCK_LEAKED:
+				case FSCK_UNMARKED:
+				case FSCK_REFERENCES:
+				case FSCK_DOUBLE:		// Repaired below
+					repaired++;
+					break;
+			}
+		}
+	}
+	
+	// Referenced blocks must not be allocated for copies of the shared blocks
+	for (block = 0; block < sb->data_cluster_count; block++) {
+		if (fsck_refs[block] > 0 && bitmap[block] == 0)
+			bitmap[block] = 1;
+	}
+	repair_shared_blocks(claimed);
+	
+	// Bitmap contains the found counts of references, leaked blocks are cleared
+	memset(block_buffer, 0, CLUSTER_SIZE);
+	for (block = 0; block < sb->data_cluster_count; block++) {
+		count = fsck_refs[block];
+		if (!(sb->features & FEATURE_DEDUP) && count > 1)
+			count = 1;
+		if (count == bitmap[block])
+			continue;
+		
+		if (count == 0) {
+			fseek(fs, sb->data_start_address + block * CLUSTER_SIZE, SEEK_SET);
+			fwrite_data(block_buffer, sizeof(block_buffer), 1, sb->data_start_address + block * CLUSTER_SIZE);
+			if (sb->features & FEATURE_DEDUP)
+				remove_dedup_block(block);
+		}
+		bitmap[block] = count;
+	}
+	fseek(fs, sb->bitmap_start_address, SEEK_SET);
+	fwrite(bitmap, sizeof(int8_t), sb->data_cluster_count, fs);
+	fflush(fs);
+	
+	// Load the repaired tree of directories
+	free_directories();
+	memset(directories, 0, sizeof(directory *) * sb->inode_count);
+	reload_directories();
+	
+	free(claimed);
+	return repaired;
+}
+
+
+/*	Give own copies to i-nodes which refer to data blocks referenced more times than allowed
+	(the first references keep the original block)
+
+	param claimed ... count of kept references to every data block
+	return count of copied data blocks
+*/
+int repair_shared_blocks(int8_t *claimed) {
+	int32_t id, i, j, copy, data_allowed;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK];
+	int32_t *pointers[7];
+	int copies = 0, changed;
+	
+	for (id = 0; id < sb->inode_count; id++) {
+		if (inode_ids[id] == FREE)
+			continue;
+		
+		pointers[0] = &inodes[id].direct1;
+		pointers[1] = &inodes[id].direct2;
+		pointers[2] = &inodes[id].direct3;
+		pointers[3] = &inodes[id].direct4;
+		pointers[4] = &inodes[id].direct5;
+		pointers[5] = &inodes[id].indirect1;
+		pointers[6] = &inodes[id].indirect2;
+		data_allowed = ((sb->features & FEATURE_DEDUP) && !inode_dirs[id]) ? MAX_REFERENCES : 1;
+		
+		for (i = 0; i < 7; i++) {
+			if (*pointers[i] < 0 || *pointers[i] >= sb->data_cluster_count)
+				continue;
+			
+			copy = repair_block(*pointers[i], (i < 5) ? data_allowed : 1, claimed);
+			if (copy != *pointers[i]) {
+				*pointers[i] = copy;
+				update_inode(id);
+				copies++;
+			}
+			if (i < 5)
+				continue;
+			
+			// Data blocks of the indirect block
+			changed = 0;
+			fseek(fs, sb->data_start_address + *pointers[i] * CLUSTER_SIZE, SEEK_SET);
+			fread(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+			for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
+				if (numbers[j] <= 0 || numbers[j] >= sb->data_cluster_count)
+					continue;
+				
+				copy = repair_block(numbers[j], data_allowed, claimed);
+				if (copy != numbers[j]) {
+					numbers[j] = copy;
+					changed = 1;
+					copies++;
+				}
+			}
+			if (changed) {
+				fseek(fs, sb->data_start_address + *pointers[i] * CLUSTER_SIZE, SEEK_SET);
+				fwrite_data(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, sb->data_start_address + *pointers[i] * CLUSTER_SIZE);
+			}
+		}
+	}
+	fflush(fs);
+	return copies;
+}
+
+
+/*	Keep the reference to the data block or copy the block if it has already got the allowed count of references
+
+	param block ... number of the data block
+	param allowed ... allowed count of references
+	param claimed ... count of kept references to every data block
+	return number of the data block which has to be referenced (the same block or its copy)
+*/
+int32_t repair_block(int32_t block, int allowed, int8_t *claimed) {
+	int32_t *free_block, copy;
+	char buffer[CLUSTER_SIZE];
+	
+	if (claimed[block] < allowed) {
+		claimed[block]++;
+		return block;
+	}
+	
+	free_block = find_free_data_blocks(1);
+	if (!free_block)		// No space for the copy
+		return block;
+	copy = free_block[0];
+	free(free_block);
+	
+	fseek(fs, sb->data_start_address + block * CLUSTER_SIZE, SEEK_SET);
+	fread(buffer, sizeof(buffer), 1, fs);
+	fseek(fs, sb->data_start_address + copy * CLUSTER_SIZE, SEEK_SET);
+	fwrite_data(buffer, sizeof(buffer), 1, sb->data_start_address + copy * CLUSTER_SIZE);
+	
+	bitmap[copy] = 1;
+	claimed[copy] = 1;
+	fsck_refs[copy] = 1;
+	fsck_refs[block]--;
+	return copy;
+}
+
+
+/*	Release the unreachable i-node - its references to data blocks are not counted and the i-node is cleared
+
+	param id ... i-node ID
+*/
+void release_inode(int32_t id) {
+	int32_t i, j;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK];
+	int32_t pointers[7] = {inodes[id].direct1, inodes[id].direct2, inodes[id].direct3, inodes[id].direct4, 
+		inodes[id].direct5, inodes[id].indirect1, inodes[id].indirect2};
+	
+	for (i = 0; i < 7; i++) {
+		if (pointers[i] < 0 || pointers[i] >= sb->data_cluster_count)
+			continue;
+		
+		fsck_refs[pointers[i]]--;
+		if (i < 5)
+			continue;
+		
+		fseek(fs, sb->data_start_address + pointers[i] * CLUSTER_SIZE, SEEK_SET);
+		fread(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+		for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
+			if (numbers[j] > 0 && numbers[j] < sb->data_cluster_count)
+				fsck_refs[numbers[j]]--;
+		}
+	}
+	
+	clear_inode(id);
+	update_inode(id);
+}
+
+
+/*	Manage snapshots of the filesystem. The snapshot keeps records of all used i-nodes, data blocks
+	(including indirect blocks and items of directories) are shared with the filesystem - every snapshot
+	adds one reference to each of its blocks, so the filesystem copies the shared blocks before it changes 
+	them (copy-on-write). The snapshot costs only its records and the blocks which were changed since.
+
+	Usage:	snapshot create <name> ... freeze the current state of the filesystem
+			snapshot list ... print the name, the time of the creation, the count of i-nodes and the count 
+				of data blocks kept only by the snapshot (released by its deletion)
+			snapshot delete <name> ... release the snapshot
+			snapshot rollback <name> ... return the filesystem to the state of the snapshot (it is kept)
+
+	param args ... action and the name of the snapshot
+*/
+void snapshot(char *args) {
+	char *action, *name;
+	
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
+	
+	action = args ? strtok_r(args, " ", &tokens) : NULL;
+	name = action ? strtok_r(NULL, " ", &tokens) : NULL;
+	if (action && strcmp("list", action) == 0) {
+		list_snapshots();
+		return;
+	}
+	if (!action || (strcmp("create", action) != 0 && strcmp("delete", action) != 0 && strcmp("rollback", action) != 0)) {
+		reply("UNKNOWN OPTION %s\n", action ? action : "");
+		return;
+	}
+	if (!name) {
+		reply("MISSING NAME\n");
+		return;
+	}
+	
+	if (strcmp("create", action) == 0)
+		create_snapshot(name);
+	else if (strcmp("delete", action) == 0)
+		delete_snapshot(name);
+	else
+		rollback_snapshot(name);
+}
+
+
+/*	Create the snapshot of the current state of the filesystem - records of used i-nodes are stored 
+	in the chain of free data blocks and every data block of the i-nodes gets one more reference
+
+	param name ... name of the snapshot
+*/
+void create_snapshot(char *name) {
+	int i, count = 0, per_block, chain_count, needed, block_count, stored;
+	int32_t id, next, *blocks, *chain;
+	char *records, buffer[CLUSTER_SIZE];
+	snapshot_info *snapshot;
+	
+	if (strlen(name) > NAME_LENGTH) {
+		reply("NAME IS TOO LONG\n");
+		return;
+	}
+	if (find_snapshot(name) != ERROR) {
+		reply(EXIST);
+		return;
+	}
+	if (sb->snapshot_count == MAX_SNAPSHOTS) {
+		reply("TOO MANY SNAPSHOTS\n");
+		return;
+	}
+	
+	// Records of used i-nodes and their data blocks
+	records = (char *)malloc((size_t)sb->inode_size * sb->inode_count);
+	for (id = 0; id < sb->inode_count; id++) {
+		if (inode_ids[id] != FREE)
+			pack_inode(id, records + (size_t)(count++) * sb->inode_size);
+	}
+	blocks = get_snapshot_blocks(records, count, 1, &block_count);
+	if (check_references(blocks, block_count, NULL, 0) == ERROR) {
+		reply("TOO MANY REFERENCES\n");
+		free(records);
+		free(blocks);
+		return;
+	}
+	
+	// Chain of data blocks for the records (+the table of snapshots with the first snapshot)
+	per_block = (CLUSTER_SIZE - sizeof(int32_t)) / sb->inode_size;
+	chain_count = (count + per_block - 1) / per_block;
+	needed = chain_count + (sb->snapshot_count == 0);
+	pthread_mutex_lock(&alloc_lock);
+	if (!(chain = find_free_data_blocks(needed))) {
+		pthread_mutex_unlock(&alloc_lock);
+		reply(NES);
+		free(records);
+		free(blocks);
+		return;
+	}
+	
+	batch_running++;		// Bitmap and the superblock are stored at once
+	for (i = 0; i < chain_count; i++) {
+		next = (i + 1 < chain_count) ? chain[i + 1] : FREE;
+		stored = (count - i * per_block < per_block) ? count - i * per_block : per_block;
+		memset(buffer, 0, CLUSTER_SIZE);
+		memcpy(buffer, &next, sizeof(int32_t));
+		memcpy(buffer + sizeof(int32_t), records + (size_t)i * per_block * sb->inode_size, (size_t)stored * sb->inode_size);
+		fseek(fs, sb->data_start_address + chain[i] * CLUSTER_SIZE, SEEK_SET);
+		fwrite_data(buffer, CLUSTER_SIZE, 1, sb->data_start_address + chain[i] * CLUSTER_SIZE);
+		set_references(chain[i], 1);
+	}
+	if (sb->snapshot_count == 0) {
+		sb->snapshot_table = chain[chain_count];
+		set_references(sb->snapshot_table, 1);
+	}
+	for (i = 0; i < block_count; i++) {
+		set_references(blocks[i], bitmap[blocks[i]] + 1);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	
+	snapshot = &snapshots[sb->snapshot_count++];
+	memset(snapshot, 0, sizeof(snapshot_info));
+	snapshot->created = time(NULL);
+	strcpy(snapshot->name, name);
+	snapshot->inode_count = count;
+	snapshot->first_block = chain[0];
+	snapshot->block_count = chain_count;
+	store_snapshots();
+	store_superblock();
+	if (--batch_running == 0)
+		commit_metadata();
+	
+	free(records);
+	free(blocks);
+	free(chain);
+	reply(OK);
+}
+
+
+/*	Print all snapshots */
+void list_snapshots() {
+	int i, j, count;
+	long kept;
+	int32_t *blocks;
+	char *records, created[32];
+	time_t seconds;
+	struct tm local;
+	
+	for (i = 0; i < sb->snapshot_count; i++) {
+		// Blocks with one reference are kept only by the snapshot
+		records = load_snapshot(&snapshots[i], NULL, NULL);
+		blocks = get_snapshot_blocks(records, snapshots[i].inode_count, 1, &count);
+		kept = snapshots[i].block_count;
+		for (j = 0; j < count; j++) {
+			kept += (bitmap[blocks[j]] == 1);
+		}
+		
+		seconds = (time_t)snapshots[i].created;
+		localtime_r(&seconds, &local);
+		strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", &local);
+		reply("%s - %s - %d i-nodes - %ld blocks (%ldB)\n", snapshots[i].name, created, snapshots[i].inode_count, kept, kept * CLUSTER_SIZE);
+		free(records);
+		free(blocks);
+	}
+}
+
+
+/*	Delete the snapshot - every data block of its i-nodes loses one reference (blocks which are not used
+	by the filesystem or other snapshots are freed) and the chain of its records is freed
+
+	param name ... name of the snapshot
+*/
+void delete_snapshot(char *name) {
+	int index, count, chain_count;
+	int32_t *blocks, *chain, table;
+	char *records;
+	snapshot_info *snapshot;
+	
+	if ((index = find_snapshot(name)) == ERROR) {
+		reply("SNAPSHOT NOT FOUND\n");
+		return;
+	}
+	snapshot = &snapshots[index];
+	chain = (int32_t *)malloc(sizeof(int32_t) * (snapshot->block_count + 1));
+	records = load_snapshot(snapshot, chain, &chain_count);
+	blocks = get_snapshot_blocks(records, snapshot->inode_count, 1, &count);
+	
+	batch_running++;
+	pthread_mutex_lock(&alloc_lock);
+	release_blocks(blocks, count);
+	release_blocks(chain, chain_count);
+	if (sb->snapshot_count == 1) {	// The table is freed with the last snapshot
+		table = sb->snapshot_table;
+		release_blocks(&table, 1);
+		sb->snapshot_table = FREE;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	
+	memmove(snapshot, snapshot + 1, sizeof(snapshot_info) * (sb->snapshot_count - index - 1));
+	sb->snapshot_count--;
+	if (sb->snapshot_count > 0)
+		store_snapshots();
+	store_superblock();
+	if (--batch_running == 0)
+		commit_metadata();
+	
+	free(records);
+	free(blocks);
+	free(chain);
+	reply(OK);
+}
+
+
+/*	Return the filesystem to the state of the snapshot - the current blocks of the filesystem are released
+	(blocks of the snapshot keep its reference), the i-nodes are replaced by the records of the snapshot,
+	their blocks get the references of the filesystem and the tree of directories is loaded again
+
+	param name ... name of the snapshot
+*/
+void rollback_snapshot(char *name) {
+	int i, index, count, current_count;
+	int32_t id, *blocks, *current;
+	char *records, *record;
+	snapshot_info *snapshot;
+	
+	if ((index = find_snapshot(name)) == ERROR) {
+		reply("SNAPSHOT NOT FOUND\n");
+		return;
+	}
+	snapshot = &snapshots[index];
+	records = load_snapshot(snapshot, NULL, NULL);
+	blocks = get_snapshot_blocks(records, snapshot->inode_count, 0, &count);
+	current = get_snapshot_blocks(NULL, 0, 0, &current_count);
+	if (check_references(blocks, count, current, current_count) == ERROR) {
+		reply("TOO MANY REFERENCES\n");
+		free(records);
+		free(blocks);
+		free(current);
+		return;
+	}
+	
+	batch_running++;
+	pthread_mutex_lock(&alloc_lock);
+	release_blocks(current, current_count);
+	for (i = 0; i < count; i++) {
+		set_references(blocks[i], bitmap[blocks[i]] + 1);
+	}
+	
+	for (id = 0; id < sb->inode_count; id++) {
+		if (inode_ids[id] != FREE)
+			clear_inode(id);
+	}
+	for (i = 0; i < snapshot->inode_count; i++) {
+		record = records + (size_t)i * sb->inode_size;
+		memcpy(&id, record, sizeof(int32_t));
+		if (id < 0 || id >= sb->inode_count)
+			continue;
+		
+		inode_ids[id] = id;
+		memcpy(&(inode_dirs[id]), record + 4, sizeof(int8_t));
+		memcpy(&(inode_sizes[id]), record + 6, sizeof(int32_t));
+		unpack_inode(record, &inodes[id]);
+		if (inline_capacity > 0)
+			memcpy(INLINE_DATA(id), record + INODE_HEADER_SIZE, inline_capacity);
+	}
+	store_inodes();
+	pthread_mutex_unlock(&alloc_lock);
+	
+	// Load the restored tree of directories (sessions return to the root)
+	free_directories();
+	memset(directories, 0, sizeof(directory *) * sb->inode_count);
+	reload_directories();
+	if (--batch_running == 0)
+		commit_metadata();
+	
+	free(records);
+	free(blocks);
+	free(current);
+	reply(OK);
+}
+
+
+/*	Find the snapshot by its name
+
+	param name ... name of the snapshot
+	return index to the table of snapshots, -1 = not found
+*/
+int find_snapshot(char *name) {
+	int i;
+	
+	for (i = 0; i < sb->snapshot_count; i++) {
+		if (strcmp(snapshots[i].name, name) == 0)
+			return i;
+	}
+	return ERROR;
+}
+
+
+/*	Load records of i-nodes of the snapshot from its chain of data blocks
+
+	param snapshot ... snapshot
+	param chain ... array to store numbers of data blocks of the chain (block_count items) or NULL
+	param chain_count ... address to store the count of data blocks of the chain or NULL
+	return records of i-nodes (inode_count records, missing records are zeros)
+*/
+char *load_snapshot(snapshot_info *snapshot, int32_t *chain, int *chain_count) {
+	int i, stored, per_block = (CLUSTER_SIZE - sizeof(int32_t)) / sb->inode_size;
+	int32_t block = snapshot->first_block;
+	char buffer[CLUSTER_SIZE];
+	char *records = (char *)calloc((size_t)snapshot->inode_count + 1, sb->inode_size);
+	
+	for (i = 0; i < snapshot->block_count && block > 0 && block < sb->data_cluster_count; i++) {
+		if (chain)
+			chain[i] = block;
+		fseek(fs, sb->data_start_address + block * CLUSTER_SIZE, SEEK_SET);
+		fread(buffer, CLUSTER_SIZE, 1, fs);
+		
+		stored = (snapshot->inode_count - i * per_block < per_block) ? snapshot->inode_count - i * per_block : per_block;
+		memcpy(records + (size_t)i * per_block * sb->inode_size, buffer + sizeof(int32_t), (size_t)stored * sb->inode_size);
+		memcpy(&block, buffer, sizeof(int32_t));
+	}
+	if (chain_count)
+		*chain_count = i;
+	return records;
+}
+
+
+/*	Store the table of snapshots to its data block */
+void store_snapshots() {
+	char buffer[CLUSTER_SIZE];
+	
+	memset(buffer, 0, CLUSTER_SIZE);
+	memcpy(buffer, snapshots, sizeof(snapshot_info) * sb->snapshot_count);
+	fseek(fs, sb->data_start_address + sb->snapshot_table * CLUSTER_SIZE, SEEK_SET);
+	fwrite_data(buffer, CLUSTER_SIZE, 1, sb->data_start_address + sb->snapshot_table * CLUSTER_SIZE);
+	fflush(fs);
+}
+
+
+/*	Get numbers of all data blocks (including indirect blocks) referenced by the records of i-nodes
+
+	param records ... records of i-nodes, NULL = used i-nodes of the filesystem
+	param record_count ... count of records
+	param distinct ... 1 = every block is in the array once, 0 = once for every its reference
+	param count ... address to store the count of data blocks
+	return array of numbers of data blocks
+*/
+int32_t *get_snapshot_blocks(char *records, int record_count, int distinct, int *count) {
+	int i, j, node_count, capacity = 1024;
+	int32_t *node_blocks, *blocks = (int32_t *)malloc(sizeof(int32_t) * capacity);
+	int8_t *seen = distinct ? (int8_t *)calloc(sb->data_cluster_count, sizeof(int8_t)) : NULL;
+	inode node;
+	
+	*count = 0;
+	for (i = 0; i < (records ? record_count : sb->inode_count); i++) {
+		if (records) {
+			unpack_inode(records + (size_t)i * sb->inode_size, &node);
+		}
+		else {
+			if (inode_ids[i] == FREE)
+				continue;
+			node = inodes[i];
+		}
+		
+		node_blocks = get_layout_blocks(&node, &node_count);
+		if (*count + node_count > capacity) {
+			while (*count + node_count > capacity) {
+				capacity *= 2;
+			}
+			blocks = (int32_t *)realloc(blocks, sizeof(int32_t) * capacity);
+		}
+		for (j = 0; j < node_count; j++) {
+			if (node_blocks[j] < 0 || node_blocks[j] >= sb->data_cluster_count || (seen && seen[node_blocks[j]]))
+				continue;
+			if (seen)
+				seen[node_blocks[j]] = 1;
+			blocks[(*count)++] = node_blocks[j];
+		}
+		free(node_blocks);
+	}
+	free(seen);
+	return blocks;
+}
+
+
+/*	Test if data blocks can get one more reference for every their occurrence in the array
+	(after the released blocks lose theirs)
+
+	param blocks ... numbers of data blocks
+	param count ... count of data blocks
+	param released ... numbers of released data blocks or NULL
+	param released_count ... count of released data blocks
+	return 0 = no error, -1 = some block would have more than MAX_REFERENCES references
+*/
+int check_references(int32_t *blocks, int count, int32_t *released, int released_count) {
+	int i, result = NO_ERROR;
+	int32_t *added = (int32_t *)calloc(sb->data_cluster_count, sizeof(int32_t));
+	
+	for (i = 0; i < released_count; i++) {
+		added[released[i]]--;
+	}
+	for (i = 0; i < count && result == NO_ERROR; i++) {
+		if (bitmap[blocks[i]] + ++added[blocks[i]] > MAX_REFERENCES)
+			result = ERROR;
+	}
+	free(added);
+	return result;
+}
+
+
+/*	Add references of all snapshots (blocks of their i-nodes, chains of records and the table) to the counts
+	of references (fsck)
+
+	param refs ... count of references to every data block
+*/
+void count_snapshot_references(int32_t *refs) {
+	int i, j, count, chain_count;
+	int32_t *blocks, *chain;
+	char *records;
+	
+	for (i = 0; i < sb->snapshot_count; i++) {
+		chain = (int32_t *)malloc(sizeof(int32_t) * (snapshots[i].block_count + 1));
+		records = load_snapshot(&snapshots[i], chain, &chain_count);
+		blocks = get_snapshot_blocks(records, snapshots[i].inode_count, 1, &count);
+		for (j = 0; j < count; j++) {
+			refs[blocks[j]]++;
+		}
+		for (j = 0; j < chain_count; j++) {
+			refs[chain[j]]++;
+		}
+		free(records);
+		free(blocks);
+		free(chain);
+	}
+	if (sb->snapshot_count > 0 && sb->snapshot_table >= 0 && sb->snapshot_table < sb->data_cluster_count)
+		refs[sb->snapshot_table]++;
+}
+
+
+/*	Give the i-node its own copies of the blocks shared with snapshots which are changed in place - indirect 
+	blocks and blocks of the directory (data blocks of files are copied by write_blocks), 
+	the caller holds the lock of the allocation
+
+	param nodeid ... i-node ID
+	return 0 = no error, -1 = not enough space
+*/
+int unshare_blocks(int32_t nodeid) {
+	int i, j, changed = 0, written, result = NO_ERROR;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK], copy;
+	inode *node = &inodes[nodeid];
+	int32_t *refs[7] = {&node->direct1, &node->direct2, &node->direct3, &node->direct4, &node->direct5, &node->indirect1, &node->indirect2};
+	
+	if (sb->snapshot_count == 0)
+		return NO_ERROR;
+	
+	// Indirect blocks first (copies of blocks of the directory are written into them), then direct blocks of the directory
+	for (i = 0; i < 7 && result == NO_ERROR; i++) {
+		j = (i + 5) % 7;
+		if (*refs[j] == FREE || bitmap[*refs[j]] <= 1 || (j < 5 && !inode_dirs[nodeid]))
+			continue;
+		if ((copy = copy_block(*refs[j])) == ERROR) {
+			result = ERROR;
+			continue;
+		}
+		*refs[j] = copy;
+		changed = 1;
+	}
+	
+	// Blocks of the directory referenced by indirect blocks
+	for (i = 5; i < 7 && result == NO_ERROR && inode_dirs[nodeid]; i++) {
+		if (*refs[i] == FREE)
+			continue;
+		
+		fseek(fs, sb->data_start_address + *refs[i] * CLUSTER_SIZE, SEEK_SET);
+		fread(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+		written = 0;
+		for (j = 0; j < MAX_NUMBERS_IN_BLOCK && result == NO_ERROR; j++) {
+			if (numbers[j] <= 0 || numbers[j] >= sb->data_cluster_count || bitmap[numbers[j]] <= 1)
+				continue;
+			if ((copy = copy_block(numbers[j])) == ERROR) {
+				result = ERROR;
+				continue;
+			}
+			numbers[j] = copy;
+			written = 1;
+		}
+		if (written) {
+			fseek(fs, sb->data_start_address + *refs[i] * CLUSTER_SIZE, SEEK_SET);
+			fwrite_data(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, sb->data_start_address + *refs[i] * CLUSTER_SIZE);
+		}
+	}
+	
+	if (changed)
+		update_inode(nodeid);
+	fflush(fs);
+	return result;
+}
+
+
+/*	Copy the shared data block to a free data block, the shared block loses one reference
+	(the caller holds the lock of the allocation)
+
+	param block ... number of the shared data block
+	return number of the copy, -1 = not enough space
+*/
+int32_t copy_block(int32_t block) {
+	int32_t *free_block, copy;
+	char buffer[CLUSTER_SIZE];
+	
+	if (!(free_block = find_free_data_blocks(1)))
+		return ERROR;
+	copy = free_block[0];
+	free(free_block);
+	
+	fseek(fs, sb->data_start_address + block * CLUSTER_SIZE, SEEK_SET);
+	fread(buffer, sizeof(buffer), 1, fs);
+	fseek(fs, sb->data_start_address + copy * CLUSTER_SIZE, SEEK_SET);
+	fwrite_data(buffer, sizeof(buffer), 1, sb->data_start_address + copy * CLUSTER_SIZE);
+	set_references(block, bitmap[block] - 1);
+	set_references(copy, 1);
+	return copy;
+}
+
+
+/*	Validate entered size of the filesystem
+	and convert it into bytes
+	
+	param size ... size of the filesystem as the string
+	return ... size of the filesystem in bytes
+*/
+int32_t get_size(char *size) {
+	char *units = NULL;
+	long number;
+	
+	if (!size || size == "") {
+		reply(CCF);
+		return ERROR;
+	}
+	
+	errno = 0;
+	number = strtol(size, &units, 0);	// Convert to number
+	
+	if (number == 0 || errno != 0) {
+		reply(CCF);
+		return ERROR;
+	}
+	
+	if (strncmp("KB", units, 2) == 0) {			// Kilobytes
+		number *= 1000;
+	}
+	else if (strncmp("MB", units, 2) == 0) {	// Megabytes
+		number *= 1000000;
+	}
+	else if (strncmp("GB", units, 2) == 0) {	// Gigabytes
+		number *= 1000000000;
+	}
+	
+	if (number < MIN_FS_SIZE) {			// If the size is not enough large 
+		reply(CCF);
+		return ERROR;
+	}
+	else if (number > INT_MAX) {	// If the size is too large
+		reply(CCF);
+		return ERROR;
+	}
+	
+	return (int32_t)number;
+}
+
+
+/*	Get the options of the format command (format SIZE [-i N] [-z] [-d] [-c])
+	-i size ... extended i-nodes of the specific size which can store small files inline
+	-z ... compress all files (requires extended i-nodes, the smallest ones are used without -i)
+	-d ... share identical data blocks of files (deduplication)
+	-c ... keep CRC32C checksums of data blocks
+	
+	param options ... arguments of the format command (size of the filesystem + options)
+	param inode_size ... address to store size of the i-node record in bytes
+	param features ... address to store optional features of the filesystem
+	return 0 = valid options, -1 = invalid options
+*/
+int get_format_options(char *options, int32_t *inode_size, int32_t *features) {
+	char *opt;
+	long number;
+	
+	*inode_size = INODE_SIZE;
+	*features = 0;
+	
+	opt = strtok_r(options, " ", &tokens);	// Skip the size of the filesystem
+	while ((opt = strtok_r(NULL, " ", &tokens)) != NULL) {
+		if (strcmp("-i", opt) == 0) {
+			opt = strtok_r(NULL, " ", &tokens);
+			if (!opt) {
+				reply(CCF);
+				return ERROR;
+			}
+			
+			number = strtol(opt, NULL, 0);
+			if (number < MIN_INODE_SIZE || number > MAX_INODE_SIZE) {	// Unsupported size of the i-node
+				reply(CCF);
+				return ERROR;
+			}
+			*inode_size = (int32_t)number;
+		}
+		else if (strcmp("-z", opt) == 0) {
+			*features |= FEATURE_COMPRESS;
+		}
+		else if (strcmp("-d", opt) == 0) {
+			*features |= FEATURE_DEDUP;
+		}
+		else if (strcmp("-c", opt) == 0) {
+			*features |= FEATURE_CHECKSUM;
+		}
+		else {
+			reply(CCF);
+			return ERROR;
+		}
+	}
+	
+	// Flags of the compressed files are stored only in the extended i-nodes
+	if ((*features & FEATURE_COMPRESS) && *inode_size == INODE_SIZE) {
+		*inode_size = MIN_INODE_SIZE;
+	}
+	return NO_ERROR;
+}
+
+
+/*	Find a free i-node
+	
+	return ... i-node ID or -1 if no i-node is free
+*/
+int32_t find_free_inode() {
+	int i, j, found = 0;
+	
+	// Chunks of IDs are tested without branches (the loop can be vectorized), the free i-node is then found in the chunk
+	for (i = 1; i + INODE_SCAN_CHUNK <= sb->inode_count; i += INODE_SCAN_CHUNK) {
+		for (j = 0; j < INODE_SCAN_CHUNK; j++) {
+			found |= (inode_ids[i + j] == FREE);
+		}
+		if (found)
+			break;
+	}
+	for (; i < sb->inode_count; i++) {	// Finding a free i-node
+		if (inode_ids[i] == FREE) {
+			record_scan(&inode_scans, i);
+			return i;
+		}
+	}
+	record_scan(&inode_scans, i - 1);
+	return ERROR;
+}
+
+
+/* 	Find free data blocks in bitmap	
+
+	param count ... count of data blocks
+	return array of free data blocks or NULL if not enough blocks found
+*/
+int32_t *find_free_data_blocks(int count) {
+	int i, j = 0;
+	long scanned;		// Count of bitmap items examined by the first pass
+	int32_t *blocks = (int32_t *)malloc(sizeof(int32_t) * (count + 1));
+	
+	if (count == 0)		// Empty file
+		return blocks;
+	
+	// Try to find consecutive blocks
+	for (i = 1; i < sb->data_cluster_count; i++) {
+		if (bitmap[i] == 0) {
+			if ((j != 0) && (blocks[j - 1] != (i - 1))) {
+				j = 0;
+				i--;
+				continue;
+			}
+			blocks[j++] = i;
+			if (j == count) {
+				record_scan(&block_scans, i);
+				return blocks;
+			}
+		}
+	}
+	scanned = i - 1;
+	
+	j = 0;
+	// If blocks are not consecutive
+	for (i = 1; i < sb->data_cluster_count; i++) {
+		if (bitmap[i] == 0) {
+			blocks[j] = i;
+			j++;
+			if (j == count) {
+				record_scan(&block_scans, scanned + i);
+				return blocks;
+			}
+		}
+	}
+	record_scan(&block_scans, scanned + i - 1);
+	free(blocks);
+	return NULL;
+}
+
+
+/*	Get numbers of the range of data blocks of the file (not compressed)
+	(the index of the data block is translated directly to the direct or indirect reference)
+
+	param nodeid ... i-node of the file
+	param first ... index of the first data block of the range
+	param count ... count of data blocks of the range
+	return array of numbers of data blocks
+*/
+int32_t *get_block_range(int32_t nodeid, int first, int count) {
+	int i, from, to, end = first + count;
+	int32_t *blocks;
+	inode *node = &inodes[nodeid];
+	int32_t direct[5] = {node->direct1, node->direct2, node->direct3, node->direct4, node->direct5};
+	
+	blocks = (int32_t *)malloc(sizeof(int32_t) * count);
+	for (i = first; i < end && i < 5; i++) {	// Direct references
+		blocks[i - first] = direct[i];
+	}
+	
+	// Data blocks 5 - 260 are referenced by indirect1
+	from = first > 5 ? first : 5;
+	to = end < 5 + MAX_NUMBERS_IN_BLOCK ? end : 5 + MAX_NUMBERS_IN_BLOCK;
+	if (from < to) {
+		fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE + (from - 5) * sizeof(int32_t), SEEK_SET);
+		fread(&blocks[from - first], sizeof(int32_t), to - from, fs);
+	}
+	
+	// Next data blocks are referenced by indirect2
+	from = first > 5 + MAX_NUMBERS_IN_BLOCK ? first : 5 + MAX_NUMBERS_IN_BLOCK;
+	if (from < end) {
+		fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE + (from - 5 - MAX_NUMBERS_IN_BLOCK) * sizeof(int32_t), SEEK_SET);
+		fread(&blocks[from - first], sizeof(int32_t), end - from, fs);
+	}
+	
+	return blocks;
+}
+
+
+/*	Set numbers of the range of data blocks of the file (not compressed), the caller stores the i-node
+
+	param nodeid ... i-node of the file
+	param first ... index of the first data block of the range
+	param count ... count of data blocks of the range
+	param blocks ... numbers of data blocks, FREE = remove the reference
+*/
+void set_block_range(int32_t nodeid, int first, int count, int32_t *blocks) {
+	int i, from, to, end = first + count;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK];
+	inode *node = &inodes[nodeid];
+	int32_t *direct[5] = {&node->direct1, &node->direct2, &node->direct3, &node->direct4, &node->direct5};
+	
+	for (i = first; i < end && i < 5; i++) {	// Direct references
+		*direct[i] = blocks[i - first];
+	}
+	
+	// Data blocks 5 - 260 are referenced by indirect1 (free item is 0)
+	from = first > 5 ? first : 5;
+	to = end < 5 + MAX_NUMBERS_IN_BLOCK ? end : 5 + MAX_NUMBERS_IN_BLOCK;
+	if (from < to) {
+		for (i = from; i < to; i++) {
+			numbers[i - from] = (blocks[i - first] == FREE) ? 0 : blocks[i - first];
+		}
+		fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE + (from - 5) * sizeof(int32_t), SEEK_SET);
+		fwrite_data(numbers, sizeof(int32_t), to - from, sb->data_start_address + node->indirect1 * CLUSTER_SIZE + (from - 5) * sizeof(int32_t));
+	}
+	
+	// Next data blocks are referenced by indirect2
+	from = first > 5 + MAX_NUMBERS_IN_BLOCK ? first : 5 + MAX_NUMBERS_IN_BLOCK;
+	if (from < end) {
+		for (i = from; i < end; i++) {
+			numbers[i - from] = (blocks[i - first] == FREE) ? 0 : blocks[i - first];
+		}
+		fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE + (from - 5 - MAX_NUMBERS_IN_BLOCK) * sizeof(int32_t), SEEK_SET);
+		fwrite_data(numbers, sizeof(int32_t), end - from, sb->data_start_address + node->indirect2 * CLUSTER_SIZE + (from - 5 - MAX_NUMBERS_IN_BLOCK) * sizeof(int32_t));
+	}
+}
+
+
+/*	Get numbers of all data blocks of the particular item
+
+	param item ... item from which we get data blocks
+	param block_count ... address to store count of data blocks
+	param rest ... address to store rest size of the last data block (only with file)
+	return array of numbers of data blocks
+*/
+int32_t *get_data_blocks(int32_t nodeid, int *block_count, int *rest) {
+	int32_t *blocks, number;
+	int i, tmp, counter;
+	int max_numbers = 517;	// Maximum data blocks 
+	inode *node = &inodes[nodeid];
+	
+	if (inode_dirs[nodeid] || (node->flags & INODE_COMPRESSED)) {	// If item is directory or compressed file (size of the data differs from the file size)
+		counter = 0;
+		blocks = (int32_t *)malloc(sizeof(int32_t) * max_numbers);
+		
+		if (node->direct1 != FREE) {
+			blocks[counter++] = node->direct1;
+		}
+		if (node->direct2 != FREE) {
+			blocks[counter++] = node->direct2;
+		}
+		if (node->direct3 != FREE) {
+			blocks[counter++] = node->direct3;
+		}	
+		if (node->direct4 != FREE) {
+			blocks[counter++] = node->direct4;
+		}	
+		if (node->direct5 != FREE) {
+			blocks[counter++] = node->direct5;
+		}	
+		if (node->indirect1 != FREE) {
+			fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
+			for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
+				fread(&number, sizeof(int32_t), 1, fs);
+				if (number > 0) {
+					blocks[counter++] = number;
+				}
+			}
+		}
+		if (node->indirect2 != FREE) {
+			fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
+			for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
+				fread(&number, sizeof(int32_t), 1, fs);
+				if (number > 0) {
+					blocks[counter++] = number;
+				}
+			}			
+		}
+		
+		*block_count = counter;
+		if (rest) 
+			*rest = 0;
+	}
+	else if (node->flags & INODE_INLINE) {	// If item is inline file -> no data blocks
+		*block_count = 0;
+		*rest = 0;
+		return NULL;
+	}
+	else {	// If item is file
+		*block_count = inode_sizes[nodeid] / CLUSTER_SIZE;
+		*rest = inode_sizes[nodeid] % CLUSTER_SIZE;
+		if (*rest != 0)
+			(*block_count)++;
+		
+		blocks = (int32_t *)malloc(sizeof(int32_t) * (*block_count + 1));
+		
+		blocks[0] = node->direct1;	// FREE with the empty file
+		if (*block_count > 1) {
+			blocks[1] = node->direct2;
+			if (*block_count > 2) {
+				blocks[2] = node->direct3;
+				if (*block_count > 3) {
+					blocks[3] = node->direct4;
+					if (*block_count > 4) {
+						blocks[4] = node->direct5;
+						if (*block_count > 5) {
+							if (*block_count > 261) {	// Both indirect references are used
+								// Read all data blocks of indirect1
+								fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
+								fread(&blocks[5], sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+								
+								// Read the rest of indirect2
+								tmp = *block_count - 261;
+								fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
+								fread(&blocks[261], sizeof(int32_t), tmp, fs);
+							}
+							else {	// Only first indirect reference is used
+								tmp = *block_count - 5;
+								fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
+								fread(&blocks[5], sizeof(int32_t), tmp, fs);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	fflush(fs);
+	return blocks;
+}
+
+
+/* 	Find particular item with the specific name in a list of items starting with first_item
+
+	param first_item ... first item in the list of items (directories or files)
+	param name ... name of the finding item
+	return founded item or NULL
+*/
+directory_item *find_item(directory_item *first_item, char *name) {
+	directory_item *item = first_item;
+	
+	while (item != NULL) {
+		if (strcmp(name, item->item_name) == 0) {
+			return item;
+		}
+		item = item->next;
+	}
+	return NULL;
+}
+
+
+/*	Parse the path of the file/directory
+
+	param path ... path + name of file/directory
+	param name ... address to store name of the file/directory
+	param dir ... address to store founded directory
+	return 0 = directory found, -1 = not found
+*/
+int parse_path(char *path, char **name, directory **dir) {
+	int length;				// Length of the path (without name of the new directory)
+	char buff[BUFF_SIZE];
+	
+	if (!path || path == "") {
+		return ERROR;
+	}
+	
+	if ((*name = strrchr(path, '/')) == NULL) {	// If path contains only directory/file name
+		*name = path;
+		*dir = working_directory;
+	}
+	else  {
+		// Separate the name of the directory/file from the rest of the path
+		length = strlen(path) - strlen(*name);
+		if (path[0] == '/') {					
+			if (!strchr(path + 1, '/'))	// If the path contains only root directory (and name of the creating directory)
+				length = 1;
+		}
+		
+		*name = *name + 1;
+		memset(buff, '\0', BUFF_SIZE);
+		strncpy(buff, path, length);
+		
+		// Find the directory
+		*dir = find_directory(buff);		
+		if (!(*dir)) {
+			return ERROR;
+		}
+	}
+
+	return NO_ERROR;
+}
+
+
+
+/*	Create a new directory
+	
+	param parent ... parent directory
+	param name ... directory name
+	return 0 = no error, -1 = error
+*/
+int create_directory(directory *parent, char *name) {
+	int32_t inode_id, *data_block;
+	directory_item **temp;
+
+	// Get ID of a free i-node
+	inode_id = find_free_inode();
+	if (inode_id == ERROR) return ERROR;	// No free i-node
+	
+	// Get number of a free data block
+	data_block = find_free_data_blocks(1);
+	if (data_block == NULL) return ERROR; 	// No free data block
+
+	// Create directory
+	directory *newdir = (directory *)pool_alloc(&directory_pool);
+	newdir->parent = parent;
+	newdir->current = create_directory_item(inode_id, name);
+	newdir->file = NULL;
+	newdir->subdir = NULL;
+	pthread_mutex_init(&(newdir->lock), NULL);
+	
+	directories[inode_id] = newdir;
+	bitmap[data_block[0]] = 1;
+	
+	// Initialize i-node of a new directory
+	inode_ids[inode_id] = inode_id;
+	inode_dirs[inode_id] = 1;
+	inodes[inode_id].references = 1;
+	inode_sizes[inode_id] = 0;
+	inodes[inode_id].direct1 = data_block[0];
+	
+	
+	temp = &(parent->subdir);
+	while (*temp != NULL) {
+		temp = &((*temp)->next);
+	}
+	
+	*temp = directories[inode_id]->current;
+	
+	if (update_directory(parent, newdir->current, 1)) {
+		return ERROR;	// No free data block for extending parent data blocks
+	}
+
+	update_inode(inode_id);
+	update_bitmap(newdir->current, 1, data_block, 1);
+	free(data_block);
+	
+	return NO_ERROR;
+}
+
+
+/* 	Create a new directory item 
+
+	param inode_id ... i-node ID
+	param name ... name of the file/directory
+*/
+directory_item *create_directory_item(int32_t inode_id, char *name) {
+	char buff[12] = {'\0'};
+	
+	directory_item *dir_item = (directory_item *)pool_alloc(&item_pool);
+
+	strncpy(buff, name, strlen(name));
+	dir_item->inode = inode_id;
+	strncpy(dir_item->item_name, buff, 12);
+	dir_item->next = NULL;
+	
+	return dir_item;
+}
+
+
+/*	Test if directory already contains item with the same name
+
+	param dir ... directory
+	param name ... name of the testing item
+	return 1 = exist, 0 = not exist
+*/
+int test_existence(directory *dir, char *name) {
+	directory_item *item;
+	
+	// If the file with the same name already exist 
+	item = dir->file;
+	while (item != NULL) {
+		if (strcmp(name, item->item_name) == 0) {
+			return 1;
+		}
+		item = item->next;
+	}
+	
+	// If the directory with the same name already exist
+	item = dir->subdir;
+	while (item != NULL) {
+		if (strcmp(name, item->item_name) == 0) {	
+			return 1;
+		}
+		item = item->next;
+	}
+	return 0;
+}
+
+
+/*	Find an entered directory according to the path
+	
+	return ... directory or NULL if wasn't found 
+*/
+directory *find_directory(char *path) {
+	int found;	// If directory was found
+	char *part;	// Part of the path
+	char *delim = "/";
+	directory *dir;
+	directory_item *item;
+	
+	if (path[0] == '/') {	// Absolute path
+		dir = directories[0];
+	}
+	else {					// Relative path
+		dir = working_directory;
+	}
+
+	part = strtok_r(path, delim, &tokens);
+	while (part != NULL) {
+		if (strcmp(part, ".") == 0) {	// The same directory
+			part = strtok_r(NULL, delim, &tokens);
+			continue;
+		}
+		else if (strcmp(part, "..") == 0) {	// Go to the parent directory
+			dir = dir->parent;
+			part = strtok_r(NULL, delim, &tokens);
+			continue;
+		}
+		else {
+			found = 0;
+			item = dir->subdir;
+			while (item != NULL) {
+				if (strcmp(part, directories[item->inode]->current->item_name) == 0) {
+					dir = directories[item->inode];
+					part = strtok_r(NULL, delim, &tokens);
+					found = 1;
+					break;
+				}
+				item = item->next;
+			}
+			
+			if (found == 0) {	// No such directory wasn't found
+				return NULL;
+			}
+		}
+	}
+	return dir;
+}
+
+
+/*	Free allocated memory for directories - the whole tree is released at once with the pools of directories
+	and directory items (locks of directories are default mutexes without any resources) */
+void free_directories() {
+	pool_release(&item_pool);
+	pool_release(&directory_pool);
+}
+
+
+/*	Allocate the table of i-nodes - arrays of IDs, types and sizes (scanned by searches of the whole table)
+	and the array of the other fields of i-nodes
+
+	param count ... count of i-nodes
+	return 0 = success, -1 = not enough memory (inodes is NULL)
+*/
+int alloc_inodes(int32_t count) {
+	inodes = (inode *)malloc(sizeof(inode) * count);
+	inode_ids = (int32_t *)malloc(sizeof(int32_t) * count);
+	inode_dirs = (int8_t *)malloc(sizeof(int8_t) * count);
+	inode_sizes = (int32_t *)malloc(sizeof(int32_t) * count);
+	
+	if (!inodes || !inode_ids || !inode_dirs || !inode_sizes) {
+		free_inodes();
+		return ERROR;
+	}
+	return NO_ERROR;
+}
+
+
+/*	Free the table of i-nodes */
+void free_inodes() {
+	free(inodes);
+	free(inode_ids);
+	free(inode_dirs);
+	free(inode_sizes);
+	inodes = NULL;
+	inode_ids = NULL;
+	inode_dirs = NULL;
+	inode_sizes = NULL;
+}
+
+
+/*	Allocate an object from the pool (the last released object or the next one of the last slab)
+
+	param p ... pool
+	return object or NULL if the memory is exhausted
+*/
+void *pool_alloc(pool *p) {
+	void *object;
+	char **slabs;
+	
+	pthread_mutex_lock(&p->lock);
+	if (p->free_list) {
+		object = p->free_list;
+		p->free_list = *(void **)object;
+	}
+	else {
+		if (p->slab_used == POOL_SLAB) {	// New slab
+			if (p->slab_count == p->slab_capacity) {
+				slabs = (char **)realloc(p->slabs, sizeof(char *) * (p->slab_capacity ? p->slab_capacity * 2 : 16));
+				if (!slabs) {
+					pthread_mutex_unlock(&p->lock);
+					return NULL;
+				}
+				p->slabs = slabs;
+				p->slab_capacity = p->slab_capacity ? p->slab_capacity * 2 : 16;
+			}
+			if (!(p->slabs[p->slab_count] = (char *)malloc(p->size * POOL_SLAB))) {
+				pthread_mutex_unlock(&p->lock);
+				return NULL;
+			}
+			p->slab_count++;
+			p->slab_used = 0;
+		}
+		object = p->slabs[p->slab_count - 1] + p->size * p->slab_used++;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return object;
+}
+
+
+/*	Return the object to the pool
+
+	param p ... pool
+	param object ... object allocated by pool_alloc
+*/
+void pool_free(pool *p, void *object) {
+	pthread_mutex_lock(&p->lock);
+	*(void **)object = p->free_list;
+	p->free_list = object;
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/*	Free all slabs of the pool (all its objects at once)
+
+	param p ... pool
+*/
+void pool_release(pool *p) {
+	int i;
+	
+	pthread_mutex_lock(&p->lock);
+	for (i = 0; i < p->slab_count; i++) {
+		free(p->slabs[i]);
+	}
+	free(p->slabs);
+	p->slabs = NULL;
+	p->slab_count = 0;
+	p->slab_capacity = 0;
+	p->slab_used = POOL_SLAB;
+	p->free_list = NULL;
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/* Set specific i-node as free 
+
+	param id ... i-node id
+*/ 
+void clear_inode(int id) {
+	inode_ids[id] = FREE;
+	inode_dirs[id] = 0;
+	inodes[id].references = 0;
+	inode_sizes[id] = 0;
+	inodes[id].direct1 = FREE;
+	inodes[id].direct2 = FREE;
+	inodes[id].direct3 = FREE;
+	inodes[id].direct4 = FREE;
+	inodes[id].direct5 = FREE;
+	inodes[id].indirect1 = FREE;
+	inodes[id].indirect2 = FREE;
+	inodes[id].flags = 0;
+	if (inline_capacity > 0) {
+		memset(INLINE_DATA(id), 0, inline_capacity);
+	}
+}
+
+
+/*	Update size of all i-nodes on the path from the directory to root
+
+	param dir ... the directory from which we move up in hierarchy
+	param size ... adding size to originally size (can be negative if remove file)
+*/
+void update_sizes(directory *dir, int32_t size) {
+	directory *d = dir;
+	while (d != directories[0]) {
+		pthread_rwlock_wrlock(&inode_locks[d->current->inode]);
+		inode_sizes[d->current->inode] += size;
+		update_inode(d->current->inode);
+		pthread_rwlock_unlock(&inode_locks[d->current->inode]);
+		d = d->parent;
+	}
+	
+	pthread_rwlock_wrlock(&inode_locks[d->current->inode]);
+	inode_sizes[d->current->inode] += size;
+	update_inode(d->current->inode);	
+	pthread_rwlock_unlock(&inode_locks[d->current->inode]);
+}
+
+
+/*	Print info about file/directory
+
+	param item ... file or directory
+*/
+void print_info(directory_item *item) {
+	int i;
+	int32_t number; // Data block number
+	inode node = inodes[item->inode];
+	
+	reply("%s - %dB - i-node %d -", item->item_name, inode_sizes[item->inode], inode_ids[item->inode]);
+	if (node.flags & INODE_INLINE) {
+		reply(" Inline\n");
+		return;
+	}
+	if (node.flags & INODE_COMPRESSED) {
+		reply(" Compressed -");
+	}
+	reply(" Dir:");
+	if (node.direct1 != FREE) {
+		reply(" %d", node.direct1);
+	}
+	if (node.direct2 != FREE) {
+		reply(" %d", node.direct2);
+	}
+	if (node.direct3 != FREE) {
+		reply(" %d", node.direct3);
+	}
+	if (node.direct4 != FREE) {
+		reply(" %d", node.direct4);
+	}
+	if (node.direct5 != FREE) {
+		reply(" %d", node.direct5);
+	}
+	reply(" Indir:");
+	if (node.indirect1 != FREE) {
+		reply(" (%d)", node.indirect1);
+		fseek(fs, sb->data_start_address + node.indirect1 * CLUSTER_SIZE, SEEK_SET);
+		for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
+			fread(&number, sizeof(int32_t), 1, fs);
+			if (number == 0) 
+				break;
+			reply(" %d", number);
+		}
+	}
+	if (node.indirect2 != FREE) {
+		reply(" (%d)", node.indirect2);
+		fseek(fs, sb->data_start_address + node.indirect2 * CLUSTER_SIZE, SEEK_SET);
+		for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
+			fread(&number, sizeof(int32_t), 1, fs);
+			if (number == 0) 
+				break;
+			reply(" %d", number);
+		}
+	}
+	reply("\n");
+}
+
+
+/* 	Write the range of the content of the file
+
+	param nodeid ... i-node of the file
+	param out ... output stream
+	param offset ... first written byte of the file
+	param length ... count of written bytes (the range must be within the file)
+	return 0 = no error, -1 = corrupted data, -2 = data do not match their checksums
+*/
+int write_file(int32_t nodeid, FILE *out, int32_t offset, int32_t length) {
+	int i, first, count, run, skip, size, result = NO_ERROR;
+	int32_t *blocks;
+	char *buffer;
+	
+	if (length <= 0)
+		return NO_ERROR;
+	
+	if (inodes[nodeid].flags & INODE_INLINE) {	// Data are stored in the i-node
+		fwrite(INLINE_DATA(nodeid) + offset, sizeof(char), length, out);
+		return NO_ERROR;
+	}
+	
+	if ((result = verify_layout(nodeid)) != NO_ERROR)		// Numbers of data blocks cannot be trusted
+		return result;
+	
+	if (inodes[nodeid].flags & INODE_COMPRESSED) {	// Data blocks contain the compressed stream
+		return decompress_file(nodeid, out, offset, length);
+	}
+	
+	// Get only data blocks covering the range
+	first = offset / CLUSTER_SIZE;
+	count = (offset + length - 1) / CLUSTER_SIZE - first + 1;
+	blocks = get_block_range(nodeid, first, count);
+	buffer = (char *)malloc(READ_BUFFER);
+	
+	skip = offset % CLUSTER_SIZE;
+	for (i = 0; i < count; i += run) {
+		run = count - i;
+		if (run > READ_BUFFER / CLUSTER_SIZE)
+			run = READ_BUFFER / CLUSTER_SIZE;
+		if ((result = read_blocks(blocks + i, run, buffer)) != NO_ERROR)	// Corrupted data are not written
+			break;
+		
+		size = run * CLUSTER_SIZE - skip;
+		if (size > length)
+			size = length;
+		fwrite(buffer + skip, sizeof(char), size, out);
+		length -= size;
+		skip = 0;
+	}
+	
+	fflush(fs);
+	free(buffer);
+	free(blocks);
+	return result;
+}
+
+
+/*	Read data blocks to the memory (consecutive data blocks are read at once), their checksums are verified
+
+	param blocks ... numbers of data blocks
+	param count ... count of data blocks
+	param buffer ... memory for the content of data blocks (count * CLUSTER_SIZE bytes)
+	return 0 = no error, -2 = some data block does not match its checksum
+*/
+int read_blocks(int32_t *blocks, int count, char *buffer) {
+	int i, run, result;
+	
+	for (i = 0; i < count; i += run) {
+		for (run = 1; i + run < count && blocks[i + run] == blocks[i] + run; run++);
+		fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+		fread(buffer + i * CLUSTER_SIZE, CLUSTER_SIZE, run, fs);
+		if ((result = verify_blocks(blocks[i], run, buffer + i * CLUSTER_SIZE)) != NO_ERROR)
+			return result;
+	}
+	return NO_ERROR;
+}
+
+
+/*	Write decompressed content of the compressed file
+	(data blocks contain the table of compressed lengths of all chunks followed by the chunks)
+
+	param nodeid ... i-node of the compressed file
+	param out ... output stream
+	param offset ... first written byte of the file
+	param length ... count of written bytes (the range must be within the file)
+	return 0 = no error, -1 = corrupted data, -2 = data do not match their checksums
+*/
+int decompress_file(int32_t nodeid, FILE *out, int32_t offset, int32_t length) {
+	int i, block_count, rest, chunk_count, first, last, table_blocks, from, to, result;
+	int32_t *blocks, *lengths, start, end;
+	char *stream;
+	
+	if (length <= 0)
+		return NO_ERROR;
+	
+	blocks = get_data_blocks(nodeid, &block_count, &rest);
+	stream = (char *)malloc(block_count * CLUSTER_SIZE);
+	chunk_count = (inode_sizes[nodeid] + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	first = offset / CHUNK_SIZE;
+	last = (offset + length - 1) / CHUNK_SIZE;
+	
+	// Read the table of lengths
+	table_blocks = (chunk_count * sizeof(int32_t) + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	if (table_blocks > block_count) {
+		free(stream);
+		free(blocks);
+		return ERROR;
+	}
+	if ((result = read_blocks(blocks, table_blocks, stream)) != NO_ERROR) {
+		free(stream);
+		free(blocks);
+		return result;
+	}
+	lengths = (int32_t *)stream;
+	
+	// Find the part of the stream with chunks covering the range
+	start = chunk_count * sizeof(int32_t);
+	for (i = 0; i < first; i++)
+		start += lengths[i] & ~CHUNK_RAW;
+	end = start;
+	for (i = first; i <= last; i++)
+		end += lengths[i] & ~CHUNK_RAW;
+	if (end > block_count * CLUSTER_SIZE) {	// Chunks are out of the stream
+		free(stream);
+		free(blocks);
+		return ERROR;
+	}
+	
+	// Read only data blocks of the part (blocks of the table are already read)
+	from = start / CLUSTER_SIZE;
+	if (from < table_blocks)
+		from = table_blocks;
+	to = (end + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	result = NO_ERROR;
+	if (from < to)
+		result = read_blocks(blocks + from, to - from, stream + from * CLUSTER_SIZE);
+	fflush(fs);
+	free(blocks);
+	if (result != NO_ERROR) {
+		free(stream);
+		return result;
+	}
+	
+	result = inflate_chunks(stream, inode_sizes[nodeid], start, first, last, out, offset, length);
+	free(stream);
+	return result;
+}
+
+
+/*	Write decompressed chunks of the compressed stream loaded in the memory
+
+	param stream ... compressed stream (the table of lengths and the chunks of the range must be loaded)
+	param size ... size of the file
+	param position ... start of the first chunk in the stream
+	param first ... index of the first chunk
+	param last ... index of the last chunk
+	param out ... output stream
+	param offset ... first written byte of the file
+	param length ... count of written bytes
+	return 0 = no error, -1 = corrupted data
+*/
+int inflate_chunks(char *stream, int32_t size, int32_t position, int first, int last, FILE *out, int32_t offset, int32_t length) {
+	int i, from, to, chunk_size, result = NO_ERROR;
+	int32_t *lengths = (int32_t *)stream, chunk_length;
+	uint8_t chunk[CHUNK_SIZE];
+	
+	// Decompress chunk by chunk
+	for (i = first; i <= last; i++) {
+		chunk_length = lengths[i] & ~CHUNK_RAW;
+		chunk_size = size - i * CHUNK_SIZE;
+		if (chunk_size > CHUNK_SIZE)
+			chunk_size = CHUNK_SIZE;
+		
+		if (lengths[i] & CHUNK_RAW) {
+			memcpy(chunk, stream + position, chunk_size);
+		}
+		else if (lz_decompress((uint8_t *)stream + position, chunk_length, chunk, chunk_size) != chunk_size) {
+			result = ERROR;
+			break;
+		}
+		position += chunk_length;
+		
+		// Write only the part of the chunk within the range
+		from = (i == first) ? offset - i * CHUNK_SIZE : 0;
+		to = (i == last) ? offset + length - i * CHUNK_SIZE : chunk_size;
+		fwrite(chunk + from, sizeof(char), to - from, out);
+	}
+	return result;
+}
+
+
+/*	Compress data of the file chunk by chunk
+
+	param data ... data of the file
+	param size ... size of the data
+	param stored_size ... address to store size of the compressed stream
+	return compressed stream or NULL if compression does not save any space
+*/
+char *compress_data(char *data, int32_t size, int32_t *stored_size) {
+	int i, length, raw_length;
+	int chunk_count = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	int32_t offset = chunk_count * sizeof(int32_t);
+	int32_t *lengths;
+	char *stream = (char *)malloc(offset + size + CLUSTER_SIZE);	// Stream is padded to whole data blocks
+	
+	if (!stream) return NULL;
+	lengths = (int32_t *)stream;
+	
+	for (i = 0; i < chunk_count; i++) {
+		raw_length = size - i * CHUNK_SIZE;
+		if (raw_length > CHUNK_SIZE)
+			raw_length = CHUNK_SIZE;
+		
+		// Compressed chunk has to be smaller than the raw chunk
+		length = lz_compress((uint8_t *)data + i * CHUNK_SIZE, raw_length, (uint8_t *)stream + offset, raw_length - 1);
+		if (length == ERROR) {	// Store the chunk raw
+			memcpy(stream + offset, data + i * CHUNK_SIZE, raw_length);
+			lengths[i] = raw_length | CHUNK_RAW;
+			length = raw_length;
+		}
+		else {
+			lengths[i] = length;
+		}
+		offset += length;
+	}
+	
+	if (offset >= size) {	// No space is saved
+		free(stream);
+		return NULL;
+	}
+	
+	memset(stream + offset, 0, CLUSTER_SIZE - offset % CLUSTER_SIZE);	// Whole last data block is hashed by deduplication
+	*stored_size = offset;
+	return stream;
+}
+
+
+/*	Compress data with a simple LZ77 codec (LZ4-like format of sequences)
+	Sequence: token (4 bits count of literals, 4 bits length of match - LZ_MIN_MATCH), 
+			  extended count of literals, literals, offset of match (2 bytes), extended length of match
+	The last sequence contains only literals.
+
+	param src ... source data
+	param length ... length of the source data
+	param dst ... destination buffer
+	param capacity ... size of the destination buffer
+	return length of the compressed data or -1 if the data does not fit into the buffer
+*/
+int lz_compress(const uint8_t *src, int length, uint8_t *dst, int capacity) {
+	int32_t table[1 << LZ_HASH_BITS];	// Last positions of the hashed sequences of LZ_MIN_MATCH bytes
+	int i, ip = 0, anchor = 0, op = 0, ref, literals, match, misses = 0;
+	int limit = length - LZ_LAST_LITERALS;
+	uint32_t sequence, hash;
+	
+	for (i = 0; i < (1 << LZ_HASH_BITS); i++) {
+		table[i] = ERROR;
+	}
+	
+	while (ip + LZ_MIN_MATCH <= limit) {
+		memcpy(&sequence, src + ip, sizeof(sequence));
+		hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+		ref = table[hash];
+		table[hash] = ip;
+		
+		if (ref == ERROR || (ip - ref) > LZ_MAX_OFFSET || memcmp(src + ref, src + ip, LZ_MIN_MATCH) != 0) {
+			ip += 1 + (misses++ >> 5);	// Skip faster through incompressible data
+			continue;
+		}
+		misses = 0;
+		
+		// Extend the match
+		match = LZ_MIN_MATCH;
+		while (ip + match < limit && src[ref + match] == src[ip + match]) {
+			match++;
+		}
+		
+		// Store the sequence
+		literals = ip - anchor;
+		if (op + 1 + literals / 255 + 1 + literals + 2 + (match - LZ_MIN_MATCH) / 255 + 1 > capacity) {
+			return ERROR;
+		}
+		dst[op++] = ((literals < 15 ? literals : 15) << 4) | (match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15);
+		if (literals >= 15) {
+			op = lz_put_length(dst, op, literals - 15);
+		}
+		memcpy(dst + op, src + anchor, literals);
+		op += literals;
+		dst[op++] = (ip - ref) & 0xFF;
+		dst[op++] = (ip - ref) >> 8;
+		if (match - LZ_MIN_MATCH >= 15) {
+			op = lz_put_length(dst, op, match - LZ_MIN_MATCH - 15);
+		}
+		
+		ip += match;
+		anchor = ip;
+	}
+	
+	// Store the last literals
+	literals = length - anchor;
+	if (op + 1 + literals / 255 + 1 + literals > capacity) {
+		return ERROR;
+	}
+	dst[op++] = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15) {
+		op = lz_put_length(dst, op, literals - 15);
+	}
+	memcpy(dst + op, src + anchor, literals);
+	op += literals;
+	
+	return op;
+}
+
+
+/*	Store the extended length of the literals/match (bytes 255 until the rest is smaller), the caller checks
+	that the length fits into the destination buffer
+
+	param dst ... destination buffer
+	param op ... position in the destination buffer
+	param length ... storing length
+	return new position in the destination buffer
+*/
+int lz_put_length(uint8_t *dst, int op, int length) {
+	while (length >= 255) {
+		dst[op++] = 255;
+		length -= 255;
+	}
+	dst[op++] = length;
+	return op;
+}
+
+
+/*	Decompress data compressed by lz_compress
+
+	param src ... compressed data
+	param length ... length of the compressed data
+	param dst ... destination buffer
+	param capacity ... size of the destination buffer
+	return length of the decompressed data or -1 if the data are corrupted
+*/
+int lz_decompress(const uint8_t *src, int length, uint8_t *dst, int capacity) {
+	int ip = 0, op = 0, literals, match, offset;
+	uint8_t token, b;
+	
+	while (ip < length) {
+		token = src[ip++];
+		
+		// Copy literals
+		literals = token >> 4;
+		if (literals == 15) {
+			do {
+				if (ip >= length) return ERROR;
+				b = src[ip++];
+				literals += b;
+			} while (b == 255);
+		}
+		if (ip + literals > length || op + literals > capacity) {
+			return ERROR;
+		}
+		memcpy(dst + op, src + ip, literals);
+		ip += literals;
+		op += literals;
+		
+		if (ip == length) {	// The last sequence
+			break;
+		}
+		
+		// Copy match (may overlap)
+		if (ip + 2 > length) return ERROR;
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		match = token & 0x0F;
+		if (match == 15) {
+			do {
+				if (ip >= length) return ERROR;
+				b = src[ip++];
+				match += b;
+			} while (b == 255);
+		}
+		match += LZ_MIN_MATCH;
+		
+		if (offset == 0 || offset > op || op + match > capacity) {
+			return ERROR;
+		}
+		while (match-- > 0) {
+			dst[op] = dst[op - offset];
+			op++;
+		}
+	}
+	return op;
+}
+
+
+/* Printf the message of unformatted filesystem. */
+void print_format_msg() {
+	reply("The filesystem has to be formatted first.\nUsage: format SIZE [-i N] [-z] [-d] [-c]\n");
+}
+
+/*	Set i-node as file and initialize all data blocks
+
+	param id ... i-node ID
+	param size ... size of the file
+	param block_count ... count of data blocks occupied by file
+	param tmp_count ... block_count + blocks for indirect references
+	param last_block_index ... address of the index to the last data block of the file
+	param blocks ... data blocks
+*/
+void initialize_inode(int32_t id, int32_t size, int block_count, int tmp_count, int *last_block_index, int32_t *blocks) {
+	int tmp;
+	inode *node = &inodes[id];
+	
+	inode_ids[id] = id;
+	inode_dirs[id] = 0;
+	node->references = 1;
+	inode_sizes[id] = size;
+	node->direct1 = (block_count > 0) ? blocks[0] : FREE;
+	
+	*last_block_index = 0;
+	if (block_count > 1) {
+		node->direct2 = blocks[1];
+		*last_block_index = 1;
+		
+		if (block_count > 2) {
+			node->direct3 = blocks[2];
+			*last_block_index = 2;
+			
+			if (block_count > 3) {
+				node->direct4 = blocks[3];
+				*last_block_index = 3;
+				
+				if (block_count > 4) {
+					node->direct5 = blocks[4];
+					*last_block_index = 4;
+					
+					if (block_count > 5) {
+						node->indirect1 = blocks[tmp_count - 1];
+						
+						
+						if (block_count > 261) {
+							node->indirect2 = blocks[tmp_count - 2];
+							*last_block_index = tmp_count - 3;
+							fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
+							fwrite_data(&blocks[5], sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, sb->data_start_address + node->indirect1 * CLUSTER_SIZE);
+							
+							tmp = block_count - 261;
+							fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
+							fwrite_data(&blocks[261], sizeof(int32_t), tmp, sb->data_start_address + node->indirect2 * CLUSTER_SIZE);
+						}
+						else  {
+							*last_block_index = tmp_count - 2;
+							tmp = block_count - 5;
+							fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
+							fwrite_data(&blocks[5], sizeof(int32_t), tmp, sb->data_start_address + node->indirect1 * CLUSTER_SIZE);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+
+/*	Load filesystem from the file */
+int load_fs() {
+	int i;
+	
+	if (!fs) {
+		fs = open_fs("rb+");
+	}
+	if (fs_fd < 0) {
+		fs_fd = open(fs_name, O_RDWR);
+	}
+
+	// Load superblock
+	sb = (struct superblock *)malloc(sizeof(struct superblock));
+	if (!sb || !fs || fs_fd < 0) {
+		reply("Filesystem loading failed.\n");
+		return ERROR;
+	}
+	
+	fread(&(sb->disk_size), sizeof(int32_t), 1, fs);
+	fread(&(sb->cluster_size), sizeof(int32_t), 1, fs);
+	fread(&(sb->cluster_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->inode_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->bitmap_cluster_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->inode_cluster_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->data_cluster_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->bitmap_start_address), sizeof(int32_t), 1, fs);
+	fread(&(sb->inode_start_address), sizeof(int32_t), 1, fs);
+	fread(&(sb->data_start_address), sizeof(int32_t), 1, fs);
+	fread(&(sb->inode_size), sizeof(int32_t), 1, fs);
+	fread(&(sb->features), sizeof(int32_t), 1, fs);
+	fread(&(sb->dedup_cluster_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->dedup_start_address), sizeof(int32_t), 1, fs);
+	fread(&(sb->defrag_cursor), sizeof(int32_t), 1, fs);
+	fread(&(sb->snapshot_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->snapshot_table), sizeof(int32_t), 1, fs);
+	fread(&(sb->checksum_cluster_count), sizeof(int32_t), 1, fs);
+	fread(&(sb->checksum_start_address), sizeof(int32_t), 1, fs);
+	
+	if (sb->inode_size == 0) {	// Filesystem without extended i-nodes
+		sb->inode_size = INODE_SIZE;
+	}
+	inline_capacity = (sb->inode_size > INODE_SIZE) ? sb->inode_size - INODE_HEADER_SIZE : 0;
+	
+//	printf("Size: %d\nCount of clusters: %d\nCount of i-nodes: %d\nCount of bitmap blocks: %d\nCount of i-node blocks: %d\nCount of data blocks: %d\nAddress of bitmap: %d\nAddress of i-nodes: %d\nAddress of data: %d\n", 
+//	sb->disk_size, sb->cluster_count, sb->inode_count, sb->bitmap_cluster_count, sb->inode_cluster_count, sb->data_cluster_count, sb->bitmap_start_address, sb->inode_start_address, sb->data_start_address);
+	
+	bitmap = (int8_t *)malloc(sb->data_cluster_count);
+	alloc_inodes(sb->inode_count);
+	directories = (directory **)calloc(sb->inode_count, sizeof(directory *));
+	if (inline_capacity > 0) {
+		inline_data = (char *)malloc(inline_capacity * sb->inode_count);
+	}
+	if (sb->features & FEATURE_DEDUP) {
+		dedup_hashes = (uint64_t *)malloc(HASH_SIZE * sb->data_cluster_count);
+	}
+	if (sb->features & FEATURE_CHECKSUM) {
+		checksums = (uint32_t *)malloc(CHECKSUM_SIZE * sb->data_cluster_count);
+		checksums_dirty = (int8_t *)calloc(sb->checksum_cluster_count, sizeof(int8_t));
+	}
+	if (!bitmap || !inodes || !directories || (inline_capacity > 0 && !inline_data) || ((sb->features & FEATURE_DEDUP) && !dedup_hashes)
+		|| ((sb->features & FEATURE_CHECKSUM) && (!checksums || !checksums_dirty))) {
+		reply(CCF);
+		return ERROR;
+	}
+	
+	init_locks();
+	
+	// Load bitmap
+	fseek(fs, sb->bitmap_start_address, SEEK_SET);
+	fread(bitmap, sizeof(int8_t), sb->data_cluster_count, fs);
+	
+	// Load hashes of data blocks
+	if (sb->features & FEATURE_DEDUP) {
+		fseek(fs, sb->dedup_start_address, SEEK_SET);
+		fread(dedup_hashes, HASH_SIZE, sb->data_cluster_count, fs);
+		build_dedup_index();
+	}
+	
+	// Load checksums of data blocks
+	if (sb->features & FEATURE_CHECKSUM) {
+		init_crc32c();
+		fseek(fs, sb->checksum_start_address, SEEK_SET);
+		fread(checksums, CHECKSUM_SIZE, sb->data_cluster_count, fs);
+	}
+	
+	// Load the table of snapshots
+	if (sb->snapshot_count > 0) {
+		fseek(fs, sb->data_start_address + sb->snapshot_table * CLUSTER_SIZE, SEEK_SET);
+		fread(snapshots, sizeof(snapshot_info), sb->snapshot_count, fs);
+	}
+	
+	// Load i-nodes
+	fseek(fs, sb->inode_start_address, SEEK_SET);
+	for (i = 0; i < sb->inode_count; i++) {
+		fread(&(inode_ids[i]), sizeof(int32_t), 1, fs);
+		fread(&(inode_dirs[i]), sizeof(int8_t), 1, fs);
+		fread(&(inodes[i].references), sizeof(int8_t), 1, fs);
+		fread(&(inode_sizes[i]), sizeof(int32_t), 1, fs);
+		fread(&(inodes[i].direct1), sizeof(int32_t), 1, fs);
+		fread(&(inodes[i].direct2), sizeof(int32_t), 1, fs);
+		fread(&(inodes[i].direct3), sizeof(int32_t), 1, fs);
+		fread(&(inodes[i].direct4), sizeof(int32_t), 1, fs);
+		fread(&(inodes[i].direct5), sizeof(int32_t), 1, fs);
+		fread(&(inodes[i].indirect1), sizeof(int32_t), 1, fs);
+		fread(&(inodes[i].indirect2), sizeof(int32_t), 1, fs);
+		inodes[i].flags = 0;
+		
+		if (sb->inode_size > INODE_SIZE) {	// Extended i-node
+			fread(&(inodes[i].flags), sizeof(int8_t), 1, fs);
+			fread(INLINE_DATA(i), sizeof(char), inline_capacity, fs);
+		}
+	}
+	
+	// Load directories
+	reload_directories();
+	return NO_ERROR;
+}
+
+
+/*	Create the tree of directories from the file, the root becomes the working directory */
+void reload_directories() {
+	directory *root;
+	
+	// Create root directory
+	root = (directory *)pool_alloc(&directory_pool);
+	if (!root) {
+		reply(CCF);
+		return;
+	}
+	root->current = create_directory_item(0,"/");
+	root->parent = root;
+	root->subdir = NULL;
+	root->file = NULL;
+	pthread_mutex_init(&(root->lock), NULL);
+
+	working_directory = root;	// Set root as working directory
+	reset_sessions(NULL, root);
+	directories[0] = root;
+	
+	load_directory(root, 0);
+}
+
+
+/*	Load all items of the directory from the file
+
+	param dir ... directory
+	param id ... directory id
+*/
+void load_directory(directory *dir, int id) {
+	int i, j, block_count, rest;
+	int inode_count = 64;	// Maximum count of i-nodes in one data block
+	int32_t *blocks;		// Numbers of data blocks
+	int32_t nodeid;			// Item id
+	char name[12];			// Item name
+	directory *newdir;
+	directory_item *item, *temp;
+	directory_item **psubdir = &(dir->subdir);	// Address of the last (free) subdirectory in the list of subdirectories
+	directory_item **pfile = &(dir->file);		// Address of the last (free) file in the list of files
+	
+	// Get data blocks of this directory
+	blocks = get_data_blocks(dir->current->inode, &block_count, NULL);
+	
+	for (i = 0; i < block_count; i++) {		// Iteration over data blocks
+		fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+		for (j = 0; j < inode_count; j++) {	// Iteration over items in data block
+			fread(&nodeid, sizeof(int32_t), 1, fs);		// Read inode id, if id < 1 -> invalid item and skip to the next item
+			if (nodeid > 0 && nodeid < sb->inode_count && inode_ids[nodeid] != FREE) {
+				fread(name, sizeof(name), 1, fs);
+				item = create_directory_item(nodeid, name);
+				if (inode_dirs[nodeid]) {	// If item is directory
+					*psubdir = item;
+					psubdir = &(item->next);
+				}
+				else {								// If item is file
+					*pfile = item;
+					pfile = &(item->next);
+				}
+			}
+			else {
+				fseek(fs, sizeof(name), SEEK_CUR);	// Skip the place for the name of the file/directory
+			} 
+		}	
+	}
+	free(blocks);
+
+	// Recursive call this function on all loaded subdirectories
+	temp = dir->subdir;
+	while (temp != NULL) {
+		newdir = (directory *)pool_alloc(&directory_pool);
+		newdir->parent = dir;
+		newdir->current = temp;
+		newdir->subdir = NULL;
+		newdir->file = NULL;
+		pthread_mutex_init(&(newdir->lock), NULL);
+		
+		directories[temp->inode] = newdir;
+		load_directory(newdir, temp->inode);
+		
+		temp = temp->next;
+	}
+}
+
+
+/*	Update bitmap in the file according to the file/directory
+
+	param item ... file/directory
+	param value ... 1 = use data blocks, 0 = free data blocks
+	param data_blocks ... data blocks of the item or NULL (directory)
+	param b_count ... count of blocks if not NULL
+*/
+void update_bitmap(directory_item *item, int8_t value, int32_t *data_blocks, int b_count) {
+	int i, block_count, rest;
+	int32_t *blocks; 
+	
+	if (!data_blocks) {
+		blocks = get_data_blocks(item->inode, &block_count, NULL);
+	}
+	else {
+		blocks = data_blocks;
+		block_count = b_count;
+	}
+	for (i = 0; i < block_count; i++) {
+		set_references(blocks[i], value);
+	}
+
+	// Indirect references blocks
+	if (inodes[item->inode].indirect1 != FREE) {
+		set_references(inodes[item->inode].indirect1, value);
+	}
+	if (inodes[item->inode].indirect2 != FREE) {
+		set_references(inodes[item->inode].indirect2, value);
+	}
+
+	fflush(fs);
+}
+
+
+/* 	Update specific i-node in the file
+
+	param id ... i-node id = offset in the file from the start of i-nodes
+*/
+void update_inode(int id) {
+	char record[MAX_INODE_SIZE];
+	
+	if (batch_running) {
+		defer_inode(id);
+		return;
+	}
+	pack_inode(id, record);
+	fseek(fs, sb->inode_start_address + id * sb->inode_size, SEEK_SET);
+	fwrite(record, sb->inode_size, 1, fs);
+	fflush(fs);
+}
+
+
+/*	Store the i-node into its record in the file format
+
+	param id ... i-node id
+	param record ... buffer for the record (sb->inode_size bytes)
+*/
+void pack_inode(int id, char *record) {
+	inode *node = &inodes[id];
+	
+	memcpy(record, &(inode_ids[id]), sizeof(int32_t));
+	memcpy(record + 4, &(inode_dirs[id]), sizeof(int8_t));
+	memcpy(record + 5, &(node->references), sizeof(int8_t));
+	memcpy(record + 6, &(inode_sizes[id]), sizeof(int32_t));
+	memcpy(record + 10, &(node->direct1), sizeof(int32_t));
+	memcpy(record + 14, &(node->direct2), sizeof(int32_t));
+	memcpy(record + 18, &(node->direct3), sizeof(int32_t));
+	memcpy(record + 22, &(node->direct4), sizeof(int32_t));
+	memcpy(record + 26, &(node->direct5), sizeof(int32_t));
+	memcpy(record + 30, &(node->indirect1), sizeof(int32_t));
+	memcpy(record + 34, &(node->indirect2), sizeof(int32_t));
+	
+	if (sb->inode_size > INODE_SIZE) {	// Extended i-node
+		memcpy(record + INODE_SIZE, &(node->flags), sizeof(int8_t));
+		memcpy(record + INODE_HEADER_SIZE, INLINE_DATA(id), inline_capacity);
+	}
+}
+
+
+/*	Load the references and flags of the i-node from its record in the file format (the i-node ID, 
+	the type, the size and inline data stay in the record)
+
+	param record ... record of the i-node (sb->inode_size bytes)
+	param node ... address to store the i-node
+*/
+void unpack_inode(char *record, inode *node) {
+	memcpy(&(node->references), record + 5, sizeof(int8_t));
+	memcpy(&(node->direct1), record + 10, sizeof(int32_t));
+	memcpy(&(node->direct2), record + 14, sizeof(int32_t));
+	memcpy(&(node->direct3), record + 18, sizeof(int32_t));
+	memcpy(&(node->direct4), record + 22, sizeof(int32_t));
+	memcpy(&(node->direct5), record + 26, sizeof(int32_t));
+	memcpy(&(node->indirect1), record + 30, sizeof(int32_t));
+	memcpy(&(node->indirect2), record + 34, sizeof(int32_t));
+	node->flags = 0;
+	
+	if (sb->inode_size > INODE_SIZE) {	// Extended i-node
+		memcpy(&(node->flags), record + INODE_SIZE, sizeof(int8_t));
+	}
+}
+
+
+/*	Store all i-nodes in the file at once */
+void store_inodes() {
+	int i;
+	char *records;
+	
+	if (batch_running) {
+		defer_inode(0);
+		defer_inode(sb->inode_count - 1);
+		return;
+	}
+	
+	records = (char *)malloc(sb->inode_size * sb->inode_count);
+	for (i = 0; i < sb->inode_count; i++) {
+		pack_inode(i, records + i * sb->inode_size);
+	}
+	fseek(fs, sb->inode_start_address, SEEK_SET);
+	fwrite(records, sb->inode_size, sb->inode_count, fs);
+	fflush(fs);
+	free(records);
+}
+
+
+/*	Store the superblock to the file */
+void store_superblock() {
+	if (batch_running) {
+		superblock_dirty = 1;
+		return;
+	}
+	
+	rewind(fs);
+	fwrite(&(sb->disk_size), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->cluster_size), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->cluster_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->inode_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->bitmap_cluster_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->inode_cluster_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->data_cluster_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->bitmap_start_address), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->inode_start_address), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->data_start_address), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->inode_size), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->features), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->dedup_cluster_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->dedup_start_address), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->defrag_cursor), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->snapshot_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->snapshot_table), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->checksum_cluster_count), sizeof(int32_t), 1, fs);
+	fwrite(&(sb->checksum_start_address), sizeof(int32_t), 1, fs);
+	fflush(fs);
+}
+
+
+/*	Update directory - add/remove item from the file
+
+	param dir ... directory
+	param item ... item adding/removing to/from the directory
+	param action ... 1 = add item, 0 = remove item
+	return 0 = success, -1 = all data blocks of the directory are full or removing item was not found
+*/
+int update_directory(directory *dir, directory_item *item, int action) {
+	int i, j, block_count, prev, item_count, found = 0, result;
+	int32_t *blocks, *free_block, indirect, slot;
+	int name_length = 12;
+	int zeros[4] = {0};  // buffer with zeros - for removing the item from the file
+	int max_items_in_block = 64;
+	int32_t nodeid;
+	inode *dir_node;
+	
+	// Items are changed in place -> blocks of the directory shared with snapshots are copied first
+	if (sb->snapshot_count > 0) {
+		pthread_rwlock_wrlock(&inode_locks[dir->current->inode]);
+		pthread_mutex_lock(&alloc_lock);
+		result = unshare_blocks(dir->current->inode);
+		pthread_mutex_unlock(&alloc_lock);
+		pthread_rwlock_unlock(&inode_locks[dir->current->inode]);
+		if (result == ERROR)
+			return ERROR;
+	}
+	
+	// Get data blocks
+	blocks = get_data_blocks(dir->current->inode, &block_count, NULL);
+
+	if (action == 1) {	// Store item (find free space)
+		for (i = 0; i < block_count; i++) {
+			fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+			for (j = 0; j < max_items_in_block; j++) {
+				fread(&nodeid, sizeof(int32_t), 1, fs);
+				if (nodeid == 0) {	// Free place found -> store item
+					fseek(fs, -4, SEEK_CUR);
+					fflush(fs);
+					fwrite_data(&(item->inode), sizeof(int32_t), 1, sb->data_start_address + blocks[i] * CLUSTER_SIZE + j * (sizeof(int32_t) + name_length));
+					fwrite_data(item->item_name, sizeof(item->item_name), 1, sb->data_start_address + blocks[i] * CLUSTER_SIZE + j * (sizeof(int32_t) + name_length) + sizeof(int32_t));
+					fflush(fs);
+					free(blocks);
+					return NO_ERROR;
+				}
+				else {
+					fseek(fs, name_length, SEEK_CUR);	// Skip the space for name
+				}
+			}
+		}
+		
+		// No free space was found in the current data blocks of the directory -> try to find another free data block
+		pthread_rwlock_wrlock(&inode_locks[dir->current->inode]);
+		pthread_mutex_lock(&alloc_lock);
+		free_block = find_free_data_blocks(1);	// Use direct reference
+		if (!free_block) {
+			pthread_mutex_unlock(&alloc_lock);
+			pthread_rwlock_unlock(&inode_locks[dir->current->inode]);
+			return ERROR;
+		}
+		
+		dir_node = &(inodes[dir->current->inode]);
+		
+		if (dir_node->direct1 == FREE) {
+			dir_node->direct1 = free_block[0];
+		}
+		else if (dir_node->direct2 == FREE) {
+			dir_node->direct2 = free_block[0];
+		}
+		else if (dir_node->direct3 == FREE) {
+			dir_node->direct3 = free_block[0];
+		}
+		else if (dir_node->direct4 == FREE) {
+			dir_node->direct4 = free_block[0];
+		}
+		else if (dir_node->direct5 == FREE) {
+			dir_node->direct5 = free_block[0];
+		}
+		else {
+			// Use a free reference in an indirect block or a new indirect block (need 2 free blocks)
+			indirect = FREE;
+			if ((slot = find_free_reference(dir_node->indirect1)) != ERROR) {
+				indirect = dir_node->indirect1;
+			}
+			else if ((slot = find_free_reference(dir_node->indirect2)) != ERROR) {
+				indirect = dir_node->indirect2;
+			}
+			else if (dir_node->indirect1 == FREE || dir_node->indirect2 == FREE) {
+				free(free_block);
+				free_block = find_free_data_blocks(2);
+				if (!free_block) {
+					pthread_mutex_unlock(&alloc_lock);
+					pthread_rwlock_unlock(&inode_locks[dir->current->inode]);
+					free(blocks);
+					return ERROR;
+				}
+				
+				indirect = free_block[1];
+				slot = 0;
+				memset(block_buffer, 0, CLUSTER_SIZE);
+				fseek(fs, sb->data_start_address + indirect * CLUSTER_SIZE, SEEK_SET);
+				fwrite_data(block_buffer, CLUSTER_SIZE, 1, sb->data_start_address + indirect * CLUSTER_SIZE);
+				if (dir_node->indirect1 == FREE)
+					dir_node->indirect1 = indirect;
+				else
+					dir_node->indirect2 = indirect;
+			}
+			
+			if (indirect == FREE) {	// All references of the directory are used
+				pthread_mutex_unlock(&alloc_lock);
+				pthread_rwlock_unlock(&inode_locks[dir->current->inode]);
+				free(free_block);
+				free(blocks);
+				return ERROR;
+			}
+			fseek(fs, sb->data_start_address + indirect * CLUSTER_SIZE + slot * sizeof(int32_t), SEEK_SET);
+			fwrite_data(&(free_block[0]), sizeof(int32_t), 1, sb->data_start_address + indirect * CLUSTER_SIZE + slot * sizeof(int32_t));
+		}
+
+		// Other items of the new data block are free
+		memset(block_buffer, 0, CLUSTER_SIZE);
+		fseek(fs, sb->data_start_address + free_block[0] * CLUSTER_SIZE, SEEK_SET);
+		fwrite_data(block_buffer, CLUSTER_SIZE, 1, sb->data_start_address + free_block[0] * CLUSTER_SIZE);
+		fseek(fs, sb->data_start_address + free_block[0] * CLUSTER_SIZE, SEEK_SET);
+		fwrite_data(&(item->inode), sizeof(int32_t), 1, sb->data_start_address + free_block[0] * CLUSTER_SIZE);
+		fwrite_data(item->item_name, sizeof(item->item_name), 1, sb->data_start_address + free_block[0] * CLUSTER_SIZE + sizeof(int32_t));
+		
+		fflush(fs);
+		update_bitmap(dir->current, 1, NULL, 0);
+		pthread_mutex_unlock(&alloc_lock);
+		update_inode(dir->current->inode);
+		pthread_rwlock_unlock(&inode_locks[dir->current->inode]);
+		free(free_block);
+		free(blocks);
+		return NO_ERROR;
+	}
+	else {	// Remove item (find the item with the specific id)
+		prev = blocks[0];
+		for (i = 0; i < block_count; i++) {
+			if (prev != (blocks[i] - 1)) {
+				fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+			}
+
+			item_count = 0;	// Counter of items in this data block
+			for (j = 0; j < max_items_in_block; j++) {
+				fread(&nodeid, sizeof(int32_t), 1, fs);
+				if (nodeid > 0)
+					item_count++;
+					
+				if (!found && nodeid == (item->inode)) {
+					fseek(fs, -4, SEEK_CUR);
+					fflush(fs);
+					fwrite_data(&zeros, sizeof(zeros), 1, sb->data_start_address + blocks[i] * CLUSTER_SIZE + j * (sizeof(int32_t) + name_length));
+					fflush(fs);
+					found = 1;
+					if (item_count > 1)
+						break;
+				}
+				else {
+					fseek(fs, name_length, SEEK_CUR);	// Skip the name
+				}
+			}
+			if (found) {	// If the only item in the data block was removing item -> free data block
+				if (item_count == 1) {
+					pthread_rwlock_wrlock(&inode_locks[dir->current->inode]);
+					pthread_mutex_lock(&alloc_lock);
+					remove_reference(dir->current, blocks[i]);
+					pthread_mutex_unlock(&alloc_lock);
+					pthread_rwlock_unlock(&inode_locks[dir->current->inode]);
+				}
+				
+				free(blocks);
+				return NO_ERROR;
+			}
+			prev = blocks[i];
+		}
+	}
+	return ERROR;
+}
+
+
+/*	Find a free reference (0) in the indirect block of the directory
+
+	param indirect ... number of the indirect block or FREE
+	return index of the free reference, -1 = no free reference or no indirect block
+*/
+int32_t find_free_reference(int32_t indirect) {
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK];
+	int i;
+	
+	if (indirect == FREE)
+		return ERROR;
+	
+	fseek(fs, sb->data_start_address + indirect * CLUSTER_SIZE, SEEK_SET);
+	fread(numbers, sizeof(int32_t), MAX_NUMBERS_IN_BLOCK, fs);
+	for (i = 0; i < MAX_NUMBERS_IN_BLOCK; i++) {
+		if (numbers[i] <= 0)
+			return i;
+	}
+	return ERROR;
+}
+
+
+/*	Remove reference to the data block from i-node (except data block of direct1)
+	(+from the file with indirect references)
+
+	param item ... directory in which we remove data block
+	param block_id ... number of the removing data block
+*/
+void remove_reference(directory_item *item, int32_t block_id) {
+	int i, j;
+	int32_t number, count, found, zero = 0, blocks[2];
+	inode *node = &inodes[item->inode];
+	
+	if (node->direct1 == block_id) {	// First direct block is not removing
+		return;
+	}
+	else if (node->direct2 == block_id) {
+		blocks[0] = node->direct2;
+		node->direct2 = FREE;
+	}
+	else if (node->direct3 == block_id) {
+		blocks[0] = node->direct3;
+		node->direct3 = FREE;
+	}
+	else if (node->direct4 == block_id) {
+		blocks[0] = node->direct4;
+		node->direct4 = FREE;
+	}
+	else if (node->direct5 == block_id) {
+		blocks[0] = node->direct5;
+		node->direct5 = FREE;
+	}
+	else {
+		for (i = 0; i < 2; i++) {
+			if ((i == 0 ? node->indirect1 : node->indirect2) == FREE)	// The other indirect block may be released
+				continue;
+			if (i == 0)	// Go through indirect1
+				fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
+			else 		// Go through indirect2
+				fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
+			
+			count = 0;
+			found = 0;
+			for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
+				fread(&number, sizeof(int32_t), 1, fs);
+				if (number > 0) 
+					count++;
+				if (!found) {
+					if (number == block_id) {
+						found = 1;
+						blocks[0] = number;
+						fseek(fs, -4, SEEK_CUR);
+						fflush(fs);
+						fwrite_data(&zero, sizeof(int32_t), 1, sb->data_start_address + (i == 0 ? node->indirect1 : node->indirect2) * CLUSTER_SIZE + j * sizeof(int32_t));
+						fflush(fs);
+						if (count > 1)
+							break;
+					}
+				}
+			}
+			
+			if (found) {
+				if (count == 1) {
+					if (i == 0) {
+						blocks[1] = node->indirect1;
+						node->indirect1 = FREE;
+					}
+					else {
+						blocks[1] = node->indirect2;
+						node->indirect2 = FREE;
+					}
+				}
+				break;
+			}
+		}
+	}
+	
+	update_bitmap(item, 0, blocks, 1);
+	update_inode(item->inode);
+}
+
+
+/*	Compute the 128-bit hash of the content of the data block (MurmurHash3 x64)
+
+	param data ... content of the data block (CLUSTER_SIZE bytes)
+	param hash ... address to store the hash (2 numbers), hash is never 0
+*/
+void hash_block(const char *data, uint64_t *hash) {
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	int i;
+	
+	for (i = 0; i < CLUSTER_SIZE; i += 16) {
+		memcpy(&k1, data + i, sizeof(uint64_t));
+		memcpy(&k2, data + i + 8, sizeof(uint64_t));
+		
+		k1 *= c1; 
+		k1 = ROTL64(k1, 31); 
+		k1 *= c2; 
+		h1 ^= k1;
+		h1 = ROTL64(h1, 27); 
+		h1 += h2; 
+		h1 = h1 * 5 + 0x52dce729;
+		
+		k2 *= c2; 
+		k2 = ROTL64(k2, 33); 
+		k2 *= c1; 
+		h2 ^= k2;
+		h2 = ROTL64(h2, 31); 
+		h2 += h1; 
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+	
+	h1 ^= CLUSTER_SIZE;
+	h2 ^= CLUSTER_SIZE;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	
+	if (h1 == 0 && h2 == 0) {	// 0 means that the block is not indexed
+		h1 = 1;
+	}
+	hash[0] = h1;
+	hash[1] = h2;
+}
+
+
+/*	Final mix of the hash (MurmurHash3)
+
+	param k ... part of the hash
+	return mixed value
+*/
+uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+
+/*	Build the hash table of all indexed data blocks (from the loaded hashes) */
+void build_dedup_index() {
+	int32_t i, pos;
+	
+	free(dedup_index);
+	dedup_index = NULL;
+	dedup_index_size = 0;
+	
+	if (!(sb->features & FEATURE_DEDUP)) 
+		return;
+	
+	// At least 2 items per data block -> short chains
+	dedup_index_size = 1;
+	while (dedup_index_size < 2 * sb->data_cluster_count) {
+		dedup_index_size *= 2;
+	}
+	
+	dedup_index = (int32_t *)malloc(sizeof(int32_t) * dedup_index_size);
+	for (i = 0; i < dedup_index_size; i++) {
+		dedup_index[i] = FREE;
+	}
+	
+	for (i = 0; i < sb->data_cluster_count; i++) {
+		if (bitmap[i] == 0 || (dedup_hashes[2 * i] == 0 && dedup_hashes[2 * i + 1] == 0))
+			continue;
+		
+		pos = dedup_hashes[2 * i] & (dedup_index_size - 1);
+		while (dedup_index[pos] != FREE) {
+			pos = (pos + 1) & (dedup_index_size - 1);
+		}
+		dedup_index[pos] = i;
+	}
+}
+
+
+/*	Find the stored data block with the same content
+
+	param hash ... hash of the content
+	param data ... content of the data block (to verify the match)
+	return number of the data block or -1 if not found
+*/
+int32_t find_duplicate(uint64_t *hash, char *data) {
+	int32_t pos, block;
+	char buffer[CLUSTER_SIZE];
+	
+	pos = hash[0] & (dedup_index_size - 1);
+	while ((block = dedup_index[pos]) != FREE) {
+		if (dedup_hashes[2 * block] == hash[0] && dedup_hashes[2 * block + 1] == hash[1] && bitmap[block] < MAX_SHARED) {
+			// Verify the content, the hash is not cryptographic
+			fseek(fs, sb->data_start_address + block * CLUSTER_SIZE, SEEK_SET);
+			fread(buffer, sizeof(buffer), 1, fs);
+			if (memcmp(buffer, data, CLUSTER_SIZE) == 0) {
+				return block;
+			}
+		}
+		pos = (pos + 1) & (dedup_index_size - 1);
+	}
+	return ERROR;
+}
+
+
+/*	Add the data block to the index (+store its hash to the file)
+
+	param block ... number of the data block
+	param hash ... hash of the content of the data block
+*/
+void insert_dedup_block(int32_t block, uint64_t *hash) {
+	int32_t pos;
+	
+	dedup_hashes[2 * block] = hash[0];
+	dedup_hashes[2 * block + 1] = hash[1];
+	if (batch_running) {
+		defer_blocks(block, block);
+	}
+	else {
+		fseek(fs, sb->dedup_start_address + block * HASH_SIZE, SEEK_SET);
+		fwrite(&dedup_hashes[2 * block], HASH_SIZE, 1, fs);
+	}
+	
+	pos = hash[0] & (dedup_index_size - 1);
+	while (dedup_index[pos] != FREE) {
+		pos = (pos + 1) & (dedup_index_size - 1);
+	}
+	dedup_index[pos] = block;
+}
+
+
+/*	Remove the data block from the index (+clear its hash in the file)
+
+	param block ... number of the data block
+*/
+void remove_dedup_block(int32_t block) {
+	int32_t pos, next, home;
+	uint64_t zero[2] = {0};
+	int32_t mask = dedup_index_size - 1;
+	
+	if (dedup_hashes[2 * block] == 0 && dedup_hashes[2 * block + 1] == 0) {	// Block is not indexed
+		return;
+	}
+	
+	pos = dedup_hashes[2 * block] & mask;
+	while (dedup_index[pos] != block) {
+		if (dedup_index[pos] == FREE) 
+			break;
+		pos = (pos + 1) & mask;
+	}
+	
+	// Shift back the following items of the chain so that lookups don't stop at the hole
+	if (dedup_index[pos] == block) {
+		next = pos;
+		while (1) {
+			next = (next + 1) & mask;
+			if (dedup_index[next] == FREE) 
+				break;
+			
+			home = dedup_hashes[2 * dedup_index[next]] & mask;
+			if (((next > pos) && (home <= pos || home > next)) || ((next < pos) && (home <= pos && home > next))) {
+				dedup_index[pos] = dedup_index[next];
+				pos = next;
+			}
+		}
+		dedup_index[pos] = FREE;
+	}
+	
+	dedup_hashes[2 * block] = 0;
+	dedup_hashes[2 * block + 1] = 0;
+	if (batch_running) {
+		defer_blocks(block, block);
+		return;
+	}
+	fseek(fs, sb->dedup_start_address + block * HASH_SIZE, SEEK_SET);
+	fwrite(zero, HASH_SIZE, 1, fs);
+}
+
+
+/*	Set the count of references to the data block (+store it in the bitmap in the file)
+
+	param block ... number of the data block
+	param count ... count of references, 0 = free block
+*/
+void set_references(int32_t block, int8_t count) {
+	bitmap[block] = count;
+	if (batch_running) {
+		defer_blocks(block, block);
+		return;
+	}
+	fseek(fs, sb->bitmap_start_address + block, SEEK_SET);
+	fwrite(&count, sizeof(int8_t), 1, fs);
+}
+
+
+/*	Find data blocks which can be shared with the data of the file
+
+	param data ... data of the file (block_count * CLUSTER_SIZE bytes)
+	param block_count ... count of data blocks of the file
+	return array of candidates - stored data block with the same content, -(i + 2) if the content 
+		is the same as i-th block of this file, FREE if the content is unique
+*/
+int32_t *find_duplicates(char *data, int block_count) {
+	int i, j;
+	uint64_t *hashes = (uint64_t *)malloc(HASH_SIZE * block_count);
+	int32_t *candidates = (int32_t *)malloc(sizeof(int32_t) * block_count);
+	
+	for (i = 0; i < block_count; i++) {
+		hash_block(data + i * CLUSTER_SIZE, &hashes[2 * i]);
+		candidates[i] = find_duplicate(&hashes[2 * i], data + i * CLUSTER_SIZE);
+		if (candidates[i] != ERROR) 
+			continue;
+		
+		// The same content as the previous unique block of this file
+		for (j = 0; j < i; j++) {
+			if (candidates[j] == FREE && hashes[2 * j] == hashes[2 * i] && hashes[2 * j + 1] == hashes[2 * i + 1] 
+				&& memcmp(data + j * CLUSTER_SIZE, data + i * CLUSTER_SIZE, CLUSTER_SIZE) == 0) {
+				candidates[i] = -(j + 2);
+				break;
+			}
+		}
+	}
+	
+	free(hashes);
+	return candidates;
+}
+
+
+/*	Allocate data blocks of the file, candidates are shared if they can get another reference
+
+	param candidates ... data blocks which can be shared (see find_duplicates)
+	param block_count ... count of data blocks of the file
+	param tmp_count ... block_count + blocks for indirect references
+	param new_blocks ... address to store 1 for every data block which has to be written, 0 for shared block
+	return array of data blocks (as find_free_data_blocks) or NULL if not enough blocks found
+*/
+int32_t *allocate_shared_blocks(int32_t *candidates, int block_count, int tmp_count, int8_t *new_blocks) {
+	int i, j, refs, count = 0;
+	int32_t *blocks = (int32_t *)malloc(sizeof(int32_t) * (tmp_count + 1));	// Empty file has no blocks
+	int32_t *free_blocks = NULL;
+	
+	for (i = 0; i < block_count; i++) {
+		blocks[i] = candidates[i];
+		new_blocks[i] = 0;
+		
+		if (candidates[i] == FREE) {
+			new_blocks[i] = 1;
+			continue;
+		}
+		
+		// Count references to the candidate including the previous blocks of this file
+		refs = (candidates[i] >= 0) ? bitmap[candidates[i]] : 1;
+		for (j = 0; j < i; j++) {
+			if (blocks[j] == candidates[i])
+				refs++;
+		}
+		if (refs >= MAX_SHARED) {
+			blocks[i] = FREE;
+			new_blocks[i] = 1;
+		}
+	}
+	
+	for (i = 0; i < block_count; i++) {
+		count += new_blocks[i];
+	}
+	count += tmp_count - block_count;	// Blocks for indirect references
+	
+	if (count > 0) {
+		free_blocks = find_free_data_blocks(count);
+		if (!free_blocks) {
+			free(blocks);
+			return NULL;
+		}
+	}
+	
+	j = 0;
+	for (i = 0; i < block_count; i++) {
+		if (new_blocks[i])
+			blocks[i] = free_blocks[j++];
+	}
+	for (i = 0; i < block_count; i++) {
+		if (blocks[i] < FREE)	// The same block as the previous block of this file
+			blocks[i] = blocks[-blocks[i] - 2];
+	}
+	for (i = block_count; i < tmp_count; i++) {
+		blocks[i] = free_blocks[j++];
+	}
+	
+	free(free_blocks);
+	return blocks;
+}
+
+
+/*	Add references to the allocated data blocks of the file (+index the new blocks)
+
+	param data ... data of the file or NULL if new blocks should not be indexed
+	param blocks ... data blocks of the file
+	param block_count ... count of data blocks
+	param new_blocks ... 1 = new block, 0 = shared block
+*/
+void reference_shared_blocks(char *data, int32_t *blocks, int block_count, int8_t *new_blocks) {
+	int i;
+	uint64_t hash[2];
+	
+	for (i = 0; i < block_count; i++) {
+		if (new_blocks[i]) {
+			set_references(blocks[i], 1);
+			if (data) {
+				hash_block(data + i * CLUSTER_SIZE, hash);
+				insert_dedup_block(blocks[i], hash);
+			}
+		}
+		else {
+			set_references(blocks[i], bitmap[blocks[i]] + 1);
+			dedup_saved_writes++;
+		}
+	}
+	fflush(fs);
+}
+
+
+/*	Remove one reference from shared data blocks of the removed file
+
+	param blocks ... data blocks of the file, the blocks which become free are moved to the beginning
+	param block_count ... count of data blocks
+	return count of data blocks which become free
+*/
+int release_shared_blocks(int32_t *blocks, int block_count) {
+	int i, count = 0;
+	
+	for (i = 0; i < block_count; i++) {
+		if (bitmap[blocks[i]] > 1) {
+			set_references(blocks[i], bitmap[blocks[i]] - 1);
+		}
+		else {
+			if (sb->features & FEATURE_DEDUP)
+				remove_dedup_block(blocks[i]);
+			blocks[count++] = blocks[i];
+		}
+	}
+	fflush(fs);
+	return count;
+}
+
+
+/*	Print or change the verification of checksums of data blocks (only the filesystem formatted with -c
+	has checksums). Every write of data blocks updates their checksums, reads of files (cat, outcp, cp)
+	verify them - the verification can be turned off for the speed (only for the session, like its working
+	directory).
+
+	Usage:	checksum ... print the state of checksums
+			checksum on | off ... turn the verification on or off
+
+	param args ... on, off or nothing
+*/
+void checksum(char *args) {
+	char *mode = strtok_r(args, DELIM, &tokens);
+	
+	if (!fs_formatted) {
+		print_format_msg();
+		return;	
+	}
+	
+	if (!mode) {
+		if (sb->features & FEATURE_CHECKSUM)
+			reply("CHECKSUMS ON (%s, VERIFICATION %s)\n", crc32c_hardware ? "SSE4.2" : "SOFTWARE", verify_checksums ? "ON" : "OFF");
+		else
+			reply("CHECKSUMS OFF\n");
+		return;
+	}
+	if (strcmp(mode, "on") == 0)
+		verify_checksums = 1;
+	else if (strcmp(mode, "off") == 0)
+		verify_checksums = 0;
+	else {
+		reply("Usage: checksum [on | off]\n");
+		return;
+	}
+	reply(OK);
+}
+
+
+/*	Prepare the table of the software computation of CRC32C and test if the processor has the instruction crc32 */
+void init_crc32c() {
+	char cluster[CLUSTER_SIZE];
+	uint32_t i, j, value;
+	
+	for (i = 0; i < 256; i++) {
+		value = i;
+		for (j = 0; j < 8; j++) {
+			value = (value >> 1) ^ ((value & 1) ? CRC32C_POLY : 0);
+		}
+		crc32c_table[i] = value;
+	}
+#ifdef CRC32C_HARDWARE
+	crc32c_hardware = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#endif
+	memset(cluster, 0, CLUSTER_SIZE);
+	zero_crc = crc32c(0, cluster, CLUSTER_SIZE);
+}
+
+
+/*	Compute CRC32C of the data (the instruction crc32 of SSE4.2 is used when the processor has it)
+
+	param crc ... CRC32C of the previous data, 0 = none
+	param data ... data
+	param length ... count of bytes
+	return CRC32C of the previous data followed by these data
+*/
+uint32_t crc32c(uint32_t crc, const char *data, size_t length) {
+#ifdef CRC32C_HARDWARE
+	if (crc32c_hardware)
+		return crc32c_sse42(crc, data, length);
+#endif
+	crc = ~crc;
+	while (length-- > 0) {
+		crc = (crc >> 8) ^ crc32c_table[(crc ^ (uint8_t)*data++) & 0xFF];
+	}
+	return ~crc;
+}
+
+
+#ifdef CRC32C_HARDWARE
+/*	Compute CRC32C of the data by the instruction crc32 (8 bytes at once, 32 bytes in one step of the loop)
+
+	param crc ... CRC32C of the previous data, 0 = none
+	param data ... data
+	param length ... count of bytes
+	return CRC32C of the previous data followed by these data
+*/
+__attribute__((target("sse4.2"))) uint32_t crc32c_sse42(uint32_t crc, const char *data, size_t length) {
+	uint64_t value = (uint32_t)~crc;
+	const uint64_t *words = (const uint64_t *)data;
+	
+	for (; length >= 4 * sizeof(uint64_t); length -= 4 * sizeof(uint64_t), words += 4) {
+		value = __builtin_ia32_crc32di(value, words[0]);
+		value = __builtin_ia32_crc32di(value, words[1]);
+		value = __builtin_ia32_crc32di(value, words[2]);
+		value = __builtin_ia32_crc32di(value, words[3]);
+	}
+	for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), words++) {
+		value = __builtin_ia32_crc32di(value, *words);
+	}
+	data = (const char *)words;
+	for (; length > 0; length--, data++) {
+		value = __builtin_ia32_crc32qi((uint32_t)value, (uint8_t)*data);
+	}
+	return ~(uint32_t)value;
+}
+#endif
+
+
+/*	Remember checksums of data blocks covered by the write of the image (writes of data blocks call it).
+	Checksums are applied at the end of the command (the data are in the file then), so the partly written
+	data block is read again whole only once.
+
+	param data ... written data
+	param offset ... position of the write in the image
+	param length ... count of written bytes
+*/
+void update_checksums(const char *data, off_t offset, size_t length) {
+	off_t start = offset - sb->data_start_address, end = start + (off_t)length, position;
+	off_t size = (off_t)sb->data_cluster_count * CLUSTER_SIZE;	// Size of the area of data blocks
+	int32_t block, last;
+	int i, count;
+	const char *cluster;
+	checksum_update batch[CHECKSUM_BATCH], *update;
+	
+	if (length == 0 || end <= 0 || start >= size)	// Write of other areas
+		return;
+	if (start < 0) {
+		data -= start;
+		start = 0;
+	}
+	if (end > size)
+		end = size;
+	
+	last = (end - 1) / CLUSTER_SIZE;
+	for (block = start / CLUSTER_SIZE; block <= last; block += count) {
+		// Checksums are computed without the lock (workers write concurrently)
+		count = (last - block + 1 < CHECKSUM_BATCH) ? last - block + 1 : CHECKSUM_BATCH;
+		for (i = 0; i < count; i++) {
+			position = (off_t)(block + i) * CLUSTER_SIZE;
+			cluster = data + (position - start);
+			batch[i].block = block + i;
+			batch[i].partial = !(position >= start && position + CLUSTER_SIZE <= end);
+			if (batch[i].partial)
+				batch[i].crc = 0;
+			else if (cluster[0] == 0 && memcmp(cluster, cluster + 1, CLUSTER_SIZE - 1) == 0)	// Cleared data block
+				batch[i].crc = zero_crc;
+			else
+				batch[i].crc = crc32c(0, cluster, CLUSTER_SIZE);
+		}
+		
+		pthread_mutex_lock(&checksum_lock);
+		if (pending_sum_count + count > pending_sum_capacity) {
+			pending_sum_capacity = (pending_sum_capacity > count) ? 2 * pending_sum_capacity : 2 * count + CHECKSUM_BATCH;
+			pending_sums = (checksum_update *)realloc(pending_sums, sizeof(checksum_update) * pending_sum_capacity);
+		}
+		update = pending_sum_count > 0 ? &pending_sums[pending_sum_count - 1] : NULL;
+		if (update && update->block == block && (!batch[0].partial || update->partial))	// Overwritten block, or the block is read once (parts of one directory item)
+			pending_sum_count--;
+		memcpy(&pending_sums[pending_sum_count], batch, sizeof(checksum_update) * count);
+		pending_sum_count += count;
+		pthread_mutex_unlock(&checksum_lock);
+	}
+}
+
+
+/*	Write data blocks (or their part) at the current position of the image and remember their checksums,
+	the write is counted by the calling function (fwrite_data)
+
+	param offset ... position of the write in the image (the position of the stream, it is not asked for)
+	param site ... calling function
+	return count of written items
+*/
+size_t write_data(const void *data, size_t size, size_t count, off_t offset, const char *site) {
+	size_t result = stat_fwrite(data, size, count, fs, site);
+	
+	if (checksums)
+		update_checksums((const char *)data, offset, result * size);
+	return result;
+}
+
+
+/*	Apply pending checksums of all sessions, later writes of the same data block override earlier ones.
+	Partly written data blocks are read from the image - the stream of the session is flushed first, streams
+	of other sessions are not buffered while more threads use the filesystem (open_fs) and workers write
+	the file directly.
+*/
+void apply_checksums() {
+	char cluster[CLUSTER_SIZE];
+	int i;
+	checksum_update *update;
+	
+	if (fs)
+		fflush(fs);		// Data of pending checksums are in the file
+	pthread_mutex_lock(&checksum_lock);
+	for (i = 0; i < pending_sum_count; i++) {
+		update = &pending_sums[i];
+		if (!update->partial)
+			checksums[update->block] = update->crc;
+		else if (read_at(cluster, CLUSTER_SIZE, (off_t)sb->data_start_address + (off_t)update->block * CLUSTER_SIZE) == NO_ERROR)
+			checksums[update->block] = crc32c(0, cluster, CLUSTER_SIZE);
+		mark_checksums(update->block, update->block);
+	}
+	pending_sum_count = 0;
+	pthread_mutex_unlock(&checksum_lock);
+}
+
+
+/*	Remember changed checksums of the range of data blocks, their clusters are stored by store_checksums
+	(the caller holds checksum_lock)
+
+	param first ... first data block
+	param last ... last data block
+*/
+void mark_checksums(int32_t first, int32_t last) {
+	int32_t i;
+	
+	first = first * CHECKSUM_SIZE / CLUSTER_SIZE;		// Clusters of checksums
+	last = last * CHECKSUM_SIZE / CLUSTER_SIZE;
+	for (i = first; i <= last; i++) {
+		checksums_dirty[i] = 1;
+	}
+	if (first < dirty_checksum_first)
+		dirty_checksum_first = first;
+	if (last > dirty_checksum_last)
+		dirty_checksum_last = last;
+}
+
+
+/*	Store changed clusters of checksums (directly to the file, consecutive clusters are written at once,
+	the position of the stream is kept)
+*/
+void store_checksums() {
+	int32_t i, j;
+	off_t from, to, size = (off_t)CHECKSUM_SIZE * sb->data_cluster_count;	// Size of all checksums
+	
+	pthread_mutex_lock(&checksum_lock);
+	for (i = dirty_checksum_first; i <= dirty_checksum_last; i = j) {
+		if (!checksums_dirty[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i; j <= dirty_checksum_last && checksums_dirty[j]; j++) {
+			checksums_dirty[j] = 0;
+		}
+		from = (off_t)i * CLUSTER_SIZE;
+		to = ((off_t)j * CLUSTER_SIZE < size) ? (off_t)j * CLUSTER_SIZE : size;
+		write_at((char *)checksums + from, to - from, (off_t)sb->checksum_start_address + from);
+	}
+	dirty_checksum_first = INT_MAX;
+	dirty_checksum_last = -1;
+	pthread_mutex_unlock(&checksum_lock);
+}
+
+
+/* Store checksums of data blocks written by the session so far (at the end of every command) */
+void flush_checksums() {
+	if (!checksums)
+		return;
+	apply_checksums();
+	store_checksums();
+}
+
+
+/*	Verify checksums of consecutive data blocks read to the memory (only with FEATURE_CHECKSUM
+	and turned on verification)
+
+	param first ... first data block
+	param count ... count of data blocks
+	param data ... content of the data blocks
+	return 0 = data match their checksums, -1 = some data block is out of the range, -2 = some data block is corrupted
+*/
+int verify_blocks(int32_t first, int count, const char *data) {
+	int i, pending;
+	
+	if (!checksums || !verify_checksums)
+		return NO_ERROR;
+	if (first < 0 || first + count > sb->data_cluster_count)
+		return ERROR;
+	
+	pthread_mutex_lock(&checksum_lock);		// Workers and other sessions add pending checksums
+	pending = pending_sum_count;
+	pthread_mutex_unlock(&checksum_lock);
+	if (pending > 0)	// Checksums of data blocks written by commands which have not finished yet
+		apply_checksums();
+	
+	for (i = 0; i < count; i++) {
+		if (crc32c(0, data + i * CLUSTER_SIZE, CLUSTER_SIZE) != checksums[first + i])
+			return BAD_CHECKSUM;
+	}
+	return NO_ERROR;
+}
+
+
+/*	Verify indirect blocks of the file - their checksums and numbers of data blocks in them (only with
+	FEATURE_CHECKSUM and turned on verification)
+
+	param nodeid ... i-node of the file
+	return 0 = no error, -1 = some indirect block is corrupted, -2 = some indirect block does not match its checksum
+*/
+int verify_layout(int32_t nodeid) {
+	int i, j, result;
+	int32_t numbers[MAX_NUMBERS_IN_BLOCK];
+	int32_t indirect[2] = {inodes[nodeid].indirect1, inodes[nodeid].indirect2};
+	
+	if (!checksums || !verify_checksums || (inodes[nodeid].flags & INODE_INLINE))
+		return NO_ERROR;
+	
+	for (i = 0; i < 2; i++) {
+		if (indirect[i] == FREE)
+			continue;
+		if (indirect[i] < 0 || indirect[i] >= sb->data_cluster_count)
+			return ERROR;
+		
+		fseek(fs, sb->data_start_address + indirect[i] * CLUSTER_SIZE, SEEK_SET);
+		if (fread(numbers, CLUSTER_SIZE, 1, fs) != 1)
+			return ERROR;
+		if ((result = verify_blocks(indirect[i], 1, (char *)numbers)) != NO_ERROR)
+			return result;
+		for (j = 0; j < MAX_NUMBERS_IN_BLOCK; j++) {
+			if (numbers[j] < FREE || numbers[j] >= sb->data_cluster_count)	// Free item is 0 (or FREE)
+				return ERROR;
+		}
+	}
+	return NO_ERROR;
+}
+
+
+/*	Store the inline or compressed file as a plain file with the changed content
+
+	param nodeid ... i-node of the file
+	param offset ... offset of the written data
+	param data ... written data, NULL = zeros
+	param length ... count of written bytes
+	param new_size ... new size of the file
+	return 0 = no error, -1 = not enough space, 1 = corrupted data, -2 = data do not match their checksums
+*/
+int expand_file(int32_t nodeid, int32_t offset, char *data, int32_t length, int32_t new_size) {
+	int block_count, rest, count, result;
+	int32_t kept, *blocks;
+	size_t stream_size;
+	char *content, *stream;
+	FILE *f;
+	inode saved = inodes[nodeid];
+	
+	// Current content of the file (only the part which is kept)
+	kept = (inode_sizes[nodeid] < new_size) ? inode_sizes[nodeid] : new_size;
+	content = (char *)calloc(new_size + 1, sizeof(char));
+	if (saved.flags & INODE_INLINE) {
+		memcpy(content, INLINE_DATA(nodeid), kept);
+	}
+	else {
+		f = open_memstream(&stream, &stream_size);
+		if ((result = decompress_file(nodeid, f, 0, kept)) != NO_ERROR) {
+			fclose(f);
+			free(stream);
+			free(content);
+			return (result == BAD_CHECKSUM) ? BAD_CHECKSUM : 1;
+		}
+		fclose(f);
+		memcpy(content, stream, kept);
+		free(stream);
+	}
+	if (data)
+		memcpy(content + offset, data, length);
+	
+	// Old data blocks are released when the new ones are written
+	blocks = get_data_blocks(nodeid, &block_count, &rest);
+	blocks = (int32_t *)realloc(blocks, sizeof(int32_t) * (block_count + 2));
+	if (saved.indirect1 != FREE)
+		blocks[block_count++] = saved.indirect1;
+	if (saved.indirect2 != FREE)
+		blocks[block_count++] = saved.indirect2;
+	
+	inodes[nodeid].direct1 = inodes[nodeid].direct2 = inodes[nodeid].direct3 = inodes[nodeid].direct4 = inodes[nodeid].direct5 = FREE;
+	inodes[nodeid].indirect1 = inodes[nodeid].indirect2 = FREE;
+	inodes[nodeid].flags = 0;
+	
+	count = (new_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	if (resize_blocks(nodeid, 0, count) == ERROR) {
+		inodes[nodeid] = saved;
+		free(blocks);
+		free(content);
+		return ERROR;
+	}
+	if (new_size > 0 && write_blocks(nodeid, 0, content, new_size) == ERROR) {
+		resize_blocks(nodeid, count, 0);
+		inodes[nodeid] = saved;
+		free(blocks);
+		free(content);
+		return ERROR;
+	}
+	
+	pthread_mutex_lock(&alloc_lock);
+	release_blocks(blocks, block_count);
+	pthread_mutex_unlock(&alloc_lock);
+	if (saved.flags & INODE_INLINE)
+		memset(INLINE_DATA(nodeid), 0, inline_capacity);
+	
+	free(blocks);
+	free(content);
+	return NO_ERROR;
+}
+
+
+/*	Change the count of data blocks of the plain file, new data blocks are appended to the direct
+	and indirect references, removed data blocks are released (+indirect blocks which are no longer needed)
+
+	param nodeid ... i-node of the file
+	param old_count ... current count of data blocks
+	param new_count ... new count of data blocks
+	return 0 = no error, -1 = not enough space
+*/
+int resize_blocks(int32_t nodeid, int old_count, int new_count) {
+	int i, count, result;
+	int32_t *blocks, *removed, zero[MAX_NUMBERS_IN_BLOCK] = {0};
+	inode *node = &inodes[nodeid];
+	
+	// References in indirect blocks are changed in place -> blocks shared with snapshots are copied first
+	if (sb->snapshot_count > 0 && new_count != old_count) {
+		pthread_mutex_lock(&alloc_lock);
+		result = unshare_blocks(nodeid);
+		pthread_mutex_unlock(&alloc_lock);
+		if (result == ERROR)
+			return ERROR;
+	}
+	
+	if (new_count > old_count) {
+		count = new_count - old_count;
+		if (new_count > 5 && old_count <= 5)		// First indirect reference is needed
+			count++;
+		if (new_count > 261 && old_count <= 261)	// Second indirect reference is needed
+			count++;
+		
+		pthread_mutex_lock(&alloc_lock);
+		blocks = find_free_data_blocks(count);
+		if (!blocks) {
+			pthread_mutex_unlock(&alloc_lock);
+			return ERROR;
+		}
+		for (i = 0; i < count; i++) {
+			set_references(blocks[i], 1);
+		}
+		pthread_mutex_unlock(&alloc_lock);
+		
+		// Indirect blocks follow the data blocks, they are cleared before the references are added
+		i = new_count - old_count;
+		if (new_count > 5 && old_count <= 5) {
+			node->indirect1 = blocks[i++];
+			fseek(fs, sb->data_start_address + node->indirect1 * CLUSTER_SIZE, SEEK_SET);
+			fwrite_data(zero, sizeof(zero), 1, sb->data_start_address + node->indirect1 * CLUSTER_SIZE);
+		}
+		if (new_count > 261 && old_count <= 261) {
+			node->indirect2 = blocks[i++];
+			fseek(fs, sb->data_start_address + node->indirect2 * CLUSTER_SIZE, SEEK_SET);
+			fwrite_data(zero, sizeof(zero), 1, sb->data_start_address + node->indirect2 * CLUSTER_SIZE);
+		}
+		set_block_range(nodeid, old_count, new_count - old_count, blocks);
+		fflush(fs);
+		free(blocks);
+	}
+	else if (new_count < old_count) {
+		count = old_count - new_count;
+		blocks = get_block_range(nodeid, new_count, count);
+		blocks = (int32_t *)realloc(blocks, sizeof(int32_t) * (count + 2));
+		
+		// Remove the references (direct references get FREE, items of indirect blocks get 0)
+		removed = (int32_t *)malloc(sizeof(int32_t) * count);
+		for (i = 0; i < count; i++) {
+			removed[i] = FREE;
+		}
+		set_block_range(nodeid, new_count, count, removed);
+		free(removed);
+		if (new_count <= 5 && old_count > 5) {
+			blocks[count++] = node->indirect1;
+			node->indirect1 = FREE;
+		}
+		if (new_count <= 261 && old_count > 261) {
+			blocks[count++] = node->indirect2;
+			node->indirect2 = FREE;
+		}
+		
+		pthread_mutex_lock(&alloc_lock);
+		release_blocks(blocks, count);
+		pthread_mutex_unlock(&alloc_lock);
+		free(blocks);
+	}
+	return NO_ERROR;
+}
+
+
+/*	Write the data into the data blocks of the plain file (the data blocks have to be allocated),
+	shared data blocks are copied before they are changed
+
+	param nodeid ... i-node of the file
+	param offset ... offset of the written data
+	param data ... written data, NULL = zeros
+	param length ... count of written bytes (at least 1)
+	return 0 = no error, -1 = not enough space for copies of shared data blocks
+*/
+int write_blocks(int32_t nodeid, int32_t offset, char *data, int32_t length) {
+	int i, j, first, count, run, shared = 0;
+	int32_t *blocks, *copies = NULL;
+	uint64_t hash[2];
+	char *buffer;
+	
+	first = offset / CLUSTER_SIZE;
+	count = (offset + length - 1) / CLUSTER_SIZE - first + 1;
+	blocks = get_block_range(nodeid, first, count);
+	buffer = (char *)malloc(count * CLUSTER_SIZE);
+	
+	// Data blocks which are written only partially keep the rest of their content
+	if (offset % CLUSTER_SIZE != 0)
+		read_blocks(blocks, 1, buffer);
+	if ((offset + length) % CLUSTER_SIZE != 0 && (count > 1 || offset % CLUSTER_SIZE == 0))
+		read_blocks(blocks + count - 1, 1, buffer + (count - 1) * CLUSTER_SIZE);
+	if (data)
+		memcpy(buffer + offset % CLUSTER_SIZE, data, length);
+	else
+		memset(buffer + offset % CLUSTER_SIZE, 0, length);
+	
+	if (BLOCKS_SHARED) {
+		pthread_mutex_lock(&alloc_lock);
+		for (i = 0; i < count; i++) {
+			shared += (bitmap[blocks[i]] > 1);
+		}
+		if (shared > 0 && (unshare_blocks(nodeid) == ERROR || !(copies = find_free_data_blocks(shared)))) {
+			pthread_mutex_unlock(&alloc_lock);
+			free(blocks);
+			free(buffer);
+			return ERROR;
+		}
+		
+		// Shared data block loses one reference and the file gets its copy, the hash of the changed block is replaced
+		for (i = 0, j = 0; i < count; i++) {
+			if (bitmap[blocks[i]] > 1) {
+				set_references(blocks[i], bitmap[blocks[i]] - 1);
+				blocks[i] = copies[j++];
+				set_references(blocks[i], 1);
+			}
+			else if (sb->features & FEATURE_DEDUP) {
+				remove_dedup_block(blocks[i]);
+			}
+			if (sb->features & FEATURE_DEDUP) {
+				hash_block(buffer + i * CLUSTER_SIZE, hash);
+				insert_dedup_block(blocks[i], hash);
+			}
+		}
+		pthread_mutex_unlock(&alloc_lock);
+		
+		if (shared > 0)
+			set_block_range(nodeid, first, count, blocks);
+		free(copies);
+	}
+	
+	for (i = 0; i < count; i += run) {
+		for (run = 1; i + run < count && blocks[i + run] == blocks[i] + run; run++);
+		fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+		fwrite_data(buffer + i * CLUSTER_SIZE, CLUSTER_SIZE, run, sb->data_start_address + blocks[i] * CLUSTER_SIZE);
+	}
+	fflush(fs);
+	
+	free(blocks);
+	free(buffer);
+	return NO_ERROR;
+}
+
+
+/*	Release data blocks - shared data blocks only lose one reference, the other blocks are cleared and freed
+	(the caller holds the lock of the allocation)
+
+	param blocks ... numbers of data blocks (the array is reordered)
+	param count ... count of data blocks
+*/
+void release_blocks(int32_t *blocks, int count) {
+	int i;
+	
+	if (BLOCKS_SHARED)
+		count = release_shared_blocks(blocks, count);
+	
+	memset(block_buffer, 0, CLUSTER_SIZE);
+	for (i = 0; i < count; i++) {
+		fseek(fs, sb->data_start_address + blocks[i] * CLUSTER_SIZE, SEEK_SET);
+		fwrite_data(block_buffer, sizeof(block_buffer), 1, sb->data_start_address + blocks[i] * CLUSTER_SIZE);
+		set_references(blocks[i], 0);
+	}
+	fflush(fs);
+}
+
+
+/*	Start the threads of the worker pool (if they are not running yet) */
+void start_workers() {
+	int i;
+	
+	if (worker_count > 0)
+		return;
+	
+	workers_exit = 0;
+	for (i = 0; i < WORKER_COUNT; i++) {
+		if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0)
+			break;
+		worker_count++;
+	}
+}
+
+
+/*	Stop all threads of the worker pool */
+void stop_workers() {
+	int i;
+	
+	pthread_mutex_lock(&job_lock);
+	workers_exit = 1;
+	pthread_cond_broadcast(&job_ready);
+	pthread_mutex_unlock(&job_lock);
+	
+	for (i = 0; i < worker_count; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	worker_count = 0;
+}
+
+
+/*	Main function of the worker - take jobs from the queue until the pool is stopped
+
+	param arg ... not used
+	return NULL
+*/
+void *worker_main(void *arg) {
+	io_job *job;
+	int result;
+	char *buffer = (char *)malloc(WORKER_BUFFER);	// Own buffer of the worker (JOB_COPY)
+	
+	pthread_mutex_lock(&job_lock);
+	while (1) {
+		while (job_next >= job_total && !workers_exit) {
+			pthread_cond_wait(&job_ready, &job_lock);
+		}
+		if (workers_exit)
+			break;
+		
+		job = &job_queue[job_next++];
+		trace_command = job_command;
+		verify_checksums = job_verify;
+		pthread_mutex_unlock(&job_lock);
+		
+		result = execute_job(job, buffer);
+		
+		pthread_mutex_lock(&job_lock);
+		if (result == BAD_CHECKSUM)
+			job_mismatches++;
+		else if (result != NO_ERROR)
+			job_errors++;
+		if (++job_finished == job_total)
+			pthread_cond_signal(&job_done);
+	}
+	pthread_mutex_unlock(&job_lock);
+	
+	free(buffer);
+	return NULL;
+}
+
+
+/*	Execute the jobs by the worker pool and wait until all of them are finished. 
+	Jobs must be independent - no job may write data blocks which other job reads or writes.
+
+	param jobs ... array of jobs
+	param count ... count of jobs
+	return 0 = success, -1 = some job failed, -2 = some copied data block does not match its checksum
+*/
+int run_jobs(io_job *jobs, int count) {
+	int i, result, errors = 0, mismatches = 0;
+	
+	if (count == 0)
+		return NO_ERROR;
+	
+	fflush(fs);		// Workers access the file directly, pending writes of the stream go first
+	pthread_mutex_lock(&submit_lock);
+	start_workers();
+	
+	if (worker_count == 0 || count == 1) {	// Threads are not available (or one job would only wait for them) -> execute the jobs here
+		for (i = 0; i < count; i++) {
+			result = execute_job(&jobs[i], NULL);
+			if (result == BAD_CHECKSUM)
+				mismatches++;
+			else if (result != NO_ERROR)
+				errors++;
+		}
+	}
+	else {
+		pthread_mutex_lock(&job_lock);
+		job_queue = jobs;
+		job_command = trace_command;
+		job_verify = verify_checksums;
+		job_next = 0;
+		job_total = count;
+		job_finished = 0;
+		job_errors = 0;
+		job_mismatches = 0;
+		pthread_cond_broadcast(&job_ready);
+		while (job_finished < count) {
+			pthread_cond_wait(&job_done, &job_lock);
+		}
+		errors = job_errors;
+		mismatches = job_mismatches;
+		job_total = 0;
+		job_next = 0;
+		pthread_mutex_unlock(&job_lock);
+	}
+	pthread_mutex_unlock(&submit_lock);
+	
+	fflush(fs);		// Discard data of the stream buffer, they may be outdated
+	return mismatches ? BAD_CHECKSUM : errors ? ERROR : NO_ERROR;
+}
+
+
+/*	Execute one job of the worker pool
+
+	param job ... job
+	param buffer ... own buffer of the worker (WORKER_BUFFER bytes), NULL = allocate a new one
+	return 0 = success, -1 = I/O error, -2 = source data block does not match its checksum (copy)
+*/
+int execute_job(io_job *job, char *buffer) {
+	int32_t done, size, count, result = NO_ERROR;
+	char *own = NULL;
+	
+	switch (job->kind) {
+		case JOB_READ:
+			return read_at(job->data, job->size, (off_t)sb->data_start_address + (off_t)job->from * CLUSTER_SIZE);
+		case JOB_WRITE:
+			result = write_at(job->data, job->size, (off_t)sb->data_start_address + (off_t)job->to * CLUSTER_SIZE);
+			if (checksums && !checksums_carried && result == NO_ERROR)
+				update_checksums(job->data, (off_t)sb->data_start_address + (off_t)job->to * CLUSTER_SIZE, job->size);
+			return result;
+		case JOB_COPY:
+			if (!buffer) 
+				buffer = own = (char *)malloc(WORKER_BUFFER);
+			
+			// Source blocks are read whole (also the partly copied last one) and their checksums are verified
+			for (done = 0; done < job->size && result == NO_ERROR; done += size) {
+				size = (job->size - done < WORKER_BUFFER) ? job->size - done : WORKER_BUFFER;
+				count = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+				result = read_at(buffer, count * CLUSTER_SIZE, (off_t)sb->data_start_address + (off_t)job->from * CLUSTER_SIZE + done);
+				if (result == NO_ERROR)
+					result = verify_blocks(job->from + done / CLUSTER_SIZE, count, buffer);
+				if (result == NO_ERROR)
+					result = write_at(buffer, size, (off_t)sb->data_start_address + (off_t)job->to * CLUSTER_SIZE + done);
+				if (checksums && result == NO_ERROR)
+					update_checksums(buffer, (off_t)sb->data_start_address + (off_t)job->to * CLUSTER_SIZE + done, size);
+			}
+			free(own);
+			return result;
+	}
+	return ERROR;
+}
+
+
+/*	Read data from the filesystem file at the position (does not move the position of the stream)
+
+	param data ... buffer for the data
+	param size ... count of bytes
+	param offset ... position in the file
+	return 0 = success, -1 = error or end of the file
+*/
+int (read_at)(void *data, size_t size, off_t offset) {
+	ssize_t result;
+	
+	while (size > 0) {
+		result = pread(fs_fd, data, size, offset);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return ERROR;
+		
+		data = (char *)data + result;
+		size -= result;
+		offset += result;
+	}
+	return NO_ERROR;
+}
+
+
+/*	Write data to the filesystem file at the position (does not move the position of the stream)
+
+	param data ... data
+	param size ... count of bytes
+	param offset ... position in the file
+	return 0 = success, -1 = error
+*/
+int (write_at)(const void *data, size_t size, off_t offset) {
+	ssize_t result;
+	
+	while (size > 0) {
+		result = pwrite(fs_fd, data, size, offset);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result < 0)
+			return ERROR;
+		
+		data = (const char *)data + result;
+		size -= result;
+		offset += result;
+	}
+	return NO_ERROR;
+}
+
+
+/*	Print statistics of the filesystem - latency of commands, I/O of the image and searches of allocators
+	(counted since the start of the program or since the last reset)
+
+	param option ... json = machine-readable output, reset = set all counters to zero
+*/
+void stats(char *option) {
+	char *format = strtok_r(option, DELIM, &tokens);
+	int json = 0, i, j, count, first;
+	command_stats *cs;
+	io_site sites[IO_SITES];
+	long total, value;
+	
+	if (format && strcmp(format, "reset") == 0) {
+		for (i = 0; i <= CMD_QUIT; i++) {
+			__atomic_store_n(&command_latency[i].count, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&command_latency[i].total_us, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&command_latency[i].max_us, 0, __ATOMIC_RELAXED);
+			for (j = 0; j < HIST_BUCKETS; j++) {
+				__atomic_store_n(&command_latency[i].buckets[j], 0, __ATOMIC_RELAXED);
+			}
+		}
+		for (i = 0; i < IO_SITES; i++) {	// Names of functions stay in the table
+			for (j = 0; j < 4; j++) {
+				__atomic_store_n(&io_sites[i].counts[j], 0, __ATOMIC_RELAXED);
+			}
+			__atomic_store_n(&io_sites[i].bytes[IO_READ], 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&io_sites[i].bytes[IO_WRITE], 0, __ATOMIC_RELAXED);
+		}
+		memset(&inode_scans, 0, sizeof(scan_stats));
+		memset(&block_scans, 0, sizeof(scan_stats));
+		defrag_peak_memory = 0;
+		reply(OK);
+		return;
+	}
+	if (format && strcmp(format, "json") == 0)
+		json = 1;
+	else if (format) {
+		reply("Usage: stats [json | reset]\n");
+		return;
+	}
+	
+	// Copy of the used call sites sorted by the name of the function
+	for (i = 0, count = 0; i < IO_SITES; i++) {
+		if (__atomic_load_n(&io_sites[i].name, __ATOMIC_ACQUIRE))
+			sites[count++] = io_sites[i];
+	}
+	qsort(sites, count, sizeof(io_site), compare_io_sites);
+	
+	// Commands
+	if (json)
+		reply("{\"commands\": {");
+	else
+		reply("%-10s %8s %12s %10s %10s %10s %10s %10s\n", "command", "count", "total_ms", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+	for (i = 0, first = 1; i <= CMD_QUIT; i++) {
+		cs = &command_latency[i];
+		if (cs->count == 0)
+			continue;
+		
+		if (!json) {
+			reply("%-10s %8ld %12.3f %10ld %10ld %10ld %10ld %10ld\n", i < CMD_QUIT ? commands[i].name : "unknown", cs->count,
+				cs->total_us / 1e3, cs->total_us / cs->count, hist_percentile(cs, 0.5), hist_percentile(cs, 0.9),
+				hist_percentile(cs, 0.99), cs->max_us);
+			continue;
+		}
+		reply("%s\n  \"%s\": {\"count\": %ld, \"total_us\": %ld, \"p50_us\": %ld, \"p90_us\": %ld, \"p99_us\": %ld, \"max_us\": %ld, \"histogram\": [",
+			first ? "" : ",", i < CMD_QUIT ? commands[i].name : "unknown", cs->count, cs->total_us, hist_percentile(cs, 0.5),
+			hist_percentile(cs, 0.9), hist_percentile(cs, 0.99), cs->max_us);
+		for (j = 0, total = 0; j < HIST_BUCKETS; j++) {		// [upper bound in us, count] of non-empty buckets
+			if ((value = cs->buckets[j]) > 0) {
+				reply("%s[%ld, %ld]", total ? ", " : "", hist_upper(j), value);
+				total += value;
+			}
+		}
+		reply("]}");
+		first = 0;
+	}
+	
+	// I/O of the image
+	if (json)
+		reply("\n},\n\"io\": {");
+	else
+		reply("\n%-24s %10s %12s %10s %12s %10s %10s\n", "function", "reads", "read_kb", "writes", "written_kb", "seeks", "flushes");
+	for (i = 0, first = 1; i < count; i++) {
+		if (sites[i].counts[IO_READ] + sites[i].counts[IO_WRITE] + sites[i].counts[IO_SEEK] + sites[i].counts[IO_FLUSH] == 0)
+			continue;
+		if (json) {
+			reply("%s\n  \"%s\": {\"reads\": %ld, \"read_bytes\": %ld, \"writes\": %ld, \"written_bytes\": %ld, \"seeks\": %ld, \"flushes\": %ld}",
+				first ? "" : ",", sites[i].name, sites[i].counts[IO_READ], sites[i].bytes[IO_READ], sites[i].counts[IO_WRITE],
+				sites[i].bytes[IO_WRITE], sites[i].counts[IO_SEEK], sites[i].counts[IO_FLUSH]);
+		}
+		else {
+			reply("%-24s %10ld %12.1f %10ld %12.1f %10ld %10ld\n", sites[i].name, sites[i].counts[IO_READ],
+				sites[i].bytes[IO_READ] / 1024.0, sites[i].counts[IO_WRITE], sites[i].bytes[IO_WRITE] / 1024.0,
+				sites[i].counts[IO_SEEK], sites[i].counts[IO_FLUSH]);
+		}
+		first = 0;
+	}
+	
+	// Allocators
+	if (json) {
+		reply("\n},\n\"allocators\": {\n  \"inodes\": {\"calls\": %ld, \"scanned\": %ld, \"max\": %ld},\n", inode_scans.calls,
+			inode_scans.scanned, inode_scans.max);
+		reply("  \"blocks\": {\"calls\": %ld, \"scanned\": %ld, \"max\": %ld}\n},\n", block_scans.calls, block_scans.scanned,
+			block_scans.max);
+		reply("\"defrag\": {\"peak_memory_bytes\": %ld}}\n", defrag_peak_memory);
+		return;
+	}
+	reply("\n%-24s %10s %12s %10s %10s\n", "allocator", "calls", "scanned", "mean", "max");
+	reply("%-24s %10ld %12ld %10.1f %10ld\n", "find_free_inode", inode_scans.calls, inode_scans.scanned,
+		inode_scans.calls ? (double)inode_scans.scanned / inode_scans.calls : 0.0, inode_scans.max);
+	reply("%-24s %10ld %12ld %10.1f %10ld\n", "find_free_data_blocks", block_scans.calls, block_scans.scanned,
+		block_scans.calls ? (double)block_scans.scanned / block_scans.calls : 0.0, block_scans.max);
+	reply("\nPeak memory of the last defragmentation: %.1f KB\n", defrag_peak_memory / 1024.0);
+}
+
+
+/*	Add the run of the command to its statistics
+
+	param id ... CMD_* identifier (CMD_UNKNOWN = unknown command)
+	param us ... duration in microseconds
+*/
+void record_latency(int id, long us) {
+	command_stats *cs = &command_latency[(id >= 0 && id < CMD_QUIT) ? id : CMD_QUIT];
+	long max = __atomic_load_n(&cs->max_us, __ATOMIC_RELAXED);
+	
+	__atomic_fetch_add(&cs->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cs->total_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cs->buckets[hist_bucket(us)], 1, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&cs->max_us, &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+/*	Bucket of the latency histogram - values below 2^HIST_SUB_BITS have their own buckets, every next power of 2
+	is split into 2^HIST_SUB_BITS buckets of the same width (the error is at most 1/2^HIST_SUB_BITS)
+
+	param us ... duration in microseconds
+	return index of the bucket
+*/
+int hist_bucket(long us) {
+	int exponent, bucket;
+	
+	if (us < (1L << HIST_SUB_BITS))
+		return us < 0 ? 0 : (int)us;
+	
+	exponent = 63 - __builtin_clzl((unsigned long)us);
+	bucket = ((exponent - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((us >> (exponent - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+	return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+
+/*	The largest value which belongs to the bucket of the latency histogram
+
+	param bucket ... index of the bucket
+	return duration in microseconds
+*/
+long hist_upper(int bucket) {
+	int shift = (bucket >> HIST_SUB_BITS) - 1;
+	
+	if (bucket < (1 << HIST_SUB_BITS))
+		return bucket;
+	return (((long)(1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift) + (1L << shift) - 1;
+}
+
+
+/*	Percentile of the latency of the command (the upper bound of its bucket, at most the maximum)
+
+	param cs ... statistics of the command
+	param percentile ... 0 - 1
+	return duration in microseconds
+*/
+long hist_percentile(command_stats *cs, double percentile) {
+	long rank = (long)(percentile * cs->count + 0.999999), seen = 0;
+	int i;
+	
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += cs->buckets[i];
+		if (seen >= rank && seen > 0)
+			return hist_upper(i) < cs->max_us ? hist_upper(i) : cs->max_us;
+	}
+	return cs->max_us;
+}
+
+
+/*	Add the search of the allocator to its statistics
+
+	param scan ... statistics of the allocator
+	param length ... count of examined items
+*/
+void record_scan(scan_stats *scan, long length) {
+	long max = __atomic_load_n(&scan->max, __ATOMIC_RELAXED);
+	
+	__atomic_fetch_add(&scan->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&scan->scanned, length, __ATOMIC_RELAXED);
+	while (length > max && !__atomic_compare_exchange_n(&scan->max, &max, length, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+/*	Count the I/O of the image done by the function (the function gets its item in the table at its first I/O)
+
+	param site ... name of the function (__func__, the address is the key)
+	param kind ... IO_READ, IO_WRITE, IO_SEEK or IO_FLUSH
+	param bytes ... count of read or written bytes
+	return index of the item of the function, -1 = table is full
+*/
+int count_io(const char *site, int kind, size_t bytes) {
+	int i, index = (int)(((uintptr_t)site >> 3) % IO_SITES);
+	const char *name;
+	
+	for (i = 0; i < IO_SITES; i++, index = (index + 1) % IO_SITES) {
+		name = __atomic_load_n(&io_sites[index].name, __ATOMIC_ACQUIRE);
+		if (!name && __atomic_compare_exchange_n(&io_sites[index].name, &name, site, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			name = site;	// Free item was taken (otherwise name is the function which took it meanwhile)
+		if (name != site)
+			continue;
+		
+		__atomic_fetch_add(&io_sites[index].counts[kind], 1, __ATOMIC_RELAXED);
+		if (kind == IO_READ || kind == IO_WRITE)
+			__atomic_fetch_add(&io_sites[index].bytes[kind], (long)bytes, __ATOMIC_RELAXED);
+		return index;
+	}
+	return ERROR;
+}
+
+
+/*	Compare items of the table of I/O by the name of the function (qsort)
+
+	return order
+*/
+int compare_io_sites(const void *a, const void *b) {
+	return strcmp(((const io_site *)a)->name, ((const io_site *)b)->name);
+}
+
+
+/*	Counted fread (only reads of the image of the filesystem are counted)
+
+	param site ... calling function
+	return count of read items
+*/
+size_t stat_fread(void *data, size_t size, size_t count, FILE *stream, const char *site) {
+	long offset = (trace_log && stream && stream == fs) ? ftell(stream) : 0;
+	size_t result = (fread)(data, size, count, stream);
+	int index;
+	
+	if (stream && stream == fs) {
+		index = count_io(site, IO_READ, result * size);
+		if (trace_log)
+			trace_io(index, TRACE_READ, offset, result * size);
+	}
+	return result;
+}
+
+
+/*	Counted fwrite (only writes of the image of the filesystem are counted)
+
+	param site ... calling function
+	return count of written items
+*/
+size_t stat_fwrite(const void *data, size_t size, size_t count, FILE *stream, const char *site) {
+	long offset = (trace_log && stream && stream == fs) ? ftell(stream) : 0;
+	size_t result = (fwrite)(data, size, count, stream);
+	int index;
+	
+	if (stream && stream == fs) {
+		index = count_io(site, IO_WRITE, result * size);
+		if (trace_log)
+			trace_io(index, TRACE_WRITE, offset, result * size);
+	}
+	return result;
+}
+
+
+/*	Counted fseek (only seeks in the image of the filesystem are counted)
+
+	param site ... calling function
+	return 0 = success, -1 = error
+*/
+int stat_fseek(FILE *stream, long offset, int whence, const char *site) {
+	int result = (fseek)(stream, offset, whence), index;
+	
+	if (stream && stream == fs) {
+		index = count_io(site, IO_SEEK, 0);
+		if (trace_log)
+			trace_io(index, TRACE_SEEK, ftell(stream), 0);
+	}
+	return result;
+}
+
+
+/*	Counted fflush (only flushes of the image of the filesystem are counted)
+
+	param site ... calling function
+	return 0 = success, EOF = error
+*/
+int stat_fflush(FILE *stream, const char *site) {
+	int index;
+	
+	if (stream && stream == fs) {
+		index = count_io(site, IO_FLUSH, 0);
+		if (trace_log)
+			trace_io(index, TRACE_FLUSH, ftell(stream), 0);
+	}
+	return (fflush)(stream);
+}
+
+
+/*	Counted read_at
+
+	param site ... calling function
+	return 0 = success, -1 = error or end of the file
+*/
+int stat_read_at(void *data, size_t size, off_t offset, const char *site) {
+	int result = (read_at)(data, size, offset);
+	int index = count_io(site, IO_READ, result == NO_ERROR ? size : 0);
+	
+	if (trace_log)
+		trace_io(index, TRACE_READ, offset, result == NO_ERROR ? size : 0);
+	return result;
+}
+
+
+/*	Counted write_at
+
+	param site ... calling function
+	return 0 = success, -1 = error
+*/
+int stat_write_at(const void *data, size_t size, off_t offset, const char *site) {
+	int result = (write_at)(data, size, offset);
+	int index = count_io(site, IO_WRITE, result == NO_ERROR ? size : 0);
+	
+	if (trace_log)
+		trace_io(index, TRACE_WRITE, offset, result == NO_ERROR ? size : 0);
+	return result;
+}
+
+
+/*	Start or stop the trace of I/O of the image (format of the trace is in trace.h, tracestat analyzes it)
+
+	param args ... on file = start the trace to the file (the previous trace ends), off = stop the trace,
+				   nothing = print the state of the trace
+*/
+void trace(char *args) {
+	char *mode = strtok_r(args, DELIM, &tokens);
+	char *name = strtok_r(NULL, DELIM, &tokens);
+	char names[CMD_QUIT + 1][TRACE_NAME_SIZE];
+	trace_header header;
+	int i;
+	
+	if (!mode) {
+		if (trace_log)
+			reply("TRACE ON (%ld records)\n", trace_records);
+		else
+			reply("TRACE OFF\n");
+		return;
+	}
+	if (strcmp(mode, "off") == 0) {
+		if (trace_log)
+			fclose(trace_log);
+		trace_log = NULL;
+		reply(OK);
+		return;
+	}
+	if (strcmp(mode, "on") != 0 || !name) {
+		reply("Usage: trace [on file | off]\n");
+		return;
+	}
+	
+	if (trace_log)
+		fclose(trace_log);
+	if (!(trace_log = fopen(name, "wb"))) {
+		reply(CCF);
+		return;
+	}
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.command_count = CMD_QUIT + 1;
+	memset(names, 0, sizeof(names));
+	for (i = 0; i <= CMD_QUIT; i++) {
+		strncpy(names[i], i < CMD_QUIT ? commands[i].name : "unknown", TRACE_NAME_SIZE - 1);
+	}
+	fwrite(&header, sizeof(trace_header), 1, trace_log);
+	fwrite(names, sizeof(names), 1, trace_log);
+	
+	trace_records = 0;
+	memset(trace_named, 0, sizeof(trace_named));
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	if (fs_formatted)
+		trace_layout_record();
+	reply(OK);
+}
+
+
+/*	Add the access to the image to the trace (the name of the function goes first when it appears for the first time)
+
+	param site ... index of the function in io_sites, -1 = none
+	param op ... TRACE_* operation
+	param offset ... position in the image
+	param length ... count of bytes
+*/
+void trace_io(int site, int op, long offset, long length) {
+	const char *name;
+	
+	pthread_mutex_lock(&trace_lock);
+	if (trace_log) {		// Trace could have been stopped meanwhile
+		if (site >= 0 && !trace_named[site]) {
+			name = io_sites[site].name;
+			trace_write(site, TRACE_NAME, 0, strlen(name), name);
+			trace_named[site] = 1;
+		}
+		trace_write(site, op, offset, length, NULL);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+
+/*	Add the layout of the image to the trace (at its start and after format) */
+void trace_layout_record() {
+	trace_layout layout;
+	
+	layout.disk_size = sb->disk_size;
+	layout.cluster_size = sb->cluster_size;
+	layout.bitmap_start = sb->bitmap_start_address;
+	layout.inode_start = sb->inode_start_address;
+	layout.dedup_start = (sb->features & FEATURE_DEDUP) ? sb->dedup_start_address 
+		: (sb->features & FEATURE_CHECKSUM) ? sb->checksum_start_address : 0;
+	layout.data_start = sb->data_start_address;
+	
+	pthread_mutex_lock(&trace_lock);
+	trace_write(ERROR, TRACE_LAYOUT, 0, sizeof(trace_layout), &layout);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+
+/*	Write one record to the trace (the caller holds trace_lock)
+
+	param site ... index of the function in io_sites, -1 = none
+	param op ... TRACE_* operation
+	param offset ... position in the image
+	param length ... count of bytes
+	param data ... data which follow the record (length bytes), NULL = none
+*/
+void trace_write(int site, int op, long offset, long length, const void *data) {
+	trace_record record;
+	struct timespec now;
+	
+	if (trace_session < 0)
+		trace_session = trace_sessions++ % 256;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	record.time = (int64_t)(now.tv_sec - trace_start.tv_sec) * 1000000000LL + (now.tv_nsec - trace_start.tv_nsec);
+	record.offset = offset;
+	record.length = (int32_t)length;
+	record.op = (uint8_t)op;
+	record.command = (uint8_t)trace_command;
+	record.site = (uint8_t)(site < 0 ? 255 : site);
+	record.session = (uint8_t)trace_session;
+	fwrite(&record, sizeof(trace_record), 1, trace_log);
+	if (data)
+		fwrite(data, 1, length, trace_log);
+	trace_records++;
+}
+
+
+/*	Mount the filesystem for the library (only one filesystem can be mounted at once)
+
+	param image ... name of the file with the formatted filesystem
+	param context ... address to store the mounted filesystem
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_mount(const char *image, zos_context **context) {
+	return mount_image(image, context, 1);
+}
+
+
+/*	Mount the new filesystem for the library - the image does not exist yet, it is created by the command
+	format (zos_execute), other functions return ZOS_EFORMAT until then
+
+	param image ... name of the file for the filesystem
+	param context ... address to store the mounted filesystem
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_create(const char *image, zos_context **context) {
+	return mount_image(image, context, 0);
+}
+
+
+/*	Mount the existing or the new filesystem (zos_mount, zos_create)
+
+	param image ... name of the file with the filesystem
+	param context ... address to store the mounted filesystem
+	param formatted ... if the image exists and is loaded (0 = false, 1 = true)
+	return ZOS_OK or ZOS_E* code
+*/
+int mount_image(const char *image, zos_context **context, int formatted) {
+	zos_context *mounted;
+	
+	if (!image || !context)
+		return ZOS_EINVAL;
+	
+	pthread_rwlock_wrlock(&tree_lock);
+	if (api_context) {
+		pthread_rwlock_unlock(&tree_lock);
+		return ZOS_EBUSY;
+	}
+	if ((access(image, F_OK) == 0) != formatted) {
+		pthread_rwlock_unlock(&tree_lock);
+		return formatted ? ZOS_ENOENT : ZOS_EEXIST;
+	}
+	
+	if (!api_output)
+		api_output = fopen("/dev/null", "w");
+	output = api_output;	// Replies are discarded
+	fs_shared = 0;			// Stream of this thread is buffered until another thread uses the filesystem
+	api_owner = pthread_self();
+	if (fs) {				// Stream of the previous mount
+		fclose(fs);
+		fs = NULL;
+	}
+	
+	mounted = (zos_context *)malloc(sizeof(zos_context));
+	fs_name = strdup(image);
+	if (!mounted || !fs_name || !api_output || (formatted && load_fs() == ERROR)) {
+		shutdown_fs();
+		free(fs_name);
+		free(mounted);
+		fs_name = NULL;
+		pthread_rwlock_unlock(&tree_lock);
+		return ZOS_ERROR;
+	}
+	
+	fs_formatted = formatted;
+	mounted->mount = ++api_mount;
+	mounted->working_directory = formatted ? directories[0] : NULL;
+	mounted->verify_checksums = 1;
+	api_session = mounted->mount;
+	api_context = mounted;
+	*context = mounted;
+	pthread_rwlock_unlock(&tree_lock);
+	return ZOS_OK;
+}
+
+
+/*	Unmount the filesystem, its open files stop working (ZOS_EBADF) and have to be closed (the recording
+	of the workload ends)
+
+	param context ... mounted filesystem
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_unmount(zos_context *context) {
+	pthread_rwlock_wrlock(&tree_lock);
+	if (!context || context != api_context) {
+		pthread_rwlock_unlock(&tree_lock);
+		return ZOS_EINVAL;
+	}
+	
+	shutdown_fs();
+	free(fs_name);
+	fs_name = NULL;
+	fs_formatted = 0;
+	api_context = NULL;
+	free(context);
+	if (record_log) {
+		fclose(record_log);
+		record_log = NULL;
+	}
+	pthread_rwlock_unlock(&tree_lock);
+	return ZOS_OK;
+}
+
+
+/*	Execute the command of the console (e.g. "format 20MB", "cd /a", "ls"), commands of the loaded file (load)
+	are executed too. The working directory of commands is kept by the mount (paths of other functions start
+	in the root). The recorded workload (zos_record) contains the command.
+
+	param context ... mounted filesystem
+	param command ... command with arguments (one line)
+	param replies ... stream for the replies of the command, NULL = replies are discarded
+	return ZOS_OK, ZOS_EXIT (exit command) or ZOS_E* code (errors of the command are only in its replies)
+*/
+int zos_execute(zos_context *context, const char *command, FILE *replies) {
+	char buffer[BUFF_SIZE];
+	FILE *f = NULL;				// File with commands (load)
+	int result;
+	
+	if (!command || strlen(command) >= BUFF_SIZE)
+		return ZOS_EINVAL;
+	if ((result = api_stream(context)) != ZOS_OK)
+		return result;
+	
+	output = replies ? replies : api_output;
+	verify_checksums = context->verify_checksums;
+	strcpy(buffer, command);
+	do {
+		result = record_log ? record_command(buffer, &f, &context->working_directory) 
+			: execute_command(buffer, &f, &context->working_directory);
+	} while (!result && read_command(buffer, &f) == NO_ERROR);
+	if (file_input) {			// Exit command in the loaded file
+		file_input = 0;
+		fclose(f);
+	}
+	
+	if (fs && fs_buffered)		// Another thread may use the filesystem next
+		fflush(fs);
+	context->verify_checksums = verify_checksums;
+	output = api_output;
+	return result ? ZOS_EXIT : ZOS_OK;
+}
+
+
+/*	Wait for the input of the console, the idle filesystem is defragmented in steps meanwhile (only if
+	the idle defragmentation is enabled by defrag and the input is a terminal)
+
+	param context ... mounted filesystem
+	param input ... descriptor of the input
+	return ZOS_OK (input is ready) or ZOS_E* code
+*/
+int zos_idle(zos_context *context, int input) {
+	int result;
+	
+	if ((result = api_stream(context)) != ZOS_OK)
+		return result;
+	wait_for_input(input);
+	if (fs && fs_buffered)		// Another thread may use the filesystem next
+		fflush(fs);
+	return ZOS_OK;
+}
+
+
+/*	Serve clients of the Unix domain socket by the mounted filesystem until SIGINT or SIGTERM
+	(clients send commands of the console, see serve)
+
+	param context ... mounted filesystem
+	param path ... path of the socket
+	return ZOS_OK (server stopped) or ZOS_E* code
+*/
+int zos_serve(zos_context *context, const char *path) {
+	int result;
+	
+	if (!path)
+		return ZOS_EINVAL;
+	if ((result = api_stream(context)) != ZOS_OK)
+		return result;
+	__atomic_store_n(&fs_shared, 1, __ATOMIC_RELEASE);		// Streams of sessions are not buffered
+	return (serve(path) == NO_ERROR) ? ZOS_OK : ZOS_ERROR;
+}
+
+
+/*	Record the workload of the mounted filesystem - commands of zos_execute are written into the log (see 
+	record_command), the image in its current state is copied to the file log.image (the replay tool uses both)
+
+	param context ... mounted filesystem
+	param log ... path of the log
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_record(zos_context *context, const char *log) {
+	char snapshot[BUFF_SIZE];	// Copy of the image before the recorded workload
+	int result;
+	
+	if (!log)
+		return ZOS_EINVAL;
+	if ((result = api_stream(context)) != ZOS_OK)
+		return result;
+	if (record_log)
+		return ZOS_EBUSY;
+	
+	snprintf(snapshot, BUFF_SIZE, "%s.image", log);
+	if (fs) 
+		fflush(fs);
+	if (!(record_log = fopen(log, "w")) || (fs_formatted && copy_host_file(fs_name, snapshot) == ERROR)) {
+		if (record_log)
+			fclose(record_log);
+		record_log = NULL;
+		return ZOS_ERROR;
+	}
+	fprintf(record_log, "# Workload of %s\n", fs_name);
+	clock_gettime(CLOCK_MONOTONIC, &record_start);
+	return ZOS_OK;
+}
+
+
+/*	Compute the size and the hash of the host file like the recording of the workload (host files of the log)
+
+	param path ... path of the host file
+	param size ... address to store the size
+	param hash ... address to store the hash
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_hash_file(const char *path, int32_t *size, uint64_t *hash) {
+	if (!path || !size || !hash)
+		return ZOS_EINVAL;
+	return (hash_file(path, size, hash) == NO_ERROR) ? ZOS_OK : ZOS_ENOENT;
+}
+
+
+/*	Open the file, the handle refers to the path and the i-node of the file
+
+	param context ... mounted filesystem
+	param path ... path of the file
+	param flags ... ZOS_READ and/or ZOS_WRITE, optionally ZOS_CREATE, ZOS_TRUNCATE, ZOS_APPEND
+	param file ... address to store the open file
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_open(zos_context *context, const char *path, int flags, zos_file **file) {
+	char buffer[BUFF_SIZE], *name;
+	directory *dir;
+	directory_item *item;
+	int32_t id = FREE;
+	int result;
+	zos_file *opened;
+	
+	if (!file || !(flags & (ZOS_READ | ZOS_WRITE)) || ((flags & (ZOS_TRUNCATE | ZOS_APPEND)) && !(flags & ZOS_WRITE)))
+		return ZOS_EINVAL;
+	if ((result = enter_api(context, 0)) != ZOS_OK)
+		return result;
+	if ((result = api_split_path(path, buffer, &name, &dir)) != ZOS_OK) {
+		leave_api();
+		return result;
+	}
+	
+	pthread_mutex_lock(&(dir->lock));
+	item = find_item(dir->file, name);
+	if (item) {
+		id = item->inode;
+	}
+	else if (name[0] == '\0' || find_item(dir->subdir, name)) {
+		result = ZOS_EISDIR;
+	}
+	else if (!(flags & ZOS_CREATE)) {
+		result = ZOS_ENOENT;
+	}
+	else if (strlen(name) > 11) {	// Name 8+3
+		result = ZOS_EINVAL;
+	}
+	else if ((id = create_file(dir, name)) == ERROR) {
+		result = ZOS_ENOSPC;
+	}
+	
+	if (result == ZOS_OK && (flags & ZOS_TRUNCATE) && inode_sizes[id] > 0) {
+		pthread_rwlock_wrlock(&inode_locks[id]);	// Wait for readers of the file
+		if (change_file(dir, id, 0, NULL, 0, 0) != NO_ERROR)
+			result = ZOS_ERROR;
+		pthread_rwlock_unlock(&inode_locks[id]);
+	}
+	pthread_mutex_unlock(&(dir->lock));
+	leave_api();
+	if (result != ZOS_OK)
+		return result;
+	
+	opened = (zos_file *)malloc(sizeof(zos_file));
+	if (!opened || !(opened->path = strdup(path))) {
+		free(opened);
+		return ZOS_ERROR;
+	}
+	opened->context = context;
+	opened->mount = context->mount;
+	opened->inode = id;
+	opened->position = 0;
+	opened->flags = flags;
+	*file = opened;
+	return ZOS_OK;
+}
+
+
+/*	Close the file
+
+	param file ... open file
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_close(zos_file *file) {
+	if (!file)
+		return ZOS_EBADF;
+	
+	free(file->path);
+	free(file);
+	return ZOS_OK;
+}
+
+
+/*	Read the data from the current position of the file and move the position
+
+	param file ... file open for reading
+	param buffer ... buffer for the data
+	param length ... size of the buffer
+	return count of read bytes (0 = end of the file) or ZOS_E* code
+*/
+int32_t zos_read(zos_file *file, void *buffer, int32_t length) {
+	directory *dir;
+	int32_t size, count = 0;
+	int result;
+	FILE *out;
+	
+	if (!file || !(file->flags & ZOS_READ))
+		return ZOS_EBADF;
+	if (!buffer || length < 0)
+		return ZOS_EINVAL;
+	if ((result = enter_api(file->context, 0)) != ZOS_OK)
+		return result;
+	if ((result = api_find_file(file, &dir)) != ZOS_OK) {
+		leave_api();
+		return result;
+	}
+	pthread_rwlock_rdlock(&inode_locks[file->inode]);
+	pthread_mutex_unlock(&(dir->lock));
+	
+	size = inode_sizes[file->inode];
+	if (file->position < size)
+		count = (length < size - file->position) ? length : size - file->position;
+	
+	// Content is written into the buffer of the caller by the same function as by cat
+	if (count > 0) {
+		out = fmemopen(buffer, count, "r+");	// Mode w would end the data by \0
+		if (!out)
+			result = ZOS_ERROR;
+		else if ((result = write_file(file->inode, out, file->position, count)) != NO_ERROR)
+			result = (result == BAD_CHECKSUM) ? ZOS_ECHECKSUM : ZOS_ERROR;
+		if (out)
+			fclose(out);
+	}
+	pthread_rwlock_unlock(&inode_locks[file->inode]);
+	leave_api();
+	
+	if (result != ZOS_OK)
+		return result;
+	file->position += count;
+	return count;
+}
+
+
+/*	Write the data at the current position of the file (at the end with ZOS_APPEND) and move the position,
+	the gap after the end of the file (after zos_seek) is filled by zeros
+
+	param file ... file open for writing
+	param buffer ... written data
+	param length ... count of bytes
+	return count of written bytes or ZOS_E* code
+*/
+int32_t zos_write(zos_file *file, const void *buffer, int32_t length) {
+	directory *dir;
+	int32_t id, offset, size;
+	int result;
+	
+	if (!file || !(file->flags & ZOS_WRITE))
+		return ZOS_EBADF;
+	if ((!buffer && length > 0) || length < 0)
+		return ZOS_EINVAL;
+	if (length == 0)
+		return 0;
+	if ((result = enter_api(file->context, 0)) != ZOS_OK)
+		return result;
+	if ((result = api_find_file(file, &dir)) != ZOS_OK) {
+		leave_api();
+		return result;
+	}
+	id = file->inode;
+	pthread_rwlock_wrlock(&inode_locks[id]);	// Wait for readers of the file
+	
+	size = inode_sizes[id];
+	offset = (file->flags & ZOS_APPEND) ? size : file->position;
+	if (length > MAX_SIZE - offset) {
+		result = ZOS_EFBIG;
+	}
+	else {
+		if (offset > size)	// Files have no holes
+			result = change_file(dir, id, size, NULL, offset - size, offset);
+		if (result == NO_ERROR)
+			result = change_file(dir, id, offset, (char *)buffer, length, (offset + length > size) ? offset + length : size);
+		if (result != NO_ERROR)
+			result = (result == ERROR) ? ZOS_ENOSPC : (result == BAD_CHECKSUM) ? ZOS_ECHECKSUM : ZOS_ERROR;
+	}
+	
+	pthread_rwlock_unlock(&inode_locks[id]);
+	pthread_mutex_unlock(&(dir->lock));
+	leave_api();
+	
+	if (result != ZOS_OK)
+		return result;
+	file->position = offset + length;
+	return length;
+}
+
+
+/*	Set the position of the file (it may be set after the end of the file)
+
+	param file ... open file
+	param offset ... offset from the origin
+	param whence ... ZOS_SEEK_SET, ZOS_SEEK_CUR or ZOS_SEEK_END
+	return new position or ZOS_E* code
+*/
+int32_t zos_seek(zos_file *file, int32_t offset, int whence) {
+	directory *dir;
+	int64_t position;
+	int result;
+	
+	if (!file)
+		return ZOS_EBADF;
+	
+	switch (whence) {
+		case ZOS_SEEK_SET:
+			position = offset;
+			break;
+		case ZOS_SEEK_CUR:
+			position = (int64_t)file->position + offset;
+			break;
+		case ZOS_SEEK_END:
+			if ((result = enter_api(file->context, 0)) != ZOS_OK)
+				return result;
+			if ((result = api_find_file(file, &dir)) != ZOS_OK) {
+				leave_api();
+				return result;
+			}
+			pthread_rwlock_rdlock(&inode_locks[file->inode]);
+			pthread_mutex_unlock(&(dir->lock));
+			position = (int64_t)inode_sizes[file->inode] + offset;
+			pthread_rwlock_unlock(&inode_locks[file->inode]);
+			leave_api();
+			break;
+		default:
+			return ZOS_EINVAL;
+	}
+	
+	if (position < 0 || position > MAX_SIZE)
+		return ZOS_EINVAL;
+	file->position = (int32_t)position;
+	return file->position;
+}
+
+
+/*	Get the information about the file or directory
+
+	param context ... mounted filesystem
+	param path ... path of the file or directory
+	param info ... address to store the information
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_stat(zos_context *context, const char *path, zos_info *info) {
+	char buffer[BUFF_SIZE], *name;
+	directory *dir;
+	directory_item *item;
+	int result;
+	
+	if (!info)
+		return ZOS_EINVAL;
+	if ((result = enter_api(context, 0)) != ZOS_OK)
+		return result;
+	if ((result = api_split_path(path, buffer, &name, &dir)) != ZOS_OK) {
+		leave_api();
+		return result;
+	}
+	
+	pthread_mutex_lock(&(dir->lock));
+	if (name[0] == '\0') {		// Root
+		api_fill_info(dir->current->inode, info);
+	}
+	else if ((item = find_item(dir->file, name)) || (item = find_item(dir->subdir, name))) {
+		api_fill_info(item->inode, info);
+	}
+	else {
+		result = ZOS_ENOENT;
+	}
+	pthread_mutex_unlock(&(dir->lock));
+	leave_api();
+	return result;
+}
+
+
+/*	Call the function for every item of the directory (subdirectories first, then files)
+
+	param context ... mounted filesystem
+	param path ... path of the directory
+	param callback ... called function, the directory may be changed by the function
+	param arg ... argument of the function
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_readdir(zos_context *context, const char *path, zos_readdir_callback callback, void *arg) {
+	char buffer[BUFF_SIZE], (*names)[12] = NULL;
+	directory *dir;
+	directory_item *item;
+	zos_info *infos = NULL;
+	int i, count = 0, result;
+	
+	if (!callback)
+		return ZOS_EINVAL;
+	if ((result = enter_api(context, 0)) != ZOS_OK)
+		return result;
+	if (!path || strlen(path) >= BUFF_SIZE) {
+		leave_api();
+		return ZOS_EINVAL;
+	}
+	strcpy(buffer, path);
+	if (!(dir = find_directory(buffer))) {
+		leave_api();
+		return ZOS_ENOENT;
+	}
+	
+	// Items are copied, the function is called without locks
+	pthread_mutex_lock(&(dir->lock));
+	for (i = 0; i < 2; i++) {
+		for (item = (i == 0) ? dir->subdir : dir->file; item != NULL; item = item->next) {
+			if (count % 64 == 0) {
+				names = realloc(names, sizeof(*names) * (count + 64));
+				infos = (zos_info *)realloc(infos, sizeof(zos_info) * (count + 64));
+			}
+			strcpy(names[count], item->item_name);
+			api_fill_info(item->inode, &infos[count]);
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&(dir->lock));
+	leave_api();
+	
+	for (i = 0; i < count; i++) {
+		if (callback(names[i], &infos[i], arg))
+			break;
+	}
+	free(names);
+	free(infos);
+	return ZOS_OK;
+}
+
+
+/*	Create a new directory
+
+	param context ... mounted filesystem
+	param path ... path of the directory
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_mkdir(zos_context *context, const char *path) {
+	char buffer[BUFF_SIZE], *name;
+	directory *dir;
+	int result;
+	
+	if ((result = enter_api(context, 1)) != ZOS_OK)
+		return result;
+	if ((result = api_split_path(path, buffer, &name, &dir)) == ZOS_OK) {
+		if (name[0] == '\0' || strlen(name) > 11 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			result = ZOS_EINVAL;
+		else if (test_existence(dir, name))
+			result = ZOS_EEXIST;
+		else if (create_directory(dir, name))
+			result = ZOS_ENOSPC;
+	}
+	leave_api();
+	return result;
+}
+
+
+/*	Remove the file (open handles of the file stop working)
+
+	param context ... mounted filesystem
+	param path ... path of the file
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_unlink(zos_context *context, const char *path) {
+	char buffer[BUFF_SIZE], *name;
+	directory *dir;
+	int result;
+	
+	if ((result = enter_api(context, 0)) != ZOS_OK)
+		return result;
+	if ((result = api_split_path(path, buffer, &name, &dir)) == ZOS_OK && remove_file(dir, name)) {
+		pthread_mutex_lock(&(dir->lock));
+		result = (name[0] == '\0' || find_item(dir->subdir, name)) ? ZOS_EISDIR : ZOS_ENOENT;
+		pthread_mutex_unlock(&(dir->lock));
+	}
+	leave_api();
+	return result;
+}
+
+
+/*	Remove the empty directory (working directories of sessions in it move to its parent)
+
+	param context ... mounted filesystem
+	param path ... path of the directory
+	return ZOS_OK or ZOS_E* code
+*/
+int zos_rmdir(zos_context *context, const char *path) {
+	char buffer[BUFF_SIZE], *name;
+	directory *dir;
+	directory_item *item;
+	int result;
+	
+	if ((result = enter_api(context, 1)) != ZOS_OK)
+		return result;
+	if ((result = api_split_path(path, buffer, &name, &dir)) == ZOS_OK) {
+		item = find_item(dir->subdir, name);
+		if (name[0] == '\0')		// Root
+			result = ZOS_EINVAL;
+		else if (!item)
+			result = ZOS_ENOENT;
+		else if (directories[item->inode]->file != NULL || directories[item->inode]->subdir != NULL)
+			result = ZOS_ENOTEMPTY;
+		else
+			remove_directory(dir, item);
+	}
+	leave_api();
+	return result;
+}
+
+
+/*	Get the description of the code returned by the library
+
+	param code ... ZOS_* code
+	return description
+*/
+const char *zos_strerror(int code) {
+	switch (code) {
+		case ZOS_OK:
+			return "Success";
+		case ZOS_ENOENT:
+			return "File or directory not found";
+		case ZOS_EEXIST:
+			return "File or directory exists";
+		case ZOS_ENOSPC:
+			return "Not enough space";
+		case ZOS_EFBIG:
+			return "File too large";
+		case ZOS_EINVAL:
+			return "Invalid argument";
+		case ZOS_EISDIR:
+			return "Is a directory";
+		case ZOS_EBUSY:
+			return "Another filesystem is mounted";
+		case ZOS_EBADF:
+			return "File is not open for the operation";
+		case ZOS_EFORMAT:
+			return "Filesystem is not formatted";
+		case ZOS_ECHECKSUM:
+			return "Data of the file do not match their checksums";
+		case ZOS_ENOTEMPTY:
+			return "Directory is not empty";
+		default:
+			return (code > 0) ? "Success" : "Filesystem error";
+	}
+}
+
+
+/*	Start the operation of the library - lock the tree of directories like execute_command and prepare
+	the session of the thread (own stream of the filesystem, replies are discarded, paths start in the root)
+
+	param context ... mounted filesystem
+	param exclusive ... if the operation changes the tree of directories (0 = false, 1 = true)
+	return ZOS_OK or ZOS_E* code (the lock is not held)
+*/
+int enter_api(zos_context *context, int exclusive) {
+	int result;
+	
+	share_fs(context);
+	if (exclusive)
+		pthread_rwlock_wrlock(&tree_lock);
+	else
+		pthread_rwlock_rdlock(&tree_lock);
+	
+	if (!fs_formatted && context && context == api_context) {
+		pthread_rwlock_unlock(&tree_lock);
+		return ZOS_EFORMAT;
+	}
+	if ((result = api_stream(context)) != ZOS_OK) {
+		pthread_rwlock_unlock(&tree_lock);
+		return result;
+	}
+	working_directory = directories[0];
+	verify_checksums = context->verify_checksums;
+	return ZOS_OK;
+}
+
+
+/*	Prepare the session of the thread for the mount - own stream of the filesystem (opened again after
+	the next mount or when another thread starts using the filesystem), replies are discarded
+
+	param context ... mounted filesystem
+	return ZOS_OK or ZOS_E* code
+*/
+int api_stream(zos_context *context) {
+	if (!context || context != api_context)
+		return ZOS_EINVAL;
+	
+	share_fs(context);
+	output = api_output;
+	if (api_session != context->mount || (fs_buffered && __atomic_load_n(&fs_shared, __ATOMIC_ACQUIRE))) {
+		if (fs)					// Stream of the previous mount or the buffered one
+			fclose(fs);
+		fs = NULL;
+		api_session = context->mount;
+	}
+	if (!fs && fs_formatted && !(fs = open_fs("rb+")))
+		return ZOS_ERROR;
+	return ZOS_OK;
+}
+
+
+/*	Let another thread than the one which mounted the filesystem use it - streams of the library are not
+	buffered from now on (the mounting thread flushes its stream after every operation and opens it again)
+
+	param context ... mounted filesystem
+*/
+void share_fs(zos_context *context) {
+	if (pthread_equal(pthread_self(), api_owner) || __atomic_load_n(&fs_shared, __ATOMIC_ACQUIRE))
+		return;
+	
+	pthread_rwlock_wrlock(&tree_lock);		// The mounting thread is between operations
+	if (context && context == api_context)
+		__atomic_store_n(&fs_shared, 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+
+/* Finish the operation of the library */
+void leave_api() {
+	flush_checksums();			// Checksums of data blocks written by the operation are stored
+	if (fs && fs_buffered)		// Another thread may use the filesystem next
+		fflush(fs);
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+
+/*	Split the path of the library into the directory and the name (the caller holds the lock of the tree)
+
+	param path ... path of the file or directory
+	param buffer ... buffer for the copy of the path (BUFF_SIZE bytes)
+	param name ... address to store the name (part of the buffer, empty = root)
+	param dir ... address to store the directory
+	return ZOS_OK or ZOS_E* code
+*/
+int api_split_path(const char *path, char *buffer, char **name, directory **dir) {
+	if (!path || path[0] == '\0' || strlen(path) >= BUFF_SIZE)
+		return ZOS_EINVAL;
+	
+	strcpy(buffer, path);
+	if (parse_path(buffer, name, dir))
+		return ZOS_ENOENT;
+	return ZOS_OK;
+}
+
+
+/*	Find the open file again, it must not have been removed meanwhile and its filesystem must not have
+	been unmounted (the context of the next mount may have the same address)
+
+	param file ... open file
+	param dir ... address to store the directory of the file (its lock is held on success)
+	return ZOS_OK or ZOS_E* code
+*/
+int api_find_file(zos_file *file, directory **dir) {
+	char buffer[BUFF_SIZE], *name;
+	directory_item *item;
+	int result;
+	
+	if (file->mount != api_context->mount)
+		return ZOS_EBADF;
+	if ((result = api_split_path(file->path, buffer, &name, dir)) != ZOS_OK)
+		return result;
+	
+	pthread_mutex_lock(&((*dir)->lock));
+	item = find_item((*dir)->file, name);
+	if (!item || item->inode != file->inode) {
+		pthread_mutex_unlock(&((*dir)->lock));
+		return ZOS_ENOENT;
+	}
+	return ZOS_OK;
+}
+
+
+/*	Fill the information about the i-node (the caller holds the lock of its directory)
+
+	param id ... i-node ID
+	param info ... information
+*/
+void api_fill_info(int32_t id, zos_info *info) {
+	pthread_rwlock_rdlock(&inode_locks[id]);
+	info->inode = id;
+	info->is_directory = inode_dirs[id];
+	info->size = inode_sizes[id];
+	info->is_inline = (inodes[id].flags & INODE_INLINE) != 0;
+	info->is_compressed = (inodes[id].flags & INODE_COMPRESSED) != 0;
+	pthread_rwlock_unlock(&inode_locks[id]);
+}
@@ -0,0 +1,87 @@
+/**************************************************
+			Simple Filesystem Simulator
+				Library interface (libzos)
+
+				Author: Jiri Besta
+***************************************************/
+
+/*	The filesystem is linked as the static library libzos.a (make libzos.a) and used in-process,
+	the console (console.c), the benchmark and the replay tool are its clients. Functions return ZOS_OK
+	(or a count of bytes) on success and a negative ZOS_E* code on failure, nothing is printed except
+	the replies of zos_execute and the state of the server (zos_serve).
+
+	Only one filesystem can be mounted in the process at once. Functions can be called from more
+	threads, they use the same locks as the server. Paths without the leading / are relative to the root,
+	names of files and directories have at most 11 characters.
+*/
+
+#ifndef LIBZOS_H
+#define LIBZOS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define ZOS_OK 0
+#define ZOS_EXIT 1					// Command of zos_execute ends the console (exit)
+#define ZOS_ERROR -1				// Filesystem could not be loaded or data of the file are corrupted
+#define ZOS_ENOENT -2				// File or directory not found
+#define ZOS_EEXIST -3				// File or directory with the same name exists
+#define ZOS_ENOSPC -4				// Filesystem has not enough space (data blocks or i-nodes)
+#define ZOS_EFBIG -5				// File would be too large
+#define ZOS_EINVAL -6				// Invalid argument (path, name, offset, flags)
+#define ZOS_EISDIR -7				// Path is a directory
+#define ZOS_EBUSY -8				// Another filesystem is mounted
+#define ZOS_EBADF -9				// File is not open for the operation
+#define ZOS_EFORMAT -10				// Filesystem is not formatted yet (zos_create)
+#define ZOS_ECHECKSUM -11			// Data of the file do not match their checksums (filesystem formatted with -c)
+#define ZOS_ENOTEMPTY -12			// Directory is not empty
+
+#define ZOS_READ 1					// Flags of zos_open - file is read
+#define ZOS_WRITE 2					// File is written
+#define ZOS_CREATE 4				// Empty file is created if it does not exist
+#define ZOS_TRUNCATE 8				// Content of the file is removed (with ZOS_WRITE)
+#define ZOS_APPEND 16				// Every write appends the data to the end of the file
+
+#define ZOS_SEEK_SET 0				// Origin of zos_seek - start of the file
+#define ZOS_SEEK_CUR 1				// Current position
+#define ZOS_SEEK_END 2				// End of the file
+
+// Mounted filesystem
+typedef struct zos_context zos_context;
+
+// Open file
+typedef struct zos_file zos_file;
+
+// Information about the file or directory
+typedef struct zos_stat {
+	int32_t inode;					// I-node ID
+	int8_t is_directory;			// 0 = file, 1 = directory
+	int32_t size;					// Size of the file / sum of sizes of the content of the directory in bytes
+	int8_t is_inline;				// Data are stored in the i-node
+	int8_t is_compressed;			// Data blocks contain the compressed stream
+} zos_info;
+
+// Function called for every item of the directory, returns 0 = continue, otherwise stop
+typedef int (*zos_readdir_callback)(const char *name, const zos_info *info, void *arg);
+
+int zos_mount(const char *image, zos_context **context);
+int zos_create(const char *image, zos_context **context);
+int zos_unmount(zos_context *context);
+int zos_execute(zos_context *context, const char *command, FILE *replies);
+int zos_idle(zos_context *context, int input);
+int zos_serve(zos_context *context, const char *path);
+int zos_record(zos_context *context, const char *log);
+int zos_hash_file(const char *path, int32_t *size, uint64_t *hash);
+int zos_open(zos_context *context, const char *path, int flags, zos_file **file);
+int zos_close(zos_file *file);
+int32_t zos_read(zos_file *file, void *buffer, int32_t length);
+int32_t zos_write(zos_file *file, const void *buffer, int32_t length);
+int32_t zos_seek(zos_file *file, int32_t offset, int whence);
+int zos_stat(zos_context *context, const char *path, zos_info *info);
+int zos_readdir(zos_context *context, const char *path, zos_readdir_callback callback, void *arg);
+int zos_mkdir(zos_context *context, const char *path);
+int zos_unlink(zos_context *context, const char *path);
+int zos_rmdir(zos_context *context, const char *path);
+const char *zos_strerror(int code);
+
+#endif
@@ -0,0 +1,446 @@
+/**************************************************
+			Simple Filesystem Simulator
+				Replay of recorded workloads
+
+				Author: Jiri Besta
+***************************************************/
+
+/*	Replay of the workload recorded by the console (filesystem image --record log). The console keeps the image
+	in its state before the workload (log.image), commands of the log run against its copy (log.image.replay)
+	through the library (libzos.a) like the commands of the console. The latency of every command is printed
+	next to the recorded one.
+
+	Host files read by incp, write, append and batch scripts are checked by their size and hash. A missing or changed
+	file is replaced by generated data of the same size (the name of the file stays the same). The directory of
+	incp -r is replaced as a whole when any of its files is changed (its tree is generated again).
+
+	Usage: replay image log [original | max | N]	(recorded timing, no waiting, N times faster)
+	e.g. replay log.image log max
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "libzos.h"
+
+#define LINE_SIZE 512				// Size of the buffer for one line of the log
+#define PATH_SIZE 256				// Size of the buffer for paths
+#define HOST_DIRECTORY -1			// Size of the recorded host directory (incp -r)
+
+// Structure of the replayed command
+typedef struct thereplayed {
+	char name[16];				// Name of the command
+	long recorded;				// Recorded duration in microseconds
+	long replayed;				// Duration of the replay in microseconds
+} replayed;
+
+// Structure of the recorded host file of the next command
+typedef struct thehostfile {
+	int32_t size;				// Size in bytes, HOST_DIRECTORY = directory
+	uint64_t hash;				// Hash of the content
+	char path[PATH_SIZE];		// Recorded path
+} host_file;
+
+// Structure of the host file (or the directory) which replaces the recorded one
+typedef struct thesubstitute {
+	char original[PATH_SIZE];	// Path in the log
+	char path[PATH_SIZE];		// Path of the generated file
+} substitute;
+
+int copy_file(const char *from, const char *to);
+long elapsed_us(const struct timespec *from, const struct timespec *to);
+int parse_host_file(char *fields, host_file *file);
+void substitute_files(char *command, host_file *files, int count);
+int same_host_files(host_file *files, int count);
+int make_substitute(host_file *files, int count, substitute *sub);
+void generate_file(const char *path, int32_t size, uint64_t seed);
+void replace_path(char *line, const substitute *sub);
+void wait_until(const struct timespec *start, long offset, double speed);
+void print_summary(replayed *list, int count);
+int compare_replayed(const void *a, const void *b);
+
+FILE *report;						// Stream of the report (replies of the filesystem are discarded)
+char temp_dir[PATH_SIZE] = "";		// Directory with generated host files (created when needed)
+int substitutes = 0;				// Count of generated host files
+int substitute_dirs = 0;			// Count of directories of substitutes (their names are numbers)
+
+
+/*	Entry point of the replay
+
+	param argv[1] ... image of the filesystem before the workload (it is not changed, missing = log starts with format)
+	param argv[2] ... recorded log
+	param argv[3] ... optional speed - original (default), max or N
+*/
+int main(int argc, char *argv[]) {
+	char line[LINE_SIZE], text[LINE_SIZE], copy[PATH_SIZE + 8], *fields, *command;
+	long offset, recorded;
+	double speed = 1;			// 0 = maximum speed
+	int count = 0, capacity = 64, pending = 0, pending_capacity = 16, errors = 0, result;
+	struct timespec start, begin, end;
+	replayed *list;
+	host_file *files;			// Host files of the next command
+	zos_context *context;
+	FILE *log;
+
+	if (argc < 3) {
+		printf("Usage: %s image log [original | max | N]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 3 && strcmp(argv[3], "original") != 0) {
+		speed = (strcmp(argv[3], "max") == 0) ? 0 : atof(argv[3]);
+		if (speed < 0 || (speed == 0 && strcmp(argv[3], "max") != 0)) {
+			printf("Invalid speed %s\n", argv[3]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (!(log = fopen(argv[2], "r"))) {
+		printf("The log %s cannot be opened.\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	// The recorded image is not changed
+	snprintf(copy, sizeof(copy), "%s.replay", argv[1]);
+	if (access(argv[1], F_OK) == 0) {
+		if (copy_file(argv[1], copy)) {
+			printf("The image cannot be copied to %s.\n", copy);
+			return EXIT_FAILURE;
+		}
+		result = zos_mount(copy, &context);
+	}
+	else {						// The log starts with format
+		unlink(copy);
+		result = zos_create(copy, &context);
+	}
+	if (result != ZOS_OK) {
+		printf("The image %s cannot be loaded: %s.\n", copy, zos_strerror(result));
+		return EXIT_FAILURE;
+	}
+	report = stdout;
+
+	fprintf(report, "Replay of %s on %s (speed %s)\n", argv[2], copy, argc > 3 ? argv[3] : "original");
+	fprintf(report, "%6s %12s %12s %12s  %s\n", "#", "start_ms", "recorded_us", "replayed_us", "command");
+	list = (replayed *)malloc(sizeof(replayed) * capacity);
+	files = (host_file *)malloc(sizeof(host_file) * pending_capacity);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (fgets(line, LINE_SIZE, log)) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (line[0] == 'F' && line[1] == '\t') {		// Host file of the next command
+			if (pending == pending_capacity) {
+				pending_capacity *= 2;
+				files = (host_file *)realloc(files, sizeof(host_file) * pending_capacity);
+			}
+			if (parse_host_file(line + 2, &files[pending]))
+				pending++;
+			continue;
+		}
+		if (line[0] != 'C' || line[1] != '\t')			// Comment
+			continue;
+
+		// C	start	duration	command
+		offset = strtol(line + 2, &fields, 10);
+		recorded = strtol(fields, &command, 10);
+		if (*command != '\t') {
+			errors++;
+			continue;
+		}
+		command++;
+		substitute_files(command, files, pending);
+		pending = 0;
+
+		if (speed > 0)
+			wait_until(&start, offset, speed);
+
+		if (count == capacity) {
+			capacity *= 2;
+			list = (replayed *)realloc(list, sizeof(replayed) * capacity);
+		}
+		strcpy(text, command);		// Command is changed by its parsing
+		sscanf(command, "%15s", list[count].name);
+		list[count].recorded = recorded;
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		result = zos_execute(context, command, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		list[count].replayed = elapsed_us(&begin, &end);
+		fprintf(report, "%6d %12.3f %12ld %12ld  %s\n", count + 1, offset / 1e3, recorded, list[count].replayed, text);
+		count++;
+		if (result == ZOS_EXIT)
+			break;
+	}
+
+	print_summary(list, count);
+	fprintf(report, "\n%d commands, %d generated host files, %d invalid lines, total %.3f ms\n", count, substitutes, errors,
+		(double)elapsed_us(&start, &end) / 1e3);
+
+	zos_unmount(context);
+	fclose(log);
+	free(list);
+	free(files);
+	if (temp_dir[0])
+		fprintf(report, "Generated host files are in %s\n", temp_dir);
+	return EXIT_SUCCESS;
+}
+
+
+/*	Copy the file (the image of the filesystem)
+
+	param from ... path of the file
+	param to ... path of the copy
+	return 0 = no error, -1 = error
+*/
+int copy_file(const char *from, const char *to) {
+	char buffer[4096];
+	size_t length;
+	int result = 0;
+	FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+
+	if (!in || !out) {
+		result = -1;
+	}
+	else {
+		while ((length = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+			if (fwrite(buffer, 1, length, out) != length) {
+				result = -1;
+				break;
+			}
+		}
+	}
+	if (in) fclose(in);
+	if (out && fclose(out) != 0)
+		result = -1;
+	return result;
+}
+
+
+/*	Time between two moments
+
+	param from ... the first moment
+	param to ... the second moment
+	return microseconds
+*/
+long elapsed_us(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+
+/*	Read the recorded host file
+
+	param fields ... size, hash and path of the file separated by tabulators
+	param file ... address to store the file
+	return 1 = valid file, 0 = invalid line
+*/
+int parse_host_file(char *fields, host_file *file) {
+	char *hash_text, *path;
+
+	file->size = (int32_t)strtol(fields, &hash_text, 10);
+	file->hash = strtoull(hash_text, &path, 16);
+	if (*path != '\t')
+		return 0;
+	snprintf(file->path, PATH_SIZE, "%s", path + 1);
+	return 1;
+}
+
+
+/*	Replace missing or changed host files of the command by generated ones (files of the directory
+	follow it in the log, the directory is replaced as a whole)
+
+	param command ... command (LINE_SIZE bytes)
+	param files ... recorded host files of the command
+	param count ... count of the files
+*/
+void substitute_files(char *command, host_file *files, int count) {
+	substitute sub;
+	size_t length;
+	int i, next;
+
+	for (i = 0; i < count; i = next) {
+		length = strlen(files[i].path);
+		for (next = i + 1; files[i].size == HOST_DIRECTORY && next < count
+			&& strncmp(files[next].path, files[i].path, length) == 0 && files[next].path[length] == '/'; next++);
+
+		if (!same_host_files(files + i, next - i) && make_substitute(files + i, next - i, &sub))
+			replace_path(command, &sub);
+	}
+}
+
+
+/*	Test if the host files are the same as in the recording
+
+	param files ... recorded host files
+	param count ... count of the files
+	return 1 = all files are the same, 0 = a file is missing or changed
+*/
+int same_host_files(host_file *files, int count) {
+	struct stat info;
+	int32_t size;
+	uint64_t hash;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (files[i].size == HOST_DIRECTORY) {
+			if (stat(files[i].path, &info) != 0 || !S_ISDIR(info.st_mode))
+				return 0;
+		}
+		else if (zos_hash_file(files[i].path, &size, &hash) != ZOS_OK || size != files[i].size || hash != files[i].hash) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*	Generate the substitute of the host file or of the directory with all its files
+
+	param files ... recorded host file or the directory followed by its files
+	param count ... count of the files
+	param sub ... address to store the substitute
+	return 1 = substitute was generated, 0 = error
+*/
+int make_substitute(host_file *files, int count, substitute *sub) {
+	char path[PATH_SIZE];
+	const char *name = strrchr(files[0].path, '/') ? strrchr(files[0].path, '/') + 1 : files[0].path;
+	size_t length = strlen(files[0].path);
+	int i;
+
+	if (!temp_dir[0]) {
+		strcpy(temp_dir, "/tmp/zosreplay.XXXXXX");
+		if (!mkdtemp(temp_dir)) {
+			temp_dir[0] = '\0';
+			return 0;
+		}
+	}
+
+	// Generated file keeps the name (incp uses it as the name of the new file), files of the directory keep their paths in it
+	snprintf(sub->original, PATH_SIZE, "%s", files[0].path);
+	snprintf(sub->path, PATH_SIZE, "%s/%d", temp_dir, substitute_dirs++);
+	mkdir(sub->path, 0700);
+	snprintf(sub->path + strlen(sub->path), PATH_SIZE - strlen(sub->path), "/%s", name);
+	for (i = 0; i < count; i++) {
+		snprintf(path, PATH_SIZE, "%s%s", sub->path, files[i].path + length);
+		if (files[i].size == HOST_DIRECTORY) {
+			mkdir(path, 0700);
+		}
+		else {
+			generate_file(path, files[i].size, files[i].hash);
+			substitutes++;
+		}
+	}
+	return 1;
+}
+
+
+/*	Generate the file with pseudo-random content
+
+	param path ... path of the file
+	param size ... size in bytes
+	param seed ... seed of the generator (hash of the original file)
+*/
+void generate_file(const char *path, int32_t size, uint64_t seed) {
+	char buffer[4096];
+	int32_t i, done;
+	FILE *f = fopen(path, "wb");
+
+	if (!f)
+		return;
+	seed |= 1;
+	for (done = 0; done < size; done += i) {
+		for (i = 0; i < (int32_t)sizeof(buffer) && done + i < size; i++) {
+			seed ^= seed >> 12;		// xorshift64*
+			seed ^= seed << 25;
+			seed ^= seed >> 27;
+			buffer[i] = (char)((seed * 2685821657736338717ULL) >> 56);
+		}
+		fwrite(buffer, 1, i, f);
+	}
+	fclose(f);
+}
+
+
+/*	Replace the recorded path of the host file in the command by the path of its substitute
+
+	param line ... command (LINE_SIZE bytes)
+	param sub ... substitute
+*/
+void replace_path(char *line, const substitute *sub) {
+	char result[LINE_SIZE];
+	char *found = strstr(line, sub->original);
+	size_t length = strlen(sub->original);
+
+	// Only the whole argument is replaced
+	while (found && !((found == line || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0'))) {
+		found = strstr(found + 1, sub->original);
+	}
+	if (!found)
+		return;
+
+	snprintf(result, LINE_SIZE, "%.*s%s%s", (int)(found - line), line, sub->path, found + length);
+	strcpy(line, result);
+}
+
+
+/*	Wait for the recorded start of the command
+
+	param start ... start of the replay
+	param offset ... recorded start of the command in microseconds from the start of the recording
+	param speed ... N times faster than the recording
+*/
+void wait_until(const struct timespec *start, long offset, double speed) {
+	struct timespec target;
+	long long ns = (long long)(offset / speed * 1000);
+
+	target.tv_sec = start->tv_sec + (start->tv_nsec + ns) / 1000000000LL;
+	target.tv_nsec = (start->tv_nsec + ns) % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) != 0)
+		;
+}
+
+
+/*	Print the latency of every kind of command
+
+	param list ... replayed commands
+	param count ... count of commands
+*/
+void print_summary(replayed *list, int count) {
+	int i, j, n;
+	long recorded;
+	double total;
+	long *samples = (long *)malloc(sizeof(long) * (count + 1));
+
+	qsort(list, count, sizeof(replayed), compare_replayed);
+	fprintf(report, "\n%-10s %8s %14s %14s %10s %10s %10s\n", "command", "count", "recorded_ms", "replayed_ms", "p50_us", "p99_us", "max_us");
+	for (i = 0; i < count; i = j) {
+		recorded = 0;
+		total = 0;
+		for (j = i, n = 0; j < count && strcmp(list[j].name, list[i].name) == 0; j++, n++) {
+			samples[n] = list[j].replayed;
+			recorded += list[j].recorded;
+			total += list[j].replayed;
+		}
+
+		// Samples of one command are sorted by the replayed duration
+		fprintf(report, "%-10s %8d %14.3f %14.3f %10ld %10ld %10ld\n", list[i].name, n, recorded / 1e3, total / 1e3,
+			samples[n / 2], samples[(n * 99) / 100], samples[n - 1]);
+	}
+	free(samples);
+}
+
+
+/*	Compare replayed commands by the name and by the duration of the replay (qsort)
+
+	return order
+*/
+int compare_replayed(const void *a, const void *b) {
+	const replayed *x = (const replayed *)a, *y = (const replayed *)b;
+	int order = strcmp(x->name, y->name);
+
+	if (order != 0)
+		return order;
+	return (x->replayed > y->replayed) - (x->replayed < y->replayed);
+}
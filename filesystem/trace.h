@@ -0,0 +1,62 @@
+/**************************************************
+			Simple Filesystem Simulator
+				Format of the I/O trace
+
+				Author: Jiri Besta
+***************************************************/
+
+/*	The command trace on file logs every access to the image of the filesystem as a binary record
+	(tracestat analyzes the trace). The trace starts with the header followed by names of commands
+	(TRACE_NAME_SIZE bytes each, the last one is the name for unknown commands) and continues with records.
+
+	Records TRACE_NAME and TRACE_LAYOUT are followed by their data (length bytes) - the name of the function
+	when it appears first in the trace and the layout of the image (at the start of the trace and after format).
+	TRACE_COMMAND marks the start of the command in the session. All numbers use the byte order of the host.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "ZOSTRACE"			// First 8 bytes of the trace
+#define TRACE_VERSION 1
+#define TRACE_NAME_SIZE 16				// Size of the name of the command in the header
+
+#define TRACE_READ 0					// Operations of records - read of the image
+#define TRACE_WRITE 1					// Write
+#define TRACE_SEEK 2					// Seek of the stream (offset = new position)
+#define TRACE_FLUSH 3					// Flush of the stream
+#define TRACE_COMMAND 4					// Start of the command
+#define TRACE_NAME 5					// Name of the function (site)
+#define TRACE_LAYOUT 6					// Layout of the image (trace_layout)
+
+// Header of the trace
+typedef struct thetrace_header {
+	char magic[8];						// TRACE_MAGIC (without \0)
+	int32_t version;					// TRACE_VERSION
+	int32_t command_count;				// Count of names of commands which follow the header
+} trace_header;
+
+// Record of the trace
+typedef struct thetrace_record {
+	int64_t time;						// Nanoseconds since the start of the trace
+	int64_t offset;						// Position in the image
+	int32_t length;						// Count of bytes (length of the data of TRACE_NAME and TRACE_LAYOUT)
+	uint8_t op;							// TRACE_*
+	uint8_t command;					// Index of the name of the running command
+	uint8_t site;						// Function which accessed the image (see TRACE_NAME)
+	uint8_t session;					// Thread which accessed the image (own stream of the image)
+} trace_record;
+
+// Layout of the image (start addresses of areas)
+typedef struct thetrace_layout {
+	int32_t disk_size;					// Size of the image
+	int32_t cluster_size;				// Size of the cluster
+	int32_t bitmap_start;				// Bitmap of data blocks
+	int32_t inode_start;				// I-nodes
+	int32_t dedup_start;				// Hashes of data blocks (dedup or checksums), 0 = none
+	int32_t data_start;					// Data blocks
+} trace_layout;
+
+#endif
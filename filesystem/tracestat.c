@@ -0,0 +1,432 @@
+/**************************************************
+			Simple Filesystem Simulator
+				Analysis of I/O traces
+
+				Author: Jiri Besta
+***************************************************/
+
+/*	Analysis of the trace of I/O of the image (command trace on file, format in trace.h). Printed are
+	- the I/O of every function with its sequentiality and seek distances (which functions cause random I/O),
+	- the I/O of every area of the image (superblock, bitmap, i-nodes, hashes, data blocks),
+	- the histogram of seek distances and the most accessed clusters,
+	- the I/O of every command with its amplification (transferred bytes / distinct bytes touched by one run).
+
+	Reads and writes of one session (thread with its own stream) are sequential when they start where
+	the previous one ended, the seek distance is the distance from this position.
+
+	Usage: tracestat trace [N]	(N = count of printed hot clusters, default 10)
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "trace.h"
+
+#define SESSIONS 256				// Count of sessions in the trace (uint8_t)
+#define SITES 256					// Count of functions in the trace (uint8_t, 255 = none)
+#define AREAS 6						// Areas of the image - superblock, bitmap, i-nodes, hashes, data, unknown layout
+#define DISTANCES 6					// Classes of seek distances
+#define DEFAULT_CLUSTER 1024		// Size of the cluster when the trace has no layout
+
+// Structure of the counters of I/O (of the function, area or command)
+typedef struct theio_counts {
+	long ops[4];					// Count of TRACE_READ, TRACE_WRITE, TRACE_SEEK, TRACE_FLUSH
+	long bytes[2];					// Read and written bytes
+	long sequential;				// Reads and writes which continue the previous one
+	long random;					// Reads and writes which need a seek
+	long distance;					// Sum of seek distances in bytes
+} io_counts;
+
+// Structure of the range of the image accessed by the run of the command
+typedef struct therange {
+	int64_t start;
+	int64_t end;
+	int write;						// 0 = read, 1 = write
+} range;
+
+// Structure of the session (state of one thread)
+typedef struct thesession {
+	int64_t position;				// End of the last read or write, -1 = none
+	int command;					// Command of the current run, -1 = none
+	range *ranges;					// Ranges accessed by the current run
+	int count;						// Count of ranges
+	int capacity;
+} session;
+
+// Structure of the statistics of one command
+typedef struct thecommand_counts {
+	long runs;						// Count of runs
+	io_counts io;
+	long distinct[2];				// Distinct read and written bytes (sum over runs)
+} command_counts;
+
+// Structure of the accesses to one cluster of the image
+typedef struct thecluster_counts {
+	long reads;
+	long writes;
+} cluster_counts;
+
+void account(trace_record *record);
+void finish_run(session *s);
+void add_range(session *s, int64_t start, int64_t end, int write);
+int get_area(int64_t offset);
+void print_counts(const char *name, io_counts *c);
+void print_hot_clusters(int top);
+int compare_sites(const void *a, const void *b);
+int compare_ranges(const void *a, const void *b);
+
+const char *area_names[AREAS] = {"superblock", "bitmap", "inodes", "hashes", "data", "image"};
+const long distance_limits[DISTANCES] = {0, 4096, 65536, 1048576, 16777216, -1};	// Upper bounds of classes, -1 = any
+const char *distance_names[DISTANCES] = {"sequential", "<= 4 KB", "<= 64 KB", "<= 1 MB", "<= 16 MB", "> 16 MB"};
+
+char (*command_names)[TRACE_NAME_SIZE];	// Names of commands from the header of the trace
+int command_count;
+char site_names[SITES][TRACE_NAME_SIZE * 4];	// Names of functions
+io_counts sites[SITES];
+io_counts areas[AREAS];
+io_counts total;
+long distances[DISTANCES];
+command_counts *commands;
+session sessions[SESSIONS];
+trace_layout layout;				// Layout of the image, cluster_size = 0 = unknown
+cluster_counts *clusters = NULL;	// Accesses to clusters of the image, offset / cluster size = index
+long cluster_count = 0;
+int64_t duration = 0;				// Time of the last record
+
+
+/*	Entry point of the analyzer
+
+	param argv[1] ... trace
+	param argv[2] ... optional count of printed hot clusters
+*/
+int main(int argc, char *argv[]) {
+	trace_header header;
+	trace_record record;
+	char data[sizeof(site_names[0])];
+	long records = 0;
+	int i, order[SITES], used = 0, top = 10;
+	FILE *f;
+
+	if (argc < 2) {
+		printf("Usage: %s trace [N]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (argc > 2)
+		top = atoi(argv[2]);
+	if (!(f = fopen(argv[1], "rb"))) {
+		printf("The trace %s cannot be opened.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (fread(&header, sizeof(trace_header), 1, f) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != TRACE_VERSION || header.command_count <= 0 || header.command_count > 255) {
+		printf("%s is not a trace of the filesystem.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	command_count = header.command_count;
+	command_names = malloc(TRACE_NAME_SIZE * command_count);
+	commands = calloc(command_count, sizeof(command_counts));
+	if (fread(command_names, TRACE_NAME_SIZE, command_count, f) != (size_t)command_count) {
+		printf("The trace %s is truncated.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < command_count; i++) {
+		command_names[i][TRACE_NAME_SIZE - 1] = '\0';
+	}
+	for (i = 0; i < SESSIONS; i++) {
+		sessions[i].position = -1;
+		sessions[i].command = -1;
+	}
+	strcpy(site_names[SITES - 1], "(none)");
+
+	while (fread(&record, sizeof(trace_record), 1, f) == 1) {
+		records++;
+		duration = record.time;
+		if (record.op == TRACE_NAME || record.op == TRACE_LAYOUT) {
+			if (record.length < 0 || record.length >= (int32_t)sizeof(data) || fread(data, 1, record.length, f) != (size_t)record.length)
+				break;
+			data[record.length] = '\0';
+			if (record.op == TRACE_NAME)
+				strcpy(site_names[record.site], data);
+			else if (record.length == sizeof(trace_layout))
+				memcpy(&layout, data, sizeof(trace_layout));
+			continue;
+		}
+		if (record.command >= command_count)
+			record.command = command_count - 1;
+		account(&record);
+	}
+	for (i = 0; i < SESSIONS; i++) {
+		finish_run(&sessions[i]);
+	}
+	fclose(f);
+
+	printf("%ld records, %.3f ms, %ld reads (%.1f KB), %ld writes (%.1f KB), %ld seeks, %ld flushes\n", records, duration / 1e6,
+		total.ops[TRACE_READ], total.bytes[0] / 1024.0, total.ops[TRACE_WRITE], total.bytes[1] / 1024.0, total.ops[TRACE_SEEK],
+		total.ops[TRACE_FLUSH]);
+
+	// Functions ordered by the count of random reads and writes
+	for (i = 0; i < SITES; i++) {
+		if (sites[i].ops[0] + sites[i].ops[1] + sites[i].ops[2] + sites[i].ops[3] > 0)
+			order[used++] = i;
+	}
+	qsort(order, used, sizeof(int), compare_sites);
+	printf("\n%-24s %9s %10s %9s %10s %8s %8s %7s %8s %12s\n", "function", "reads", "read_kb", "writes", "written_kb", "seeks",
+		"flushes", "seq_%", "random_%", "avg_seek_kb");
+	for (i = 0; i < used; i++) {
+		print_counts(site_names[order[i]][0] ? site_names[order[i]] : "?", &sites[order[i]]);
+	}
+
+	printf("\n%-24s %9s %10s %9s %10s %8s %8s %7s %8s %12s\n", "area", "reads", "read_kb", "writes", "written_kb", "seeks",
+		"flushes", "seq_%", "random_%", "avg_seek_kb");
+	for (i = 0; i < AREAS; i++) {
+		if (areas[i].ops[TRACE_READ] + areas[i].ops[TRACE_WRITE] > 0)
+			print_counts(area_names[i], &areas[i]);
+	}
+
+	printf("\n%-12s %10s\n", "seek", "accesses");
+	for (i = 0; i < DISTANCES; i++) {
+		printf("%-12s %10ld\n", distance_names[i], distances[i]);
+	}
+
+	print_hot_clusters(top);
+
+	printf("\n%-10s %6s %9s %10s %9s %10s %8s %8s %10s %10s\n", "command", "runs", "reads", "read_kb", "writes", "written_kb",
+		"seq_%", "ops/run", "read_amp", "write_amp");
+	for (i = 0; i < command_count; i++) {
+		command_counts *c = &commands[i];
+		long ops = c->io.ops[TRACE_READ] + c->io.ops[TRACE_WRITE];
+
+		if (c->runs == 0 && ops == 0)
+			continue;
+		printf("%-10s %6ld %9ld %10.1f %9ld %10.1f %8.1f %8.1f %10.2f %10.2f\n", command_names[i], c->runs, c->io.ops[TRACE_READ],
+			c->io.bytes[0] / 1024.0, c->io.ops[TRACE_WRITE], c->io.bytes[1] / 1024.0,
+			ops ? 100.0 * c->io.sequential / ops : 0.0, c->runs ? (double)ops / c->runs : (double)ops,
+			c->distinct[0] ? (double)c->io.bytes[0] / c->distinct[0] : 0.0, c->distinct[1] ? (double)c->io.bytes[1] / c->distinct[1] : 0.0);
+	}
+	return EXIT_SUCCESS;
+}
+
+
+/*	Add the record to the statistics
+
+	param record ... record of the trace (not TRACE_NAME or TRACE_LAYOUT)
+*/
+void account(trace_record *record) {
+	session *s = &sessions[record->session];
+	io_counts *counts[4];
+	int64_t distance, end = record->offset + record->length;
+	int i, j, write = record->op == TRACE_WRITE, area = get_area(record->offset);
+	long cluster;
+
+	if (record->op == TRACE_COMMAND) {		// New run of the command in the session
+		finish_run(s);
+		s->command = record->command;
+		commands[record->command].runs++;
+		return;
+	}
+	if (record->op > TRACE_FLUSH)
+		return;
+	if (s->command != record->command) {	// Worker took a job of another command
+		finish_run(s);
+		s->command = record->command;
+	}
+
+	counts[0] = &total;
+	counts[1] = &sites[record->site];
+	counts[2] = &areas[area];
+	counts[3] = &commands[record->command].io;
+	for (i = 0; i < 4; i++) {
+		counts[i]->ops[record->op]++;
+	}
+	if (record->op != TRACE_READ && !write)
+		return;
+
+	// Sequentiality
+	distance = s->position < 0 ? 0 : llabs(record->offset - s->position);
+	for (i = 0; i < 4; i++) {
+		counts[i]->bytes[write] += record->length;
+		if (s->position >= 0 && distance == 0)
+			counts[i]->sequential++;
+		else if (s->position >= 0) {
+			counts[i]->random++;
+			counts[i]->distance += distance;
+		}
+	}
+	if (s->position >= 0) {
+		for (j = 0; distance_limits[j] >= 0 && distance > distance_limits[j]; j++)
+			;
+		distances[j]++;
+	}
+	s->position = end;
+	add_range(s, record->offset, end, write);
+
+	// Clusters of the image
+	for (cluster = record->offset / (layout.cluster_size ? layout.cluster_size : DEFAULT_CLUSTER);
+		record->length > 0 && cluster * (layout.cluster_size ? layout.cluster_size : DEFAULT_CLUSTER) < end; cluster++) {
+		if (cluster >= cluster_count) {
+			long count = cluster_count ? cluster_count : 1024;
+
+			while (count <= cluster)
+				count *= 2;
+			clusters = realloc(clusters, sizeof(cluster_counts) * count);
+			memset(clusters + cluster_count, 0, sizeof(cluster_counts) * (count - cluster_count));
+			cluster_count = count;
+		}
+		if (write)
+			clusters[cluster].writes++;
+		else
+			clusters[cluster].reads++;
+	}
+}
+
+
+/*	Finish the run of the command in the session - add distinct bytes which it touched
+
+	param s ... session
+*/
+void finish_run(session *s) {
+	int64_t start = -1, end = -1;
+	int i, write = -1;
+
+	if (s->command >= 0 && s->count > 0) {
+		qsort(s->ranges, s->count, sizeof(range), compare_ranges);
+		for (i = 0; i <= s->count; i++) {
+			if (i < s->count && s->ranges[i].write == write && s->ranges[i].start <= end) {	// Overlapping range
+				if (s->ranges[i].end > end)
+					end = s->ranges[i].end;
+				continue;
+			}
+			if (write >= 0)
+				commands[s->command].distinct[write] += end - start;
+			if (i < s->count) {
+				write = s->ranges[i].write;
+				start = s->ranges[i].start;
+				end = s->ranges[i].end;
+			}
+		}
+	}
+	s->count = 0;
+	s->command = -1;
+}
+
+
+/*	Add the accessed range to the current run of the session
+
+	param s ... session
+	param start ... first byte
+	param end ... byte after the range
+	param write ... 0 = read, 1 = write
+*/
+void add_range(session *s, int64_t start, int64_t end, int write) {
+	if (s->command < 0 || end <= start)
+		return;
+	if (s->count == s->capacity) {
+		s->capacity = s->capacity ? s->capacity * 2 : 64;
+		s->ranges = realloc(s->ranges, sizeof(range) * s->capacity);
+	}
+	s->ranges[s->count].start = start;
+	s->ranges[s->count].end = end;
+	s->ranges[s->count].write = write;
+	s->count++;
+}
+
+
+/*	Area of the image which contains the position
+
+	param offset ... position in the image
+	return index of the area
+*/
+int get_area(int64_t offset) {
+	if (layout.cluster_size == 0)
+		return AREAS - 1;
+	if (offset < layout.bitmap_start)
+		return 0;
+	if (offset < layout.inode_start)
+		return 1;
+	if (offset < (layout.dedup_start ? layout.dedup_start : layout.data_start))
+		return 2;
+	if (offset < layout.data_start)
+		return 3;
+	return 4;
+}
+
+
+/*	Print one row of the table of I/O
+
+	param name ... name of the row
+	param c ... counters
+*/
+void print_counts(const char *name, io_counts *c) {
+	long ops = c->sequential + c->random;
+
+	printf("%-24s %9ld %10.1f %9ld %10.1f %8ld %8ld %7.1f %8.1f %12.1f\n", name, c->ops[TRACE_READ], c->bytes[0] / 1024.0,
+		c->ops[TRACE_WRITE], c->bytes[1] / 1024.0, c->ops[TRACE_SEEK], c->ops[TRACE_FLUSH],
+		ops ? 100.0 * c->sequential / ops : 0.0, total.random ? 100.0 * c->random / total.random : 0.0,
+		c->random ? c->distance / 1024.0 / c->random : 0.0);
+}
+
+
+/*	Print the most accessed clusters of the image
+
+	param top ... count of printed clusters
+*/
+void print_hot_clusters(int top) {
+	long i, best, *printed = calloc(top > 0 ? top : 1, sizeof(long));
+	int n, k, area;
+	int32_t size = layout.cluster_size ? layout.cluster_size : DEFAULT_CLUSTER;
+
+	printf("\n%-10s %-12s %10s %10s %10s\n", "cluster", "area", "accesses", "reads", "writes");
+	for (n = 0; n < top; n++) {
+		best = -1;
+		for (i = 0; i < cluster_count; i++) {
+			if (clusters[i].reads + clusters[i].writes == 0)
+				continue;
+			for (k = 0; k < n && printed[k] != i; k++)
+				;
+			if (k < n)
+				continue;
+			if (best < 0 || clusters[i].reads + clusters[i].writes > clusters[best].reads + clusters[best].writes)
+				best = i;
+		}
+		if (best < 0)
+			break;
+		printed[n] = best;
+		area = get_area((int64_t)best * size);
+
+		// Data blocks are numbered from the start of the area
+		if (area == 4 && (int64_t)best * size >= layout.data_start)
+			printf("%-10ld %-12s %10ld %10ld %10ld  (data block %ld)\n", best, area_names[area], clusters[best].reads + clusters[best].writes,
+				clusters[best].reads, clusters[best].writes, (long)(((int64_t)best * size - layout.data_start) / size));
+		else
+			printf("%-10ld %-12s %10ld %10ld %10ld\n", best, area_names[area], clusters[best].reads + clusters[best].writes,
+				clusters[best].reads, clusters[best].writes);
+	}
+	free(printed);
+}
+
+
+/*	Compare functions by the count of random reads and writes (qsort, descending)
+
+	return order
+*/
+int compare_sites(const void *a, const void *b) {
+	const io_counts *x = &sites[*(const int *)a], *y = &sites[*(const int *)b];
+
+	if (x->random != y->random)
+		return (y->random > x->random) - (y->random < x->random);
+	return (y->ops[0] + y->ops[1] > x->ops[0] + x->ops[1]) - (y->ops[0] + y->ops[1] < x->ops[0] + x->ops[1]);
+}
+
+
+/*	Compare ranges by the kind of access and by the start (qsort)
+
+	return order
+*/
+int compare_ranges(const void *a, const void *b) {
+	const range *x = (const range *)a, *y = (const range *)b;
+
+	if (x->write != y->write)
+		return x->write - y->write;
+	return (x->start > y->start) - (x->start < y->start);
+}